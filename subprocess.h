@@ -93,7 +93,26 @@ enum subprocess_option_e {
 
   // Make subprocess_read_stdout and subprocess_read_stderr return immediately
   // with 0 if no data is available. Requires subprocess_option_enable_async.
-  subprocess_option_enable_async_no_wait = 0x20
+  subprocess_option_enable_async_no_wait = 0x20,
+
+  // Start the child in a process group of its own, so that
+  // subprocess_terminate and subprocess_terminate_ex reach every process it
+  // starts in turn. On Windows they still end only the child itself.
+  subprocess_option_new_process_group = 0x40,
+
+  // Start the child in a session of its own, detached from the controlling
+  // terminal. Implies subprocess_option_new_process_group. Not supported on
+  // Windows.
+  subprocess_option_new_session = 0x80,
+
+  // Kill the child when the thread that created it exits. Only supported on
+  // Linux.
+  subprocess_option_die_with_parent = 0x100,
+
+  // Give the child a pipe to say it is ready on, for subprocess_wait_ready. Its
+  // descriptor is in the child's SUBPROCESS_NOTIFY_FD environment variable.
+  // Not supported on Windows.
+  subprocess_option_notify_ready = 0x200
 };
 
 // Error codes returned by subprocess_create and subprocess_create_ex.
@@ -111,6 +130,332 @@ enum subprocess_error_e {
   subprocess_error_not_supported = -9
 };
 
+// A resource a child's use of which subprocess_attr_s::limits can cap.
+enum subprocess_limit_e {
+  // The largest core dump the child may write, in bytes; 0 stops it writing
+  // any, so a crashing child exits straight away.
+  subprocess_limit_core = 0,
+  // The most address space the child may map, in bytes.
+  subprocess_limit_address_space = 1,
+  // The processor time the child may use, in seconds, before it is killed.
+  subprocess_limit_cpu_seconds = 2,
+  // One more than the highest file descriptor the child may open.
+  subprocess_limit_open_files = 3,
+  // The most processes the child's user may have; once the user has more the
+  // child cannot start any.
+  subprocess_limit_processes = 4
+};
+
+// A scheduling policy for subprocess_attr_s::scheduling.
+enum subprocess_scheduling_e {
+  // Keep the parent's policy.
+  subprocess_scheduling_inherit = 0,
+  // For processor-bound batch work: never preempts other processes to run.
+  subprocess_scheduling_batch = 1,
+  // Only runs when nothing else wants the processor.
+  subprocess_scheduling_idle = 2
+};
+
+// An I/O scheduling class for subprocess_attr_s::io_class.
+enum subprocess_io_class_e {
+  // Keep the parent's I/O priority.
+  subprocess_io_inherit = 0,
+  // Share the disk with a priority level from 0 (highest) to 7 (lowest).
+  subprocess_io_best_effort = 1,
+  // Only use the disk when nothing else does.
+  subprocess_io_idle = 2
+};
+
+// A limit for subprocess_attr_s::limits.
+struct subprocess_limit_s {
+  // A subprocess_limit_e.
+  int resource;
+  // The value both the soft and the hard limit are set to.
+  unsigned long value;
+};
+
+// A ring buffer in memory shared between a parent and a cooperating child,
+// for moving bulk data without a system call or a copy through the kernel per
+// chunk. One side writes and the other reads. The parent creates it with
+// subprocess_channel_init and hands it over through subprocess_attr_s, and the
+// child opens it with subprocess_channel_open.
+struct subprocess_channel_s {
+  // The shared memory, its size in bytes, and the descriptor behind it.
+  void *shared;
+  size_t size;
+  int fd;
+
+  // The bytes the ring holds, fixed when the channel is created or opened.
+  // The copy in the shared memory is never trusted, as the other side can
+  // write to it.
+  unsigned capacity;
+};
+
+// A descriptor for subprocess_attr_s::fds to hand to a child under a number of
+// its choosing.
+struct subprocess_fd_s {
+  // The parent's descriptor, which stays owned by the caller.
+  int parent_fd;
+
+  // The number the child gets it under, above 2.
+  int child_fd;
+};
+
+// Additional settings for subprocess_create_attr. Always initialise one with
+// subprocess_attr_init first, so that fields added later keep their defaults.
+struct subprocess_attr_s {
+  // A descriptor the child uses as its standard input instead of a pipe, or -1
+  // (the default) for a pipe the parent writes through subprocess_stdin. The
+  // descriptor stays owned by the caller and may be shared by many children.
+  // On Linux a regular file (such as one from subprocess_create_stdin_memfd)
+  // is reopened read-only for each child, so every child gets its own file
+  // offset starting where the caller's offset is; elsewhere the children
+  // share the caller's open file description and its offset. Not supported
+  // on Windows.
+  int stdin_fd;
+
+  // Bytes written into the standard input pipe before the child starts, and
+  // their number, or NULL and 0 (the default) for none. On Linux the pipe is
+  // grown to fit them if need be; a payload that still does not fit is an
+  // error. With stdin_close non-zero the parent's end is closed straight
+  // after, so the child finds its whole input and the end of it waiting, and
+  // subprocess_stdin returns NULL. Cannot be combined with stdin_fd. Not
+  // supported on Windows.
+  const void *stdin_data;
+  size_t stdin_size;
+  int stdin_close;
+
+  // A descriptor the child writes its standard output to instead of a pipe,
+  // or -1 (the default) for a pipe read through subprocess_stdout. With
+  // subprocess_option_combined_stdout_stderr the standard error goes there
+  // too. The descriptor stays owned by the caller. Not supported on Windows.
+  int stdout_fd;
+
+  // The capacity in bytes requested for each pipe the library creates, or 0
+  // (the default) for the system default. Only honoured on Linux, where the
+  // kernel rounds it up to a power of two pages and caps it for unprivileged
+  // users at /proc/sys/fs/pipe-max-size; elsewhere it is ignored.
+  unsigned pipe_capacity;
+
+  // Resource limits the child starts with, and their number, or NULL and 0
+  // (the default) to inherit the parent's. The limits are set in the child
+  // between fork and exec, so they hold from its first instruction, and it
+  // cannot raise them again. Not supported on Windows.
+  const struct subprocess_limit_s *limits;
+  unsigned limit_count;
+
+  // The processors the child may run on, and their number, or NULL and 0 (the
+  // default) to keep the parent's affinity. Linux only.
+  const unsigned *cpus;
+  unsigned cpu_count;
+
+  // A bit per NUMA node (bit n for node n) the child must allocate its memory
+  // from, or 0 (the default) to keep the parent's memory policy. Linux only.
+  unsigned long memory_nodes;
+
+  // How much to add to the child's nice value: positive to make it yield to
+  // other processes, negative (which needs privileges) to favour it. 0 (the
+  // default) keeps the parent's.
+  int nice;
+
+  // A subprocess_scheduling_e for the child. Linux only.
+  int scheduling;
+
+  // A subprocess_io_class_e for the child, and its level for
+  // subprocess_io_best_effort. Linux only.
+  int io_class;
+  int io_level;
+
+  // A channel the child inherits the descriptor of, or NULL (the default).
+  // The descriptor keeps its number, from subprocess_channel_fd, which the
+  // child has to be told, for instance on its command line. Linux only.
+  const struct subprocess_channel_s *channel;
+
+  // Descriptors the child gets under numbers of its choosing, and how many,
+  // or NULL and 0 (the default) for none. Each stays owned by the caller, and
+  // the child's numbers must be distinct and not the channel's. The mapping
+  // is applied as a whole, so a child number may be another entry's parent
+  // descriptor. Not supported on Windows.
+  const struct subprocess_fd_s *fds;
+  unsigned fd_count;
+};
+
+// Spreads processes round-robin over a set of processors, one each, for
+// subprocess_cpu_pool_assign. Initialise `cpus` and `count` and zero `next`.
+struct subprocess_cpu_pool_s {
+  const unsigned *cpus;
+  unsigned count;
+  unsigned next;
+};
+
+// What became of a job run by subprocess_run_jobs.
+enum subprocess_job_state_e {
+  // The job has not been started.
+  subprocess_job_pending = 0,
+  // The job ran and returned zero.
+  subprocess_job_succeeded = 1,
+  // The job ran and returned non-zero.
+  subprocess_job_failed = 2,
+  // The job was not started because a job it depends on did not succeed.
+  subprocess_job_skipped = 3
+};
+
+// A job for subprocess_run_jobs: a command line, the jobs that must succeed
+// before it starts, and how much of the executor's capacity it occupies.
+struct subprocess_job_s {
+  // The command line to run, as for subprocess_create_ex.
+  const char *const *command_line;
+
+  // The indices of the jobs this job depends on, and their number.
+  const unsigned *dependencies;
+  unsigned dependency_count;
+
+  // How much of the executor's capacity the job occupies while it runs; 0
+  // counts as 1.
+  unsigned weight;
+
+  // Filled in by subprocess_run_jobs: a subprocess_job_state_e, the return
+  // code of the job once it has run, and when it started and ended in
+  // milliseconds since subprocess_run_jobs was called.
+  int state;
+  int return_code;
+  unsigned long start_ms;
+  unsigned long end_ms;
+};
+
+// One of the output streams of a process, as read by subprocess_capture.
+enum subprocess_stream_e {
+  subprocess_stream_stdout = 1,
+  subprocess_stream_stderr = 2
+};
+
+// What subprocess_read_stdout_ex and subprocess_read_stderr_ex found.
+enum subprocess_read_status_e {
+  // At least one byte was read.
+  subprocess_read_data = 0,
+  // No data arrived before the timeout, but more may come.
+  subprocess_read_again = 1,
+  // The child closed the stream, so no more data will come.
+  subprocess_read_eof = 2,
+  // The read failed, and errno says why.
+  subprocess_read_error = 3
+};
+
+// A chunk of output recorded by subprocess_capture. Its bytes follow the
+// header directly, at (const char *)(chunk + 1).
+struct subprocess_chunk_s {
+  // When the chunk was read, on the monotonic clock. Chunks read after the
+  // same wakeup share a time, and their relative order is not known.
+  unsigned long seconds;
+  unsigned long nanoseconds;
+
+  // Counts up from 0 across both streams in the order the chunks were read.
+  unsigned sequence;
+
+  // A subprocess_stream_e.
+  unsigned stream;
+
+  // The number of bytes that follow the header.
+  unsigned size;
+};
+
+// A log of chunks from both output streams of a process, in a buffer owned by
+// the caller. Initialise one with subprocess_capture_init, and walk it with
+// subprocess_capture_next. Setting `size` and `count` back to 0 empties it
+// without restarting the sequence.
+struct subprocess_capture_s {
+  // The start of the log, and how many bytes it can hold.
+  char *buffer;
+  size_t capacity;
+
+  // The bytes used so far, and the number of chunks in them.
+  size_t size;
+  unsigned count;
+
+  // The sequence number of the next chunk.
+  unsigned sequence;
+
+  // A bit per subprocess_stream_e that has reached end of file.
+  unsigned ended;
+};
+
+// What a watch rule does when its pattern turns up.
+enum subprocess_watch_action_e {
+  // Call the watch's callback, if it has one.
+  subprocess_watch_notify = 0,
+
+  // Terminate the process with subprocess_terminate, then call the callback.
+  subprocess_watch_terminate = 1
+};
+
+// A literal to look for in a process's output.
+struct subprocess_watch_rule_s {
+  // The bytes to look for, NUL-terminated and not empty.
+  const char *pattern;
+
+  // The subprocess_stream_e values to look in, or'ed together.
+  unsigned streams;
+
+  // A subprocess_watch_action_e.
+  int action;
+};
+
+// Literal patterns looked for in a process's output, compiled by
+// subprocess_watch_init into one automaton that takes a single step per byte
+// whatever the number of patterns. Each stream's place in the automaton is
+// kept between reads, so a match split across two reads is still found.
+struct subprocess_watch_s {
+  // The rules, which must outlive the watch, and how many there are.
+  const struct subprocess_watch_rule_s *rules;
+  unsigned rule_count;
+
+  // Called for every match with the rule's index and the stream, or NULL.
+  void (*callback)(void *user_data, unsigned rule, int stream);
+  void *user_data;
+
+  // The automaton, in one allocation: the next state for each state and byte
+  // class, the first rule ending at each state or ~0u, the next state down
+  // its suffixes with a rule ending there, and the next rule with the same
+  // pattern.
+  unsigned *transitions;
+  unsigned *outputs;
+  unsigned *output_links;
+  unsigned *next_rules;
+  unsigned class_count;
+  unsigned char classes[256];
+
+  // The byte every pattern starts with, or -1 if they start with different
+  // ones, in which case starts has a non-zero entry for each.
+  int first_byte;
+  unsigned char starts[256];
+
+  // Where each stream is in the automaton, 0 being the start.
+  unsigned states[2];
+};
+
+// What a process is using, as sampled by subprocess_sample. Sizes are in KiB
+// so that they fit an unsigned long everywhere.
+struct subprocess_stats_s {
+  // CPU time spent in user mode and in the kernel, in milliseconds.
+  unsigned long user_ms;
+  unsigned long system_ms;
+
+  // Memory resident in RAM.
+  unsigned long rss_kb;
+
+  // Data passed through read and write calls and the like, whether or not
+  // storage was involved.
+  unsigned long read_kb;
+  unsigned long write_kb;
+
+  // Data fetched from and sent towards storage.
+  unsigned long storage_read_kb;
+  unsigned long storage_write_kb;
+
+  // The number of threads, which is never 0 for a sampled process.
+  unsigned threads;
+};
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -157,23 +502,204 @@ subprocess_create_ex(const char *const command_line[], int options,
                      const char *const process_cwd,
                      struct subprocess_s *const out_process);
 
+/// @brief Initialise process creation attributes to their defaults.
+/// @param attr The attributes to initialise.
+///
+/// The defaults make subprocess_create_attr behave exactly like
+/// subprocess_create_ex.
+subprocess_weak void subprocess_attr_init(struct subprocess_attr_s *const attr);
+
+/// @brief Create a process (extended create with attributes).
+/// @param command_line As for subprocess_create_ex.
+/// @param options As for subprocess_create_ex.
+/// @param environment As for subprocess_create_ex.
+/// @param process_cwd As for subprocess_create_ex.
+/// @param attr Additional settings initialised with subprocess_attr_init, or
+/// NULL for the defaults. Only needs to persist until this function returns.
+/// @param out_process The newly created process.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned, as for subprocess_create_ex.
+/// Settings the platform cannot honour fail with
+/// `subprocess_error_not_supported`.
+subprocess_weak int
+subprocess_create_attr(const char *const command_line[], int options,
+                       const char *const environment[],
+                       const char *const process_cwd,
+                       const struct subprocess_attr_s *const attr,
+                       struct subprocess_s *const out_process);
+
+/// @brief Create a process from an executable that is already open.
+/// @param exec_fd A descriptor for the executable, which the caller keeps
+/// owning. It may be opened read-only, and may be a memfd holding a binary or
+/// a script.
+/// @param command_line As for subprocess_create_ex, except that the first
+/// element is only passed to the process as its name and is never looked up.
+/// @param options As for subprocess_create_ex.
+/// subprocess_option_search_user_path is ignored.
+/// @param environment As for subprocess_create_ex.
+/// @param process_cwd As for subprocess_create_ex.
+/// @param attr As for subprocess_create_attr.
+/// @param out_process The newly created process.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned, as for subprocess_create_ex.
+///
+/// Launching from a descriptor skips the path lookup, and the process runs the
+/// file the descriptor was opened on even if the path is replaced meanwhile. A
+/// script is run with the descriptor left open, since its interpreter opens it
+/// again through /proc/self/fd. Only available on Linux; other platforms
+/// return `subprocess_error_not_supported`.
+subprocess_weak int
+subprocess_create_fd(int exec_fd, const char *const command_line[],
+                     int options, const char *const environment[],
+                     const char *const process_cwd,
+                     const struct subprocess_attr_s *const attr,
+                     struct subprocess_s *const out_process);
+
+/// @brief Place the next process on the next processor of a pool.
+/// @param pool The pool to take a processor from.
+/// @param attr The attributes whose `cpus` and `cpu_count` are set to the
+/// processor taken. `pool` must outlive any use of them.
+///
+/// Processors are handed out round-robin, and many threads may share a pool.
+subprocess_weak void
+subprocess_cpu_pool_assign(struct subprocess_cpu_pool_s *const pool,
+                           struct subprocess_attr_s *const attr);
+
+/// @brief Create a sealed, read-only in-memory file holding some data.
+/// @param data The bytes to store.
+/// @param size The number of bytes to store.
+/// @param out_fd The new close-on-exec descriptor, which the caller closes.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned and `errno` holds the reason.
+///
+/// The descriptor is meant for `subprocess_attr_s::stdin_fd`: the data is
+/// written once and shared by every child through the page cache, and each
+/// child can seek and mmap its standard input. Only available on Linux; other
+/// platforms return `subprocess_error_not_supported`.
+subprocess_weak int subprocess_create_stdin_memfd(const void *const data,
+                                                  size_t size,
+                                                  int *const out_fd);
+
+/// @brief Create a pipe to hand one end of to a child through
+/// `subprocess_attr_s::fds`.
+/// @param out_fds The read end, then the write end. Both are close-on-exec,
+/// above the standard streams, and owned by the caller, who closes the child's
+/// end once the child has been created.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned and `errno` holds the reason. Not
+/// supported on Windows.
+subprocess_weak int subprocess_create_pipe(int out_fds[2]);
+
+/// @brief Create a pipeline of processes, like the shell's `a | b | c`.
+/// @param command_lines One command line per stage, each as for
+/// subprocess_create_ex.
+/// @param count The number of stages, at least one.
+/// @param options As for subprocess_create_ex, applied to every stage. With
+/// subprocess_option_combined_stdout_stderr a stage's standard error also
+/// feeds the next stage.
+/// @param environment As for subprocess_create_ex, used by every stage.
+/// @param process_cwd As for subprocess_create_ex, used by every stage.
+/// @param attr As for subprocess_create_attr. `stdin_fd` applies to the first
+/// stage, `stdout_fd` to the last stage, and `pipe_capacity` to every pipe,
+/// including the ones between stages. Can be NULL.
+/// @param out_stages An array of `count` processes to create.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned and every stage created so far has
+/// been terminated and destroyed.
+///
+/// The standard output of each stage is connected to the standard input of
+/// the next by a single kernel pipe, so no data passes through the parent.
+/// Write to the pipeline with subprocess_stdin on the first stage and read
+/// from it with subprocess_stdout (or subprocess_read_stdout) on the last.
+/// Every stage has its own standard error. Only the first stage has a
+/// standard input file, and only the last a standard output file. Not
+/// supported on Windows.
+subprocess_weak int subprocess_create_pipeline(
+    const char *const *const command_lines[], unsigned count, int options,
+    const char *const environment[], const char *const process_cwd,
+    const struct subprocess_attr_s *const attr,
+    struct subprocess_s *const out_stages);
+
+/// @brief Wait for every stage of a pipeline to finish execution.
+/// @param stages The stages created by subprocess_create_pipeline.
+/// @param count The number of stages.
+/// @param pipefail If zero the pipeline's return code is the last stage's. If
+/// non-zero it is that of the last stage to return non-zero, or zero when all
+/// stages succeeded, like the shell's `set -o pipefail`.
+/// @param out_return_codes An array receiving each stage's return code (can
+/// be NULL).
+/// @param out_return_code The return code of the pipeline (can be NULL).
+/// @return On success zero is returned. Every stage is joined even if joining
+/// an earlier one fails.
+///
+/// Joining the pipeline closes the stdin pipe of the first stage.
+subprocess_weak int subprocess_join_pipeline(struct subprocess_s *const stages,
+                                             unsigned count, int pipefail,
+                                             int *const out_return_codes,
+                                             int *const out_return_code);
+
+/// @brief Run a graph of jobs, many at a time.
+/// @param jobs The jobs to run. Their dependencies must not form a cycle.
+/// @param count The number of jobs.
+/// @param capacity How much job weight may run at once, or 0 for the number
+/// of online processors. No job may weigh more than this.
+/// @param options As for subprocess_create_ex, applied to every job.
+/// @param environment As for subprocess_create_ex, used by every job.
+/// @param process_cwd As for subprocess_create_ex, used by every job.
+/// @param attr As for subprocess_create_attr, used by every job. Can be NULL.
+/// @param out_critical_path An array of `count` entries receiving, in order,
+/// the indices of the chain of dependent jobs that took longest to run (can be
+/// NULL).
+/// @param out_critical_length The number of jobs on the critical path (can be
+/// NULL).
+/// @return On success zero is returned, even if some jobs failed; check each
+/// job's `state`. On failure a non-zero `subprocess_error_e` value is
+/// returned. If a job cannot be started no further jobs are, but the ones
+/// already running are waited for.
+///
+/// A job starts once all of its dependencies have succeeded, and is skipped if
+/// any of them failed or was skipped. Among the jobs ready to start the one
+/// heading the longest chain of dependents is started first, so the critical
+/// path is never left waiting behind short jobs. Each job's standard input is
+/// empty and its standard output and error go to `attr->stdout_fd`, or are
+/// discarded when that is -1. On Linux finished jobs are collected with a
+/// reaper. Not supported on Windows.
+subprocess_weak int
+subprocess_run_jobs(struct subprocess_job_s *const jobs, unsigned count,
+                    unsigned capacity, int options,
+                    const char *const environment[],
+                    const char *const process_cwd,
+                    const struct subprocess_attr_s *const attr,
+                    unsigned *const out_critical_path,
+                    unsigned *const out_critical_length);
+
 /// @brief Get the standard input file for a process.
 /// @param process The process to query.
 /// @return The file for standard input of the process.
 ///
 /// The file returned can be written to by the parent process to feed data to
-/// the standard input of the process.
-subprocess_pure subprocess_weak FILE *
-subprocess_stdin(const struct subprocess_s *const process);
+/// the standard input of the process. If the process was created with a
+/// `subprocess_attr_s::stdin_fd` this function returns NULL.
+///
+/// The file is created on the first call, so a process that is only used
+/// through subprocess_stdin_fd never allocates one. Creating it stores into
+/// the process, so only the thread that writes to stdin may call this.
+subprocess_weak FILE *
+subprocess_stdin(struct subprocess_s *const process);
 
 /// @brief Get the standard output file for a process.
 /// @param process The process to query.
 /// @return The file for standard output of the process.
 ///
 /// The file returned can be read from by the parent process to read data from
-/// the standard output of the child process.
-subprocess_pure subprocess_weak FILE *
-subprocess_stdout(const struct subprocess_s *const process);
+/// the standard output of the child process. If the process was created with a
+/// `subprocess_attr_s::stdout_fd` this function returns NULL.
+///
+/// The file is created on the first call. subprocess_read_stdout does not need
+/// it, so a process that is only read that way never allocates one. Only the
+/// thread that reads stdout may call this.
+subprocess_weak FILE *
+subprocess_stdout(struct subprocess_s *const process);
 
 /// @brief Get the standard error file for a process.
 /// @param process The process to query.
@@ -185,8 +711,37 @@ subprocess_stdout(const struct subprocess_s *const process);
 /// If the process was created with the subprocess_option_combined_stdout_stderr
 /// option bit set, this function will return NULL, and the subprocess_stdout
 /// function should be used for both the standard output and error combined.
-subprocess_pure subprocess_weak FILE *
-subprocess_stderr(const struct subprocess_s *const process);
+/// Like subprocess_stdout the file is created on the first call, so only the
+/// thread that reads stderr may call this.
+subprocess_weak FILE *
+subprocess_stderr(struct subprocess_s *const process);
+
+/// @brief Get the descriptor for the standard input of a process.
+/// @param process The process to query.
+/// @return The descriptor, or -1 if there is none.
+///
+/// The descriptor stays owned by the process: it is closed by subprocess_join
+/// or subprocess_destroy, and backs the file from subprocess_stdin. On Windows
+/// it is a C runtime descriptor.
+subprocess_pure subprocess_weak int
+subprocess_stdin_fd(const struct subprocess_s *const process);
+
+/// @brief Get the descriptor for the standard output of a process.
+/// @param process The process to query.
+/// @return The descriptor, or -1 if there is none.
+///
+/// The descriptor stays owned by the process, as for subprocess_stdin_fd.
+subprocess_pure subprocess_weak int
+subprocess_stdout_fd(const struct subprocess_s *const process);
+
+/// @brief Get the descriptor for the standard error of a process.
+/// @param process The process to query.
+/// @return The descriptor, or -1 if there is none or the process was created
+/// with subprocess_option_combined_stdout_stderr.
+///
+/// The descriptor stays owned by the process, as for subprocess_stdin_fd.
+subprocess_pure subprocess_weak int
+subprocess_stderr_fd(const struct subprocess_s *const process);
 
 /// @brief Wait for a process to finish execution.
 /// @param process The process to wait for.
@@ -194,7 +749,9 @@ subprocess_stderr(const struct subprocess_s *const process);
 /// NULL).
 /// @return On success zero is returned.
 ///
-/// Joining a process will close the stdin pipe to the process.
+/// Joining a process will close the stdin pipe to the process, so no other
+/// thread may be writing to stdin while it runs. Any number of threads may
+/// join the same process, and each gets the same return code.
 subprocess_weak int subprocess_join(struct subprocess_s *const process,
                                     int *const out_return_code);
 
@@ -203,7 +760,8 @@ subprocess_weak int subprocess_join(struct subprocess_s *const process,
 /// @return On success zero is returned.
 ///
 /// If the process to be destroyed had not finished execution, it may out live
-/// the parent process.
+/// the parent process. No other thread may be using the process while it is
+/// destroyed.
 subprocess_weak int subprocess_destroy(struct subprocess_s *const process);
 
 /// @brief Terminate a previously created process.
@@ -211,9 +769,44 @@ subprocess_weak int subprocess_destroy(struct subprocess_s *const process);
 /// @return On success zero is returned.
 ///
 /// If the process to be destroyed had not finished execution, it will be
-/// terminated (i.e killed).
+/// terminated (i.e killed). On POSIX a process created with
+/// subprocess_option_new_process_group is killed along with every process in
+/// its group, until the group has emptied after the process was reaped; from
+/// then on its id may belong to someone else and is never signalled. On
+/// Windows only the process itself is terminated.
 subprocess_weak int subprocess_terminate(struct subprocess_s *const process);
 
+/// @brief Ask processes to terminate, killing any that take too long.
+/// @param processes The processes to terminate.
+/// @param count The number of processes.
+/// @param grace_ms How long each process has to exit once asked before it is
+/// killed.
+/// @return On success zero is returned, or -1 if a process could not be
+/// signalled.
+///
+/// Each process is sent SIGTERM, or its whole process group is if it was
+/// created with subprocess_option_new_process_group, and this returns straight
+/// away. Once the grace period is over subprocess_terminate_poll or
+/// subprocess_join sends SIGKILL to whatever is left. On Windows the processes
+/// are terminated straight away, as by subprocess_terminate.
+subprocess_weak int
+subprocess_terminate_ex(struct subprocess_s *const processes, unsigned count,
+                        unsigned grace_ms);
+
+/// @brief Kill the processes whose grace period from subprocess_terminate_ex
+/// is over.
+/// @param processes The processes given to subprocess_terminate_ex.
+/// @param count The number of processes.
+/// @return The number of processes still in their grace period. Never blocks.
+///
+/// A process with a process group of its own is only done once every process
+/// in the group has gone. subprocess_join on a process that is being
+/// terminated also waits for the rest of its group, and kills whatever is left
+/// of it at the end of the grace period.
+subprocess_weak unsigned
+subprocess_terminate_poll(struct subprocess_s *const processes,
+                          unsigned count);
+
 /// @brief Read the standard output from the child process.
 /// @param process The process to read from.
 /// @param buffer The buffer to read into.
@@ -244,9 +837,303 @@ subprocess_weak unsigned
 subprocess_read_stderr(struct subprocess_s *const process, char *const buffer,
                        unsigned size);
 
+/// @brief Read the standard output from the child process, waiting at most a
+/// timeout for data.
+/// @param process The process to read from.
+/// @param buffer The buffer to read into.
+/// @param size The maximum number of bytes to read, which must not be 0.
+/// @param timeout_ms How long to wait for data, as for poll(): 0 returns
+/// straight away and a negative timeout waits until data or the end of the
+/// stream arrives.
+/// @param out_bytes_read The number of bytes read into buffer.
+/// @return A subprocess_read_status_e. Only subprocess_read_data comes with
+/// bytes.
+///
+/// Unlike subprocess_read_stdout, this tells no data yet, the end of the
+/// stream and a failed read apart, so a loop can sleep in here until data
+/// arrives and stop at the end of the stream. It never blocks longer than the
+/// timeout, whichever options the process was created with. On Windows a
+/// timeout other than 0 waits until data or the end of the stream arrives,
+/// except with subprocess_option_enable_async_no_wait where it is taken as 0.
+subprocess_weak int
+subprocess_read_stdout_ex(struct subprocess_s *const process,
+                          char *const buffer, unsigned size, int timeout_ms,
+                          unsigned *const out_bytes_read);
+
+/// @brief Read the standard error from the child process, waiting at most a
+/// timeout for data.
+/// @param process The process to read from.
+/// @param buffer The buffer to read into.
+/// @param size The maximum number of bytes to read, which must not be 0.
+/// @param timeout_ms How long to wait for data, as for
+/// subprocess_read_stdout_ex.
+/// @param out_bytes_read The number of bytes read into buffer.
+/// @return A subprocess_read_status_e, as for subprocess_read_stdout_ex.
+subprocess_weak int
+subprocess_read_stderr_ex(struct subprocess_s *const process,
+                          char *const buffer, unsigned size, int timeout_ms,
+                          unsigned *const out_bytes_read);
+
+/// @brief Wait until a child created with `subprocess_option_notify_ready`
+/// says it is ready.
+/// @param process The process to wait on.
+/// @param timeout_ms How long to wait, as for subprocess_read_stdout_ex.
+/// @return subprocess_read_data once the child has said it is ready,
+/// subprocess_read_again on timeout, subprocess_read_eof if the child closed
+/// the pipe or exited without saying so, and subprocess_read_error on failure
+/// or for a process created without the option.
+///
+/// The child says it is ready by writing a `READY=1` line to the descriptor
+/// in its SUBPROCESS_NOTIFY_FD environment variable, as subprocess_notify_ready
+/// does. The line may arrive over several writes, and across calls that time
+/// out. Other lines, such as sd_notify's `STATUS=`, are skipped. The pipe is closed once the child is ready, after which this
+/// keeps returning subprocess_read_data.
+subprocess_weak int subprocess_wait_ready(struct subprocess_s *const process,
+                                          int timeout_ms);
+
+/// @brief Tell the parent that created this process with
+/// `subprocess_option_notify_ready` that it is ready.
+/// @return On success, or when the process was not created with the option,
+/// zero is returned. On failure a non-zero `subprocess_error_e` value is
+/// returned and `errno` holds the reason.
+///
+/// Called in the child, this writes `READY=1` to the descriptor named by
+/// SUBPROCESS_NOTIFY_FD and closes it. The variable stays set, so a child that
+/// starts processes of its own should not pass its environment on unchanged.
+subprocess_weak int subprocess_notify_ready(void);
+
+/// @brief Initialise a capture log over a buffer.
+/// @param capture The log to initialise.
+/// @param buffer The memory to record chunks in, which must outlive the log.
+/// @param capacity The size of buffer in bytes.
+///
+/// The start of the buffer is rounded up to the alignment of a chunk header,
+/// so any buffer works.
+subprocess_weak void
+subprocess_capture_init(struct subprocess_capture_s *const capture,
+                        void *const buffer, size_t capacity);
+
+/// @brief Record the standard output and error of a process in one log.
+/// @param process The process to read from.
+/// @param capture The log to append to.
+/// @return Zero once both streams have reached end of file, 1 if the log
+/// filled up first, or a negative `subprocess_error_e` value with `errno`
+/// holding the reason.
+///
+/// Both pipes are drained by one poll loop, and each read becomes a chunk
+/// tagged with its stream, a sequence number and the time, so the streams stay
+/// apart while their relative order is kept as precisely as the kernel
+/// reports it. Bytes are read straight into the log. Once it is full, empty it
+/// or give it more room and call again to continue. A process created with
+/// subprocess_option_combined_stdout_stderr only has subprocess_stream_stdout
+/// chunks. Not supported on Windows.
+subprocess_weak int
+subprocess_capture(struct subprocess_s *const process,
+                   struct subprocess_capture_s *const capture);
+
+/// @brief Walk the chunks of a capture log.
+/// @param capture The log to walk.
+/// @param chunk The previous chunk, or NULL for the first.
+/// @return The next chunk, or NULL after the last.
+subprocess_pure subprocess_weak const struct subprocess_chunk_s *
+subprocess_capture_next(const struct subprocess_capture_s *const capture,
+                        const struct subprocess_chunk_s *const chunk);
+
+/// @brief Compile rules into a watch.
+/// @param watch The watch to initialise.
+/// @param rules The rules, which must outlive the watch.
+/// @param rule_count The number of rules, at least one.
+/// @param callback Called for every match, or NULL.
+/// @param user_data Passed to callback.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned and `errno` holds the reason.
+///
+/// The patterns may add up to 1 MiB. The automaton needs memory roughly
+/// proportional to their length times the number of distinct bytes in them.
+subprocess_weak int
+subprocess_watch_init(struct subprocess_watch_s *const watch,
+                      const struct subprocess_watch_rule_s *const rules,
+                      unsigned rule_count,
+                      void (*callback)(void *user_data, unsigned rule,
+                                       int stream),
+                      void *const user_data);
+
+/// @brief Look for a watch's patterns in bytes read from a process.
+/// @param watch The watch to look with.
+/// @param process The process the bytes came from, which rules with
+/// subprocess_watch_terminate terminate. Can be NULL if there are none.
+/// @param stream The subprocess_stream_e the bytes came from.
+/// @param data The bytes.
+/// @param size The number of bytes.
+/// @return The number of matches, each of which has had its rule's action.
+///
+/// Feed each stream's bytes in the order they were read. Overlapping matches
+/// all count. Outside a possible match the bytes are skipped with memchr when
+/// every pattern starts with the same byte.
+subprocess_weak unsigned
+subprocess_watch_feed(struct subprocess_watch_s *const watch,
+                      struct subprocess_s *const process, int stream,
+                      const char *const data, size_t size);
+
+/// @brief Read from a process, as for subprocess_read_stdout_ex or
+/// subprocess_read_stderr_ex, and feed what was read to a watch.
+/// @param watch The watch to look with.
+/// @param process The process to read from.
+/// @param stream The subprocess_stream_e to read.
+/// @param buffer The buffer to read into.
+/// @param size The maximum number of bytes to read, which must not be 0.
+/// @param timeout_ms How long to wait for data, as for
+/// subprocess_read_stdout_ex.
+/// @param out_bytes_read The number of bytes read into buffer.
+/// @return A subprocess_read_status_e, as for subprocess_read_stdout_ex.
+subprocess_weak int subprocess_watch_read(
+    struct subprocess_watch_s *const watch, struct subprocess_s *const process,
+    int stream, char *const buffer, unsigned size, int timeout_ms,
+    unsigned *const out_bytes_read);
+
+/// @brief Free a watch's automaton.
+/// @param watch The watch to destroy.
+subprocess_weak void
+subprocess_watch_destroy(struct subprocess_watch_s *const watch);
+
+/// @brief Sample what a running process is using.
+/// @param process The process to sample.
+/// @param out_stats The sample.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned and `errno` holds the reason, ESRCH
+/// once the process has been reaped. Only supported on Linux.
+///
+/// The I/O fields are 0 when the process's /proc io file is not available,
+/// as without task I/O accounting or for a set-user-id child; the other
+/// fields are still filled in. The process's /proc files are opened on the
+/// first call and kept open until it is destroyed. Each sample rereads them into a stack buffer and
+/// parses them in place, without allocating. The descriptors follow the
+/// process, not its id, so a reused id is never sampled by mistake.
+subprocess_weak int
+subprocess_sample(struct subprocess_s *const process,
+                  struct subprocess_stats_s *const out_stats);
+
+/// @brief Sample many processes in one sweep.
+/// @param processes The processes to sample.
+/// @param count The number of processes.
+/// @param out_stats A sample per process. A process that could not be sampled
+/// gets all zeroes, threads included.
+/// @return The number of processes sampled.
+subprocess_weak unsigned
+subprocess_sample_group(struct subprocess_s *const processes, unsigned count,
+                        struct subprocess_stats_s *const out_stats);
+
+/// @brief Write a snapshot of the library's metrics in the OpenMetrics text
+/// format.
+/// @param buffer The buffer to write into.
+/// @param size The size of buffer in bytes.
+/// @param out_length The length of the snapshot, without the terminating NUL
+/// (can be NULL).
+/// @return On success zero is returned. If the snapshot does not fit,
+/// `subprocess_error_no_memory` is returned and `out_length` says how long it
+/// is. Without SUBPROCESS_ENABLE_METRICS, or on Windows,
+/// `subprocess_error_not_supported` is returned.
+///
+/// The snapshot covers processes spawned and failed spawns by error, live
+/// children, bytes read and read calls per stream, and a histogram of how
+/// long subprocess_join took. Counters are read one at a time while other
+/// threads keep updating them, so they are only consistent with each other
+/// once the library is idle.
+subprocess_weak int subprocess_metrics_write(char *const buffer, size_t size,
+                                             size_t *const out_length);
+
+/// @brief Create a channel to share with a child.
+/// @param channel The channel to create.
+/// @param capacity How many bytes the channel can hold, a power of two no
+/// bigger than 1 GiB.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned; platforms without memfd_create and
+/// futexes return `subprocess_error_not_supported`.
+///
+/// Hand the channel to a child through subprocess_attr_s::channel.
+subprocess_weak int
+subprocess_channel_init(struct subprocess_channel_s *const channel,
+                        unsigned capacity);
+
+/// @brief Open, in the child, a channel inherited from the parent.
+/// @param channel The channel to open.
+/// @param fd The channel's descriptor, as the parent's subprocess_channel_fd.
+/// @return On success zero is returned, or `subprocess_error_invalid_options`
+/// if fd is not a channel.
+subprocess_weak int
+subprocess_channel_open(struct subprocess_channel_s *const channel, int fd);
+
+/// @brief Get the descriptor behind a channel.
+/// @param channel The channel to query.
+/// @return The descriptor, which a child given the channel inherits with the
+/// same number.
+subprocess_pure subprocess_weak int
+subprocess_channel_fd(const struct subprocess_channel_s *const channel);
+
+/// @brief Write to a channel, waiting at most a timeout for room.
+/// @param channel The channel to write to.
+/// @param data The bytes to write.
+/// @param size The number of bytes to write, which must not be 0.
+/// @param timeout_ms How long to wait for room, as for
+/// subprocess_read_stdout_ex.
+/// @param out_bytes_written How many bytes were written, which is less than
+/// size when the channel fills up.
+/// @return A subprocess_read_status_e: subprocess_read_data if bytes were
+/// written, subprocess_read_again if there was no room before the timeout,
+/// subprocess_read_eof if either side has closed the channel, or
+/// subprocess_read_error with `errno` EPROTO if the other side has corrupted
+/// the ring.
+///
+/// Only one thread in one process may write to a channel. The reader is only
+/// woken, with a system call, when it is waiting for data.
+subprocess_weak int
+subprocess_channel_write(struct subprocess_channel_s *const channel,
+                         const void *const data, unsigned size, int timeout_ms,
+                         unsigned *const out_bytes_written);
+
+/// @brief Read from a channel, waiting at most a timeout for data.
+/// @param channel The channel to read from.
+/// @param buffer The buffer to read into.
+/// @param size The maximum number of bytes to read, which must not be 0.
+/// @param timeout_ms How long to wait for data, as for
+/// subprocess_read_stdout_ex.
+/// @param out_bytes_read How many bytes were read into buffer.
+/// @return A subprocess_read_status_e: subprocess_read_data if bytes were
+/// read, subprocess_read_again if none arrived before the timeout,
+/// subprocess_read_eof once the channel is closed and empty, or
+/// subprocess_read_error with `errno` EPROTO if the other side has corrupted
+/// the ring.
+///
+/// Only one thread in one process may read from a channel. The writer is only
+/// woken, with a system call, when it is waiting for room.
+subprocess_weak int
+subprocess_channel_read(struct subprocess_channel_s *const channel,
+                        void *const buffer, unsigned size, int timeout_ms,
+                        unsigned *const out_bytes_read);
+
+/// @brief Close a channel for both sides.
+/// @param channel The channel to close.
+///
+/// The reader still gets what was written before, then the end of the stream.
+/// The writer gets subprocess_read_eof straight away.
+subprocess_weak void
+subprocess_channel_close(struct subprocess_channel_s *const channel);
+
+/// @brief Unmap a channel and close its descriptor in this process.
+/// @param channel The channel to destroy.
+/// @return On success zero is returned.
+///
+/// The other side keeps its own mapping, so the parent may destroy a channel
+/// once it has created the child, if it does not use the channel itself.
+subprocess_weak int
+subprocess_channel_destroy(struct subprocess_channel_s *const channel);
+
 /// @brief Returns if the subprocess is currently still alive and executing.
 /// @param process The process to check.
 /// @return If the process is still alive non-zero is returned.
+///
+/// This never blocks and never touches the process's streams, so it may be
+/// called from any thread while others read from or write to the process.
 subprocess_weak int subprocess_alive(struct subprocess_s *const process);
 
 #if defined(__cplusplus)
@@ -270,9 +1157,21 @@ subprocess_weak int subprocess_alive(struct subprocess_s *const process);
 #if defined(__APPLE__)
 #include <AvailabilityMacros.h>
 #endif
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
 #endif
 
 #if defined(__NetBSD__)
@@ -349,6 +1248,113 @@ subprocess_weak int subprocess_alive(struct subprocess_s *const process);
 #endif
 #endif
 
+/* Whether subprocess_create_stdin_memfd is available. It needs memfd_create
+   and file seals, and reopening through /proc so that every child gets a file
+   offset of its own. */
+#if !defined(SUBPROCESS_HAVE_MEMFD)
+#if defined(__linux__) && defined(MFD_CLOEXEC) && defined(F_ADD_SEALS)
+#define SUBPROCESS_HAVE_MEMFD 1
+#else
+#define SUBPROCESS_HAVE_MEMFD 0
+#endif
+#endif
+
+/* Whether the subprocess_channel_* functions are available. A channel lives
+   in a memfd, and its sides wait for each other on futexes in it. */
+#if !defined(SUBPROCESS_HAVE_CHANNEL)
+#if SUBPROCESS_HAVE_MEMFD && defined(SYS_futex)
+#define SUBPROCESS_HAVE_CHANNEL 1
+#else
+#define SUBPROCESS_HAVE_CHANNEL 0
+#endif
+#endif
+
+/* Whether a child can be placed with subprocess_attr_s::cpus, memory_nodes,
+   scheduling and io_class. They use Linux system calls, and glibc only
+   declares the affinity API with _GNU_SOURCE. */
+#if !defined(SUBPROCESS_HAVE_PLACEMENT)
+#if defined(__linux__) && defined(CPU_SET) && defined(SCHED_BATCH) &&        \
+    defined(SCHED_IDLE) && defined(SYS_ioprio_set) &&                        \
+    defined(SYS_set_mempolicy)
+#define SUBPROCESS_HAVE_PLACEMENT 1
+#else
+#define SUBPROCESS_HAVE_PLACEMENT 0
+#endif
+#endif
+
+/* Whether the subprocess_reaper_* functions are available. They wait on
+   pidfds (Linux 5.3 and later) through epoll; without them every call returns
+   subprocess_error_not_supported. */
+#if !defined(SUBPROCESS_HAVE_REAPER)
+#if defined(__linux__) && defined(SYS_pidfd_open)
+#define SUBPROCESS_HAVE_REAPER 1
+#else
+#define SUBPROCESS_HAVE_REAPER 0
+#endif
+#endif
+
+/* Whether the subprocess_spawner_* functions and subprocess_create_async are
+   available. Their threads sleep on an eventfd semaphore (Linux 2.6.30 and
+   later); without one every call returns subprocess_error_not_supported. */
+#if !defined(SUBPROCESS_HAVE_SPAWNER)
+#if defined(__linux__) && defined(EFD_SEMAPHORE)
+#define SUBPROCESS_HAVE_SPAWNER 1
+#else
+#define SUBPROCESS_HAVE_SPAWNER 0
+#endif
+#endif
+
+/* Whether subprocess_create_fd is available. It execs the open file with
+   execveat (Linux 3.19 and later), which glibc only wraps from 2.34. */
+#if !defined(SUBPROCESS_HAVE_EXEC_FD)
+#if defined(__linux__) && defined(SYS_execveat)
+#define SUBPROCESS_HAVE_EXEC_FD 1
+#else
+#define SUBPROCESS_HAVE_EXEC_FD 0
+#endif
+#endif
+
+/* Whether the library keeps the counters and histograms that
+   subprocess_metrics_write reports. Define SUBPROCESS_ENABLE_METRICS to 1, the
+   same way in every translation unit that includes this header, to turn them
+   on; by default every update compiles out. They need atomics, which are not
+   available on Windows. */
+#if !defined(SUBPROCESS_ENABLE_METRICS)
+#define SUBPROCESS_ENABLE_METRICS 0
+#endif
+
+#if SUBPROCESS_ENABLE_METRICS && !defined(_WIN32)
+#define SUBPROCESS_HAVE_METRICS 1
+#else
+#define SUBPROCESS_HAVE_METRICS 0
+#endif
+
+/* Atomic operations on int and pointer sized values, for state shared between
+   threads. TinyCC has no atomic builtins, so there they degrade to plain
+   volatile accesses that are only safe from a single thread. */
+#if defined(__TINYC__)
+#define SUBPROCESS_ATOMIC_LOAD(p) (*(volatile __typeof__(*(p)) *)(p))
+#define SUBPROCESS_ATOMIC_STORE(p, v)                                          \
+  ((*(volatile __typeof__(*(p)) *)(p)) = (v))
+#define SUBPROCESS_ATOMIC_CAS(p, expected, desired)                            \
+  ((*(p) == *(expected)) ? ((*(p) = (desired)), 1)                            \
+                         : ((*(expected) = *(p)), 0))
+#define SUBPROCESS_ATOMIC_ADD(p, v) ((*(p) += (v)) - (v))
+#define SUBPROCESS_ATOMIC_ADD_RELAXED(p, v) ((*(p) += (v)) - (v))
+#define SUBPROCESS_ATOMIC_FENCE() ((void)0)
+#else
+#define SUBPROCESS_ATOMIC_LOAD(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define SUBPROCESS_ATOMIC_STORE(p, v)                                          \
+  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SUBPROCESS_ATOMIC_CAS(p, expected, desired)                            \
+  __atomic_compare_exchange_n((p), (expected), (desired), 0,                  \
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#define SUBPROCESS_ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+#define SUBPROCESS_ATOMIC_ADD_RELAXED(p, v)                                    \
+  __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define SUBPROCESS_ATOMIC_FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
 #if defined(_WIN32)
 
 #include <wchar.h>
@@ -565,107 +1571,709 @@ typedef size_t subprocess_size_t;
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wpadded"
 #endif
+// A running process. Without an external lock, one thread at a time may
+// write to stdin, one at a time may read from each of stdout and stderr, and
+// any number may call subprocess_alive, subprocess_join, subprocess_terminate,
+// subprocess_terminate_ex and subprocess_terminate_poll. subprocess_join
+// closes stdin, and subprocess_destroy must not overlap with anything else.
+// Under TinyCC, which has no atomic builtins, only one thread may use it.
 struct subprocess_s {
+  // The files for the streams, each created on first use from its descriptor.
   FILE *stdin_file;
   FILE *stdout_file;
   FILE *stderr_file;
 
+  // The parent's ends of the streams, or -1. stderr_fd is stdout_fd when the
+  // two are combined.
+  int stdin_fd;
+  int stdout_fd;
+  int stderr_fd;
+
 #if defined(_WIN32)
   void *hProcess;
   void *hStdInput;
   void *hEventOutput;
   void *hEventError;
 #else
+  // The process id until the process has been reaped, then 0, and its exit
+  // status once alive is 0. Only the thread that claims reaping waits for the
+  // process; every thread reads these with atomic loads.
   pid_t child;
   int return_status;
+  int reaping;
+
+  // The reaper collecting this process, if any, with the pidfd it waits on
+  // and whether it has collected the exit status yet.
+  struct subprocess_reaper_s *reaper;
+  int pidfd;
+  int collected;
+
+  // The process group the process leads, or 0 if it shares the parent's or
+  // the group has gone since the process was reaped, and when a
+  // subprocess_terminate_ex escalates to SIGKILL, if one is pending.
+  pid_t process_group;
+  int terminating;
+  unsigned long kill_deadline_ms;
+
+  // The read end of the pipe the child says it is ready on, or -1, whether it
+  // has said so, and how much of READY=1 the line read so far matches, or -1
+  // if it cannot. A line may arrive over several reads.
+  int notify_fd;
+  int ready;
+  int notify_matched;
+
+  // The process's /proc stat and io files, opened by the first
+  // subprocess_sample, or -1.
+  int stat_fd;
+  int io_fd;
+
+  // The governor that admitted the process, until it has been reaped or
+  // destroyed.
+  struct subprocess_governor_s *governor;
 #endif
 
   int alive;
   int no_wait;
 };
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
 
-#if defined(_WIN32)
-subprocess_weak int subprocess_error_from_windows_error(unsigned long error);
-int subprocess_error_from_windows_error(unsigned long error) {
-  enum {
-    errorFileNotFound = 2,
-    errorPathNotFound = 3,
-    errorTooManyOpenFiles = 4,
-    errorAccessDenied = 5,
-    errorInvalidHandle = 6,
-    errorNotEnoughMemory = 8,
-    errorOutOfMemory = 14,
-    errorInvalidDrive = 15,
-    errorBadPathname = 161,
-    errorDirectory = 267
-  };
+#if !defined(_WIN32)
+// A finished process, as queued by a reaper. The process has been reaped
+// when the event is queued and may be destroyed before it is taken, so the
+// pointer only says which process it was; pid and return_code are copies.
+struct subprocess_reaper_event_s {
+  struct subprocess_s *process;
+  pid_t pid;
+  int return_code;
+};
 
-  switch (error) {
-  case errorFileNotFound:
-  case errorPathNotFound:
-  case errorInvalidDrive:
-  case errorBadPathname:
-  case errorDirectory:
-    return subprocess_error_not_found;
-  case errorAccessDenied:
-    return subprocess_error_permission_denied;
-  case errorTooManyOpenFiles:
-  case errorNotEnoughMemory:
-  case errorOutOfMemory:
-    return subprocess_error_no_memory;
-  case errorInvalidHandle:
-    return subprocess_error_pipe;
-  default:
-    return subprocess_error_unknown;
-  }
-}
-#else
-subprocess_weak int subprocess_error_from_errno(int error);
-int subprocess_error_from_errno(int error) {
-  switch (error) {
-  case ENOENT:
-  case ENOTDIR:
-    return subprocess_error_not_found;
-  case EACCES:
-  case EPERM:
-    return subprocess_error_permission_denied;
-  case EMFILE:
-  case ENFILE:
-  case ENOMEM:
-    return subprocess_error_no_memory;
-  case ENOSYS:
-    return subprocess_error_not_supported;
-  default:
-    return subprocess_error_unknown;
-  }
-}
-#endif
+// Storage for one queued event. Only the reaper touches these.
+struct subprocess_reaper_slot_s {
+  unsigned sequence;
+  struct subprocess_reaper_event_s event;
+};
 
-#if defined(__clang__)
-#if __has_warning("-Wunsafe-buffer-usage")
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
-#endif
-#endif
+// Collects the exit of every process added to it as it happens, and queues
+// one event per process. Any number of threads may produce events (the ones
+// polling the reaper, or joining its processes); one thread consumes them.
+struct subprocess_reaper_s {
+  struct subprocess_reaper_slot_s *slots;
+  unsigned capacity;
+  unsigned enqueue_position;
+  unsigned dequeue_position;
+  unsigned outstanding;
+  int epoll_fd;
+  int event_fd;
+};
 
-#if defined(_WIN32)
-subprocess_weak int subprocess_create_named_pipe_helper(void **rd, void **wr);
-subprocess_weak void subprocess_close_handle(void **handle);
-void subprocess_close_handle(void **handle) {
-  const void *const invalidHandleValue =
-      SUBPROCESS_PTR_CAST(void *, ~(SUBPROCESS_CAST(subprocess_intptr_t, 0)));
+// A request to create a process on a spawner's thread. Everything it points
+// to, and the request itself, must stay valid until it is done.
+struct subprocess_spawn_s {
+  // What to create, as for subprocess_create_attr.
+  const char *const *command_line;
+  int options;
+  const char *const *environment;
+  const char *process_cwd;
+  const struct subprocess_attr_s *attr;
+
+  // Where the process is created.
+  struct subprocess_s *process;
+
+  // Called on the spawner's thread as the request completes, if not NULL, and
+  // free for the caller's use.
+  void (*callback)(struct subprocess_spawn_s *spawn);
+  void *user_data;
+
+  // What subprocess_create_attr returned, once subprocess_spawn_done says the
+  // request is done.
+  int result;
+  int done;
+};
 
-  if (*handle && (invalidHandleValue != *handle)) {
-    CloseHandle(*handle);
-  }
+// Storage for one queued request. Only the spawner touches these.
+struct subprocess_spawner_slot_s {
+  unsigned sequence;
+  struct subprocess_spawn_s *spawn;
+};
 
-  *handle = SUBPROCESS_NULL;
-}
+// Creates processes on threads that run subprocess_spawner_run, so that the
+// threads submitting requests never wait for the kernel to create them. Any
+// number of threads may submit requests, and any number may run the spawner.
+struct subprocess_spawner_s {
+  struct subprocess_spawner_slot_s *slots;
+  unsigned capacity;
+  unsigned enqueue_position;
+  unsigned dequeue_position;
+  int stopping;
+  int request_fd;
+  int done_fd;
+};
 
-int subprocess_create_named_pipe_helper(void **rd, void **wr) {
+// Storage for one standby process of a pool. Only the pool touches these.
+struct subprocess_standby_slot_s {
+  struct subprocess_s process;
+  struct subprocess_spawn_s spawn;
+  int starting;
+  int ready;
+};
+
+// Processes of one command started ahead of time, each waiting on its
+// standard input, so that one can be handed out without waiting for exec.
+// Only one thread may use a pool at a time.
+struct subprocess_standby_s {
+  // What every standby runs, as for subprocess_create_attr. Everything these
+  // point to must outlive the pool.
+  const char *const *command_line;
+  int options;
+  const char *const *environment;
+  const char *process_cwd;
+  const struct subprocess_attr_s *attr;
+
+  // The spawner replacements are started on, or NULL (the default) to start
+  // them in subprocess_standby_fill.
+  struct subprocess_spawner_s *spawner;
+
+  // How many standbys to keep, at most capacity. It can be changed at any
+  // time, and subprocess_standby_fill starts or stops standbys to match.
+  unsigned target;
+
+  // The slots, which must outlive the pool, how many there are, and where
+  // the next subprocess_standby_acquire starts looking.
+  struct subprocess_standby_slot_s *slots;
+  unsigned capacity;
+  unsigned next;
+};
+
+// Admission control for creating processes, so that a burst of requests
+// queues up instead of overwhelming the system. Fill in the limits, 0 for
+// none, then call subprocess_governor_init. Any number of threads may create
+// processes through one governor.
+struct subprocess_governor_s {
+  // How many processes may start per second on average, and how many may
+  // start back to back after a quiet spell.
+  unsigned rate;
+  unsigned burst;
+
+  // The most processes the governor admitted that may be running at once.
+  unsigned max_live;
+
+  // The share of the last ten seconds, in percent, in which some task was
+  // stalled waiting for memory or for a processor, as /proc/pressure reports
+  // it, at or above which processes are held back. Linux only.
+  unsigned memory_pressure;
+  unsigned cpu_pressure;
+
+  // Kept by the governor: how many processes it admitted are running, when
+  // the next start is due on the rate's schedule, the /proc/pressure files
+  // or -1, and when they were last read and whether they were over a limit.
+  unsigned live;
+  unsigned long due_us;
+  int memory_fd;
+  int cpu_fd;
+  unsigned long pressure_ms;
+  int pressured;
+};
+
+// A job queued on a scheduler.
+struct subprocess_scheduler_job_s {
+  // What to run, as for subprocess_create_attr. Everything these point to
+  // must outlive the job.
+  const char *const *command_line;
+  int options;
+  const char *const *environment;
+  const char *process_cwd;
+  const struct subprocess_attr_s *attr;
+
+  // The index of the tenant the job belongs to, and its priority among that
+  // tenant's jobs: higher starts first, and equal ones in the order queued.
+  unsigned tenant;
+  int priority;
+
+  // Filled in by the scheduler: the process once the job has started, how
+  // long the job waited in its queue, when it was queued and the job queued
+  // behind it.
+  struct subprocess_s process;
+  unsigned long wait_ms;
+  unsigned long queued_ms;
+  struct subprocess_scheduler_job_s *next;
+};
+
+// One of the parties sharing a scheduler.
+struct subprocess_scheduler_tenant_s {
+  // The tenant's share of starts relative to the other tenants; 0 counts as
+  // 1. A tenant of weight 2 starts two jobs in each round for every one a
+  // tenant of weight 1 starts.
+  unsigned weight;
+
+  // The most of the tenant's jobs that may run at once, or 0 for no limit.
+  unsigned quota;
+
+  // Kept by the scheduler: the tenant's queue, how many of its jobs are
+  // queued and running, and how many more it may start in its current turn.
+  struct subprocess_scheduler_job_s *head;
+  struct subprocess_scheduler_job_s *tail;
+  unsigned queued;
+  unsigned running;
+  unsigned deficit;
+
+  // Kept by the scheduler: how many of the tenant's jobs have started, and
+  // the total and the longest time they waited in the queue.
+  unsigned long started;
+  unsigned long wait_total_ms;
+  unsigned long wait_max_ms;
+};
+
+// Jobs from several tenants sharing a number of running processes. Tenants
+// take turns starting jobs in proportion to their weights (deficit round
+// robin), so a tenant with a long queue cannot starve the others. Only one
+// thread may use a scheduler at a time.
+struct subprocess_scheduler_s {
+  // The tenants, which must outlive the scheduler, and how many there are.
+  struct subprocess_scheduler_tenant_s *tenants;
+  unsigned tenant_count;
+
+  // The most jobs that may run at once, across all tenants. It can be
+  // changed at any time.
+  unsigned capacity;
+
+  // How many jobs are running, and whose turn it is.
+  unsigned running;
+  unsigned current;
+};
+#endif
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
+#if !defined(_WIN32)
+/// @brief Initialise a reaper.
+/// @param reaper The reaper to initialise.
+/// @param slots Storage for queued events, which must outlive the reaper.
+/// @param capacity The number of slots, a power of two. At most this many
+/// processes can be added and not yet have had their event taken.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned; platforms without pidfds return
+/// `subprocess_error_not_supported`.
+subprocess_weak int
+subprocess_reaper_init(struct subprocess_reaper_s *const reaper,
+                       struct subprocess_reaper_slot_s *const slots,
+                       unsigned capacity);
+
+/// @brief Hand a process to a reaper.
+/// @param reaper The reaper to collect the process.
+/// @param process A process that has not been joined, and that
+/// subprocess_alive has not reported as finished.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned; `subprocess_error_no_memory` means
+/// every slot is spoken for.
+///
+/// From then on only the reaper waits for the process. subprocess_join and
+/// subprocess_alive keep working, using the status the reaper records. The
+/// process must not be destroyed before it has finished and been collected,
+/// which subprocess_join, a zero from subprocess_alive, or its event
+/// guarantee.
+subprocess_weak int
+subprocess_reaper_add(struct subprocess_reaper_s *const reaper,
+                      struct subprocess_s *const process);
+
+/// @brief Collect every added process that has finished.
+/// @param reaper The reaper to poll.
+/// @param timeout_ms How long to wait for a process to finish: 0 to return
+/// straight away, or -1 to wait indefinitely.
+/// @return The number of processes collected, or -1 on error.
+///
+/// A single wakeup collects every finished process. Call this in a loop on a
+/// thread of your own for a background reaper.
+subprocess_weak int
+subprocess_reaper_poll(struct subprocess_reaper_s *const reaper,
+                       int timeout_ms);
+
+/// @brief Take the next event from a reaper's queue.
+/// @param reaper The reaper to take from.
+/// @param out_event The event taken.
+/// @return Non-zero if an event was taken, zero if the queue is empty.
+///
+/// Only one thread at a time may take events from a reaper.
+subprocess_weak int
+subprocess_reaper_next(struct subprocess_reaper_s *const reaper,
+                       struct subprocess_reaper_event_s *const out_event);
+
+/// @brief Wait until a reaper has an event to take.
+/// @param reaper The reaper to wait on.
+/// @param timeout_ms How long to wait: 0 to return straight away, or -1 to
+/// wait indefinitely.
+/// @return 1 if an event is ready, 0 on timeout, or -1 on error.
+///
+/// Waiting collects finished processes itself, so no other thread has to poll
+/// the reaper.
+subprocess_weak int
+subprocess_reaper_wait(struct subprocess_reaper_s *const reaper,
+                       int timeout_ms);
+
+/// @brief Destroy a reaper.
+/// @param reaper The reaper to destroy.
+/// @return On success zero is returned.
+///
+/// Every process added to the reaper must have been collected first.
+subprocess_weak int
+subprocess_reaper_destroy(struct subprocess_reaper_s *const reaper);
+
+/// @brief Initialise a spawner.
+/// @param spawner The spawner to initialise.
+/// @param slots Storage for queued requests, which must outlive the spawner.
+/// @param capacity The number of slots, a power of two. At most this many
+/// requests can be waiting at once.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned; platforms without eventfd return
+/// `subprocess_error_not_supported`.
+subprocess_weak int
+subprocess_spawner_init(struct subprocess_spawner_s *const spawner,
+                        struct subprocess_spawner_slot_s *const slots,
+                        unsigned capacity);
+
+/// @brief Run a spawner, creating the processes requested of it.
+/// @param spawner The spawner to run.
+/// @return Zero once subprocess_spawner_stop has been called and every
+/// request submitted before it is done, or -1 on error.
+///
+/// Call this on a thread of your own, or on each thread of a pool. It sleeps
+/// while there is nothing to do.
+subprocess_weak int
+subprocess_spawner_run(struct subprocess_spawner_s *const spawner);
+
+/// @brief Ask every thread running a spawner to return once no requests are
+/// left.
+/// @param spawner The spawner to stop.
+/// @return On success zero is returned.
+///
+/// Requests submitted from then on are refused. No thread may be submitting a
+/// request while this runs.
+subprocess_weak int
+subprocess_spawner_stop(struct subprocess_spawner_s *const spawner);
+
+/// @brief Get a descriptor that becomes readable as requests complete.
+/// @param spawner The spawner to query.
+/// @return The descriptor, an eventfd holding the number of requests
+/// completed since it was last read, or -1 if there is none.
+///
+/// Wait on it with poll or epoll from one thread, read it, then check the
+/// requests it submitted with subprocess_spawn_done.
+subprocess_pure subprocess_weak int
+subprocess_spawner_done_fd(const struct subprocess_spawner_s *const spawner);
+
+/// @brief Destroy a spawner.
+/// @param spawner The spawner to destroy.
+/// @return On success zero is returned.
+///
+/// No thread may be running the spawner any more.
+subprocess_weak int
+subprocess_spawner_destroy(struct subprocess_spawner_s *const spawner);
+
+/// @brief Create a process on a spawner's thread.
+/// @param spawner The spawner to create the process.
+/// @param spawn The request, with every field before result filled in.
+/// @return Zero if the request was queued, and never blocks. On failure a
+/// non-zero `subprocess_error_e` value is returned;
+/// `subprocess_error_no_memory` means every slot is spoken for, and
+/// `subprocess_error_invalid_options` that the spawner has been stopped.
+///
+/// Once the process has been created, or has failed to be, the request's
+/// callback runs on the spawner's thread, then the request is marked done and
+/// the spawner's descriptor is signalled. The spawner does not touch the
+/// request after marking it done.
+subprocess_weak int
+subprocess_create_async(struct subprocess_spawner_s *const spawner,
+                        struct subprocess_spawn_s *const spawn);
+
+/// @brief Check whether a request from subprocess_create_async is done.
+/// @param spawn The request to check.
+/// @return Non-zero once the request is done and its result and process may
+/// be used, zero before.
+subprocess_weak int
+subprocess_spawn_done(const struct subprocess_spawn_s *const spawn);
+
+/// @brief Initialise a standby pool. No process is started until
+/// subprocess_standby_fill.
+/// @param pool The pool to initialise.
+/// @param command_line As for subprocess_create_attr.
+/// @param options As for subprocess_create_attr.
+/// @param environment As for subprocess_create_attr.
+/// @param process_cwd As for subprocess_create_attr.
+/// @param attr As for subprocess_create_attr, or NULL.
+/// @param slots Storage for the standbys, which must outlive the pool.
+/// @param capacity The number of slots, which is also the initial target.
+///
+/// Everything the command points to must outlive the pool. Set the pool's
+/// spawner to start replacements off the calling thread.
+subprocess_weak void
+subprocess_standby_init(struct subprocess_standby_s *const pool,
+                        const char *const command_line[], int options,
+                        const char *const environment[],
+                        const char *const process_cwd,
+                        const struct subprocess_attr_s *const attr,
+                        struct subprocess_standby_slot_s *const slots,
+                        unsigned capacity);
+
+/// @brief Bring a pool to its target.
+/// @param pool The pool to fill.
+/// @return On success zero is returned. On failure the `subprocess_error_e`
+/// value from creating a standby is returned, and `errno` holds the reason.
+///
+/// Takes in standbys the spawner has finished starting and drops the ones
+/// that exited while idle. It then stops standbys above the target and
+/// starts new ones up to it. New standbys go on the pool's spawner if it has
+/// one, and are otherwise created here. Call it whenever there is time, such
+/// as after handing a request to an acquired process.
+subprocess_weak int
+subprocess_standby_fill(struct subprocess_standby_s *const pool);
+
+/// @brief Take a running process from a pool.
+/// @param pool The pool to take from.
+/// @param out_process The process, which the caller joins and destroys as if
+/// it had created it.
+/// @return On success zero is returned. On failure a non-zero
+/// `subprocess_error_e` value is returned and `errno` holds the reason.
+///
+/// Standbys found to have exited are dropped on the way. With a spawner, a
+/// replacement is queued at once. If no standby is ready, the process is
+/// created here, as subprocess_create_attr would.
+subprocess_weak int
+subprocess_standby_acquire(struct subprocess_standby_s *const pool,
+                           struct subprocess_s *const out_process);
+
+/// @brief Stop every standby of a pool.
+/// @param pool The pool to destroy.
+/// @return On success zero is returned.
+///
+/// Standbys the spawner is still starting are waited for, so the spawner
+/// must still be running if any were queued.
+subprocess_weak int
+subprocess_standby_destroy(struct subprocess_standby_s *const pool);
+
+/// @brief Initialise a governor once its limits have been filled in.
+/// @param governor The governor to initialise.
+/// @return On success zero is returned. If a pressure limit is set but the
+/// system does not report pressure, subprocess_error_not_supported is
+/// returned and `errno` holds the reason.
+subprocess_weak int
+subprocess_governor_init(struct subprocess_governor_s *const governor);
+
+/// @brief Create a process once a governor admits it.
+/// @param governor The governor to wait on.
+/// @param command_line As for subprocess_create_attr.
+/// @param options As for subprocess_create_attr.
+/// @param environment As for subprocess_create_attr.
+/// @param process_cwd As for subprocess_create_attr.
+/// @param attr As for subprocess_create_attr, or NULL.
+/// @param out_process The newly created process.
+/// @param timeout_ms How long to wait to be admitted: 0 to try once, or -1 to
+/// wait indefinitely.
+/// @return On success zero is returned. If the process was not admitted in
+/// time, subprocess_error_unknown is returned and `errno` is ETIMEDOUT.
+/// Otherwise, as for subprocess_create_attr.
+///
+/// Waits while the rate is used up, while max_live processes the governor
+/// admitted are running, or while the system is under more pressure than the
+/// governor allows. If creating fails with EAGAIN, because the system is
+/// short of processes for the moment, it backs off and tries again within the
+/// same timeout. The process counts towards max_live until it is joined or
+/// destroyed.
+subprocess_weak int subprocess_governor_create(
+    struct subprocess_governor_s *const governor,
+    const char *const command_line[], int options,
+    const char *const environment[], const char *const process_cwd,
+    const struct subprocess_attr_s *const attr,
+    struct subprocess_s *const out_process, int timeout_ms);
+
+/// @brief Destroy a governor.
+/// @param governor The governor to destroy.
+/// @return On success zero is returned.
+///
+/// Every process the governor admitted must have been joined or destroyed
+/// first.
+subprocess_weak int
+subprocess_governor_destroy(struct subprocess_governor_s *const governor);
+
+/// @brief Initialise a scheduler.
+/// @param scheduler The scheduler to initialise.
+/// @param tenants The tenants, with their weights and quotas filled in, which
+/// must outlive the scheduler.
+/// @param tenant_count The number of tenants.
+/// @param capacity The most jobs that may run at once, or 0 for the number of
+/// online processors.
+subprocess_weak void
+subprocess_scheduler_init(struct subprocess_scheduler_s *const scheduler,
+                          struct subprocess_scheduler_tenant_s *const tenants,
+                          unsigned tenant_count, unsigned capacity);
+
+/// @brief Queue a job on a scheduler.
+/// @param scheduler The scheduler to queue on.
+/// @param job The job, which must outlive its time on the scheduler.
+/// @return On success zero is returned. If the job names no tenant of the
+/// scheduler, subprocess_error_invalid_options is returned and `errno` is
+/// EINVAL.
+subprocess_weak int
+subprocess_scheduler_submit(struct subprocess_scheduler_s *const scheduler,
+                            struct subprocess_scheduler_job_s *const job);
+
+/// @brief Start the next job due on a scheduler.
+/// @param scheduler The scheduler to start from.
+/// @param out_job The job started, or NULL if none can start now, because
+/// nothing is queued, the scheduler is at capacity, or every tenant with jobs
+/// queued is at its quota.
+/// @return On success zero is returned. On failure to create the job's
+/// process the `subprocess_error_e` value from subprocess_create_attr is
+/// returned, `errno` holds the reason, and `out_job` is the job, which is
+/// taken off its queue.
+///
+/// Call it in a loop until no job is started. The caller joins and destroys a
+/// started job's process, then hands the job back with
+/// subprocess_scheduler_finish.
+subprocess_weak int
+subprocess_scheduler_start(struct subprocess_scheduler_s *const scheduler,
+                           struct subprocess_scheduler_job_s **const out_job);
+
+/// @brief Give back the slot of a job that has finished.
+/// @param scheduler The scheduler the job was started on.
+/// @param job The job, whose process has been joined.
+subprocess_weak void
+subprocess_scheduler_finish(struct subprocess_scheduler_s *const scheduler,
+                            struct subprocess_scheduler_job_s *const job);
+#endif
+
+#if defined(_WIN32)
+subprocess_weak int subprocess_error_from_windows_error(unsigned long error);
+int subprocess_error_from_windows_error(unsigned long error) {
+  enum {
+    errorFileNotFound = 2,
+    errorPathNotFound = 3,
+    errorTooManyOpenFiles = 4,
+    errorAccessDenied = 5,
+    errorInvalidHandle = 6,
+    errorNotEnoughMemory = 8,
+    errorOutOfMemory = 14,
+    errorInvalidDrive = 15,
+    errorBadPathname = 161,
+    errorDirectory = 267
+  };
+
+  switch (error) {
+  case errorFileNotFound:
+  case errorPathNotFound:
+  case errorInvalidDrive:
+  case errorBadPathname:
+  case errorDirectory:
+    return subprocess_error_not_found;
+  case errorAccessDenied:
+    return subprocess_error_permission_denied;
+  case errorTooManyOpenFiles:
+  case errorNotEnoughMemory:
+  case errorOutOfMemory:
+    return subprocess_error_no_memory;
+  case errorInvalidHandle:
+    return subprocess_error_pipe;
+  default:
+    return subprocess_error_unknown;
+  }
+}
+#else
+subprocess_weak int subprocess_error_from_errno(int error);
+int subprocess_error_from_errno(int error) {
+  switch (error) {
+  case ENOENT:
+  case ENOTDIR:
+    return subprocess_error_not_found;
+  case EACCES:
+  case EPERM:
+    return subprocess_error_permission_denied;
+  case EMFILE:
+  case ENFILE:
+  case ENOMEM:
+    return subprocess_error_no_memory;
+  case ENOSYS:
+    return subprocess_error_not_supported;
+  default:
+    return subprocess_error_unknown;
+  }
+}
+#endif
+
+#if defined(__clang__)
+#if __has_warning("-Wunsafe-buffer-usage")
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wunsafe-buffer-usage"
+#endif
+#endif
+
+/* Close a stream through its file if one was created, which also closes the
+   descriptor, or else through the descriptor alone. */
+static void subprocess_close_stream(FILE **const file, int *const fd) {
+  if (*file) {
+    fclose(*file);
+  } else if (-1 != *fd) {
+#if defined(_WIN32)
+    _close(*fd);
+#else
+    close(*fd);
+#endif
+  }
+
+  *file = SUBPROCESS_NULL;
+  *fd = -1;
+}
+
+#if !defined(_WIN32)
+/* Close stdin for subprocess_join. Joins may overlap, so the descriptor is
+   claimed first and only the caller that swaps it out closes it; the others
+   would otherwise close the file twice, or close a number already reused. */
+static void subprocess_close_stdin(struct subprocess_s *const process) {
+  int fd = SUBPROCESS_ATOMIC_LOAD(&process->stdin_fd);
+  FILE *file;
+
+  do {
+    if (-1 == fd) {
+      return;
+    }
+  } while (!SUBPROCESS_ATOMIC_CAS(&process->stdin_fd, &fd, -1));
+
+  /* No thread writes to stdin while a join runs, so the file is stable. */
+  file = process->stdin_file;
+  process->stdin_file = SUBPROCESS_NULL;
+
+  if (file) {
+    fclose(file);
+  } else {
+    close(fd);
+  }
+}
+#endif
+
+static void subprocess_close_streams(struct subprocess_s *const process) {
+  subprocess_close_stream(&process->stdin_file, &process->stdin_fd);
+
+  if (process->stderr_fd != process->stdout_fd) {
+    subprocess_close_stream(&process->stderr_file, &process->stderr_fd);
+  }
+
+  subprocess_close_stream(&process->stdout_file, &process->stdout_fd);
+  process->stderr_file = SUBPROCESS_NULL;
+  process->stderr_fd = -1;
+}
+
+#if defined(_WIN32)
+subprocess_weak int subprocess_create_named_pipe_helper(void **rd, void **wr);
+subprocess_weak void subprocess_close_handle(void **handle);
+void subprocess_close_handle(void **handle) {
+  const void *const invalidHandleValue =
+      SUBPROCESS_PTR_CAST(void *, ~(SUBPROCESS_CAST(subprocess_intptr_t, 0)));
+
+  if (*handle && (invalidHandleValue != *handle)) {
+    CloseHandle(*handle);
+  }
+
+  *handle = SUBPROCESS_NULL;
+}
+
+int subprocess_create_named_pipe_helper(void **rd, void **wr) {
   const unsigned long pipeAccessInbound = 0x00000001;
   const unsigned long fileFlagOverlapped = 0x40000000;
   const unsigned long pipeTypeByte = 0x00000000;
@@ -814,1386 +2422,6268 @@ static int subprocess_pipe_cloexec(int fds[2]) {
 
   return subprocess_fds_above_std(fds);
 }
-#endif
 
-int subprocess_create(const char *const commandLine[], int options,
-                      struct subprocess_s *const out_process) {
-  return subprocess_create_ex(commandLine, options, SUBPROCESS_NULL,
-                              SUBPROCESS_NULL, out_process);
-}
+/* Write the decimal form of value after prefix into out, which must have room
+   for the prefix and 11 more characters. Hand rolled rather than snprintf so
+   that it is also usable between fork() and exec(). */
+static void subprocess_format_int(char *out, const char *prefix, int value) {
+  char digits[11];
+  unsigned magnitude = SUBPROCESS_CAST(unsigned, value);
+  int count = 0;
 
-#if SUBPROCESS_SPAWN_VIA_FORK
-/* Not every platform declares execvpe: AIX exports it from libc without ever
-   naming it in a header, and glibc hides it behind _GNU_SOURCE. */
-extern int execvpe(const char *, char *const *, char *const *);
-#endif
+  while ('\0' != *prefix) {
+    *out++ = *prefix++;
+  }
 
-int subprocess_create_ex(const char *const commandLine[], int options,
-                         const char *const environment[],
-                         const char *const process_cwd,
-                         struct subprocess_s *const out_process) {
-#if defined(_WIN32)
-  int fd;
-  int async_no_wait;
-  void *rd = SUBPROCESS_NULL;
-  void *wr = SUBPROCESS_NULL;
-  char *commandLineCombined;
-  subprocess_wchar_t *commandLineCombinedWide = SUBPROCESS_NULL;
-  subprocess_wchar_t *process_cwd_wide = SUBPROCESS_NULL;
-  subprocess_size_t len;
-  int wide_len;
-  int i, j;
-  int need_quoting;
-  subprocess_size_t bs_run;
-  unsigned long flags = 0;
-  unsigned long last_error = 0;
-  int attribute_list_initialized = 0;
-  int result = subprocess_error_unknown;
-  const unsigned int codePageUtf8 = 65001;
-  const unsigned long mbErrInvalidChars = 0x00000008;
-  const unsigned long startFUseStdHandles = 0x00000100;
-  const unsigned long handleFlagInherit = 0x00000001;
-  const unsigned long createNoWindow = 0x08000000;
-  const unsigned long createUnicodeEnvironment = 0x00000400;
-  const unsigned long extendedStartupInfoPresent = 0x00080000;
-  const subprocess_size_t procThreadAttributeHandleList = 0x00020002;
-  struct subprocess_subprocess_information_s processInfo = {SUBPROCESS_NULL,
-                                                            SUBPROCESS_NULL, 0,
-                                                            0};
-  struct subprocess_security_attributes_s saAttr = {sizeof(saAttr),
-                                                    SUBPROCESS_NULL, 1};
-  subprocess_wchar_t empty_environment[2] = {0, 0};
-  subprocess_wchar_t *used_environment = SUBPROCESS_NULL;
-  subprocess_ulongptr_t attribute_list_size = 0;
-  subprocess_size_t inherited_handle_count = 0;
-  LPPROC_THREAD_ATTRIBUTE_LIST attribute_list = SUBPROCESS_NULL;
-  void *inherited_handles[3];
-  struct subprocess_startup_info_ex_s startInfoEx;
-  struct subprocess_startup_info_s startInfo = {0,
-                                                SUBPROCESS_NULL,
-                                                SUBPROCESS_NULL,
-                                                SUBPROCESS_NULL,
-                                                0,
-                                                0,
-                                                0,
-                                                0,
-                                                0,
-                                                0,
-                                                0,
-                                                0,
-                                                0,
-                                                0,
-                                                SUBPROCESS_NULL,
-                                                SUBPROCESS_NULL,
-                                                SUBPROCESS_NULL,
-                                                SUBPROCESS_NULL};
+  if (value < 0) {
+    *out++ = '-';
+    magnitude = 0u - magnitude;
+  }
 
-  async_no_wait = subprocess_option_enable_async_no_wait ==
-                  (options & subprocess_option_enable_async_no_wait);
+  do {
+    digits[count++] = SUBPROCESS_CAST(char, '0' + (magnitude % 10u));
+    magnitude /= 10u;
+  } while (0u != magnitude);
 
-  if (async_no_wait && (subprocess_option_enable_async !=
-                        (options & subprocess_option_enable_async))) {
-    return subprocess_error_invalid_options;
+  while (0 < count) {
+    *out++ = digits[--count];
   }
 
-  startInfo.cb = sizeof(startInfo);
-  startInfo.dwFlags = startFUseStdHandles;
+  *out = '\0';
+}
 
-  if (subprocess_option_no_window == (options & subprocess_option_no_window)) {
-    flags |= createNoWindow;
-  }
+/* Microseconds on the same clock as subprocess_monotonic_ms. */
+static unsigned long subprocess_monotonic_us(void) {
+  struct timespec now;
 
-  memset(out_process, 0, sizeof(*out_process));
+  if (0 != clock_gettime(CLOCK_MONOTONIC, &now)) {
+    return 0;
+  }
 
-  if (subprocess_option_inherit_environment !=
-      (options & subprocess_option_inherit_environment)) {
-    flags |= createUnicodeEnvironment;
+  return SUBPROCESS_CAST(unsigned long, now.tv_sec) * 1000000ul +
+         SUBPROCESS_CAST(unsigned long, now.tv_nsec) / 1000ul;
+}
 
-    if (SUBPROCESS_NULL == environment) {
-      used_environment = empty_environment;
-    } else {
-      // We always end with two null terminators. MultiByteToWideChar includes
-      // each environment string's null terminator, so start with one extra.
-      len = 1;
+#if SUBPROCESS_HAVE_METRICS
+/* Join latencies are kept in microseconds, HDR style: exactly below 4, and
+   beyond that in 4 buckets per power of two up to 2^32, so every bucket is
+   within 25% of the values in it. */
+#define SUBPROCESS_METRICS_BUCKETS 124
+
+struct subprocess_metrics_s {
+  unsigned long spawns;
+  /* Indexed by the negated subprocess_error_e. */
+  unsigned long spawn_failures[10];
+  long live_children;
+  unsigned long read_bytes[2];
+  unsigned long reads[2];
+  unsigned long join_buckets[SUBPROCESS_METRICS_BUCKETS];
+  unsigned long join_count;
+  unsigned long join_sum_us;
+};
 
-      for (i = 0; environment[i]; i++) {
-        wide_len = MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
-                                       environment[i], -1, SUBPROCESS_NULL, 0);
-        if (0 == wide_len) {
-          result = subprocess_error_from_windows_error(GetLastError());
-          if (subprocess_error_unknown == result) {
-            result = subprocess_error_spawn;
-          }
-          goto cleanup;
-        }
+/* The one registry for the program. The function is weak like the rest of the
+   library, so every translation unit ends up sharing the same static. */
+subprocess_weak struct subprocess_metrics_s *subprocess_metrics(void);
+struct subprocess_metrics_s *subprocess_metrics(void) {
+  static struct subprocess_metrics_s metrics;
+  return &metrics;
+}
 
-        len += SUBPROCESS_CAST(subprocess_size_t, wide_len);
-      }
+#define SUBPROCESS_METRIC_ADD(field, value)                                    \
+  ((void)SUBPROCESS_ATOMIC_ADD_RELAXED(&subprocess_metrics()->field, (value)))
 
-      if (((SUBPROCESS_CAST(subprocess_size_t, -1)) /
-           sizeof(subprocess_wchar_t)) < len) {
-        result = subprocess_error_no_memory;
-        goto cleanup;
-      }
+static unsigned subprocess_metrics_bucket(unsigned long value) {
+  unsigned octave = 2;
 
-      used_environment = SUBPROCESS_CAST(
-          subprocess_wchar_t *, _alloca(len * sizeof(subprocess_wchar_t)));
-      if (!used_environment) {
-        result = subprocess_error_no_memory;
-        goto cleanup;
-      }
+  if (value < 4) {
+    return SUBPROCESS_CAST(unsigned, value);
+  }
 
-      // Re-use len for the insertion position.
-      len = 0;
+  /* Split in two so that a 32 bit unsigned long is not shifted by 32. */
+  if (0 != ((value >> 16) >> 16)) {
+    value = 0xFFFFFFFFul;
+  }
 
-      for (i = 0; environment[i]; i++) {
-        wide_len = MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
-                                       environment[i], -1, SUBPROCESS_NULL, 0);
-        if (0 == wide_len) {
-          result = subprocess_error_from_windows_error(GetLastError());
-          if (subprocess_error_unknown == result) {
-            result = subprocess_error_spawn;
-          }
-          goto cleanup;
-        }
+  while ((octave < 31) && (0 != (value >> (octave + 1)))) {
+    octave++;
+  }
 
-        if (0 == MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
-                                     environment[i], -1,
-                                     &used_environment[len], wide_len)) {
-          result = subprocess_error_from_windows_error(GetLastError());
-          if (subprocess_error_unknown == result) {
-            result = subprocess_error_spawn;
-          }
-          goto cleanup;
-        }
+  return 4 + (octave - 2) * 4 +
+         SUBPROCESS_CAST(unsigned, (value >> (octave - 2)) - 4);
+}
 
-        len += SUBPROCESS_CAST(subprocess_size_t, wide_len);
-      }
+/* The largest value that lands in a bucket. */
+static unsigned long subprocess_metrics_bucket_limit(unsigned bucket) {
+  unsigned octave;
 
-      // End with the second null terminator.
-      used_environment[len++] = 0;
-    }
-  } else {
-    if (SUBPROCESS_NULL != environment) {
-      return subprocess_error_invalid_environment;
-    }
+  if (bucket < 4) {
+    return bucket;
   }
 
-  if (!CreatePipe(&rd, &wr, SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr),
-                  0)) {
-    result = subprocess_error_pipe;
-    goto cleanup;
-  }
+  octave = (bucket - 4) / 4 + 2;
+  return ((4ul + (bucket - 4) % 4 + 1) << (octave - 2)) - 1;
+}
 
-  if (!SetHandleInformation(wr, handleFlagInherit, 0)) {
-    result = subprocess_error_pipe;
-    goto cleanup;
+static void subprocess_metrics_spawned(int result) {
+  if (0 == result) {
+    SUBPROCESS_METRIC_ADD(spawns, 1);
+    SUBPROCESS_METRIC_ADD(live_children, 1);
+  } else if ((result < 0) && (result >= subprocess_error_not_supported)) {
+    SUBPROCESS_METRIC_ADD(spawn_failures[-result], 1);
   }
+}
 
-  fd = _open_osfhandle(SUBPROCESS_PTR_CAST(subprocess_intptr_t, wr), 0);
-  if (-1 == fd) {
-    result = subprocess_error_pipe;
-    goto cleanup;
-  }
-  wr = SUBPROCESS_NULL;
+static void subprocess_metrics_read(int stream, ssize_t bytes_read) {
+  SUBPROCESS_METRIC_ADD(reads[stream - 1], 1);
 
-  out_process->stdin_file = _fdopen(fd, "wb");
-  if (SUBPROCESS_NULL == out_process->stdin_file) {
-    _close(fd);
-    goto cleanup;
+  if (bytes_read > 0) {
+    SUBPROCESS_METRIC_ADD(read_bytes[stream - 1],
+                          SUBPROCESS_CAST(unsigned long, bytes_read));
   }
+}
 
-  startInfo.hStdInput = rd;
-  rd = SUBPROCESS_NULL;
+static void subprocess_metrics_joined(unsigned long start_us) {
+  const unsigned long elapsed = subprocess_monotonic_us() - start_us;
 
-  if (options & subprocess_option_enable_async) {
-    if (subprocess_create_named_pipe_helper(&rd, &wr)) {
-      result = subprocess_error_pipe;
-      goto cleanup;
-    }
-  } else {
-    if (!CreatePipe(&rd, &wr,
-                    SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr), 0)) {
-      result = subprocess_error_pipe;
-      goto cleanup;
+  SUBPROCESS_METRIC_ADD(join_buckets[subprocess_metrics_bucket(elapsed)], 1);
+  SUBPROCESS_METRIC_ADD(join_count, 1);
+  SUBPROCESS_METRIC_ADD(join_sum_us, elapsed);
+}
+#endif
+
+/* Make the child's private copy of a caller supplied standard input. Like the
+   pipe ends it is close-on-exec and kept off 0, 1 and 2. On Linux a regular
+   file is reopened through /proc so each child gets a file offset of its own
+   instead of sharing, and advancing, the caller's. */
+static int subprocess_stdin_source(int fd) {
+#if defined(__linux__)
+  struct stat info;
+  char path[32];
+  off_t offset;
+  int source;
+  int saved_errno;
+
+  if ((0 == fstat(fd, &info)) && S_ISREG(info.st_mode)) {
+    subprocess_format_int(path, "/proc/self/fd/", fd);
+
+    source = open(path, O_RDONLY | O_CLOEXEC);
+    if (-1 != source) {
+      offset = lseek(fd, 0, SEEK_CUR);
+      if ((-1 == offset) || (-1 == lseek(source, offset, SEEK_SET))) {
+        saved_errno = errno;
+        close(source);
+        errno = saved_errno;
+        return -1;
+      }
+
+      if (source <= STDERR_FILENO) {
+        fd = source;
+        source = fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+      }
+
+      return source;
     }
+
+    /* Without /proc mounted fall back to sharing the description. */
   }
+#endif
 
-  if (!SetHandleInformation(rd, handleFlagInherit, 0)) {
-    result = subprocess_error_pipe;
-    goto cleanup;
+  return fcntl(fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+}
+
+/* Ask for a pipe of the given capacity. This is only a hint: the kernel may
+   refuse sizes above /proc/sys/fs/pipe-max-size, and other platforms have no
+   way to resize a pipe, so failures are ignored. */
+static void subprocess_set_pipe_capacity(int fd, unsigned capacity) {
+#if defined(F_SETPIPE_SZ)
+  if (0 != capacity) {
+    (void)fcntl(fd, F_SETPIPE_SZ, SUBPROCESS_CAST(int, capacity));
   }
+#else
+  (void)fd;
+  (void)capacity;
+#endif
+}
 
-  fd = _open_osfhandle(SUBPROCESS_PTR_CAST(subprocess_intptr_t, rd), 0);
-  if (-1 == fd) {
-    result = subprocess_error_pipe;
-    goto cleanup;
+/* Write all of data into a pipe no child reads from yet, without blocking:
+   if it does not fit now it never will. */
+static int subprocess_prefill_pipe(int fd, const void *const data,
+                                   size_t size) {
+  const char *cursor = SUBPROCESS_CAST(const char *, data);
+  const int fd_flags = fcntl(fd, F_GETFL, 0);
+  ssize_t written;
+  int result = 0;
+
+#if defined(F_GETPIPE_SZ) && defined(F_SETPIPE_SZ)
+  {
+    const int capacity = fcntl(fd, F_GETPIPE_SZ);
+
+    if ((0 <= capacity) && (SUBPROCESS_CAST(size_t, capacity) < size) &&
+        (size <= 0x40000000)) {
+      (void)fcntl(fd, F_SETPIPE_SZ, SUBPROCESS_CAST(int, size));
+    }
   }
-  rd = SUBPROCESS_NULL;
+#endif
 
-  out_process->stdout_file = _fdopen(fd, "rb");
-  if (SUBPROCESS_NULL == out_process->stdout_file) {
-    _close(fd);
-    goto cleanup;
+  if ((-1 == fd_flags) || (-1 == fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK))) {
+    return subprocess_error_pipe;
   }
 
-  startInfo.hStdOutput = wr;
-  wr = SUBPROCESS_NULL;
+  while (0 < size) {
+    written = write(fd, cursor, size);
 
-  if (subprocess_option_combined_stdout_stderr ==
-      (options & subprocess_option_combined_stdout_stderr)) {
-    out_process->stderr_file = out_process->stdout_file;
-    startInfo.hStdError = startInfo.hStdOutput;
-  } else {
-    if (options & subprocess_option_enable_async) {
-      if (subprocess_create_named_pipe_helper(&rd, &wr)) {
-        result = subprocess_error_pipe;
-        goto cleanup;
+    if (-1 == written) {
+      if (EINTR == errno) {
+        continue;
       }
-    } else {
-      if (!CreatePipe(&rd, &wr,
-                      SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr), 0)) {
+
+      if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+        errno = EFBIG;
+        result = subprocess_error_invalid_options;
+      } else {
         result = subprocess_error_pipe;
-        goto cleanup;
       }
+      break;
     }
 
-    if (!SetHandleInformation(rd, handleFlagInherit, 0)) {
-      result = subprocess_error_pipe;
-      goto cleanup;
-    }
+    cursor += written;
+    size -= SUBPROCESS_CAST(size_t, written);
+  }
 
-    fd = _open_osfhandle(SUBPROCESS_PTR_CAST(subprocess_intptr_t, rd), 0);
-    if (-1 == fd) {
-      result = subprocess_error_pipe;
-      goto cleanup;
-    }
-    rd = SUBPROCESS_NULL;
+  /* Later writes through subprocess_stdin block as usual. */
+  if ((-1 == fcntl(fd, F_SETFL, fd_flags)) && (0 == result)) {
+    result = subprocess_error_pipe;
+  }
 
-    out_process->stderr_file = _fdopen(fd, "rb");
-    if (SUBPROCESS_NULL == out_process->stderr_file) {
-      _close(fd);
-      goto cleanup;
-    }
+  return result;
+}
+#endif
 
-    startInfo.hStdError = wr;
-    wr = SUBPROCESS_NULL;
-  }
+int subprocess_create(const char *const commandLine[], int options,
+                      struct subprocess_s *const out_process) {
+  return subprocess_create_ex(commandLine, options, SUBPROCESS_NULL,
+                              SUBPROCESS_NULL, out_process);
+}
 
-  if (options & subprocess_option_enable_async) {
-    out_process->hEventOutput =
-        CreateEventA(SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr), 1, 1,
-                     SUBPROCESS_NULL);
-    out_process->hEventError =
-        CreateEventA(SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr), 1, 1,
-                     SUBPROCESS_NULL);
-    if (!out_process->hEventOutput || !out_process->hEventError) {
-      result = subprocess_error_from_windows_error(GetLastError());
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_no_memory;
-      }
-      goto cleanup;
-    }
-  } else {
-    out_process->hEventOutput = SUBPROCESS_NULL;
-    out_process->hEventError = SUBPROCESS_NULL;
-  }
+int subprocess_create_ex(const char *const commandLine[], int options,
+                         const char *const environment[],
+                         const char *const process_cwd,
+                         struct subprocess_s *const out_process) {
+  return subprocess_create_attr(commandLine, options, environment, process_cwd,
+                                SUBPROCESS_NULL, out_process);
+}
 
-  // Combine commandLine together into a single string
-  len = 0;
-  for (i = 0; commandLine[i]; i++) {
-    // for the trailing \0
-    len++;
+void subprocess_attr_init(struct subprocess_attr_s *const attr) {
+  memset(attr, 0, sizeof(*attr));
+  attr->stdin_fd = -1;
+  attr->stdout_fd = -1;
+}
 
-    // Quote the argument if it has a space in it
-    need_quoting = strpbrk(commandLine[i], "\t\v ") != SUBPROCESS_NULL ||
-                   commandLine[i][0] == SUBPROCESS_NULL;
-    if (need_quoting)
-      len += 2;
+void subprocess_cpu_pool_assign(struct subprocess_cpu_pool_s *const pool,
+                                struct subprocess_attr_s *const attr) {
+#if defined(_WIN32)
+  /* Windows cannot place a child anyway, so there is no need to be atomic. */
+  const unsigned next = pool->next++;
+#else
+  const unsigned next = SUBPROCESS_ATOMIC_ADD(&pool->next, 1u);
+#endif
 
-    bs_run = 0;
-    for (j = 0; '\0' != commandLine[i][j]; j++) {
-      len++;
+  attr->cpus = &pool->cpus[next % pool->count];
+  attr->cpu_count = 1;
+}
 
-      if ('\\' == commandLine[i][j]) {
-        bs_run++;
-      } else {
-        if ('"' == commandLine[i][j]) {
-          // Duplicate the preceding run and escape the quote.
-          len += bs_run + 1;
-        }
-        bs_run = 0;
+int subprocess_create_stdin_memfd(const void *const data, size_t size,
+                                  int *const out_fd) {
+#if SUBPROCESS_HAVE_MEMFD
+  const char *cursor = SUBPROCESS_CAST(const char *, data);
+  ssize_t written;
+  int saved_errno;
+  int fd;
+
+  *out_fd = -1;
+
+  fd = memfd_create("subprocess_stdin", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (-1 == fd) {
+    return subprocess_error_from_errno(errno);
+  }
+
+  while (0 < size) {
+    written = write(fd, cursor, size);
+    if (-1 == written) {
+      if (EINTR == errno) {
+        continue;
       }
+      goto failed;
     }
 
-    if (need_quoting) {
-      // Duplicate trailing slashes before the generated closing quote.
-      len += bs_run;
-    }
+    cursor += written;
+    size -= SUBPROCESS_CAST(size_t, written);
   }
 
-  commandLineCombined = SUBPROCESS_CAST(char *, _alloca(len));
-
-  if (!commandLineCombined) {
-    result = subprocess_error_no_memory;
-    goto cleanup;
+  /* Once sealed neither the parent nor any child can change the contents, so
+     sharing the one copy between every reader is safe. */
+  if ((-1 == fcntl(fd, F_ADD_SEALS,
+                   F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL)) ||
+      (-1 == lseek(fd, 0, SEEK_SET))) {
+    goto failed;
   }
 
-  // Gonna re-use len to store the write index into commandLineCombined
-  len = 0;
+  *out_fd = fd;
+  return 0;
 
-  for (i = 0; commandLine[i]; i++) {
-    if (0 != i) {
-      commandLineCombined[len++] = ' ';
-    }
+failed:
+  saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return subprocess_error_from_errno(saved_errno);
+#else
+  (void)data;
+  (void)size;
+  *out_fd = -1;
+#if !defined(_WIN32)
+  errno = ENOSYS;
+#endif
+  return subprocess_error_not_supported;
+#endif
+}
 
-    need_quoting = strpbrk(commandLine[i], "\t\v ") != SUBPROCESS_NULL ||
-                   commandLine[i][0] == SUBPROCESS_NULL;
-    if (need_quoting) {
-      commandLineCombined[len++] = '"';
+int subprocess_create_pipe(int out_fds[2]) {
+#if defined(_WIN32)
+  out_fds[0] = -1;
+  out_fds[1] = -1;
+  return subprocess_error_not_supported;
+#else
+  if (0 != subprocess_pipe_cloexec(out_fds)) {
+    return subprocess_error_pipe;
+  }
+
+  return 0;
+#endif
+}
+
+int subprocess_create_pipeline(const char *const *const command_lines[],
+                               unsigned count, int options,
+                               const char *const environment[],
+                               const char *const process_cwd,
+                               const struct subprocess_attr_s *const attr,
+                               struct subprocess_s *const out_stages) {
+#if defined(_WIN32)
+  (void)command_lines;
+  (void)count;
+  (void)options;
+  (void)environment;
+  (void)process_cwd;
+  (void)attr;
+  (void)out_stages;
+  return subprocess_error_not_supported;
+#else
+  struct subprocess_attr_s stage_attr;
+  int pipefd[2] = {-1, -1};
+  int previous_read = -1;
+  int result = 0;
+  int saved_errno;
+  unsigned index;
+  unsigned created;
+
+  if (0 == count) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  if (attr) {
+    stage_attr = *attr;
+  } else {
+    subprocess_attr_init(&stage_attr);
+  }
+
+  for (created = 0; created < count; created++) {
+    if (0 != created) {
+      stage_attr.stdin_fd = previous_read;
+      stage_attr.stdin_data = SUBPROCESS_NULL;
+      stage_attr.stdin_size = 0;
+      stage_attr.stdin_close = 0;
+    } else if (attr) {
+      stage_attr.stdin_fd = attr->stdin_fd;
     }
 
-    for (j = 0; '\0' != commandLine[i][j];) {
-      bs_run = 0;
-      while ('\\' == commandLine[i][j]) {
-        bs_run++;
-        j++;
+    if (created + 1 < count) {
+      if (0 != subprocess_pipe_cloexec(pipefd)) {
+        result = subprocess_error_pipe;
+        break;
       }
 
-      if ('"' == commandLine[i][j]) {
-        // 2n + 1 slashes preserve n slashes and escape the quote.
-        bs_run = (bs_run * 2) + 1;
-      } else if ('\0' == commandLine[i][j] && need_quoting) {
-        // 2n slashes preserve n slashes before the closing quote.
-        bs_run *= 2;
-      }
+      subprocess_set_pipe_capacity(pipefd[1], stage_attr.pipe_capacity);
+      stage_attr.stdout_fd = pipefd[1];
+    } else {
+      stage_attr.stdout_fd = attr ? attr->stdout_fd : -1;
+    }
 
-      while (bs_run > 0) {
-        commandLineCombined[len++] = '\\';
-        bs_run--;
-      }
+    result = subprocess_create_attr(command_lines[created], options,
+                                    environment, process_cwd, &stage_attr,
+                                    &out_stages[created]);
 
-      if ('\0' != commandLine[i][j]) {
-        commandLineCombined[len++] = commandLine[i][j++];
-      }
+    /* Each stage holds its own copies of the pipe ends. Dropping ours as we go
+       means the next stage sees EOF as soon as the previous one exits. */
+    saved_errno = errno;
+    if (-1 != previous_read) {
+      close(previous_read);
     }
-    if (need_quoting) {
-      commandLineCombined[len++] = '"';
+    if (-1 != pipefd[1]) {
+      close(pipefd[1]);
+    }
+    previous_read = pipefd[0];
+    pipefd[0] = -1;
+    pipefd[1] = -1;
+    errno = saved_errno;
+
+    if (0 != result) {
+      break;
     }
   }
 
-  commandLineCombined[len] = '\0';
+  if (0 != result) {
+    saved_errno = errno;
 
-  wide_len = MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
-                                 commandLineCombined, -1, SUBPROCESS_NULL, 0);
-  if (0 == wide_len) {
-    result = subprocess_error_from_windows_error(GetLastError());
-    if (subprocess_error_unknown == result) {
-      result = subprocess_error_spawn;
+    if (-1 != previous_read) {
+      close(previous_read);
     }
-    goto cleanup;
+
+    for (index = 0; index < created; index++) {
+      subprocess_terminate(&out_stages[index]);
+      subprocess_join(&out_stages[index], SUBPROCESS_NULL);
+      subprocess_destroy(&out_stages[index]);
+    }
+
+    errno = saved_errno;
   }
 
-  commandLineCombinedWide = SUBPROCESS_CAST(
-      subprocess_wchar_t *,
-      _alloca(SUBPROCESS_CAST(subprocess_size_t, wide_len) *
-              sizeof(subprocess_wchar_t)));
-  if (!commandLineCombinedWide) {
-    result = subprocess_error_no_memory;
-    goto cleanup;
+  return result;
+#endif
+}
+
+int subprocess_join_pipeline(struct subprocess_s *const stages, unsigned count,
+                             int pipefail, int *const out_return_codes,
+                             int *const out_return_code) {
+  int pipeline_return_code = 0;
+  int return_code;
+  int result = 0;
+  unsigned index;
+
+  for (index = 0; index < count; index++) {
+    return_code = -1;
+
+    if (0 != subprocess_join(&stages[index], &return_code)) {
+      result = -1;
+    }
+
+    if (out_return_codes) {
+      out_return_codes[index] = return_code;
+    }
+
+    if (!pipefail || (0 != return_code)) {
+      pipeline_return_code = return_code;
+    }
   }
 
-  if (0 == MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
-                               commandLineCombined, -1,
-                               commandLineCombinedWide, wide_len)) {
-    result = subprocess_error_from_windows_error(GetLastError());
-    if (subprocess_error_unknown == result) {
-      result = subprocess_error_spawn;
+  if (out_return_code) {
+    *out_return_code = pipeline_return_code;
+  }
+
+  return result;
+}
+
+#if SUBPROCESS_SPAWN_VIA_FORK
+/* Not every platform declares execvpe: AIX exports it from libc without ever
+   naming it in a header, and glibc hides it behind _GNU_SOURCE. */
+extern int execvpe(const char *, char *const *, char *const *);
+#endif
+
+#if !defined(_WIN32)
+/* The RLIMIT_ resource behind a subprocess_limit_e, or -1 if the platform
+   has none. */
+static int subprocess_limit_resource(int limit) {
+  switch (limit) {
+  case subprocess_limit_core:
+    return RLIMIT_CORE;
+#if defined(RLIMIT_AS)
+  case subprocess_limit_address_space:
+    return RLIMIT_AS;
+#endif
+  case subprocess_limit_cpu_seconds:
+    return RLIMIT_CPU;
+  case subprocess_limit_open_files:
+    return RLIMIT_NOFILE;
+#if defined(RLIMIT_NPROC)
+  case subprocess_limit_processes:
+    return RLIMIT_NPROC;
+#endif
+  default:
+    return -1;
+  }
+}
+
+/* Check the settings subprocess_fork_exec applies in the child, so that
+   mistakes are reported before anything is launched. */
+static int subprocess_check_attr(const struct subprocess_attr_s *const attr) {
+  unsigned index;
+
+  if (((0 != attr->stdin_size) || attr->stdin_close) &&
+      ((-1 != attr->stdin_fd) ||
+       ((0 != attr->stdin_size) && (SUBPROCESS_NULL == attr->stdin_data)))) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  for (index = 0; index < attr->limit_count; index++) {
+    if ((attr->limits[index].resource < subprocess_limit_core) ||
+        (attr->limits[index].resource > subprocess_limit_processes)) {
+      errno = EINVAL;
+      return subprocess_error_invalid_options;
+    }
+
+    if (-1 == subprocess_limit_resource(attr->limits[index].resource)) {
+      errno = ENOSYS;
+      return subprocess_error_not_supported;
     }
-    goto cleanup;
   }
 
-  if (process_cwd) {
-    wide_len = MultiByteToWideChar(codePageUtf8, mbErrInvalidChars, process_cwd,
-                                   -1, SUBPROCESS_NULL, 0);
-    if (0 == wide_len) {
-      result = subprocess_error_from_windows_error(GetLastError());
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
-      }
-      goto cleanup;
+  if ((attr->scheduling < subprocess_scheduling_inherit) ||
+      (attr->scheduling > subprocess_scheduling_idle) ||
+      (attr->io_class < subprocess_io_inherit) ||
+      (attr->io_class > subprocess_io_idle) || (attr->io_level < 0) ||
+      (attr->io_level > 7)) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+#if SUBPROCESS_HAVE_PLACEMENT
+  for (index = 0; index < attr->cpu_count; index++) {
+    if (attr->cpus[index] >= CPU_SETSIZE) {
+      errno = EINVAL;
+      return subprocess_error_invalid_options;
     }
+  }
+#else
+  if ((0 != attr->cpu_count) || (0 != attr->memory_nodes) ||
+      (0 != attr->scheduling) || (0 != attr->io_class)) {
+    errno = ENOSYS;
+    return subprocess_error_not_supported;
+  }
+#endif
 
-    process_cwd_wide = SUBPROCESS_CAST(
-        subprocess_wchar_t *,
-        _alloca(SUBPROCESS_CAST(subprocess_size_t, wide_len) *
-                sizeof(subprocess_wchar_t)));
-    if (!process_cwd_wide) {
-      result = subprocess_error_no_memory;
-      goto cleanup;
+#if SUBPROCESS_HAVE_CHANNEL
+  /* The child's standard streams are put in place before the channel's
+     descriptor is handed over, and would replace it. */
+  if (attr->channel && (attr->channel->fd <= STDERR_FILENO)) {
+    errno = EBADF;
+    return subprocess_error_invalid_options;
+  }
+#else
+  if (attr->channel) {
+    errno = ENOSYS;
+    return subprocess_error_not_supported;
+  }
+#endif
+
+  /* The child's standard streams are in place before the descriptors are, and
+     two descriptors cannot share a number. */
+  for (index = 0; index < attr->fd_count; index++) {
+    unsigned other;
+
+    if ((attr->fds[index].parent_fd < 0) ||
+        (attr->fds[index].child_fd <= STDERR_FILENO) ||
+        (attr->channel &&
+         (attr->fds[index].child_fd == attr->channel->fd))) {
+      errno = EBADF;
+      return subprocess_error_invalid_options;
     }
 
-    if (0 == MultiByteToWideChar(codePageUtf8, mbErrInvalidChars, process_cwd,
-                                 -1, process_cwd_wide, wide_len)) {
-      result = subprocess_error_from_windows_error(GetLastError());
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
+    for (other = 0; other < index; other++) {
+      if (attr->fds[other].child_fd == attr->fds[index].child_fd) {
+        errno = EINVAL;
+        return subprocess_error_invalid_options;
       }
-      goto cleanup;
     }
   }
 
-  /* Restrict inheritance to this subprocess's standard streams. Without a
-     handle list, concurrent subprocess_create calls can inherit each other's
-     temporarily-inheritable child pipe handles. */
-  inherited_handles[inherited_handle_count++] = startInfo.hStdInput;
-  inherited_handles[inherited_handle_count++] = startInfo.hStdOutput;
-  if (startInfo.hStdError != startInfo.hStdOutput) {
-    inherited_handles[inherited_handle_count++] = startInfo.hStdError;
+  return 0;
+}
+
+/* A copy of environment without any SUBPROCESS_NOTIFY_FD from our own parent,
+   with variable added, or NULL if out of memory. Only the array is allocated;
+   the strings are shared. */
+static char **subprocess_notify_environment(char *const environment[],
+                                            char *const variable) {
+  const char prefix[] = "SUBPROCESS_NOTIFY_FD=";
+  size_t count = 0;
+  size_t used = 0;
+  size_t index;
+  char **result;
+
+  while (environment[count]) {
+    count++;
   }
 
-  InitializeProcThreadAttributeList(SUBPROCESS_NULL, 1, 0,
-                                    &attribute_list_size);
-  if (0 == attribute_list_size) {
-    result = subprocess_error_spawn;
-    goto cleanup;
+  result = SUBPROCESS_PTR_CAST(char **, malloc(sizeof(char *) * (count + 2)));
+  if (SUBPROCESS_NULL == result) {
+    return SUBPROCESS_NULL;
   }
 
-  attribute_list = SUBPROCESS_PTR_CAST(LPPROC_THREAD_ATTRIBUTE_LIST,
-                                       _alloca(attribute_list_size));
-  if (!attribute_list || !InitializeProcThreadAttributeList(
-                             attribute_list, 1, 0, &attribute_list_size)) {
-    result = subprocess_error_spawn;
-    goto cleanup;
+  for (index = 0; index < count; index++) {
+    if (0 != strncmp(environment[index], prefix, sizeof(prefix) - 1)) {
+      result[used++] = environment[index];
+    }
   }
-  attribute_list_initialized = 1;
 
-  if (!UpdateProcThreadAttribute(
-          attribute_list, 0, procThreadAttributeHandleList, inherited_handles,
-          inherited_handle_count * sizeof(inherited_handles[0]),
-          SUBPROCESS_NULL, SUBPROCESS_NULL)) {
-    result = subprocess_error_spawn;
-    goto cleanup;
+  result[used++] = variable;
+  result[used] = SUBPROCESS_NULL;
+  return result;
+}
+
+/* The lowest descriptor above fd and base. */
+static int subprocess_fd_above(int base, int fd) {
+  return (fd >= base) ? fd + 1 : base;
+}
+
+/* The lowest descriptor above every one a child is set up from or ends up
+   with, from which the attribute's descriptors are staged in the child. Going
+   through fresh numbers lets one entry's child number be another's parent
+   descriptor, and the dup2 onto a differing number clears close-on-exec. */
+static int subprocess_fds_base(const struct subprocess_attr_s *const attr,
+                               const int stdinfd[2], const int stdoutfd[2],
+                               const int stderrfd[2]) {
+  int base = STDERR_FILENO + 1;
+  unsigned index;
+
+  for (index = 0; index < 2; index++) {
+    base = subprocess_fd_above(base, stdinfd[index]);
+    base = subprocess_fd_above(base, stdoutfd[index]);
+    base = subprocess_fd_above(base, stderrfd[index]);
   }
 
-  startInfoEx.startupInfo = startInfo;
-  startInfoEx.startupInfo.cb = sizeof(startInfoEx);
-  startInfoEx.attributeList = attribute_list;
-  flags |= extendedStartupInfoPresent;
+  for (index = 0; index < attr->fd_count; index++) {
+    base = subprocess_fd_above(base, attr->fds[index].parent_fd);
+    base = subprocess_fd_above(base, attr->fds[index].child_fd);
+  }
 
-  if (!CreateProcessW(
-          SUBPROCESS_NULL,
-          commandLineCombinedWide, // command line
-          SUBPROCESS_NULL,         // process security attributes
-          SUBPROCESS_NULL,         // primary thread security attributes
-          1,                       // handles are inherited
-          flags,                   // creation flags
-          used_environment,        // used environment
-          process_cwd_wide,        // use specified current directory
-          SUBPROCESS_PTR_CAST(LPSTARTUPINFOW,
-                              &startInfoEx), // STARTUPINFOEX pointer
-          SUBPROCESS_PTR_CAST(LPPROCESS_INFORMATION, &processInfo))) {
-    result = subprocess_error_from_windows_error(GetLastError());
-    if (subprocess_error_unknown == result) {
-      result = subprocess_error_spawn;
+  if (attr->channel) {
+    base = subprocess_fd_above(base, attr->channel->fd);
+  }
+
+  return base;
+}
+
+#if !SUBPROCESS_SPAWN_VIA_FORK
+/* Whether a child has to be set up between fork and exec, which posix_spawn
+   offers no way to do. */
+static int
+subprocess_needs_fork(int options, const struct subprocess_attr_s *const attr) {
+  if ((subprocess_option_new_session | subprocess_option_die_with_parent |
+       subprocess_option_notify_ready) &
+      options) {
+    return 1;
+  }
+
+  return attr &&
+         ((0 != attr->limit_count) || (0 != attr->cpu_count) ||
+          (0 != attr->memory_nodes) || (0 != attr->nice) ||
+          (0 != attr->scheduling) || (0 != attr->io_class) || attr->channel);
+}
+#endif
+
+/* execvpe for a forked child: search path, the parent's PATH, for file when
+   it has no slash. Only async-signal-safe calls are made. */
+static void subprocess_execvpe(const char *const file, char *const argv[],
+                               char *const envp[], const char *path) {
+#if SUBPROCESS_SPAWN_VIA_FORK
+  (void)path;
+  execvpe(file, argv, envp);
+#else
+  char candidate[4096];
+  const size_t file_length = strlen(file);
+  const char *end;
+  size_t length;
+  int denied = 0;
+
+  if (strchr(file, '/') || !path) {
+    execve(file, argv, envp);
+    return;
+  }
+
+  for (;; path = end + 1) {
+    end = strchr(path, ':');
+    if (!end) {
+      end = path + strlen(path);
+    }
+
+    /* An empty entry means the current directory. */
+    length = SUBPROCESS_CAST(size_t, end - path);
+    if (0 == length) {
+      candidate[length++] = '.';
+    } else if (length < sizeof(candidate)) {
+      memcpy(candidate, path, length);
+    }
+
+    if (length + file_length + 2 <= sizeof(candidate)) {
+      candidate[length++] = '/';
+      memcpy(candidate + length, file, file_length + 1);
+      execve(candidate, argv, envp);
+
+      if (EACCES == errno) {
+        denied = 1;
+      } else if ((ENOENT != errno) && (ENOTDIR != errno)) {
+        return;
+      }
+    }
+
+    if ('\0' == *end) {
+      break;
     }
-    goto cleanup;
   }
 
-  DeleteProcThreadAttributeList(attribute_list);
-  attribute_list_initialized = 0;
+  errno = denied ? EACCES : ENOENT;
+#endif
+}
 
-  out_process->hProcess = processInfo.hProcess;
-  processInfo.hProcess = SUBPROCESS_NULL;
+#if SUBPROCESS_HAVE_EXEC_FD
+/* execveat for a forked child. A script's interpreter is given the script as
+   /proc/self/fd/N, which a close-on-exec descriptor is gone from by then, so
+   the kernel refuses with ENOENT; the descriptor is then left open for it.
+   AT_EMPTY_PATH (0x1000) is only declared with _GNU_SOURCE. */
+static void subprocess_execveat(int fd, char *const argv[],
+                                char *const envp[]) {
+  const int at_empty_path = 0x1000;
+  const char *const empty = "";
 
-  out_process->hStdInput = startInfo.hStdInput;
-  startInfo.hStdInput = SUBPROCESS_NULL;
+  syscall(SYS_execveat, fd, empty, argv, envp, at_empty_path);
 
-  // We don't need the handle of the primary thread in the called process.
-  CloseHandle(processInfo.hThread);
-  processInfo.hThread = SUBPROCESS_NULL;
+  if ((ENOENT == errno) && (-1 != fcntl(fd, F_SETFD, 0))) {
+    syscall(SYS_execveat, fd, empty, argv, envp, at_empty_path);
+  }
+}
+#endif
+
+/* Launch a process with fork()+exec(), so the child can set itself up before
+   exec in ways posix_spawn cannot. exec_errfd[1] is close-on-exec: a
+   successful exec closes it and the parent reads EOF; a failed exec or setup
+   step writes errno through it before _exit. The child execs exec_fd instead
+   of commandLine[0] unless it is -1, and keeps notify_fd unless it is -1. */
+static int subprocess_fork_exec(int exec_fd, const char *const commandLine[],
+                                int options, char *const environment[],
+                                const char *const process_cwd,
+                                const struct subprocess_attr_s *const attr,
+                                const int stdinfd[2], const int stdoutfd[2],
+                                const int stderrfd[2], int notify_fd,
+                                pid_t *const out_child) {
+  /* Pipe used to relay the child's exec() errno back to the parent. */
+  int exec_errfd[2] = {-1, -1};
+  const char *path = SUBPROCESS_NULL;
+#if defined(__linux__)
+  const pid_t parent = getpid();
+#endif
+  int fds_base = STDERR_FILENO + 1;
+  int child_errno = 0;
+  ssize_t bytes_read;
+  pid_t child;
+  int result;
+
+  if (subprocess_option_search_user_path ==
+      (options & subprocess_option_search_user_path)) {
+    path = getenv("PATH");
+  }
+
+  if (0 != pipe(exec_errfd)) {
+    return subprocess_error_pipe;
+  }
+
+  if (-1 == fcntl(exec_errfd[1], F_SETFD, FD_CLOEXEC)) {
+    result = subprocess_error_spawn;
+    goto failed;
+  }
+
+  /* The error pipe has to survive the attribute's descriptors being put in
+     place, so it is moved above every number they use. */
+  if (attr && (0 != attr->fd_count)) {
+    const int moved = fcntl(
+        exec_errfd[1], F_DUPFD_CLOEXEC,
+        subprocess_fd_above(
+            subprocess_fds_base(attr, stdinfd, stdoutfd, stderrfd), notify_fd));
+
+    if (-1 == moved) {
+      result = subprocess_error_spawn;
+      goto failed;
+    }
+
+    close(exec_errfd[1]);
+    exec_errfd[1] = moved;
+    fds_base = moved + 1;
+  }
+
+  /* The child execs a close-on-exec copy of the caller's descriptor, which no
+     dup2 onto a standard stream or one of the attribute's numbers can land
+     on. */
+  if (-1 != exec_fd) {
+    exec_fd = fcntl(exec_fd, F_DUPFD_CLOEXEC, fds_base);
+    if (-1 == exec_fd) {
+      result = subprocess_error_spawn;
+      goto failed;
+    }
+
+    fds_base = exec_fd + 1;
+  }
+
+  child = fork();
+
+  if (child < 0) {
+    result = subprocess_error_spawn;
+    goto failed;
+  }
+
+  if (0 == child) {
+    /* Child. Everything below must stay async-signal-safe: after fork() in a
+       threaded process only such functions may be called before exec. */
+    struct rlimit limit;
+    unsigned index;
+
+    close(exec_errfd[0]);
+
+#if defined(__linux__)
+    /* If the parent died before the signal was armed it will never come. */
+    if (subprocess_option_die_with_parent ==
+        (options & subprocess_option_die_with_parent)) {
+      if (0 != prctl(PR_SET_PDEATHSIG, SIGKILL)) {
+        goto child_failed;
+      }
+
+      if (parent != getppid()) {
+        raise(SIGKILL);
+      }
+    }
+#endif
+
+    if (subprocess_option_new_session ==
+        (options & subprocess_option_new_session)) {
+      if (-1 == setsid()) {
+        goto child_failed;
+      }
+    } else if (subprocess_option_new_process_group ==
+               (options & subprocess_option_new_process_group)) {
+      if (0 != setpgid(0, 0)) {
+        goto child_failed;
+      }
+    }
+
+    /* The attribute's descriptors are copied to numbers of their own before
+       the standard streams are replaced, as one of them may be a standard
+       stream of the parent. */
+    for (index = 0; attr && (index < attr->fd_count); index++) {
+      if (-1 == dup2(attr->fds[index].parent_fd,
+                     fds_base + SUBPROCESS_CAST(int, index))) {
+        goto child_failed;
+      }
+    }
+
+    if ((-1 == dup2(stdinfd[0], STDIN_FILENO)) ||
+        (-1 == dup2(stdoutfd[1], STDOUT_FILENO))) {
+      goto child_failed;
+    }
+
+    if (subprocess_option_combined_stdout_stderr ==
+        (options & subprocess_option_combined_stdout_stderr)) {
+      if (-1 == dup2(STDOUT_FILENO, STDERR_FILENO)) {
+        goto child_failed;
+      }
+    } else {
+      if (-1 == dup2(stderrfd[1], STDERR_FILENO)) {
+        goto child_failed;
+      }
+    }
+
+    /* The originals are only closed once they have been duplicated, so that a
+       pipe end that already sits on 0, 1 or 2 is not closed out from under us. */
+    if (stdinfd[0] > STDERR_FILENO) {
+      close(stdinfd[0]);
+    }
+    if (stdinfd[1] > STDERR_FILENO) {
+      close(stdinfd[1]);
+    }
+    if (stdoutfd[0] > STDERR_FILENO) {
+      close(stdoutfd[0]);
+    }
+    if (stdoutfd[1] > STDERR_FILENO) {
+      close(stdoutfd[1]);
+    }
+    if (stderrfd[0] > STDERR_FILENO) {
+      close(stderrfd[0]);
+    }
+    if (stderrfd[1] > STDERR_FILENO) {
+      close(stderrfd[1]);
+    }
+
+    for (index = 0; attr && (index < attr->fd_count); index++) {
+      if (-1 == dup2(fds_base + SUBPROCESS_CAST(int, index),
+                     attr->fds[index].child_fd)) {
+        goto child_failed;
+      }
+
+      close(fds_base + SUBPROCESS_CAST(int, index));
+    }
+
+    if (process_cwd && (0 != chdir(process_cwd))) {
+      goto child_failed;
+    }
+
+    /* The channel's descriptor is close-on-exec in the parent, so that other
+       children do not get it, but not in this one. */
+    if (attr && attr->channel && (-1 == fcntl(attr->channel->fd, F_SETFD, 0))) {
+      goto child_failed;
+    }
+
+    if ((-1 != notify_fd) && (-1 == fcntl(notify_fd, F_SETFD, 0))) {
+      goto child_failed;
+    }
+
+#if SUBPROCESS_HAVE_PLACEMENT
+    if (attr && (0 != attr->cpu_count)) {
+      cpu_set_t cpus;
+
+      CPU_ZERO(&cpus);
+      for (index = 0; index < attr->cpu_count; index++) {
+        CPU_SET(attr->cpus[index], &cpus);
+      }
+
+      if (0 != sched_setaffinity(0, sizeof(cpus), &cpus)) {
+        goto child_failed;
+      }
+    }
+
+    /* MPOL_BIND from <linux/mempolicy.h>, which is not always installed. */
+    if (attr && (0 != attr->memory_nodes) &&
+        (0 != syscall(SYS_set_mempolicy, 2, &attr->memory_nodes,
+                      sizeof(attr->memory_nodes) * 8 + 1))) {
+      goto child_failed;
+    }
+
+    if (attr && (subprocess_scheduling_inherit != attr->scheduling)) {
+      struct sched_param param;
+
+      param.sched_priority = 0;
+      if (0 != sched_setscheduler(0,
+                                  (subprocess_scheduling_batch ==
+                                   attr->scheduling)
+                                      ? SCHED_BATCH
+                                      : SCHED_IDLE,
+                                  &param)) {
+        goto child_failed;
+      }
+    }
+
+    /* IOPRIO_WHO_PROCESS, and the priority is the class (2 for best effort,
+       3 for idle) shifted past a 13 bit level, as in <linux/ioprio.h>. */
+    if (attr && (subprocess_io_inherit != attr->io_class) &&
+        (0 != syscall(SYS_ioprio_set, 1, 0,
+                      ((attr->io_class + 1) << 13) |
+                          ((subprocess_io_best_effort == attr->io_class)
+                               ? attr->io_level
+                               : 0)))) {
+      goto child_failed;
+    }
+#endif
+
+    if (attr && (0 != attr->nice)) {
+      errno = 0;
+      if ((-1 == nice(attr->nice)) && (0 != errno)) {
+        goto child_failed;
+      }
+    }
+
+    /* Limits go on last, so that a low open file limit cannot stop the setup
+       above, and both the soft and hard limit are set so the child cannot
+       raise them again. */
+    for (index = 0; attr && (index < attr->limit_count); index++) {
+      limit.rlim_cur = SUBPROCESS_CAST(rlim_t, attr->limits[index].value);
+      limit.rlim_max = limit.rlim_cur;
+
+      if (0 != setrlimit(subprocess_limit_resource(attr->limits[index].resource),
+                         &limit)) {
+        goto child_failed;
+      }
+    }
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcast-qual"
+#pragma clang diagnostic ignored "-Wold-style-cast"
+#endif
+#if SUBPROCESS_HAVE_EXEC_FD
+    if (-1 != exec_fd) {
+      subprocess_execveat(exec_fd,
+                          SUBPROCESS_CONST_CAST(char *const *, commandLine),
+                          environment);
+      goto child_failed;
+    }
+#endif
+
+    if (subprocess_option_search_user_path ==
+        (options & subprocess_option_search_user_path)) {
+      subprocess_execvpe(commandLine[0],
+                         SUBPROCESS_CONST_CAST(char *const *, commandLine),
+                         environment, path);
+    } else {
+      execve(commandLine[0], SUBPROCESS_CONST_CAST(char *const *, commandLine),
+             environment);
+    }
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
+  child_failed:
+    child_errno = errno;
+    /* Nothing useful can be done if this write fails; the parent then sees EOF
+       and reports success, exactly as posix_spawn would without exec reporting. */
+    (void)!write(exec_errfd[1], &child_errno, sizeof(child_errno));
+    /* 127 is what POSIX requires posix_spawn's child to exit with when exec
+       fails, so both implementations look the same to a caller. */
+    _exit(127);
+  }
+
+  /* Parent. */
+  close(exec_errfd[1]);
+
+  if (-1 != exec_fd) {
+    close(exec_fd);
+  }
+
+  do {
+    bytes_read = read(exec_errfd[0], &child_errno, sizeof(child_errno));
+  } while ((-1 == bytes_read) && (EINTR == errno));
+
+  close(exec_errfd[0]);
+
+  if (bytes_read == (ssize_t)sizeof(child_errno)) {
+    /* exec failed in the child. Reap it and surface the reason. */
+    while ((-1 == waitpid(child, SUBPROCESS_NULL, 0)) && (EINTR == errno)) {
+    }
+    result = subprocess_error_from_errno(child_errno);
+    if (subprocess_error_unknown == result) {
+      result = subprocess_error_spawn;
+    }
+    errno = child_errno;
+    return result;
+  }
+
+  *out_child = child;
+  return 0;
+
+failed:
+  child_errno = errno;
+  close(exec_errfd[0]);
+  close(exec_errfd[1]);
+  if (-1 != exec_fd) {
+    close(exec_fd);
+  }
+  errno = child_errno;
+  return result;
+}
+
+#if !SUBPROCESS_SPAWN_VIA_FORK
+/* Launch a process with posix_spawn, mapping the pipe ends onto the child's
+   standard streams with file actions. */
+static int subprocess_posix_spawn(const char *const commandLine[], int options,
+                                  char *const environment[],
+                                  const char *const process_cwd,
+                                  const struct subprocess_attr_s *const attr,
+                                  const int stdinfd[2], const int stdoutfd[2],
+                                  const int stderrfd[2],
+                                  pid_t *const out_child) {
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t spawn_attr;
+  posix_spawnattr_t *used_spawn_attr = SUBPROCESS_NULL;
+  const unsigned fd_count = attr ? attr->fd_count : 0;
+  int fds_base = STDERR_FILENO + 1;
+  unsigned index;
+  int posix_error;
+  int result;
+
+  posix_error = posix_spawn_file_actions_init(&actions);
+  if (0 != posix_error) {
+    goto failed;
+  }
+
+  if (subprocess_option_new_process_group ==
+      (options & subprocess_option_new_process_group)) {
+    posix_error = posix_spawnattr_init(&spawn_attr);
+    if (0 != posix_error) {
+      goto destroy;
+    }
+    used_spawn_attr = &spawn_attr;
+
+    posix_error = posix_spawnattr_setflags(
+        &spawn_attr, SUBPROCESS_CAST(short, POSIX_SPAWN_SETPGROUP));
+    if (0 != posix_error) {
+      goto destroy;
+    }
+
+    posix_error = posix_spawnattr_setpgroup(&spawn_attr, 0);
+    if (0 != posix_error) {
+      goto destroy;
+    }
+  }
+
+  // Set working directory
+  if (process_cwd) {
+#if SUBPROCESS_ADDCHDIR_IS_POSIX
+    posix_error = posix_spawn_file_actions_addchdir(&actions, process_cwd);
+#elif !SUBPROCESS_HAVE_CWD
+    posix_error = ENOSYS;
+#else
+#if defined(__APPLE__) && defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#endif
+    posix_error = posix_spawn_file_actions_addchdir_np(&actions, process_cwd);
+#if defined(__APPLE__) && defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+#endif
+    if (0 != posix_error) {
+      goto destroy;
+    }
+  }
+
+  // Copy the extra descriptors out of the way of the standard streams
+  if (0 != fd_count) {
+    fds_base = subprocess_fds_base(attr, stdinfd, stdoutfd, stderrfd);
+  }
+
+  for (index = 0; index < fd_count; index++) {
+    posix_error = posix_spawn_file_actions_adddup2(
+        &actions, attr->fds[index].parent_fd,
+        fds_base + SUBPROCESS_CAST(int, index));
+    if (0 != posix_error) {
+      goto destroy;
+    }
+  }
+
+  // Close the stdin write end
+  if (-1 != stdinfd[1]) {
+    posix_error = posix_spawn_file_actions_addclose(&actions, stdinfd[1]);
+    if (0 != posix_error) {
+      goto destroy;
+    }
+  }
+
+  // Map the read end to stdin
+  posix_error =
+      posix_spawn_file_actions_adddup2(&actions, stdinfd[0], STDIN_FILENO);
+  if (0 != posix_error) {
+    goto destroy;
+  }
+
+  // Close the stdout read end
+  if (-1 != stdoutfd[0]) {
+    posix_error = posix_spawn_file_actions_addclose(&actions, stdoutfd[0]);
+    if (0 != posix_error) {
+      goto destroy;
+    }
+  }
+
+  // Map the write end to stdout
+  posix_error =
+      posix_spawn_file_actions_adddup2(&actions, stdoutfd[1], STDOUT_FILENO);
+  if (0 != posix_error) {
+    goto destroy;
+  }
+
+  if (subprocess_option_combined_stdout_stderr ==
+      (options & subprocess_option_combined_stdout_stderr)) {
+    posix_error = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+                                                   STDERR_FILENO);
+    if (0 != posix_error) {
+      goto destroy;
+    }
+  } else {
+    // Close the stderr read end
+    posix_error = posix_spawn_file_actions_addclose(&actions, stderrfd[0]);
+    if (0 != posix_error) {
+      goto destroy;
+    }
+    // Map the write end to stdout
+    posix_error = posix_spawn_file_actions_adddup2(&actions, stderrfd[1],
+                                                   STDERR_FILENO);
+    if (0 != posix_error) {
+      goto destroy;
+    }
+  }
+
+  // Move the extra descriptors to the numbers the child expects
+  for (index = 0; index < fd_count; index++) {
+    posix_error = posix_spawn_file_actions_adddup2(
+        &actions, fds_base + SUBPROCESS_CAST(int, index),
+        attr->fds[index].child_fd);
+    if (0 != posix_error) {
+      goto destroy;
+    }
+
+    posix_error = posix_spawn_file_actions_addclose(
+        &actions, fds_base + SUBPROCESS_CAST(int, index));
+    if (0 != posix_error) {
+      goto destroy;
+    }
+  }
+
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcast-qual"
+#pragma clang diagnostic ignored "-Wold-style-cast"
+#endif
+  if (subprocess_option_search_user_path ==
+      (options & subprocess_option_search_user_path)) {
+    posix_error = posix_spawnp(out_child, commandLine[0], &actions,
+                               used_spawn_attr,
+                               SUBPROCESS_CONST_CAST(char *const *, commandLine),
+                               environment);
+  } else {
+#if !SUBPROCESS_SPAWN_REPORTS_EXEC_ERRORS
+    /* posix_spawn cannot tell us the exec failed, so check up front */
+    if (0 != access(commandLine[0], X_OK)) {
+      posix_error = errno;
+      goto destroy;
+    }
+#endif
+    posix_error = posix_spawn(out_child, commandLine[0], &actions,
+                              used_spawn_attr,
+                              SUBPROCESS_CONST_CAST(char *const *, commandLine),
+                              environment);
+  }
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+
+destroy:
+  if (used_spawn_attr) {
+    posix_spawnattr_destroy(used_spawn_attr);
+  }
+
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (0 == posix_error) {
+    return 0;
+  }
+
+failed:
+  result = subprocess_error_from_errno(posix_error);
+  if (subprocess_error_unknown == result) {
+    result = subprocess_error_spawn;
+  }
+  errno = posix_error;
+  return result;
+}
+#endif
+#endif
+
+#if !defined(_WIN32)
+/* subprocess_create_attr's POSIX implementation, which execs exec_fd rather
+   than looking up commandLine[0] unless it is -1. */
+static int subprocess_create_posix(int exec_fd,
+                                   const char *const commandLine[],
+                                   int options,
+                                   const char *const environment[],
+                                   const char *const process_cwd,
+                                   const struct subprocess_attr_s *const attr,
+                                   struct subprocess_s *const out_process);
+#endif
+
+int subprocess_create_attr(const char *const commandLine[], int options,
+                           const char *const environment[],
+                           const char *const process_cwd,
+                           const struct subprocess_attr_s *const attr,
+                           struct subprocess_s *const out_process) {
+#if defined(_WIN32)
+  int fd;
+  int async_no_wait;
+  void *rd = SUBPROCESS_NULL;
+  void *wr = SUBPROCESS_NULL;
+  char *commandLineCombined;
+  subprocess_wchar_t *commandLineCombinedWide = SUBPROCESS_NULL;
+  subprocess_wchar_t *process_cwd_wide = SUBPROCESS_NULL;
+  subprocess_size_t len;
+  int wide_len;
+  int i, j;
+  int need_quoting;
+  subprocess_size_t bs_run;
+  unsigned long flags = 0;
+  unsigned long last_error = 0;
+  int attribute_list_initialized = 0;
+  int result = subprocess_error_unknown;
+  const unsigned int codePageUtf8 = 65001;
+  const unsigned long mbErrInvalidChars = 0x00000008;
+  const unsigned long startFUseStdHandles = 0x00000100;
+  const unsigned long handleFlagInherit = 0x00000001;
+  const unsigned long createNoWindow = 0x08000000;
+  const unsigned long createNewProcessGroup = 0x00000200;
+  const unsigned long createUnicodeEnvironment = 0x00000400;
+  const unsigned long extendedStartupInfoPresent = 0x00080000;
+  const subprocess_size_t procThreadAttributeHandleList = 0x00020002;
+  struct subprocess_subprocess_information_s processInfo = {SUBPROCESS_NULL,
+                                                            SUBPROCESS_NULL, 0,
+                                                            0};
+  struct subprocess_security_attributes_s saAttr = {sizeof(saAttr),
+                                                    SUBPROCESS_NULL, 1};
+  subprocess_wchar_t empty_environment[2] = {0, 0};
+  subprocess_wchar_t *used_environment = SUBPROCESS_NULL;
+  subprocess_ulongptr_t attribute_list_size = 0;
+  subprocess_size_t inherited_handle_count = 0;
+  LPPROC_THREAD_ATTRIBUTE_LIST attribute_list = SUBPROCESS_NULL;
+  void *inherited_handles[3];
+  struct subprocess_startup_info_ex_s startInfoEx;
+  struct subprocess_startup_info_s startInfo = {0,
+                                                SUBPROCESS_NULL,
+                                                SUBPROCESS_NULL,
+                                                SUBPROCESS_NULL,
+                                                0,
+                                                0,
+                                                0,
+                                                0,
+                                                0,
+                                                0,
+                                                0,
+                                                0,
+                                                0,
+                                                0,
+                                                SUBPROCESS_NULL,
+                                                SUBPROCESS_NULL,
+                                                SUBPROCESS_NULL,
+                                                SUBPROCESS_NULL};
+
+  async_no_wait = subprocess_option_enable_async_no_wait ==
+                  (options & subprocess_option_enable_async_no_wait);
+
+  if (async_no_wait && (subprocess_option_enable_async !=
+                        (options & subprocess_option_enable_async))) {
+    return subprocess_error_invalid_options;
+  }
+
+  if (attr && ((-1 != attr->stdin_fd) || (-1 != attr->stdout_fd) ||
+               (0 != attr->limit_count) || (0 != attr->cpu_count) ||
+               (0 != attr->memory_nodes) || (0 != attr->nice) ||
+               (0 != attr->scheduling) || (0 != attr->io_class) ||
+               attr->channel || (0 != attr->fd_count) ||
+               (0 != attr->stdin_size) || attr->stdin_close)) {
+    return subprocess_error_not_supported;
+  }
+
+  startInfo.cb = sizeof(startInfo);
+  startInfo.dwFlags = startFUseStdHandles;
+
+  if ((subprocess_option_new_session | subprocess_option_die_with_parent |
+       subprocess_option_notify_ready) &
+      options) {
+    return subprocess_error_not_supported;
+  }
+
+  if (subprocess_option_no_window == (options & subprocess_option_no_window)) {
+    flags |= createNoWindow;
+  }
+
+  if (subprocess_option_new_process_group ==
+      (options & subprocess_option_new_process_group)) {
+    flags |= createNewProcessGroup;
+  }
+
+  memset(out_process, 0, sizeof(*out_process));
+  out_process->stdin_fd = -1;
+  out_process->stdout_fd = -1;
+  out_process->stderr_fd = -1;
+
+  if (subprocess_option_inherit_environment !=
+      (options & subprocess_option_inherit_environment)) {
+    flags |= createUnicodeEnvironment;
+
+    if (SUBPROCESS_NULL == environment) {
+      used_environment = empty_environment;
+    } else {
+      // We always end with two null terminators. MultiByteToWideChar includes
+      // each environment string's null terminator, so start with one extra.
+      len = 1;
+
+      for (i = 0; environment[i]; i++) {
+        wide_len = MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
+                                       environment[i], -1, SUBPROCESS_NULL, 0);
+        if (0 == wide_len) {
+          result = subprocess_error_from_windows_error(GetLastError());
+          if (subprocess_error_unknown == result) {
+            result = subprocess_error_spawn;
+          }
+          goto cleanup;
+        }
+
+        len += SUBPROCESS_CAST(subprocess_size_t, wide_len);
+      }
+
+      if (((SUBPROCESS_CAST(subprocess_size_t, -1)) /
+           sizeof(subprocess_wchar_t)) < len) {
+        result = subprocess_error_no_memory;
+        goto cleanup;
+      }
+
+      used_environment = SUBPROCESS_CAST(
+          subprocess_wchar_t *, _alloca(len * sizeof(subprocess_wchar_t)));
+      if (!used_environment) {
+        result = subprocess_error_no_memory;
+        goto cleanup;
+      }
+
+      // Re-use len for the insertion position.
+      len = 0;
+
+      for (i = 0; environment[i]; i++) {
+        wide_len = MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
+                                       environment[i], -1, SUBPROCESS_NULL, 0);
+        if (0 == wide_len) {
+          result = subprocess_error_from_windows_error(GetLastError());
+          if (subprocess_error_unknown == result) {
+            result = subprocess_error_spawn;
+          }
+          goto cleanup;
+        }
+
+        if (0 == MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
+                                     environment[i], -1,
+                                     &used_environment[len], wide_len)) {
+          result = subprocess_error_from_windows_error(GetLastError());
+          if (subprocess_error_unknown == result) {
+            result = subprocess_error_spawn;
+          }
+          goto cleanup;
+        }
+
+        len += SUBPROCESS_CAST(subprocess_size_t, wide_len);
+      }
+
+      // End with the second null terminator.
+      used_environment[len++] = 0;
+    }
+  } else {
+    if (SUBPROCESS_NULL != environment) {
+      return subprocess_error_invalid_environment;
+    }
+  }
+
+  if (!CreatePipe(&rd, &wr, SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr),
+                  0)) {
+    result = subprocess_error_pipe;
+    goto cleanup;
+  }
+
+  if (!SetHandleInformation(wr, handleFlagInherit, 0)) {
+    result = subprocess_error_pipe;
+    goto cleanup;
+  }
+
+  fd = _open_osfhandle(SUBPROCESS_PTR_CAST(subprocess_intptr_t, wr), 0);
+  if (-1 == fd) {
+    result = subprocess_error_pipe;
+    goto cleanup;
+  }
+  wr = SUBPROCESS_NULL;
+
+  out_process->stdin_fd = fd;
+
+  startInfo.hStdInput = rd;
+  rd = SUBPROCESS_NULL;
+
+  if (options & subprocess_option_enable_async) {
+    if (subprocess_create_named_pipe_helper(&rd, &wr)) {
+      result = subprocess_error_pipe;
+      goto cleanup;
+    }
+  } else {
+    if (!CreatePipe(&rd, &wr,
+                    SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr), 0)) {
+      result = subprocess_error_pipe;
+      goto cleanup;
+    }
+  }
+
+  if (!SetHandleInformation(rd, handleFlagInherit, 0)) {
+    result = subprocess_error_pipe;
+    goto cleanup;
+  }
+
+  fd = _open_osfhandle(SUBPROCESS_PTR_CAST(subprocess_intptr_t, rd), 0);
+  if (-1 == fd) {
+    result = subprocess_error_pipe;
+    goto cleanup;
+  }
+  rd = SUBPROCESS_NULL;
+
+  out_process->stdout_fd = fd;
+
+  startInfo.hStdOutput = wr;
+  wr = SUBPROCESS_NULL;
+
+  if (subprocess_option_combined_stdout_stderr ==
+      (options & subprocess_option_combined_stdout_stderr)) {
+    out_process->stderr_fd = out_process->stdout_fd;
+    startInfo.hStdError = startInfo.hStdOutput;
+  } else {
+    if (options & subprocess_option_enable_async) {
+      if (subprocess_create_named_pipe_helper(&rd, &wr)) {
+        result = subprocess_error_pipe;
+        goto cleanup;
+      }
+    } else {
+      if (!CreatePipe(&rd, &wr,
+                      SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr), 0)) {
+        result = subprocess_error_pipe;
+        goto cleanup;
+      }
+    }
+
+    if (!SetHandleInformation(rd, handleFlagInherit, 0)) {
+      result = subprocess_error_pipe;
+      goto cleanup;
+    }
+
+    fd = _open_osfhandle(SUBPROCESS_PTR_CAST(subprocess_intptr_t, rd), 0);
+    if (-1 == fd) {
+      result = subprocess_error_pipe;
+      goto cleanup;
+    }
+    rd = SUBPROCESS_NULL;
+
+    out_process->stderr_fd = fd;
+
+    startInfo.hStdError = wr;
+    wr = SUBPROCESS_NULL;
+  }
+
+  if (options & subprocess_option_enable_async) {
+    out_process->hEventOutput =
+        CreateEventA(SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr), 1, 1,
+                     SUBPROCESS_NULL);
+    out_process->hEventError =
+        CreateEventA(SUBPROCESS_PTR_CAST(LPSECURITY_ATTRIBUTES, &saAttr), 1, 1,
+                     SUBPROCESS_NULL);
+    if (!out_process->hEventOutput || !out_process->hEventError) {
+      result = subprocess_error_from_windows_error(GetLastError());
+      if (subprocess_error_unknown == result) {
+        result = subprocess_error_no_memory;
+      }
+      goto cleanup;
+    }
+  } else {
+    out_process->hEventOutput = SUBPROCESS_NULL;
+    out_process->hEventError = SUBPROCESS_NULL;
+  }
+
+  // Combine commandLine together into a single string
+  len = 0;
+  for (i = 0; commandLine[i]; i++) {
+    // for the trailing \0
+    len++;
+
+    // Quote the argument if it has a space in it
+    need_quoting = strpbrk(commandLine[i], "\t\v ") != SUBPROCESS_NULL ||
+                   commandLine[i][0] == SUBPROCESS_NULL;
+    if (need_quoting)
+      len += 2;
+
+    bs_run = 0;
+    for (j = 0; '\0' != commandLine[i][j]; j++) {
+      len++;
+
+      if ('\\' == commandLine[i][j]) {
+        bs_run++;
+      } else {
+        if ('"' == commandLine[i][j]) {
+          // Duplicate the preceding run and escape the quote.
+          len += bs_run + 1;
+        }
+        bs_run = 0;
+      }
+    }
+
+    if (need_quoting) {
+      // Duplicate trailing slashes before the generated closing quote.
+      len += bs_run;
+    }
+  }
+
+  commandLineCombined = SUBPROCESS_CAST(char *, _alloca(len));
+
+  if (!commandLineCombined) {
+    result = subprocess_error_no_memory;
+    goto cleanup;
+  }
+
+  // Gonna re-use len to store the write index into commandLineCombined
+  len = 0;
+
+  for (i = 0; commandLine[i]; i++) {
+    if (0 != i) {
+      commandLineCombined[len++] = ' ';
+    }
+
+    need_quoting = strpbrk(commandLine[i], "\t\v ") != SUBPROCESS_NULL ||
+                   commandLine[i][0] == SUBPROCESS_NULL;
+    if (need_quoting) {
+      commandLineCombined[len++] = '"';
+    }
+
+    for (j = 0; '\0' != commandLine[i][j];) {
+      bs_run = 0;
+      while ('\\' == commandLine[i][j]) {
+        bs_run++;
+        j++;
+      }
+
+      if ('"' == commandLine[i][j]) {
+        // 2n + 1 slashes preserve n slashes and escape the quote.
+        bs_run = (bs_run * 2) + 1;
+      } else if ('\0' == commandLine[i][j] && need_quoting) {
+        // 2n slashes preserve n slashes before the closing quote.
+        bs_run *= 2;
+      }
+
+      while (bs_run > 0) {
+        commandLineCombined[len++] = '\\';
+        bs_run--;
+      }
+
+      if ('\0' != commandLine[i][j]) {
+        commandLineCombined[len++] = commandLine[i][j++];
+      }
+    }
+    if (need_quoting) {
+      commandLineCombined[len++] = '"';
+    }
+  }
+
+  commandLineCombined[len] = '\0';
+
+  wide_len = MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
+                                 commandLineCombined, -1, SUBPROCESS_NULL, 0);
+  if (0 == wide_len) {
+    result = subprocess_error_from_windows_error(GetLastError());
+    if (subprocess_error_unknown == result) {
+      result = subprocess_error_spawn;
+    }
+    goto cleanup;
+  }
+
+  commandLineCombinedWide = SUBPROCESS_CAST(
+      subprocess_wchar_t *,
+      _alloca(SUBPROCESS_CAST(subprocess_size_t, wide_len) *
+              sizeof(subprocess_wchar_t)));
+  if (!commandLineCombinedWide) {
+    result = subprocess_error_no_memory;
+    goto cleanup;
+  }
+
+  if (0 == MultiByteToWideChar(codePageUtf8, mbErrInvalidChars,
+                               commandLineCombined, -1,
+                               commandLineCombinedWide, wide_len)) {
+    result = subprocess_error_from_windows_error(GetLastError());
+    if (subprocess_error_unknown == result) {
+      result = subprocess_error_spawn;
+    }
+    goto cleanup;
+  }
+
+  if (process_cwd) {
+    wide_len = MultiByteToWideChar(codePageUtf8, mbErrInvalidChars, process_cwd,
+                                   -1, SUBPROCESS_NULL, 0);
+    if (0 == wide_len) {
+      result = subprocess_error_from_windows_error(GetLastError());
+      if (subprocess_error_unknown == result) {
+        result = subprocess_error_spawn;
+      }
+      goto cleanup;
+    }
+
+    process_cwd_wide = SUBPROCESS_CAST(
+        subprocess_wchar_t *,
+        _alloca(SUBPROCESS_CAST(subprocess_size_t, wide_len) *
+                sizeof(subprocess_wchar_t)));
+    if (!process_cwd_wide) {
+      result = subprocess_error_no_memory;
+      goto cleanup;
+    }
+
+    if (0 == MultiByteToWideChar(codePageUtf8, mbErrInvalidChars, process_cwd,
+                                 -1, process_cwd_wide, wide_len)) {
+      result = subprocess_error_from_windows_error(GetLastError());
+      if (subprocess_error_unknown == result) {
+        result = subprocess_error_spawn;
+      }
+      goto cleanup;
+    }
+  }
+
+  /* Restrict inheritance to this subprocess's standard streams. Without a
+     handle list, concurrent subprocess_create calls can inherit each other's
+     temporarily-inheritable child pipe handles. */
+  inherited_handles[inherited_handle_count++] = startInfo.hStdInput;
+  inherited_handles[inherited_handle_count++] = startInfo.hStdOutput;
+  if (startInfo.hStdError != startInfo.hStdOutput) {
+    inherited_handles[inherited_handle_count++] = startInfo.hStdError;
+  }
+
+  InitializeProcThreadAttributeList(SUBPROCESS_NULL, 1, 0,
+                                    &attribute_list_size);
+  if (0 == attribute_list_size) {
+    result = subprocess_error_spawn;
+    goto cleanup;
+  }
+
+  attribute_list = SUBPROCESS_PTR_CAST(LPPROC_THREAD_ATTRIBUTE_LIST,
+                                       _alloca(attribute_list_size));
+  if (!attribute_list || !InitializeProcThreadAttributeList(
+                             attribute_list, 1, 0, &attribute_list_size)) {
+    result = subprocess_error_spawn;
+    goto cleanup;
+  }
+  attribute_list_initialized = 1;
+
+  if (!UpdateProcThreadAttribute(
+          attribute_list, 0, procThreadAttributeHandleList, inherited_handles,
+          inherited_handle_count * sizeof(inherited_handles[0]),
+          SUBPROCESS_NULL, SUBPROCESS_NULL)) {
+    result = subprocess_error_spawn;
+    goto cleanup;
+  }
+
+  startInfoEx.startupInfo = startInfo;
+  startInfoEx.startupInfo.cb = sizeof(startInfoEx);
+  startInfoEx.attributeList = attribute_list;
+  flags |= extendedStartupInfoPresent;
+
+  if (!CreateProcessW(
+          SUBPROCESS_NULL,
+          commandLineCombinedWide, // command line
+          SUBPROCESS_NULL,         // process security attributes
+          SUBPROCESS_NULL,         // primary thread security attributes
+          1,                       // handles are inherited
+          flags,                   // creation flags
+          used_environment,        // used environment
+          process_cwd_wide,        // use specified current directory
+          SUBPROCESS_PTR_CAST(LPSTARTUPINFOW,
+                              &startInfoEx), // STARTUPINFOEX pointer
+          SUBPROCESS_PTR_CAST(LPPROCESS_INFORMATION, &processInfo))) {
+    result = subprocess_error_from_windows_error(GetLastError());
+    if (subprocess_error_unknown == result) {
+      result = subprocess_error_spawn;
+    }
+    goto cleanup;
+  }
+
+  DeleteProcThreadAttributeList(attribute_list);
+  attribute_list_initialized = 0;
+
+  out_process->hProcess = processInfo.hProcess;
+  processInfo.hProcess = SUBPROCESS_NULL;
+
+  out_process->hStdInput = startInfo.hStdInput;
+  startInfo.hStdInput = SUBPROCESS_NULL;
+
+  // We don't need the handle of the primary thread in the called process.
+  CloseHandle(processInfo.hThread);
+  processInfo.hThread = SUBPROCESS_NULL;
 
   if (SUBPROCESS_NULL != startInfo.hStdOutput) {
     CloseHandle(startInfo.hStdOutput);
 
-    if (startInfo.hStdError != startInfo.hStdOutput) {
-      CloseHandle(startInfo.hStdError);
+    if (startInfo.hStdError != startInfo.hStdOutput) {
+      CloseHandle(startInfo.hStdError);
+    }
+
+    startInfo.hStdOutput = SUBPROCESS_NULL;
+    startInfo.hStdError = SUBPROCESS_NULL;
+  }
+
+  out_process->alive = 1;
+  out_process->no_wait = async_no_wait;
+
+  return 0;
+
+cleanup:
+  last_error = GetLastError();
+
+  if (attribute_list_initialized) {
+    DeleteProcThreadAttributeList(attribute_list);
+  }
+
+  if (subprocess_error_unknown == result) {
+    result = subprocess_error_from_windows_error(last_error);
+  }
+
+  subprocess_close_streams(out_process);
+
+  subprocess_close_handle(&rd);
+  subprocess_close_handle(&wr);
+  subprocess_close_handle(&startInfo.hStdInput);
+
+  if (startInfo.hStdOutput == startInfo.hStdError) {
+    subprocess_close_handle(&startInfo.hStdOutput);
+    startInfo.hStdError = SUBPROCESS_NULL;
+  } else {
+    subprocess_close_handle(&startInfo.hStdOutput);
+    subprocess_close_handle(&startInfo.hStdError);
+  }
+
+  subprocess_close_handle(&out_process->hEventOutput);
+  subprocess_close_handle(&out_process->hEventError);
+  subprocess_close_handle(&processInfo.hThread);
+  subprocess_close_handle(&processInfo.hProcess);
+
+  SetLastError(last_error);
+
+  return result;
+#else
+  const int result = subprocess_create_posix(
+      -1, commandLine, options, environment, process_cwd, attr, out_process);
+
+#if SUBPROCESS_HAVE_METRICS
+  subprocess_metrics_spawned(result);
+#endif
+
+  return result;
+#endif
+}
+
+#if !defined(_WIN32)
+static int subprocess_create_posix(int exec_fd,
+                                   const char *const commandLine[],
+                                   int options,
+                                   const char *const environment[],
+                                   const char *const process_cwd,
+                                   const struct subprocess_attr_s *const attr,
+                                   struct subprocess_s *const out_process) {
+  int stdinfd[2] = {-1, -1};
+  int stdoutfd[2] = {-1, -1};
+  int stderrfd[2] = {-1, -1};
+  int notifyfd[2] = {-1, -1};
+  int fd, fd_flags;
+  int async_no_wait;
+  int result = subprocess_error_unknown;
+  int saved_errno = 0;
+  pid_t child = 0;
+  extern char **environ;
+  char *const empty_environment[1] = {SUBPROCESS_NULL};
+  char *const *used_environment;
+  char **notify_environment = SUBPROCESS_NULL;
+  char notify_variable[40];
+
+  async_no_wait = subprocess_option_enable_async_no_wait ==
+                  (options & subprocess_option_enable_async_no_wait);
+
+  if (async_no_wait && (subprocess_option_enable_async !=
+                        (options & subprocess_option_enable_async))) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  if (subprocess_option_inherit_environment ==
+      (options & subprocess_option_inherit_environment)) {
+    if (SUBPROCESS_NULL != environment) {
+      errno = EINVAL;
+      return subprocess_error_invalid_environment;
+    }
+  }
+
+#if !defined(__linux__)
+  if (subprocess_option_die_with_parent ==
+      (options & subprocess_option_die_with_parent)) {
+    errno = ENOSYS;
+    return subprocess_error_not_supported;
+  }
+#endif
+
+  if (attr) {
+    const int attr_error = subprocess_check_attr(attr);
+    if (0 != attr_error) {
+      return attr_error;
+    }
+  }
+
+  memset(out_process, 0, sizeof(*out_process));
+  out_process->stdin_fd = -1;
+  out_process->stdout_fd = -1;
+  out_process->stderr_fd = -1;
+  out_process->notify_fd = -1;
+  out_process->stat_fd = -1;
+  out_process->io_fd = -1;
+
+  if (attr && (-1 != attr->stdin_fd)) {
+    /* The child reads the caller's descriptor; there is no write end. */
+    stdinfd[0] = subprocess_stdin_source(attr->stdin_fd);
+    if (-1 == stdinfd[0]) {
+      saved_errno = errno;
+      result = subprocess_error_pipe;
+      goto cleanup;
+    }
+  } else if (0 != subprocess_pipe_cloexec(stdinfd)) {
+    saved_errno = errno;
+    result = subprocess_error_pipe;
+    goto cleanup;
+  } else if (attr) {
+    subprocess_set_pipe_capacity(stdinfd[1], attr->pipe_capacity);
+
+    if (0 != attr->stdin_size) {
+      result = subprocess_prefill_pipe(stdinfd[1], attr->stdin_data,
+                                       attr->stdin_size);
+      if (0 != result) {
+        saved_errno = errno;
+        goto cleanup;
+      }
+    }
+
+    /* The child's end holds the data; dropping ours means the child reads
+       the end of its input straight after. */
+    if (attr->stdin_close) {
+      close(stdinfd[1]);
+      stdinfd[1] = -1;
+    }
+  }
+
+  if (attr && (-1 != attr->stdout_fd)) {
+    /* The child writes to the caller's descriptor; there is no read end. */
+    stdoutfd[1] = fcntl(attr->stdout_fd, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+    if (-1 == stdoutfd[1]) {
+      saved_errno = errno;
+      result = subprocess_error_pipe;
+      goto cleanup;
+    }
+  } else if (0 != subprocess_pipe_cloexec(stdoutfd)) {
+    saved_errno = errno;
+    result = subprocess_error_pipe;
+    goto cleanup;
+  } else if (attr) {
+    subprocess_set_pipe_capacity(stdoutfd[0], attr->pipe_capacity);
+  }
+
+  if (subprocess_option_combined_stdout_stderr !=
+      (options & subprocess_option_combined_stdout_stderr)) {
+    if (0 != subprocess_pipe_cloexec(stderrfd)) {
+      saved_errno = errno;
+      result = subprocess_error_pipe;
+      goto cleanup;
+    }
+
+    if (attr) {
+      subprocess_set_pipe_capacity(stderrfd[0], attr->pipe_capacity);
+    }
+  }
+
+  if (environment) {
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcast-qual"
+#pragma clang diagnostic ignored "-Wold-style-cast"
+#endif
+    used_environment = SUBPROCESS_CONST_CAST(char *const *, environment);
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+  } else if (subprocess_option_inherit_environment ==
+             (options & subprocess_option_inherit_environment)) {
+    used_environment = environ;
+  } else {
+    used_environment = empty_environment;
+  }
+
+  if (subprocess_option_notify_ready ==
+      (options & subprocess_option_notify_ready)) {
+    if (0 != subprocess_pipe_cloexec(notifyfd)) {
+      saved_errno = errno;
+      result = subprocess_error_pipe;
+      goto cleanup;
+    }
+
+    /* The child's end keeps its number, so none of the attribute's
+       descriptors may land on it. */
+    if (attr && (0 != attr->fd_count)) {
+      fd = fcntl(notifyfd[1], F_DUPFD_CLOEXEC,
+                 subprocess_fds_base(attr, stdinfd, stdoutfd, stderrfd));
+      if (-1 == fd) {
+        saved_errno = errno;
+        result = subprocess_error_pipe;
+        goto cleanup;
+      }
+
+      close(notifyfd[1]);
+      notifyfd[1] = fd;
+    }
+
+    subprocess_format_int(notify_variable, "SUBPROCESS_NOTIFY_FD=",
+                          notifyfd[1]);
+    notify_environment =
+        subprocess_notify_environment(used_environment, notify_variable);
+    if (SUBPROCESS_NULL == notify_environment) {
+      saved_errno = ENOMEM;
+      result = subprocess_error_no_memory;
+      goto cleanup;
+    }
+
+    used_environment = notify_environment;
+  }
+
+#if !SUBPROCESS_SPAWN_VIA_FORK
+  /* posix_spawn cannot set resource limits, place a child or start a session
+     everywhere, so a child that needs any of that is forked and sets itself up
+     before exec. */
+  if ((-1 == exec_fd) && !subprocess_needs_fork(options, attr)) {
+    result = subprocess_posix_spawn(commandLine, options, used_environment,
+                                    process_cwd, attr, stdinfd, stdoutfd,
+                                    stderrfd, &child);
+  } else
+#endif
+  {
+    result = subprocess_fork_exec(exec_fd, commandLine, options,
+                                  used_environment, process_cwd, attr, stdinfd,
+                                  stdoutfd, stderrfd, notifyfd[1], &child);
+  }
+
+  if (0 != result) {
+    saved_errno = errno;
+    goto cleanup;
+  }
+
+  // Close the stdin read end
+  close(stdinfd[0]);
+  stdinfd[0] = -1;
+  // Store the stdin write end
+  out_process->stdin_fd = stdinfd[1];
+  stdinfd[1] = -1;
+
+  // Close the stdout write end
+  close(stdoutfd[1]);
+  stdoutfd[1] = -1;
+  // Store the stdout read end
+  out_process->stdout_fd = stdoutfd[0];
+  stdoutfd[0] = -1;
+
+  if (-1 != out_process->stdout_fd) {
+    // Set non blocking if we are async and asked not to wait.
+    if (async_no_wait) {
+      fd = out_process->stdout_fd;
+      fd_flags = fcntl(fd, F_GETFL, 0);
+      fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
+    }
+  }
+
+  if (subprocess_option_combined_stdout_stderr ==
+      (options & subprocess_option_combined_stdout_stderr)) {
+    out_process->stderr_fd = out_process->stdout_fd;
+  } else {
+    // Close the stderr write end
+    close(stderrfd[1]);
+    stderrfd[1] = -1;
+    // Store the stderr read end
+    out_process->stderr_fd = stderrfd[0];
+    stderrfd[0] = -1;
+
+    // Set non blocking if we are async and asked not to wait.
+    if (async_no_wait) {
+      fd = out_process->stderr_fd;
+      fd_flags = fcntl(fd, F_GETFL, 0);
+      fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
+    }
+  }
+
+  // Store the read end of the readiness pipe
+  out_process->notify_fd = notifyfd[0];
+  notifyfd[0] = -1;
+
+  // Store the child's pid
+  out_process->child = child;
+  child = 0;
+
+  if ((subprocess_option_new_process_group | subprocess_option_new_session) &
+      options) {
+    out_process->process_group = out_process->child;
+  }
+
+  out_process->alive = 1;
+  out_process->no_wait = async_no_wait;
+
+  result = 0;
+
+cleanup:
+  if ((0 != result) && (0 == saved_errno)) {
+    saved_errno = errno;
+  }
+
+  if ((subprocess_error_unknown == result) && (0 != saved_errno)) {
+    result = subprocess_error_from_errno(saved_errno);
+  }
+
+  if (0 != result) {
+    if (child) {
+      kill(child, 9);
+      waitpid(child, SUBPROCESS_NULL, 0);
+    }
+
+    subprocess_close_streams(out_process);
+  }
+
+  if (-1 != stdinfd[0]) {
+    close(stdinfd[0]);
+  }
+  if (-1 != stdinfd[1]) {
+    close(stdinfd[1]);
+  }
+  if (-1 != stdoutfd[0]) {
+    close(stdoutfd[0]);
+  }
+  if (-1 != stdoutfd[1]) {
+    close(stdoutfd[1]);
+  }
+  if (-1 != stderrfd[0]) {
+    close(stderrfd[0]);
+  }
+  if (-1 != stderrfd[1]) {
+    close(stderrfd[1]);
+  }
+  if (-1 != notifyfd[0]) {
+    close(notifyfd[0]);
+  }
+  if (-1 != notifyfd[1]) {
+    close(notifyfd[1]);
+  }
+
+  free(notify_environment);
+
+  if ((0 != result) && (0 != saved_errno)) {
+    errno = saved_errno;
+  }
+
+  return result;
+}
+#endif
+
+int subprocess_create_fd(int exec_fd, const char *const commandLine[],
+                         int options, const char *const environment[],
+                         const char *const process_cwd,
+                         const struct subprocess_attr_s *const attr,
+                         struct subprocess_s *const out_process) {
+#if SUBPROCESS_HAVE_EXEC_FD
+  int result;
+
+  if (exec_fd < 0) {
+    errno = EBADF;
+    return subprocess_error_invalid_options;
+  }
+
+  result = subprocess_create_posix(exec_fd, commandLine, options, environment,
+                                   process_cwd, attr, out_process);
+
+#if SUBPROCESS_HAVE_METRICS
+  subprocess_metrics_spawned(result);
+#endif
+
+  return result;
+#else
+  (void)exec_fd;
+  (void)commandLine;
+  (void)options;
+  (void)environment;
+  (void)process_cwd;
+  (void)attr;
+  (void)out_process;
+#if !defined(_WIN32)
+  errno = ENOSYS;
+#endif
+  return subprocess_error_not_supported;
+#endif
+}
+
+#if !defined(_WIN32)
+/* Milliseconds on a clock that never jumps, for turning timeouts into
+   deadlines. Only differences between two readings are meaningful. */
+static unsigned long subprocess_monotonic_ms(void) {
+  struct timespec now;
+
+  if (0 != clock_gettime(CLOCK_MONOTONIC, &now)) {
+    return 0;
+  }
+
+  return SUBPROCESS_CAST(unsigned long, now.tv_sec) * 1000ul +
+         SUBPROCESS_CAST(unsigned long, now.tv_nsec) / 1000000ul;
+}
+
+/* What is left of timeout_ms, a poll() style timeout, since start. */
+static int subprocess_remaining_ms(int timeout_ms, unsigned long start) {
+  const unsigned long elapsed = subprocess_monotonic_ms() - start;
+
+  if (timeout_ms < 0) {
+    return timeout_ms;
+  }
+
+  if (elapsed >= SUBPROCESS_CAST(unsigned long, timeout_ms)) {
+    return 0;
+  }
+
+  return timeout_ms - SUBPROCESS_CAST(int, elapsed);
+}
+
+/* Give back the place a governor holds for a process, once the process has
+   been reaped or is being destroyed. */
+static void subprocess_governor_release(struct subprocess_s *const process) {
+  struct subprocess_governor_s *const governor = process->governor;
+
+  if (governor) {
+    process->governor = SUBPROCESS_NULL;
+    (void)SUBPROCESS_ATOMIC_ADD(&governor->live, ~0u);
+  }
+}
+
+/* The process group a process leads, or 0 if it has none left. The group id
+   stays reserved while the leader exists, even unreaped, but once the leader
+   has been reaped and the last member has gone the kernel may hand the id out
+   again. A group found empty then is forgotten for good. */
+static pid_t subprocess_live_group(struct subprocess_s *const process) {
+  const pid_t group = SUBPROCESS_ATOMIC_LOAD(&process->process_group);
+
+  if (group && (0 == SUBPROCESS_ATOMIC_LOAD(&process->child)) &&
+      (0 != kill(-group, 0)) && (ESRCH == errno)) {
+    SUBPROCESS_ATOMIC_STORE(&process->process_group, 0);
+    return 0;
+  }
+
+  return group;
+}
+#endif
+
+#if SUBPROCESS_HAVE_REAPER
+/* Queue an event. The queue is Dmitry Vyukov's bounded MPMC queue used with a
+   single consumer: each slot's sequence says whether it is free for the
+   producer at a given position or holds an event for the consumer. It cannot
+   fill up, because subprocess_reaper_add never lets more processes in than
+   there are slots. */
+static void
+subprocess_reaper_push(struct subprocess_reaper_s *const reaper,
+                       struct subprocess_s *const process, const pid_t pid,
+                       int return_code) {
+  struct subprocess_reaper_slot_s *slot;
+  unsigned position = SUBPROCESS_ATOMIC_LOAD(&reaper->enqueue_position);
+
+  for (;;) {
+    slot = &reaper->slots[position & (reaper->capacity - 1)];
+
+    if (SUBPROCESS_ATOMIC_LOAD(&slot->sequence) == position) {
+      if (SUBPROCESS_ATOMIC_CAS(&reaper->enqueue_position, &position,
+                                position + 1)) {
+        break;
+      }
+    } else {
+      /* Another producer took this position first. */
+      position = SUBPROCESS_ATOMIC_LOAD(&reaper->enqueue_position);
+    }
+  }
+
+  slot->event.process = process;
+  slot->event.pid = pid;
+  slot->event.return_code = return_code;
+  SUBPROCESS_ATOMIC_STORE(&slot->sequence, position + 1);
+
+  (void)eventfd_write(reaper->event_fd, 1);
+}
+
+/* Collect a process whose pidfd has become readable. epoll only delivers the
+   event to one thread, so no other thread is collecting it at the same time.
+   Everything the process reports as reaped is published before collected is
+   set, since the process may be destroyed by another thread from then on and
+   must not be touched after that; the event gets copies. */
+static int subprocess_reaper_collect(struct subprocess_reaper_s *const reaper,
+                                     struct subprocess_s *const process) {
+  struct epoll_event rearm;
+  const int pidfd = process->pidfd;
+  const pid_t child = process->child;
+  int return_status;
+  int status = 0;
+  pid_t waited;
+
+  do {
+    waited = waitpid(child, &status, WNOHANG);
+  } while ((-1 == waited) && (EINTR == errno));
+
+  if (0 == waited) {
+    /* Not actually finished; wait for the next wakeup. */
+    rearm.events = EPOLLIN | EPOLLONESHOT;
+    rearm.data.ptr = process;
+    (void)epoll_ctl(reaper->epoll_fd, EPOLL_CTL_MOD, pidfd, &rearm);
+    return 0;
+  }
+
+  if ((waited == child) && WIFEXITED(status)) {
+    return_status = WEXITSTATUS(status);
+  } else {
+    return_status = EXIT_FAILURE;
+  }
+
+  (void)epoll_ctl(reaper->epoll_fd, EPOLL_CTL_DEL, pidfd, SUBPROCESS_NULL);
+
+  process->return_status = return_status;
+  SUBPROCESS_ATOMIC_STORE(&process->child, 0);
+  SUBPROCESS_ATOMIC_STORE(&process->alive, 0);
+  (void)subprocess_live_group(process);
+  subprocess_governor_release(process);
+  SUBPROCESS_ATOMIC_STORE(&process->collected, 1);
+#if SUBPROCESS_HAVE_METRICS
+  SUBPROCESS_METRIC_ADD(live_children, -1);
+#endif
+
+  subprocess_reaper_push(reaper, process, child, return_status);
+
+  return 1;
+}
+
+/* Wait for a process added to a reaper, in subprocess_join. */
+static int subprocess_reaper_join(struct subprocess_s *const process) {
+  struct pollfd exited;
+
+  while (!SUBPROCESS_ATOMIC_LOAD(&process->collected)) {
+    exited.fd = process->pidfd;
+    exited.events = POLLIN;
+    exited.revents = 0;
+
+    if (-1 == poll(&exited, 1, -1)) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return -1;
+    }
+
+    /* It has finished. Collect it here, unless another thread got the event
+       and is about to record it. */
+    if (-1 == subprocess_reaper_poll(process->reaper, 0)) {
+      return -1;
+    }
+
+    if (!SUBPROCESS_ATOMIC_LOAD(&process->collected)) {
+      sched_yield();
+    }
+  }
+
+  /* The pidfd stays open until subprocess_destroy, as other threads may still
+     be polling it in subprocess_alive. Collecting the process has already
+     marked it reaped. */
+  return 0;
+}
+
+static int
+subprocess_reaper_ready(const struct subprocess_reaper_s *const reaper) {
+  const unsigned position = reaper->dequeue_position;
+
+  return SUBPROCESS_ATOMIC_LOAD(
+             &reaper->slots[position & (reaper->capacity - 1)].sequence) ==
+         position + 1;
+}
+
+int subprocess_reaper_init(struct subprocess_reaper_s *const reaper,
+                           struct subprocess_reaper_slot_s *const slots,
+                           unsigned capacity) {
+  int saved_errno;
+  unsigned index;
+
+  memset(reaper, 0, sizeof(*reaper));
+  reaper->epoll_fd = -1;
+  reaper->event_fd = -1;
+
+  if ((0 == capacity) || (0 != (capacity & (capacity - 1)))) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  for (index = 0; index < capacity; index++) {
+    slots[index].sequence = index;
+  }
+
+  reaper->slots = slots;
+  reaper->capacity = capacity;
+
+  reaper->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (-1 == reaper->epoll_fd) {
+    return subprocess_error_from_errno(errno);
+  }
+
+  reaper->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (-1 == reaper->event_fd) {
+    saved_errno = errno;
+    close(reaper->epoll_fd);
+    reaper->epoll_fd = -1;
+    errno = saved_errno;
+    return subprocess_error_from_errno(saved_errno);
+  }
+
+  return 0;
+}
+
+int subprocess_reaper_add(struct subprocess_reaper_s *const reaper,
+                          struct subprocess_s *const process) {
+  struct epoll_event event;
+  unsigned outstanding = SUBPROCESS_ATOMIC_LOAD(&reaper->outstanding);
+  int saved_errno;
+  long pidfd;
+
+  if ((0 == process->child) || process->reaper) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  do {
+    if (outstanding >= reaper->capacity) {
+      errno = ENOBUFS;
+      return subprocess_error_no_memory;
+    }
+  } while (!SUBPROCESS_ATOMIC_CAS(&reaper->outstanding, &outstanding,
+                                  outstanding + 1));
+
+  /* pidfds are always close-on-exec. */
+  pidfd = syscall(SYS_pidfd_open, process->child, 0);
+  if (-1 == pidfd) {
+    goto failed;
+  }
+
+  process->pidfd = SUBPROCESS_CAST(int, pidfd);
+  process->collected = 0;
+  process->reaper = reaper;
+
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = process;
+  if (-1 == epoll_ctl(reaper->epoll_fd, EPOLL_CTL_ADD, process->pidfd,
+                      &event)) {
+    saved_errno = errno;
+    close(process->pidfd);
+    process->pidfd = -1;
+    process->reaper = SUBPROCESS_NULL;
+    errno = saved_errno;
+    goto failed;
+  }
+
+  return 0;
+
+failed:
+  saved_errno = errno;
+  SUBPROCESS_ATOMIC_ADD(&reaper->outstanding, ~0u);
+  errno = saved_errno;
+  return subprocess_error_from_errno(saved_errno);
+}
+
+int subprocess_reaper_poll(struct subprocess_reaper_s *const reaper,
+                           int timeout_ms) {
+  struct epoll_event events[64];
+  const unsigned long start = subprocess_monotonic_ms();
+  int collected = 0;
+  int count;
+  int index;
+
+  do {
+    count = epoll_wait(reaper->epoll_fd, events,
+                       SUBPROCESS_CAST(int, sizeof(events) / sizeof(events[0])),
+                       subprocess_remaining_ms(timeout_ms, start));
+  } while ((-1 == count) && (EINTR == errno));
+
+  if (-1 == count) {
+    return -1;
+  }
+
+  for (index = 0; index < count; index++) {
+    collected += subprocess_reaper_collect(
+        reaper, SUBPROCESS_PTR_CAST(struct subprocess_s *,
+                                    events[index].data.ptr));
+  }
+
+  return collected;
+}
+
+int subprocess_reaper_next(struct subprocess_reaper_s *const reaper,
+                           struct subprocess_reaper_event_s *const out_event) {
+  const unsigned position = reaper->dequeue_position;
+  struct subprocess_reaper_slot_s *const slot =
+      &reaper->slots[position & (reaper->capacity - 1)];
+
+  if (SUBPROCESS_ATOMIC_LOAD(&slot->sequence) != position + 1) {
+    return 0;
+  }
+
+  *out_event = slot->event;
+  SUBPROCESS_ATOMIC_STORE(&slot->sequence, position + reaper->capacity);
+  reaper->dequeue_position = position + 1;
+  SUBPROCESS_ATOMIC_ADD(&reaper->outstanding, ~0u);
+
+  return 1;
+}
+
+int subprocess_reaper_wait(struct subprocess_reaper_s *const reaper,
+                           int timeout_ms) {
+  struct pollfd fds[2];
+  const unsigned long start = subprocess_monotonic_ms();
+  eventfd_t value;
+  int ready;
+
+  while (!subprocess_reaper_ready(reaper)) {
+    fds[0].fd = reaper->epoll_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = reaper->event_fd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+
+    ready = poll(fds, 2, subprocess_remaining_ms(timeout_ms, start));
+    if (-1 == ready) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return -1;
+    }
+
+    if (0 == ready) {
+      return subprocess_reaper_ready(reaper);
+    }
+
+    if (fds[1].revents & POLLIN) {
+      (void)eventfd_read(reaper->event_fd, &value);
+    }
+
+    if ((fds[0].revents & POLLIN) &&
+        (-1 == subprocess_reaper_poll(reaper, 0))) {
+      return -1;
+    }
+  }
+
+  return 1;
+}
+
+int subprocess_reaper_destroy(struct subprocess_reaper_s *const reaper) {
+  if (-1 != reaper->event_fd) {
+    close(reaper->event_fd);
+    reaper->event_fd = -1;
+  }
+
+  if (-1 != reaper->epoll_fd) {
+    close(reaper->epoll_fd);
+    reaper->epoll_fd = -1;
+  }
+
+  return 0;
+}
+#elif !defined(_WIN32)
+int subprocess_reaper_init(struct subprocess_reaper_s *const reaper,
+                           struct subprocess_reaper_slot_s *const slots,
+                           unsigned capacity) {
+  (void)slots;
+  (void)capacity;
+  memset(reaper, 0, sizeof(*reaper));
+  reaper->epoll_fd = -1;
+  reaper->event_fd = -1;
+  errno = ENOSYS;
+  return subprocess_error_not_supported;
+}
+
+int subprocess_reaper_add(struct subprocess_reaper_s *const reaper,
+                          struct subprocess_s *const process) {
+  (void)reaper;
+  (void)process;
+  errno = ENOSYS;
+  return subprocess_error_not_supported;
+}
+
+int subprocess_reaper_poll(struct subprocess_reaper_s *const reaper,
+                           int timeout_ms) {
+  (void)reaper;
+  (void)timeout_ms;
+  errno = ENOSYS;
+  return -1;
+}
+
+int subprocess_reaper_next(struct subprocess_reaper_s *const reaper,
+                           struct subprocess_reaper_event_s *const out_event) {
+  (void)reaper;
+  (void)out_event;
+  return 0;
+}
+
+int subprocess_reaper_wait(struct subprocess_reaper_s *const reaper,
+                           int timeout_ms) {
+  (void)reaper;
+  (void)timeout_ms;
+  errno = ENOSYS;
+  return -1;
+}
+
+int subprocess_reaper_destroy(struct subprocess_reaper_s *const reaper) {
+  (void)reaper;
+  return 0;
+}
+#endif
+
+#if SUBPROCESS_HAVE_SPAWNER
+/* Queue a request. This is the same bounded queue as the reaper's, but with
+   any number of consumers, and producers that find it full give up. */
+static int
+subprocess_spawner_push(struct subprocess_spawner_s *const spawner,
+                        struct subprocess_spawn_s *const spawn) {
+  struct subprocess_spawner_slot_s *slot;
+  unsigned position = SUBPROCESS_ATOMIC_LOAD(&spawner->enqueue_position);
+  unsigned sequence;
+
+  for (;;) {
+    slot = &spawner->slots[position & (spawner->capacity - 1)];
+    sequence = SUBPROCESS_ATOMIC_LOAD(&slot->sequence);
+
+    if (sequence == position) {
+      if (SUBPROCESS_ATOMIC_CAS(&spawner->enqueue_position, &position,
+                                position + 1)) {
+        break;
+      }
+    } else if (SUBPROCESS_CAST(int, sequence - position) < 0) {
+      /* The request a lap ahead has not been taken yet. */
+      return 0;
+    } else {
+      position = SUBPROCESS_ATOMIC_LOAD(&spawner->enqueue_position);
+    }
+  }
+
+  slot->spawn = spawn;
+  SUBPROCESS_ATOMIC_STORE(&slot->sequence, position + 1);
+
+  return 1;
+}
+
+/* Take a request off the queue, or NULL if it is empty. */
+static struct subprocess_spawn_s *
+subprocess_spawner_pop(struct subprocess_spawner_s *const spawner) {
+  struct subprocess_spawner_slot_s *slot;
+  struct subprocess_spawn_s *spawn;
+  unsigned position = SUBPROCESS_ATOMIC_LOAD(&spawner->dequeue_position);
+  unsigned sequence;
+
+  for (;;) {
+    slot = &spawner->slots[position & (spawner->capacity - 1)];
+    sequence = SUBPROCESS_ATOMIC_LOAD(&slot->sequence);
+
+    if (sequence == position + 1) {
+      if (SUBPROCESS_ATOMIC_CAS(&spawner->dequeue_position, &position,
+                                position + 1)) {
+        break;
+      }
+    } else if (SUBPROCESS_CAST(int, sequence - (position + 1)) < 0) {
+      return SUBPROCESS_NULL;
+    } else {
+      position = SUBPROCESS_ATOMIC_LOAD(&spawner->dequeue_position);
+    }
+  }
+
+  spawn = slot->spawn;
+  SUBPROCESS_ATOMIC_STORE(&slot->sequence, position + spawner->capacity);
+
+  return spawn;
+}
+
+int subprocess_spawner_init(struct subprocess_spawner_s *const spawner,
+                            struct subprocess_spawner_slot_s *const slots,
+                            unsigned capacity) {
+  int saved_errno;
+  unsigned index;
+
+  memset(spawner, 0, sizeof(*spawner));
+  spawner->request_fd = -1;
+  spawner->done_fd = -1;
+
+  if ((0 == capacity) || (0 != (capacity & (capacity - 1)))) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  for (index = 0; index < capacity; index++) {
+    slots[index].sequence = index;
+  }
+
+  spawner->slots = slots;
+  spawner->capacity = capacity;
+
+  /* Each request posts one token, and each wakeup of a spawner thread takes
+     one, so a pool wakes one thread per request. */
+  spawner->request_fd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
+  if (-1 == spawner->request_fd) {
+    return subprocess_error_from_errno(errno);
+  }
+
+  spawner->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (-1 == spawner->done_fd) {
+    saved_errno = errno;
+    close(spawner->request_fd);
+    spawner->request_fd = -1;
+    errno = saved_errno;
+    return subprocess_error_from_errno(saved_errno);
+  }
+
+  return 0;
+}
+
+int subprocess_spawner_run(struct subprocess_spawner_s *const spawner) {
+  void (*callback)(struct subprocess_spawn_s *);
+  struct subprocess_spawn_s *spawn;
+  eventfd_t value;
+
+  for (;;) {
+    if (-1 == eventfd_read(spawner->request_fd, &value)) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return -1;
+    }
+
+    spawn = subprocess_spawner_pop(spawner);
+
+    if (SUBPROCESS_NULL == spawn) {
+      if (SUBPROCESS_ATOMIC_LOAD(&spawner->stopping)) {
+        /* Pass the stop on to the next thread running the spawner. */
+        (void)eventfd_write(spawner->request_fd, 1);
+        return 0;
+      }
+
+      /* The token was for a request another thread has already taken. */
+      continue;
+    }
+
+    spawn->result =
+        subprocess_create_attr(spawn->command_line, spawn->options,
+                               spawn->environment, spawn->process_cwd,
+                               spawn->attr, spawn->process);
+
+    callback = spawn->callback;
+    if (callback) {
+      callback(spawn);
+    }
+
+    SUBPROCESS_ATOMIC_STORE(&spawn->done, 1);
+    (void)eventfd_write(spawner->done_fd, 1);
+  }
+}
+
+int subprocess_spawner_stop(struct subprocess_spawner_s *const spawner) {
+  SUBPROCESS_ATOMIC_STORE(&spawner->stopping, 1);
+
+  if (-1 == eventfd_write(spawner->request_fd, 1)) {
+    return subprocess_error_from_errno(errno);
+  }
+
+  return 0;
+}
+
+int subprocess_spawner_destroy(struct subprocess_spawner_s *const spawner) {
+  if (-1 != spawner->request_fd) {
+    close(spawner->request_fd);
+    spawner->request_fd = -1;
+  }
+
+  if (-1 != spawner->done_fd) {
+    close(spawner->done_fd);
+    spawner->done_fd = -1;
+  }
+
+  return 0;
+}
+
+int subprocess_create_async(struct subprocess_spawner_s *const spawner,
+                            struct subprocess_spawn_s *const spawn) {
+  spawn->result = subprocess_error_unknown;
+  spawn->done = 0;
+
+  if (SUBPROCESS_ATOMIC_LOAD(&spawner->stopping)) {
+    errno = ECANCELED;
+    return subprocess_error_invalid_options;
+  }
+
+  if (!subprocess_spawner_push(spawner, spawn)) {
+    errno = ENOBUFS;
+    return subprocess_error_no_memory;
+  }
+
+  /* Only fails if the count would overflow, which the bounded queue rules
+     out. */
+  (void)eventfd_write(spawner->request_fd, 1);
+
+  return 0;
+}
+#elif !defined(_WIN32)
+int subprocess_spawner_init(struct subprocess_spawner_s *const spawner,
+                            struct subprocess_spawner_slot_s *const slots,
+                            unsigned capacity) {
+  (void)slots;
+  (void)capacity;
+  memset(spawner, 0, sizeof(*spawner));
+  spawner->request_fd = -1;
+  spawner->done_fd = -1;
+  errno = ENOSYS;
+  return subprocess_error_not_supported;
+}
+
+int subprocess_spawner_run(struct subprocess_spawner_s *const spawner) {
+  (void)spawner;
+  errno = ENOSYS;
+  return -1;
+}
+
+int subprocess_spawner_stop(struct subprocess_spawner_s *const spawner) {
+  (void)spawner;
+  errno = ENOSYS;
+  return subprocess_error_not_supported;
+}
+
+int subprocess_spawner_destroy(struct subprocess_spawner_s *const spawner) {
+  (void)spawner;
+  return 0;
+}
+
+int subprocess_create_async(struct subprocess_spawner_s *const spawner,
+                            struct subprocess_spawn_s *const spawn) {
+  (void)spawner;
+  spawn->result = subprocess_error_not_supported;
+  spawn->done = 0;
+  errno = ENOSYS;
+  return subprocess_error_not_supported;
+}
+#endif
+
+#if !defined(_WIN32)
+int subprocess_spawner_done_fd(
+    const struct subprocess_spawner_s *const spawner) {
+  return spawner->done_fd;
+}
+
+int subprocess_spawn_done(const struct subprocess_spawn_s *const spawn) {
+  return SUBPROCESS_ATOMIC_LOAD(&spawn->done);
+}
+
+/* Start a standby in slot, on the pool's spawner if it has one. */
+static int
+subprocess_standby_start(struct subprocess_standby_s *const pool,
+                         struct subprocess_standby_slot_s *const slot) {
+  int result;
+
+  if (SUBPROCESS_NULL == pool->spawner) {
+    result = subprocess_create_attr(pool->command_line, pool->options,
+                                    pool->environment, pool->process_cwd,
+                                    pool->attr, &slot->process);
+    slot->ready = (0 == result);
+    return result;
+  }
+
+  memset(&slot->spawn, 0, sizeof(slot->spawn));
+  slot->spawn.command_line = pool->command_line;
+  slot->spawn.options = pool->options;
+  slot->spawn.environment = pool->environment;
+  slot->spawn.process_cwd = pool->process_cwd;
+  slot->spawn.attr = pool->attr;
+  slot->spawn.process = &slot->process;
+
+  result = subprocess_create_async(pool->spawner, &slot->spawn);
+  slot->starting = (0 == result);
+  return result;
+}
+
+/* Take in slot's standby once the spawner has started it. */
+static void
+subprocess_standby_collect(struct subprocess_standby_slot_s *const slot) {
+  if (slot->starting && subprocess_spawn_done(&slot->spawn)) {
+    slot->starting = 0;
+    slot->ready = (0 == slot->spawn.result);
+  }
+}
+
+/* Stop slot's standby, whether or not it is still running. */
+static void
+subprocess_standby_drop(struct subprocess_standby_slot_s *const slot) {
+  if (subprocess_alive(&slot->process)) {
+    (void)subprocess_terminate(&slot->process);
+  }
+
+  (void)subprocess_join(&slot->process, SUBPROCESS_NULL);
+  (void)subprocess_destroy(&slot->process);
+  slot->ready = 0;
+}
+
+void subprocess_standby_init(struct subprocess_standby_s *const pool,
+                             const char *const command_line[], int options,
+                             const char *const environment[],
+                             const char *const process_cwd,
+                             const struct subprocess_attr_s *const attr,
+                             struct subprocess_standby_slot_s *const slots,
+                             unsigned capacity) {
+  unsigned index;
+
+  memset(pool, 0, sizeof(*pool));
+  pool->command_line = command_line;
+  pool->options = options;
+  pool->environment = environment;
+  pool->process_cwd = process_cwd;
+  pool->attr = attr;
+  pool->target = capacity;
+  pool->slots = slots;
+  pool->capacity = capacity;
+
+  for (index = 0; index < capacity; index++) {
+    slots[index].starting = 0;
+    slots[index].ready = 0;
+  }
+}
+
+int subprocess_standby_fill(struct subprocess_standby_s *const pool) {
+  struct subprocess_standby_slot_s *slot;
+  unsigned count = 0;
+  unsigned index;
+  int result;
+
+  for (index = 0; index < pool->capacity; index++) {
+    slot = &pool->slots[index];
+    subprocess_standby_collect(slot);
+
+    if (slot->ready && !subprocess_alive(&slot->process)) {
+      subprocess_standby_drop(slot);
+    }
+
+    count += slot->starting || slot->ready;
+  }
+
+  for (index = 0; (index < pool->capacity) && (count > pool->target);
+       index++) {
+    slot = &pool->slots[index];
+    if (slot->ready) {
+      subprocess_standby_drop(slot);
+      count--;
+    }
+  }
+
+  for (index = 0; (index < pool->capacity) && (count < pool->target);
+       index++) {
+    slot = &pool->slots[index];
+    if (slot->starting || slot->ready) {
+      continue;
+    }
+
+    result = subprocess_standby_start(pool, slot);
+    if (0 != result) {
+      return result;
+    }
+
+    count++;
+  }
+
+  return 0;
+}
+
+int subprocess_standby_acquire(struct subprocess_standby_s *const pool,
+                               struct subprocess_s *const out_process) {
+  struct subprocess_standby_slot_s *slot;
+  unsigned index;
+  unsigned tried;
+  int found;
+
+  for (tried = 0; tried < pool->capacity; tried++) {
+    index = (pool->next + tried) % pool->capacity;
+    slot = &pool->slots[index];
+    subprocess_standby_collect(slot);
+
+    if (!slot->ready) {
+      continue;
+    }
+
+    /* One that died while idle is useless, and its slot is started again
+       like the one handed out. */
+    found = subprocess_alive(&slot->process);
+    if (found) {
+      *out_process = slot->process;
+      slot->ready = 0;
+      pool->next = index + 1;
+    } else {
+      subprocess_standby_drop(slot);
+    }
+
+    if (pool->spawner) {
+      (void)subprocess_standby_start(pool, slot);
+    }
+
+    if (found) {
+      return 0;
+    }
+  }
+
+  return subprocess_create_attr(pool->command_line, pool->options,
+                                pool->environment, pool->process_cwd,
+                                pool->attr, out_process);
+}
+
+int subprocess_standby_destroy(struct subprocess_standby_s *const pool) {
+  const struct timespec pause = {0, 1000000};
+  struct subprocess_standby_slot_s *slot;
+  unsigned index;
+
+  for (index = 0; index < pool->capacity; index++) {
+    slot = &pool->slots[index];
+
+    while (slot->starting) {
+      subprocess_standby_collect(slot);
+      if (slot->starting) {
+        nanosleep(&pause, SUBPROCESS_NULL);
+      }
+    }
+
+    if (slot->ready) {
+      subprocess_standby_drop(slot);
+    }
+  }
+
+  return 0;
+}
+
+int subprocess_governor_init(struct subprocess_governor_s *const governor) {
+  governor->live = 0;
+  governor->due_us = subprocess_monotonic_us();
+  governor->memory_fd = -1;
+  governor->cpu_fd = -1;
+  governor->pressure_ms = subprocess_monotonic_ms() - 100;
+  governor->pressured = 0;
+
+  if ((0 == governor->memory_pressure) && (0 == governor->cpu_pressure)) {
+    return 0;
+  }
+
+#if defined(__linux__)
+  if (0 != governor->memory_pressure) {
+    governor->memory_fd = open("/proc/pressure/memory", O_RDONLY | O_CLOEXEC);
+    if (-1 == governor->memory_fd) {
+      return subprocess_error_not_supported;
+    }
+  }
+
+  if (0 != governor->cpu_pressure) {
+    governor->cpu_fd = open("/proc/pressure/cpu", O_RDONLY | O_CLOEXEC);
+    if (-1 == governor->cpu_fd) {
+      (void)subprocess_governor_destroy(governor);
+      return subprocess_error_not_supported;
+    }
+  }
+
+  return 0;
+#else
+  errno = ENOSYS;
+  return subprocess_error_not_supported;
+#endif
+}
+
+/* The "some avg10" figure of a /proc/pressure file in hundredths of a
+   percent, or -1 if it cannot be read. */
+static long subprocess_pressure_read(int fd) {
+  char buffer[128];
+  const char *cursor;
+  ssize_t bytes_read;
+  long value = 0;
+  int decimals = 0;
+
+  bytes_read = pread(fd, buffer, sizeof(buffer) - 1, 0);
+  if (bytes_read <= 0) {
+    return -1;
+  }
+
+  buffer[bytes_read] = '\0';
+
+  /* The first line is the "some" one. */
+  cursor = strstr(buffer, "avg10=");
+  if (SUBPROCESS_NULL == cursor) {
+    return -1;
+  }
+
+  for (cursor += 6; ('0' <= *cursor) && ('9' >= *cursor); cursor++) {
+    value = value * 10 + (*cursor - '0');
+  }
+
+  if ('.' == *cursor) {
+    for (cursor++; ('0' <= *cursor) && ('9' >= *cursor) && (decimals < 2);
+         cursor++, decimals++) {
+      value = value * 10 + (*cursor - '0');
+    }
+  }
+
+  for (; decimals < 2; decimals++) {
+    value *= 10;
+  }
+
+  return value;
+}
+
+/* Whether the system is under more pressure than the governor allows. The
+   files are read at most every 100ms, and the last answer stands between
+   reads. */
+static int
+subprocess_governor_pressured(struct subprocess_governor_s *const governor) {
+  const unsigned long now = subprocess_monotonic_ms();
+  int pressured = 0;
+
+  if ((-1 == governor->memory_fd) && (-1 == governor->cpu_fd)) {
+    return 0;
+  }
+
+  if (now - SUBPROCESS_ATOMIC_LOAD(&governor->pressure_ms) < 100) {
+    return SUBPROCESS_ATOMIC_LOAD(&governor->pressured);
+  }
+
+  if ((-1 != governor->memory_fd) &&
+      (subprocess_pressure_read(governor->memory_fd) >=
+       100L * SUBPROCESS_CAST(long, governor->memory_pressure))) {
+    pressured = 1;
+  }
+
+  if ((-1 != governor->cpu_fd) &&
+      (subprocess_pressure_read(governor->cpu_fd) >=
+       100L * SUBPROCESS_CAST(long, governor->cpu_pressure))) {
+    pressured = 1;
+  }
+
+  SUBPROCESS_ATOMIC_STORE(&governor->pressured, pressured);
+  SUBPROCESS_ATOMIC_STORE(&governor->pressure_ms, now);
+  return pressured;
+}
+
+/* Take a place among the governor's running processes, if there is one. */
+static int
+subprocess_governor_enter(struct subprocess_governor_s *const governor) {
+  unsigned live = SUBPROCESS_ATOMIC_LOAD(&governor->live);
+
+  do {
+    if ((0 != governor->max_live) && (live >= governor->max_live)) {
+      return 0;
+    }
+  } while (!SUBPROCESS_ATOMIC_CAS(&governor->live, &live, live + 1));
+
+  return 1;
+}
+
+/* Take the next start on the rate's schedule. This is the generic cell rate
+   algorithm: due_us is when the next start falls due if starts are evenly
+   spaced, and a start may come up to burst - 1 intervals early. Returns 0 if
+   a start was taken, or else how many microseconds until one can be. */
+static unsigned long
+subprocess_governor_take(struct subprocess_governor_s *const governor) {
+  unsigned long interval;
+  unsigned long tolerance;
+  unsigned long due;
+  unsigned long now;
+  unsigned long start;
+
+  if (0 == governor->rate) {
+    return 0;
+  }
+
+  interval = 1000000ul / governor->rate;
+  tolerance = interval * ((governor->burst > 1) ? governor->burst - 1 : 0);
+  due = SUBPROCESS_ATOMIC_LOAD(&governor->due_us);
+
+  do {
+    now = subprocess_monotonic_us();
+
+    /* A due time further ahead than one start can push it is left over from
+       before the clock wrapped, after a long quiet spell. */
+    start = due;
+    if ((SUBPROCESS_CAST(long, due - now) < 0) ||
+        (due - now > tolerance + interval)) {
+      start = now;
+    }
+
+    if (start - now > tolerance) {
+      return start - now - tolerance;
+    }
+  } while (!SUBPROCESS_ATOMIC_CAS(&governor->due_us, &due, start + interval));
+
+  return 0;
+}
+
+int subprocess_governor_create(struct subprocess_governor_s *const governor,
+                               const char *const command_line[], int options,
+                               const char *const environment[],
+                               const char *const process_cwd,
+                               const struct subprocess_attr_s *const attr,
+                               struct subprocess_s *const out_process,
+                               int timeout_ms) {
+  const unsigned long start = subprocess_monotonic_ms();
+  unsigned long backoff_us = 1000;
+  unsigned long wait_us;
+  struct timespec pause;
+  int remaining;
+  int result = 0;
+
+  for (;;) {
+    if (subprocess_governor_pressured(governor)) {
+      wait_us = 10000;
+    } else if (!subprocess_governor_enter(governor)) {
+      wait_us = 1000;
+    } else if (0 != (wait_us = subprocess_governor_take(governor))) {
+      (void)SUBPROCESS_ATOMIC_ADD(&governor->live, ~0u);
+    } else {
+      result = subprocess_create_attr(command_line, options, environment,
+                                      process_cwd, attr, out_process);
+      if (0 == result) {
+        out_process->governor = governor;
+        return 0;
+      }
+
+      (void)SUBPROCESS_ATOMIC_ADD(&governor->live, ~0u);
+      if (EAGAIN != errno) {
+        return result;
+      }
+
+      wait_us = backoff_us;
+      if (backoff_us < 64000) {
+        backoff_us *= 2;
+      }
+    }
+
+    remaining = subprocess_remaining_ms(timeout_ms, start);
+    if (0 == remaining) {
+      /* Out of time: report the last failure to create, if there was one. */
+      errno = (0 != result) ? EAGAIN : ETIMEDOUT;
+      return (0 != result) ? result : subprocess_error_unknown;
+    }
+
+    if ((remaining > 0) &&
+        (wait_us > SUBPROCESS_CAST(unsigned long, remaining) * 1000ul)) {
+      wait_us = SUBPROCESS_CAST(unsigned long, remaining) * 1000ul;
+    }
+
+    pause.tv_sec = SUBPROCESS_CAST(time_t, wait_us / 1000000ul);
+    pause.tv_nsec = SUBPROCESS_CAST(long, wait_us % 1000000ul) * 1000L;
+    nanosleep(&pause, SUBPROCESS_NULL);
+  }
+}
+
+int subprocess_governor_destroy(struct subprocess_governor_s *const governor) {
+  if (-1 != governor->memory_fd) {
+    close(governor->memory_fd);
+    governor->memory_fd = -1;
+  }
+
+  if (-1 != governor->cpu_fd) {
+    close(governor->cpu_fd);
+    governor->cpu_fd = -1;
+  }
+
+  return 0;
+}
+
+void subprocess_scheduler_init(
+    struct subprocess_scheduler_s *const scheduler,
+    struct subprocess_scheduler_tenant_s *const tenants, unsigned tenant_count,
+    unsigned capacity) {
+  unsigned index;
+  long processors;
+
+  if (0 == capacity) {
+    processors = sysconf(_SC_NPROCESSORS_ONLN);
+    capacity = (0 < processors) ? SUBPROCESS_CAST(unsigned, processors) : 1;
+  }
+
+  scheduler->tenants = tenants;
+  scheduler->tenant_count = tenant_count;
+  scheduler->capacity = capacity;
+  scheduler->running = 0;
+  scheduler->current = 0;
+
+  for (index = 0; index < tenant_count; index++) {
+    tenants[index].head = SUBPROCESS_NULL;
+    tenants[index].tail = SUBPROCESS_NULL;
+    tenants[index].queued = 0;
+    tenants[index].running = 0;
+    tenants[index].deficit = 0;
+    tenants[index].started = 0;
+    tenants[index].wait_total_ms = 0;
+    tenants[index].wait_max_ms = 0;
+  }
+
+  if (0 < tenant_count) {
+    tenants[0].deficit = tenants[0].weight ? tenants[0].weight : 1;
+  }
+}
+
+int subprocess_scheduler_submit(struct subprocess_scheduler_s *const scheduler,
+                                struct subprocess_scheduler_job_s *const job) {
+  struct subprocess_scheduler_tenant_s *tenant;
+  struct subprocess_scheduler_job_s **link;
+
+  if (job->tenant >= scheduler->tenant_count) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  tenant = &scheduler->tenants[job->tenant];
+  job->queued_ms = subprocess_monotonic_ms();
+  job->wait_ms = 0;
+  job->next = SUBPROCESS_NULL;
+
+  /* Jobs mostly arrive at the priority of the last one queued, so they go on
+     the tail without walking the queue. */
+  if ((SUBPROCESS_NULL == tenant->tail) ||
+      (job->priority <= tenant->tail->priority)) {
+    link = tenant->tail ? &tenant->tail->next : &tenant->head;
+  } else {
+    for (link = &tenant->head; job->priority <= (*link)->priority;
+         link = &(*link)->next) {
+    }
+  }
+
+  job->next = *link;
+  *link = job;
+  if (SUBPROCESS_NULL == job->next) {
+    tenant->tail = job;
+  }
+
+  tenant->queued++;
+  return 0;
+}
+
+/* Whether a tenant has a job queued and room under its quota to start it. */
+static int subprocess_scheduler_eligible(
+    const struct subprocess_scheduler_tenant_s *const tenant) {
+  return tenant->head &&
+         ((0 == tenant->quota) || (tenant->running < tenant->quota));
+}
+
+int subprocess_scheduler_start(
+    struct subprocess_scheduler_s *const scheduler,
+    struct subprocess_scheduler_job_s **const out_job) {
+  struct subprocess_scheduler_tenant_s *tenant = SUBPROCESS_NULL;
+  struct subprocess_scheduler_job_s *job;
+  unsigned long now;
+  unsigned visited;
+  int result;
+
+  *out_job = SUBPROCESS_NULL;
+
+  if ((0 == scheduler->tenant_count) ||
+      (scheduler->running >= scheduler->capacity)) {
+    return 0;
+  }
+
+  /* The tenant whose turn it is starts jobs until it has used its weight in
+     starts or has none it can start. The turn then passes on, and a tenant
+     that is passed over for being idle or at its quota loses the rest of its
+     turn rather than saving it up. Every tenant is looked at once, and the
+     current one twice, as its turn may have run out. */
+  for (visited = 0; visited <= scheduler->tenant_count; visited++) {
+    tenant = &scheduler->tenants[scheduler->current];
+
+    if ((0 < tenant->deficit) && subprocess_scheduler_eligible(tenant)) {
+      break;
+    }
+
+    tenant->deficit = 0;
+    scheduler->current = (scheduler->current + 1) % scheduler->tenant_count;
+    tenant = &scheduler->tenants[scheduler->current];
+    tenant->deficit = tenant->weight ? tenant->weight : 1;
+  }
+
+  if (visited > scheduler->tenant_count) {
+    return 0;
+  }
+
+  job = tenant->head;
+  tenant->head = job->next;
+  if (SUBPROCESS_NULL == tenant->head) {
+    tenant->tail = SUBPROCESS_NULL;
+  }
+
+  tenant->queued--;
+  tenant->deficit--;
+
+  now = subprocess_monotonic_ms();
+  job->wait_ms = now - job->queued_ms;
+  job->next = SUBPROCESS_NULL;
+  *out_job = job;
+
+  result = subprocess_create_attr(job->command_line, job->options,
+                                  job->environment, job->process_cwd,
+                                  job->attr, &job->process);
+  if (0 != result) {
+    return result;
+  }
+
+  tenant->running++;
+  tenant->started++;
+  tenant->wait_total_ms += job->wait_ms;
+  if (job->wait_ms > tenant->wait_max_ms) {
+    tenant->wait_max_ms = job->wait_ms;
+  }
+
+  scheduler->running++;
+  return 0;
+}
+
+void subprocess_scheduler_finish(
+    struct subprocess_scheduler_s *const scheduler,
+    struct subprocess_scheduler_job_s *const job) {
+  scheduler->tenants[job->tenant].running--;
+  scheduler->running--;
+}
+#endif
+
+#if SUBPROCESS_HAVE_CHANNEL
+/* The start of a channel's shared memory, followed by its data. head and tail
+   count the bytes written and read since it was created, and only the writer
+   and reader respectively move them. A side that has to wait sleeps on the
+   sequence the other side bumps as it moves its counter, after raising its
+   waiting flag so that the other side knows to wake it. Each side's state has
+   a cache line of its own. */
+struct subprocess_ring_s {
+  unsigned magic;
+  unsigned capacity;
+  unsigned closed;
+  char pad0[64 - 3 * sizeof(unsigned)];
+  unsigned head;
+  unsigned data_sequence;
+  unsigned reader_waiting;
+  char pad1[64 - 3 * sizeof(unsigned)];
+  unsigned tail;
+  unsigned space_sequence;
+  unsigned writer_waiting;
+  char pad2[64 - 3 * sizeof(unsigned)];
+};
+
+/* "spch" in ASCII. */
+#define SUBPROCESS_RING_MAGIC 0x73706368u
+
+static struct subprocess_ring_s *
+subprocess_channel_ring(const struct subprocess_channel_s *const channel) {
+  return SUBPROCESS_PTR_CAST(struct subprocess_ring_s *, channel->shared);
+}
+
+/* Sleep until *word moves on from value, for at most timeout_ms. The futex is
+   not private, as the other side is another process. */
+static void subprocess_channel_sleep(unsigned *const word, unsigned value,
+                                     int timeout_ms) {
+  struct timespec timeout;
+
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = SUBPROCESS_CAST(long, timeout_ms % 1000) * 1000000L;
+
+  /* FUTEX_WAIT, from <linux/futex.h>. Waking early, on a signal or a stale
+     value, is fine: the caller checks again. */
+  (void)syscall(SYS_futex, word, 0, value,
+                (timeout_ms < 0) ? SUBPROCESS_NULL : &timeout, SUBPROCESS_NULL,
+                0);
+}
+
+/* Move a side's counter on, and wake the other side if it is waiting. */
+static void subprocess_channel_publish(unsigned *const counter, unsigned value,
+                                       unsigned *const sequence,
+                                       unsigned *const waiting) {
+  SUBPROCESS_ATOMIC_STORE(counter, value);
+  SUBPROCESS_ATOMIC_ADD(sequence, 1u);
+
+  /* Pairs with the fence in subprocess_channel_wait: either the waiter sees
+     the new counter, or this sees its flag. */
+  SUBPROCESS_ATOMIC_FENCE();
+
+  if (SUBPROCESS_ATOMIC_LOAD(waiting)) {
+    /* FUTEX_WAKE every waiter, from <linux/futex.h>. */
+    (void)syscall(SYS_futex, sequence, 1, 0x7fffffff, SUBPROCESS_NULL,
+                  SUBPROCESS_NULL, 0);
+  }
+}
+
+/* Wait for the other side to move its counter off value, or to close the
+   channel. Returns 0 if it did, or subprocess_read_again on timeout. */
+static int subprocess_channel_wait(struct subprocess_ring_s *const ring,
+                                   unsigned *const counter, unsigned value,
+                                   unsigned *const sequence,
+                                   unsigned *const waiting, int timeout_ms) {
+  const unsigned long start = subprocess_monotonic_ms();
+  unsigned observed;
+  int remaining;
+
+  for (;;) {
+    observed = SUBPROCESS_ATOMIC_LOAD(sequence);
+    SUBPROCESS_ATOMIC_STORE(waiting, 1u);
+    SUBPROCESS_ATOMIC_FENCE();
+
+    if ((SUBPROCESS_ATOMIC_LOAD(counter) != value) ||
+        SUBPROCESS_ATOMIC_LOAD(&ring->closed)) {
+      SUBPROCESS_ATOMIC_STORE(waiting, 0u);
+      return 0;
+    }
+
+    remaining = subprocess_remaining_ms(timeout_ms, start);
+    if (0 == remaining) {
+      SUBPROCESS_ATOMIC_STORE(waiting, 0u);
+      return subprocess_read_again;
+    }
+
+    subprocess_channel_sleep(sequence, observed, remaining);
+  }
+}
+
+int subprocess_channel_init(struct subprocess_channel_s *const channel,
+                            unsigned capacity) {
+  struct subprocess_ring_s *ring;
+  int saved_errno;
+
+  channel->shared = SUBPROCESS_NULL;
+  channel->size = 0;
+  channel->capacity = 0;
+  channel->fd = -1;
+
+  if ((0 == capacity) || (0 != (capacity & (capacity - 1))) ||
+      (capacity > 0x40000000u)) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  channel->fd = memfd_create("subprocess_channel", MFD_CLOEXEC);
+  if (-1 == channel->fd) {
+    return subprocess_error_from_errno(errno);
+  }
+
+  channel->size = sizeof(struct subprocess_ring_s) + capacity;
+
+  if (0 != ftruncate(channel->fd, SUBPROCESS_CAST(off_t, channel->size))) {
+    goto failed;
+  }
+
+  channel->shared = mmap(SUBPROCESS_NULL, channel->size,
+                         PROT_READ | PROT_WRITE, MAP_SHARED, channel->fd, 0);
+  if (MAP_FAILED == channel->shared) {
+    channel->shared = SUBPROCESS_NULL;
+    goto failed;
+  }
+
+  /* A fresh memfd reads as zeros, so only the geometry needs setting. */
+  ring = subprocess_channel_ring(channel);
+  ring->capacity = capacity;
+  SUBPROCESS_ATOMIC_STORE(&ring->magic, SUBPROCESS_RING_MAGIC);
+  channel->capacity = capacity;
+
+  return 0;
+
+failed:
+  saved_errno = errno;
+  close(channel->fd);
+  channel->fd = -1;
+  channel->size = 0;
+  channel->capacity = 0;
+  errno = saved_errno;
+  return subprocess_error_from_errno(saved_errno);
+}
+
+int subprocess_channel_open(struct subprocess_channel_s *const channel,
+                            int fd) {
+  struct subprocess_ring_s *ring;
+  struct stat info;
+  int saved_errno;
+
+  channel->shared = SUBPROCESS_NULL;
+  channel->size = 0;
+  channel->capacity = 0;
+  channel->fd = -1;
+
+  if (0 != fstat(fd, &info)) {
+    return subprocess_error_invalid_options;
+  }
+
+  if ((info.st_size <= SUBPROCESS_CAST(off_t, sizeof(*ring))) ||
+      (info.st_size > SUBPROCESS_CAST(off_t, sizeof(*ring) + 0x40000000u))) {
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  channel->size = SUBPROCESS_CAST(size_t, info.st_size);
+  channel->shared = mmap(SUBPROCESS_NULL, channel->size,
+                         PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (MAP_FAILED == channel->shared) {
+    saved_errno = errno;
+    channel->shared = SUBPROCESS_NULL;
+    channel->size = 0;
+    channel->capacity = 0;
+  channel->capacity = 0;
+    errno = saved_errno;
+    return subprocess_error_invalid_options;
+  }
+
+  /* The capacity comes from the size of the mapping, and the shared copy
+     must only agree with it. */
+  ring = subprocess_channel_ring(channel);
+  channel->capacity = SUBPROCESS_CAST(unsigned, channel->size - sizeof(*ring));
+  if ((SUBPROCESS_RING_MAGIC != SUBPROCESS_ATOMIC_LOAD(&ring->magic)) ||
+      (ring->capacity != channel->capacity) ||
+      (0 != (channel->capacity & (channel->capacity - 1)))) {
+    munmap(channel->shared, channel->size);
+    channel->shared = SUBPROCESS_NULL;
+    channel->size = 0;
+    channel->capacity = 0;
+  channel->capacity = 0;
+    errno = EINVAL;
+    return subprocess_error_invalid_options;
+  }
+
+  /* Keep it out of anything this process launches in turn. */
+  (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+  channel->fd = fd;
+
+  return 0;
+}
+
+int subprocess_channel_write(struct subprocess_channel_s *const channel,
+                             const void *const data, unsigned size,
+                             int timeout_ms,
+                             unsigned *const out_bytes_written) {
+  struct subprocess_ring_s *const ring = subprocess_channel_ring(channel);
+  char *const storage = SUBPROCESS_PTR_CAST(char *, ring + 1);
+  const unsigned capacity = channel->capacity;
+  const unsigned mask = capacity - 1;
+  const unsigned head = SUBPROCESS_ATOMIC_LOAD(&ring->head);
+  unsigned tail;
+  unsigned count;
+  unsigned first;
+
+  *out_bytes_written = 0;
+
+  if (0 == size) {
+    errno = EINVAL;
+    return subprocess_read_error;
+  }
+
+  for (;;) {
+    if (SUBPROCESS_ATOMIC_LOAD(&ring->closed)) {
+      return subprocess_read_eof;
+    }
+
+    tail = SUBPROCESS_ATOMIC_LOAD(&ring->tail);
+
+    /* Only a corrupted ring holds more than its capacity. */
+    if (head - tail > capacity) {
+      errno = EPROTO;
+      return subprocess_read_error;
+    }
+
+    if (head - tail != capacity) {
+      break;
+    }
+
+    if (subprocess_read_again ==
+        subprocess_channel_wait(ring, &ring->tail, tail, &ring->space_sequence,
+                                &ring->writer_waiting, timeout_ms)) {
+      return subprocess_read_again;
+    }
+  }
+
+  count = capacity - (head - tail);
+  if (count > size) {
+    count = size;
+  }
+
+  /* The free space may wrap around the end of the storage. */
+  first = capacity - (head & mask);
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(storage + (head & mask), data, first);
+  memcpy(storage, SUBPROCESS_PTR_CAST(const char *, data) + first,
+         count - first);
+
+  subprocess_channel_publish(&ring->head, head + count, &ring->data_sequence,
+                             &ring->reader_waiting);
+
+  *out_bytes_written = count;
+  return subprocess_read_data;
+}
+
+int subprocess_channel_read(struct subprocess_channel_s *const channel,
+                            void *const buffer, unsigned size, int timeout_ms,
+                            unsigned *const out_bytes_read) {
+  struct subprocess_ring_s *const ring = subprocess_channel_ring(channel);
+  const char *const storage = SUBPROCESS_PTR_CAST(const char *, ring + 1);
+  const unsigned capacity = channel->capacity;
+  const unsigned mask = capacity - 1;
+  const unsigned tail = SUBPROCESS_ATOMIC_LOAD(&ring->tail);
+  unsigned head;
+  unsigned count;
+  unsigned first;
+
+  *out_bytes_read = 0;
+
+  if (0 == size) {
+    errno = EINVAL;
+    return subprocess_read_error;
+  }
+
+  for (;;) {
+    /* Checked before head, so that whatever was written before the channel
+       was closed is still read. */
+    const unsigned closed = SUBPROCESS_ATOMIC_LOAD(&ring->closed);
+
+    head = SUBPROCESS_ATOMIC_LOAD(&ring->head);
+    if (head != tail) {
+      break;
+    }
+
+    if (closed) {
+      return subprocess_read_eof;
+    }
+
+    if (subprocess_read_again ==
+        subprocess_channel_wait(ring, &ring->head, head, &ring->data_sequence,
+                                &ring->reader_waiting, timeout_ms)) {
+      return subprocess_read_again;
+    }
+  }
+
+  /* Only a corrupted ring holds more than its capacity. */
+  count = head - tail;
+  if (count > capacity) {
+    errno = EPROTO;
+    return subprocess_read_error;
+  }
+
+  if (count > size) {
+    count = size;
+  }
+
+  first = capacity - (tail & mask);
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(buffer, storage + (tail & mask), first);
+  memcpy(SUBPROCESS_PTR_CAST(char *, buffer) + first, storage, count - first);
+
+  subprocess_channel_publish(&ring->tail, tail + count, &ring->space_sequence,
+                             &ring->writer_waiting);
+
+  *out_bytes_read = count;
+  return subprocess_read_data;
+}
+
+void subprocess_channel_close(struct subprocess_channel_s *const channel) {
+  struct subprocess_ring_s *const ring = subprocess_channel_ring(channel);
+
+  SUBPROCESS_ATOMIC_STORE(&ring->closed, 1u);
+
+  /* Wake both sides whether or not they are waiting; closing is rare. */
+  SUBPROCESS_ATOMIC_ADD(&ring->data_sequence, 1u);
+  SUBPROCESS_ATOMIC_ADD(&ring->space_sequence, 1u);
+  (void)syscall(SYS_futex, &ring->data_sequence, 1, 0x7fffffff,
+                SUBPROCESS_NULL, SUBPROCESS_NULL, 0);
+  (void)syscall(SYS_futex, &ring->space_sequence, 1, 0x7fffffff,
+                SUBPROCESS_NULL, SUBPROCESS_NULL, 0);
+}
+
+int subprocess_channel_destroy(struct subprocess_channel_s *const channel) {
+  if (channel->shared) {
+    munmap(channel->shared, channel->size);
+    channel->shared = SUBPROCESS_NULL;
+  }
+
+  if (-1 != channel->fd) {
+    close(channel->fd);
+    channel->fd = -1;
+  }
+
+  channel->size = 0;
+  channel->capacity = 0;
+  return 0;
+}
+#else
+int subprocess_channel_init(struct subprocess_channel_s *const channel,
+                            unsigned capacity) {
+  (void)capacity;
+  channel->shared = SUBPROCESS_NULL;
+  channel->size = 0;
+  channel->capacity = 0;
+  channel->fd = -1;
+#if !defined(_WIN32)
+  errno = ENOSYS;
+#endif
+  return subprocess_error_not_supported;
+}
+
+int subprocess_channel_open(struct subprocess_channel_s *const channel,
+                            int fd) {
+  (void)fd;
+  channel->shared = SUBPROCESS_NULL;
+  channel->size = 0;
+  channel->capacity = 0;
+  channel->fd = -1;
+#if !defined(_WIN32)
+  errno = ENOSYS;
+#endif
+  return subprocess_error_not_supported;
+}
+
+int subprocess_channel_write(struct subprocess_channel_s *const channel,
+                             const void *const data, unsigned size,
+                             int timeout_ms,
+                             unsigned *const out_bytes_written) {
+  (void)channel;
+  (void)data;
+  (void)size;
+  (void)timeout_ms;
+  *out_bytes_written = 0;
+#if !defined(_WIN32)
+  errno = ENOSYS;
+#endif
+  return subprocess_read_error;
+}
+
+int subprocess_channel_read(struct subprocess_channel_s *const channel,
+                            void *const buffer, unsigned size, int timeout_ms,
+                            unsigned *const out_bytes_read) {
+  (void)channel;
+  (void)buffer;
+  (void)size;
+  (void)timeout_ms;
+  *out_bytes_read = 0;
+#if !defined(_WIN32)
+  errno = ENOSYS;
+#endif
+  return subprocess_read_error;
+}
+
+void subprocess_channel_close(struct subprocess_channel_s *const channel) {
+  (void)channel;
+}
+
+int subprocess_channel_destroy(struct subprocess_channel_s *const channel) {
+  (void)channel;
+  return 0;
+}
+#endif
+
+int subprocess_channel_fd(const struct subprocess_channel_s *const channel) {
+  return channel->fd;
+}
+
+#if !defined(_WIN32)
+/* Lay out the dependents of every job in first/dependents, check that the
+   dependencies form no cycle while finding a topological order of the jobs,
+   and find how many jobs the longest chain starting at each job holds. */
+static int subprocess_jobs_order(const struct subprocess_job_s *const jobs,
+                                 unsigned count, unsigned *const waiting,
+                                 unsigned *const first,
+                                 unsigned *const dependents,
+                                 unsigned *const order,
+                                 unsigned *const depth) {
+  unsigned ordered = 0;
+  unsigned position;
+  unsigned index;
+  unsigned edge;
+  unsigned job;
+
+  for (index = 0; index <= count; index++) {
+    first[index] = 0;
+  }
+
+  for (index = 0; index < count; index++) {
+    waiting[index] = jobs[index].dependency_count;
+
+    for (edge = 0; edge < jobs[index].dependency_count; edge++) {
+      job = jobs[index].dependencies[edge];
+      if (job >= count) {
+        return -1;
+      }
+      first[job + 1]++;
+    }
+  }
+
+  for (index = 0; index < count; index++) {
+    first[index + 1] += first[index];
+  }
+
+  /* depth is free until the end, so it first serves as the cursor each job's
+     dependents are written at, and then as the count of dependencies not yet
+     ordered. */
+  for (index = 0; index < count; index++) {
+    depth[index] = first[index];
+  }
+
+  for (index = 0; index < count; index++) {
+    for (edge = 0; edge < jobs[index].dependency_count; edge++) {
+      dependents[depth[jobs[index].dependencies[edge]]++] = index;
+    }
+  }
+
+  for (index = 0; index < count; index++) {
+    depth[index] = waiting[index];
+    if (0 == waiting[index]) {
+      order[ordered++] = index;
+    }
+  }
+
+  for (position = 0; position < ordered; position++) {
+    job = order[position];
+
+    for (edge = first[job]; edge < first[job + 1]; edge++) {
+      if (0 == --depth[dependents[edge]]) {
+        order[ordered++] = dependents[edge];
+      }
+    }
+  }
+
+  if (ordered != count) {
+    return -1;
+  }
+
+  for (position = count; 0 < position--;) {
+    job = order[position];
+    depth[job] = 1;
+
+    for (edge = first[job]; edge < first[job + 1]; edge++) {
+      if (depth[job] <= depth[dependents[edge]]) {
+        depth[job] = depth[dependents[edge]] + 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Find the chain of dependent jobs that took longest to run, breaking ties
+   by the number of jobs on it, and write it out from its first job. */
+static unsigned
+subprocess_jobs_critical_path(const struct subprocess_job_s *const jobs,
+                              unsigned count, const unsigned *const order,
+                              unsigned long *const path_ms,
+                              unsigned *const path_jobs,
+                              unsigned *const previous,
+                              unsigned *const out_path) {
+  unsigned best = count;
+  unsigned position;
+  unsigned length;
+  unsigned edge;
+  unsigned job;
+  unsigned dependency;
+
+  for (position = 0; position < count; position++) {
+    job = order[position];
+    path_ms[job] = 0;
+    path_jobs[job] = 0;
+    previous[job] = count;
+
+    if ((subprocess_job_succeeded != jobs[job].state) &&
+        (subprocess_job_failed != jobs[job].state)) {
+      continue;
+    }
+
+    /* A job only runs once every one of its dependencies has. */
+    for (edge = 0; edge < jobs[job].dependency_count; edge++) {
+      dependency = jobs[job].dependencies[edge];
+
+      if ((path_ms[dependency] > path_ms[job]) ||
+          ((path_ms[dependency] == path_ms[job]) &&
+           (path_jobs[dependency] > path_jobs[job]))) {
+        path_ms[job] = path_ms[dependency];
+        path_jobs[job] = path_jobs[dependency];
+        previous[job] = dependency;
+      }
+    }
+
+    path_ms[job] += jobs[job].end_ms - jobs[job].start_ms;
+    path_jobs[job]++;
+
+    if ((count == best) || (path_ms[job] > path_ms[best]) ||
+        ((path_ms[job] == path_ms[best]) &&
+         (path_jobs[job] > path_jobs[best]))) {
+      best = job;
+    }
+  }
+
+  if (count == best) {
+    return 0;
+  }
+
+  length = path_jobs[best];
+
+  if (out_path) {
+    position = length;
+    for (job = best; count != job; job = previous[job]) {
+      out_path[--position] = job;
+    }
+  }
+
+  return length;
+}
+#endif
+
+int subprocess_run_jobs(struct subprocess_job_s *const jobs, unsigned count,
+                        unsigned capacity, int options,
+                        const char *const environment[],
+                        const char *const process_cwd,
+                        const struct subprocess_attr_s *const attr,
+                        unsigned *const out_critical_path,
+                        unsigned *const out_critical_length) {
+#if defined(_WIN32)
+  (void)jobs;
+  (void)count;
+  (void)capacity;
+  (void)options;
+  (void)environment;
+  (void)process_cwd;
+  (void)attr;
+  (void)out_critical_path;
+  (void)out_critical_length;
+  return subprocess_error_not_supported;
+#else
+  const struct timespec pause = {0, 1000000};
+  const unsigned long start = subprocess_monotonic_ms();
+  struct subprocess_attr_s job_attr;
+  struct subprocess_s *processes = SUBPROCESS_NULL;
+  unsigned long *path_ms = SUBPROCESS_NULL;
+  unsigned *scratch = SUBPROCESS_NULL;
+  unsigned *waiting;
+  unsigned *first;
+  unsigned *dependents;
+  unsigned *order;
+  unsigned *depth;
+  unsigned *ready;
+  unsigned *worklist;
+  unsigned *running;
+  unsigned *done;
+#if SUBPROCESS_HAVE_REAPER
+  struct subprocess_reaper_slot_s *reaper_slots = SUBPROCESS_NULL;
+  struct subprocess_reaper_event_s event;
+  struct subprocess_reaper_s reaper;
+  unsigned reaper_capacity;
+  int have_reaper = 0;
+  int use_reaper = 0;
+#endif
+  unsigned edges = 0;
+  unsigned slots;
+  unsigned free_weight;
+  unsigned weight;
+  unsigned ready_count = 0;
+  unsigned running_count = 0;
+  unsigned done_count;
+  unsigned length;
+  unsigned chosen = 0;
+  unsigned best;
+  unsigned top;
+  unsigned index;
+  unsigned edge;
+  unsigned slot;
+  unsigned job;
+  long processors;
+  int null_fd = -1;
+  int result = 0;
+  int saved_errno = 0;
+  int return_code;
+
+  /* Nothing to run, and nothing to size the buffers below by. */
+  if (0 == count) {
+    if (out_critical_length) {
+      *out_critical_length = 0;
+    }
+
+    return 0;
+  }
+
+  if (0 == capacity) {
+    processors = sysconf(_SC_NPROCESSORS_ONLN);
+    capacity = (0 < processors) ? SUBPROCESS_CAST(unsigned, processors) : 1;
+  }
+
+  for (index = 0; index < count; index++) {
+    weight = jobs[index].weight ? jobs[index].weight : 1;
+    if (weight > capacity) {
+      errno = EINVAL;
+      return subprocess_error_invalid_options;
+    }
+
+    edges += jobs[index].dependency_count;
+    jobs[index].state = subprocess_job_pending;
+    jobs[index].return_code = 0;
+    jobs[index].start_ms = 0;
+    jobs[index].end_ms = 0;
+  }
+
+  /* Every job weighs at least one, so no more than this many run at once. */
+  slots = (capacity < count) ? capacity : count;
+
+  scratch = SUBPROCESS_PTR_CAST(
+      unsigned *,
+      malloc(sizeof(unsigned) * (6 * SUBPROCESS_CAST(size_t, count) + 1 +
+                                 edges + 2 * SUBPROCESS_CAST(size_t, slots))));
+  processes = SUBPROCESS_PTR_CAST(
+      struct subprocess_s *,
+      malloc(sizeof(struct subprocess_s) * SUBPROCESS_CAST(size_t, slots)));
+  if (out_critical_path || out_critical_length) {
+    path_ms = SUBPROCESS_PTR_CAST(
+        unsigned long *,
+        malloc(sizeof(unsigned long) * SUBPROCESS_CAST(size_t, count)));
+  }
+
+  if (!scratch || !processes ||
+      (!path_ms && (out_critical_path || out_critical_length))) {
+    result = subprocess_error_no_memory;
+    saved_errno = ENOMEM;
+    goto cleanup;
+  }
+
+  waiting = scratch;
+  first = waiting + count;
+  dependents = first + count + 1;
+  order = dependents + edges;
+  depth = order + count;
+  ready = depth + count;
+  worklist = ready + count;
+  running = worklist + count;
+  done = running + slots;
+
+  if (0 != subprocess_jobs_order(jobs, count, waiting, first, dependents,
+                                 order, depth)) {
+    result = subprocess_error_invalid_options;
+    saved_errno = EINVAL;
+    goto cleanup;
+  }
+
+  if (attr) {
+    job_attr = *attr;
+  } else {
+    subprocess_attr_init(&job_attr);
+  }
+
+  if ((-1 == job_attr.stdin_fd) || (-1 == job_attr.stdout_fd)) {
+#if defined(O_CLOEXEC)
+    null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+#else
+    null_fd = open("/dev/null", O_RDWR);
+    if (-1 != null_fd) {
+      fcntl(null_fd, F_SETFD, FD_CLOEXEC);
+    }
+#endif
+    if (-1 == null_fd) {
+      saved_errno = errno;
+      result = subprocess_error_from_errno(saved_errno);
+      goto cleanup;
+    }
+
+    if (-1 == job_attr.stdin_fd) {
+      job_attr.stdin_fd = null_fd;
+    }
+
+    if (-1 == job_attr.stdout_fd) {
+      job_attr.stdout_fd = null_fd;
+    }
+  }
+
+#if SUBPROCESS_HAVE_REAPER
+  for (reaper_capacity = 1; reaper_capacity < slots; reaper_capacity <<= 1) {
+  }
+
+  reaper_slots = SUBPROCESS_PTR_CAST(
+      struct subprocess_reaper_slot_s *,
+      malloc(sizeof(struct subprocess_reaper_slot_s) * reaper_capacity));
+
+  /* Without a reaper the running jobs are swept instead. */
+  have_reaper = reaper_slots &&
+                (0 == subprocess_reaper_init(&reaper, reaper_slots,
+                                             reaper_capacity));
+  use_reaper = have_reaper;
+#endif
+
+  for (slot = 0; slot < slots; slot++) {
+    running[slot] = count;
+  }
+
+  for (index = 0; index < count; index++) {
+    if (0 == waiting[index]) {
+      ready[ready_count++] = index;
+    }
+  }
+
+  free_weight = capacity;
+
+  for (;;) {
+    /* Start every ready job that fits, those heading the longest chains of
+       dependents first. */
+    while (0 == result) {
+      best = count;
+
+      for (index = 0; index < ready_count; index++) {
+        job = ready[index];
+        weight = jobs[job].weight ? jobs[job].weight : 1;
+
+        if ((weight <= free_weight) &&
+            ((count == best) || (depth[job] > depth[best]))) {
+          best = job;
+          chosen = index;
+        }
+      }
+
+      if (count == best) {
+        break;
+      }
+
+      ready[chosen] = ready[--ready_count];
+
+      for (slot = 0; count != running[slot]; slot++) {
+      }
+
+      jobs[best].start_ms = subprocess_monotonic_ms() - start;
+      result = subprocess_create_attr(
+          jobs[best].command_line,
+          options | subprocess_option_combined_stdout_stderr, environment,
+          process_cwd, &job_attr, &processes[slot]);
+      if (0 != result) {
+        saved_errno = errno;
+        break;
+      }
+
+#if SUBPROCESS_HAVE_REAPER
+      if (use_reaper) {
+        result = subprocess_reaper_add(&reaper, &processes[slot]);
+        if (0 != result) {
+          saved_errno = errno;
+          subprocess_terminate(&processes[slot]);
+          subprocess_join(&processes[slot], SUBPROCESS_NULL);
+          subprocess_destroy(&processes[slot]);
+          break;
+        }
+      }
+#endif
+
+      running[slot] = best;
+      running_count++;
+      free_weight -= jobs[best].weight ? jobs[best].weight : 1;
+    }
+
+    if (0 == running_count) {
+      break;
+    }
+
+    /* Wait for at least one running job to finish. */
+    done_count = 0;
+
+#if SUBPROCESS_HAVE_REAPER
+    if (use_reaper) {
+      if (-1 == subprocess_reaper_wait(&reaper, -1)) {
+        if (0 == result) {
+          saved_errno = errno;
+          result = subprocess_error_from_errno(saved_errno);
+        }
+
+        /* Joining still works on processes added to the reaper. */
+        use_reaper = 0;
+        continue;
+      }
+
+      while (subprocess_reaper_next(&reaper, &event)) {
+        done[done_count++] =
+            SUBPROCESS_CAST(unsigned, event.process - processes);
+      }
+    } else
+#endif
+    {
+      for (slot = 0; slot < slots; slot++) {
+        if ((count != running[slot]) &&
+            (1 != subprocess_alive(&processes[slot]))) {
+          done[done_count++] = slot;
+        }
+      }
+
+      if (0 == done_count) {
+        nanosleep(&pause, SUBPROCESS_NULL);
+      }
+    }
+
+    for (index = 0; index < done_count; index++) {
+      slot = done[index];
+      job = running[slot];
+      return_code = -1;
+
+      subprocess_join(&processes[slot], &return_code);
+      subprocess_destroy(&processes[slot]);
+
+      jobs[job].end_ms = subprocess_monotonic_ms() - start;
+      jobs[job].return_code = return_code;
+      jobs[job].state =
+          (0 == return_code) ? subprocess_job_succeeded : subprocess_job_failed;
+
+      running[slot] = count;
+      running_count--;
+      free_weight += jobs[job].weight ? jobs[job].weight : 1;
+
+      /* Release the job's dependents. If it did not succeed they are skipped
+         instead, and so are theirs in turn. */
+      worklist[0] = job;
+      top = 1;
+
+      while (0 < top) {
+        job = worklist[--top];
+
+        for (edge = first[job]; edge < first[job + 1]; edge++) {
+          if (subprocess_job_succeeded != jobs[job].state) {
+            jobs[dependents[edge]].state = subprocess_job_skipped;
+          }
+
+          if (0 == --waiting[dependents[edge]]) {
+            if (subprocess_job_skipped == jobs[dependents[edge]].state) {
+              worklist[top++] = dependents[edge];
+            } else {
+              ready[ready_count++] = dependents[edge];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  if (out_critical_path || out_critical_length) {
+    length = subprocess_jobs_critical_path(jobs, count, order, path_ms, waiting,
+                                           ready, out_critical_path);
+
+    if (out_critical_length) {
+      *out_critical_length = length;
+    }
+  }
+
+cleanup:
+#if SUBPROCESS_HAVE_REAPER
+  if (have_reaper) {
+    subprocess_reaper_destroy(&reaper);
+  }
+
+  free(reaper_slots);
+#endif
+
+  if (-1 != null_fd) {
+    close(null_fd);
+  }
+
+  free(path_ms);
+  free(processes);
+  free(scratch);
+
+  if (0 != result) {
+    errno = saved_errno;
+  }
+
+  return result;
+#endif
+}
+
+/* Create the file for a stream the first time it is asked for. Nothing
+   guards the check and the store, so each stream must have one user at a time;
+   two threads asking together could each create a file for one descriptor. */
+static FILE *subprocess_open_stream(FILE **const file, const int fd,
+                                    const char *const mode) {
+  if ((SUBPROCESS_NULL == *file) && (-1 != fd)) {
+#if defined(_WIN32)
+    *file = _fdopen(fd, mode);
+#else
+    *file = fdopen(fd, mode);
+#endif
+  }
+
+  return *file;
+}
+
+FILE *subprocess_stdin(struct subprocess_s *const process) {
+  return subprocess_open_stream(&process->stdin_file, process->stdin_fd, "wb");
+}
+
+FILE *subprocess_stdout(struct subprocess_s *const process) {
+  return subprocess_open_stream(&process->stdout_file, process->stdout_fd,
+                                "rb");
+}
+
+FILE *subprocess_stderr(struct subprocess_s *const process) {
+  if (process->stdout_fd != process->stderr_fd) {
+    return subprocess_open_stream(&process->stderr_file,
+                                  process->stderr_fd, "rb");
+  } else {
+    return SUBPROCESS_NULL;
+  }
+}
+
+int subprocess_stdin_fd(const struct subprocess_s *const process) {
+  return process->stdin_fd;
+}
+
+int subprocess_stdout_fd(const struct subprocess_s *const process) {
+  return process->stdout_fd;
+}
+
+int subprocess_stderr_fd(const struct subprocess_s *const process) {
+  if (process->stdout_fd != process->stderr_fd) {
+    return process->stderr_fd;
+  } else {
+    return -1;
+  }
+}
+
+#if !defined(_WIN32)
+/* Signal a process, or its whole group if it leads one. Returns 0 if something
+   was left to signal. */
+static int subprocess_signal(struct subprocess_s *const process,
+                             int signal_number) {
+  const pid_t group = subprocess_live_group(process);
+  const pid_t child = SUBPROCESS_ATOMIC_LOAD(&process->child);
+
+  if (group) {
+    return kill(-group, signal_number);
+  }
+
+  if (child) {
+    return kill(child, signal_number);
+  }
+
+  /* Already reaped, and kill(0) would signal our own process group. */
+  errno = ESRCH;
+  return -1;
+}
+
+/* Move a process along its termination: kill what is left at the deadline,
+   or end it early once the process (and all of its group) has gone. Returns
+   non-zero while it is still terminating. */
+static int subprocess_terminate_step(struct subprocess_s *const process) {
+  int expected = 1;
+  int running;
+
+  /* Claiming the step keeps two threads from stepping the same process. Once
+     the process has been reaped its group may still have members. */
+  if (!SUBPROCESS_ATOMIC_CAS(&process->terminating, &expected, 0)) {
+    return 0;
+  }
+
+  running = (0 != subprocess_alive(process)) ||
+            (0 != subprocess_live_group(process));
+
+  if (!running) {
+    return 0;
+  }
+
+  if (SUBPROCESS_CAST(long, subprocess_monotonic_ms() -
+                                process->kill_deadline_ms) >= 0) {
+    subprocess_signal(process, SIGKILL);
+    return 0;
+  }
+
+  SUBPROCESS_ATOMIC_STORE(&process->terminating, 1);
+  return 1;
+}
+#endif
+
+#if !defined(_WIN32)
+/* Wait for a process not added to a reaper, blocking or not, and publish its
+   exit status. Only one thread at a time calls waitpid on the process; the
+   others see it alive until that thread has published the status. Returns 0
+   once the process has finished, 1 if it is still running, or -1 on error. */
+static int subprocess_reap(struct subprocess_s *const process, int block) {
+  const struct timespec pause = {0, 1000000};
+  int expected;
+  int status;
+  pid_t waited;
+
+  while (SUBPROCESS_ATOMIC_LOAD(&process->alive)) {
+    expected = 0;
+    if (!SUBPROCESS_ATOMIC_CAS(&process->reaping, &expected, 1)) {
+      if (!block) {
+        return 1;
+      }
+
+      nanosleep(&pause, SUBPROCESS_NULL);
+      continue;
+    }
+
+    do {
+      waited = waitpid(process->child, &status, block ? 0 : WNOHANG);
+    } while ((-1 == waited) && (EINTR == errno));
+
+    if (waited != process->child) {
+      SUBPROCESS_ATOMIC_STORE(&process->reaping, 0);
+      return (0 == waited) ? 1 : -1;
+    }
+
+    if (WIFEXITED(status)) {
+      process->return_status = WEXITSTATUS(status);
+    } else {
+      process->return_status = EXIT_FAILURE;
+    }
+
+    /* reaping stays claimed: there is nothing left to wait for. */
+    subprocess_governor_release(process);
+    SUBPROCESS_ATOMIC_STORE(&process->child, 0);
+    SUBPROCESS_ATOMIC_STORE(&process->alive, 0);
+
+    /* Forget the group straight away if it went with its leader. */
+    (void)subprocess_live_group(process);
+#if SUBPROCESS_HAVE_METRICS
+    SUBPROCESS_METRIC_ADD(live_children, -1);
+#endif
+  }
+
+  return 0;
+}
+#endif
+
+int subprocess_join(struct subprocess_s *const process,
+                    int *const out_return_code) {
+#if defined(_WIN32)
+  const unsigned long infinite = 0xFFFFFFFF;
+
+  subprocess_close_stream(&process->stdin_file, &process->stdin_fd);
+
+  if (process->hStdInput) {
+    CloseHandle(process->hStdInput);
+    process->hStdInput = SUBPROCESS_NULL;
+  }
+
+  WaitForSingleObject(process->hProcess, infinite);
+
+  if (out_return_code) {
+    if (!GetExitCodeProcess(
+            process->hProcess,
+            SUBPROCESS_PTR_CAST(unsigned long *, out_return_code))) {
+      return -1;
+    }
+  }
+
+  process->alive = 0;
+
+  return 0;
+#else
+#if SUBPROCESS_HAVE_METRICS
+  const unsigned long start_us = subprocess_monotonic_us();
+#endif
+
+  subprocess_close_stdin(process);
+
+  if (SUBPROCESS_ATOMIC_LOAD(&process->terminating)) {
+    const struct timespec pause = {0, 1000000};
+
+    /* Nothing reports when the last of a group goes, so check every
+       millisecond until it has or the grace period ends. */
+    while (subprocess_terminate_step(process)) {
+      nanosleep(&pause, SUBPROCESS_NULL);
+    }
+  }
+
+#if SUBPROCESS_HAVE_REAPER
+  if (process->reaper) {
+    if (0 != subprocess_reaper_join(process)) {
+      return -1;
+    }
+  }
+#endif
+
+  if (0 != subprocess_reap(process, 1)) {
+    return -1;
+  }
+
+  if (out_return_code) {
+    *out_return_code = process->return_status;
+  }
+
+#if SUBPROCESS_HAVE_METRICS
+  subprocess_metrics_joined(start_us);
+#endif
+
+  return 0;
+#endif
+}
+
+int subprocess_destroy(struct subprocess_s *const process) {
+  subprocess_close_streams(process);
+
+#if SUBPROCESS_HAVE_REAPER
+  if (process->reaper) {
+    /* Never joined. Take it back from the reaper unless its event has been
+       queued already, in which case that event still holds its slot. */
+    (void)epoll_ctl(process->reaper->epoll_fd, EPOLL_CTL_DEL, process->pidfd,
+                    SUBPROCESS_NULL);
+    if (!SUBPROCESS_ATOMIC_LOAD(&process->collected)) {
+      SUBPROCESS_ATOMIC_ADD(&process->reaper->outstanding, ~0u);
+    }
+    close(process->pidfd);
+    process->pidfd = -1;
+    process->reaper = SUBPROCESS_NULL;
+  }
+#endif
+
+#if !defined(_WIN32)
+  if (-1 != process->notify_fd) {
+    close(process->notify_fd);
+    process->notify_fd = -1;
+  }
+
+  if (-1 != process->stat_fd) {
+    close(process->stat_fd);
+    process->stat_fd = -1;
+  }
+
+  if (-1 != process->io_fd) {
+    close(process->io_fd);
+    process->io_fd = -1;
+  }
+
+  subprocess_governor_release(process);
+#endif
+
+#if defined(_WIN32)
+  if (process->hProcess) {
+    CloseHandle(process->hProcess);
+    process->hProcess = SUBPROCESS_NULL;
+
+    if (process->hStdInput) {
+      CloseHandle(process->hStdInput);
+    }
+
+    if (process->hEventOutput) {
+      CloseHandle(process->hEventOutput);
+    }
+
+    if (process->hEventError) {
+      CloseHandle(process->hEventError);
+    }
+  }
+#endif
+
+  return 0;
+}
+
+int subprocess_terminate(struct subprocess_s *const process) {
+#if defined(_WIN32)
+  unsigned int killed_process_exit_code;
+  int success_terminate;
+  int windows_call_result;
+
+  killed_process_exit_code = 99;
+  windows_call_result =
+      TerminateProcess(process->hProcess, killed_process_exit_code);
+  success_terminate = (windows_call_result == 0) ? 1 : 0;
+  return success_terminate;
+#else
+  return subprocess_signal(process, SIGKILL);
+#endif
+}
+
+int subprocess_terminate_ex(struct subprocess_s *const processes,
+                            unsigned count, unsigned grace_ms) {
+  int result = 0;
+  unsigned index;
+
+#if defined(_WIN32)
+  (void)grace_ms;
+
+  for (index = 0; index < count; index++) {
+    if (processes[index].alive && subprocess_terminate(&processes[index])) {
+      result = -1;
+    }
+  }
+#else
+  const unsigned long now = subprocess_monotonic_ms();
+
+  for (index = 0; index < count; index++) {
+    if ((0 == SUBPROCESS_ATOMIC_LOAD(&processes[index].child)) &&
+        !subprocess_live_group(&processes[index])) {
+      continue;
+    }
+
+    if (0 != subprocess_signal(&processes[index], (0 == grace_ms) ? SIGKILL
+                                                                   : SIGTERM)) {
+      if (ESRCH != errno) {
+        result = -1;
+      }
+      continue;
+    }
+
+    processes[index].kill_deadline_ms = now + grace_ms;
+    SUBPROCESS_ATOMIC_STORE(&processes[index].terminating, (0 != grace_ms));
+  }
+#endif
+
+  return result;
+}
+
+unsigned subprocess_terminate_poll(struct subprocess_s *const processes,
+                                   unsigned count) {
+#if defined(_WIN32)
+  (void)processes;
+  (void)count;
+  return 0;
+#else
+  unsigned pending = 0;
+  unsigned index;
+
+  for (index = 0; index < count; index++) {
+    if (subprocess_terminate_step(&processes[index])) {
+      pending++;
+    }
+  }
+
+  return pending;
+#endif
+}
+
+unsigned subprocess_read_stdout(struct subprocess_s *const process,
+                                char *const buffer, unsigned size) {
+#if defined(_WIN32)
+  void *handle;
+  unsigned long bytes_available = 0;
+  unsigned long bytes_read = 0;
+  struct subprocess_overlapped_s overlapped = {0, 0, {{0, 0}}, SUBPROCESS_NULL};
+  overlapped.hEvent = process->hEventOutput;
+
+  handle = SUBPROCESS_PTR_CAST(void *,
+                               _get_osfhandle(process->stdout_fd));
+
+  if (process->no_wait) {
+    if (!PeekNamedPipe(handle, SUBPROCESS_NULL, 0, SUBPROCESS_NULL,
+                       &bytes_available, SUBPROCESS_NULL)) {
+      return 0;
+    }
+
+    if (0 == bytes_available) {
+      return 0;
+    }
+  }
+
+  if (!ReadFile(handle, buffer, size, &bytes_read,
+                SUBPROCESS_PTR_CAST(LPOVERLAPPED, &overlapped))) {
+    const unsigned long errorIoPending = 997;
+    unsigned long error = GetLastError();
+
+    // Means we've got an async read!
+    if (error == errorIoPending) {
+      const uintptr_t statusPending = 0x00000103;
+
+      const int wait = statusPending == overlapped.Internal;
+
+      if (!GetOverlappedResult(handle,
+                               SUBPROCESS_PTR_CAST(LPOVERLAPPED, &overlapped),
+                               &bytes_read, wait)) {
+        const unsigned long errorHandleEOF = 38;
+        const unsigned long errorBrokenPipe = 109;
+        const unsigned long errorIoIncomplete = 996;
+        error = GetLastError();
+
+        if ((errorHandleEOF != error) && (errorBrokenPipe != error) &&
+            (errorIoIncomplete != error)) {
+          return 0;
+        }
+      }
+    }
+  }
+
+  return SUBPROCESS_CAST(unsigned, bytes_read);
+#else
+  const int fd = process->stdout_fd;
+  const ssize_t bytes_read = read(fd, buffer, size);
+
+#if SUBPROCESS_HAVE_METRICS
+  subprocess_metrics_read(subprocess_stream_stdout, bytes_read);
+#endif
+
+  if (bytes_read < 0) {
+    return 0;
+  }
+
+  return SUBPROCESS_CAST(unsigned, bytes_read);
+#endif
+}
+
+unsigned subprocess_read_stderr(struct subprocess_s *const process,
+                                char *const buffer, unsigned size) {
+#if defined(_WIN32)
+  void *handle;
+  unsigned long bytes_available = 0;
+  unsigned long bytes_read = 0;
+  struct subprocess_overlapped_s overlapped = {0, 0, {{0, 0}}, SUBPROCESS_NULL};
+  overlapped.hEvent = process->hEventError;
+
+  handle = SUBPROCESS_PTR_CAST(void *,
+                               _get_osfhandle(process->stderr_fd));
+
+  if (process->no_wait) {
+    if (!PeekNamedPipe(handle, SUBPROCESS_NULL, 0, SUBPROCESS_NULL,
+                       &bytes_available, SUBPROCESS_NULL)) {
+      return 0;
+    }
+
+    if (0 == bytes_available) {
+      return 0;
+    }
+  }
+
+  if (!ReadFile(handle, buffer, size, &bytes_read,
+                SUBPROCESS_PTR_CAST(LPOVERLAPPED, &overlapped))) {
+    const unsigned long errorIoPending = 997;
+    unsigned long error = GetLastError();
+
+    // Means we've got an async read!
+    if (error == errorIoPending) {
+      if (!GetOverlappedResult(handle,
+                               SUBPROCESS_PTR_CAST(LPOVERLAPPED, &overlapped),
+                               &bytes_read, 1)) {
+        const unsigned long errorIoIncomplete = 996;
+        const unsigned long errorHandleEOF = 38;
+        error = GetLastError();
+
+        if ((error != errorIoIncomplete) && (error != errorHandleEOF)) {
+          return 0;
+        }
+      }
+    }
+  }
+
+  return SUBPROCESS_CAST(unsigned, bytes_read);
+#else
+  const int fd = process->stderr_fd;
+  const ssize_t bytes_read = read(fd, buffer, size);
+
+#if SUBPROCESS_HAVE_METRICS
+  subprocess_metrics_read(subprocess_stream_stderr, bytes_read);
+#endif
+
+  if (bytes_read < 0) {
+    return 0;
+  }
+
+  return SUBPROCESS_CAST(unsigned, bytes_read);
+#endif
+}
+
+#if defined(_WIN32)
+/* Peek at a pipe so that a read from it cannot block. */
+static int subprocess_read_status_windows(int fd, int timeout_ms,
+                                          int no_wait) {
+  const unsigned long errorBrokenPipe = 109;
+  unsigned long bytes_available = 0;
+  void *const handle = SUBPROCESS_PTR_CAST(void *, _get_osfhandle(fd));
+
+  if (!PeekNamedPipe(handle, SUBPROCESS_NULL, 0, SUBPROCESS_NULL,
+                     &bytes_available, SUBPROCESS_NULL)) {
+    return (errorBrokenPipe == GetLastError()) ? subprocess_read_eof
+                                               : subprocess_read_error;
+  }
+
+  /* A read from a pipe that was opened not to wait cannot wait either. */
+  if ((0 == bytes_available) && ((0 == timeout_ms) || no_wait)) {
+    return subprocess_read_again;
+  }
+
+  return subprocess_read_data;
+}
+#else
+/* Wait up to timeout_ms for fd to be readable, then read from it once. The
+   read counts towards stream's metrics, unless stream is 0. */
+static int subprocess_read_fd_ex(int fd, int stream, char *const buffer,
+                                 unsigned size, int timeout_ms,
+                                 unsigned *const out_bytes_read) {
+  const unsigned long start = subprocess_monotonic_ms();
+
+  *out_bytes_read = 0;
+
+  if (-1 == fd) {
+    errno = EBADF;
+    return subprocess_read_error;
+  }
+
+  if (0 == size) {
+    errno = EINVAL;
+    return subprocess_read_error;
+  }
+
+  for (;;) {
+    struct pollfd poll_fd;
+    ssize_t bytes_read;
+    int ready;
+
+    poll_fd.fd = fd;
+    poll_fd.events = POLLIN;
+    poll_fd.revents = 0;
+
+    ready = poll(&poll_fd, 1, subprocess_remaining_ms(timeout_ms, start));
+
+    if (0 == ready) {
+      return subprocess_read_again;
+    }
+
+    if (ready < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+
+      return subprocess_read_error;
     }
 
-    startInfo.hStdOutput = SUBPROCESS_NULL;
-    startInfo.hStdError = SUBPROCESS_NULL;
-  }
+    /* A hang up with nothing left to read makes this return 0, the end of
+       the stream, straight away. */
+    bytes_read = read(fd, buffer, size);
 
-  out_process->alive = 1;
-  out_process->no_wait = async_no_wait;
+#if SUBPROCESS_HAVE_METRICS
+    if (0 != stream) {
+      subprocess_metrics_read(stream, bytes_read);
+    }
+#else
+    (void)stream;
+#endif
 
-  return 0;
+    if (bytes_read > 0) {
+      *out_bytes_read = SUBPROCESS_CAST(unsigned, bytes_read);
+      return subprocess_read_data;
+    }
 
-cleanup:
-  last_error = GetLastError();
+    if (0 == bytes_read) {
+      return subprocess_read_eof;
+    }
 
-  if (attribute_list_initialized) {
-    DeleteProcThreadAttributeList(attribute_list);
+    if ((EINTR != errno) && (EAGAIN != errno) && (EWOULDBLOCK != errno)) {
+      return subprocess_read_error;
+    }
   }
+}
+#endif
 
-  if (subprocess_error_unknown == result) {
-    result = subprocess_error_from_windows_error(last_error);
-  }
+int subprocess_read_stdout_ex(struct subprocess_s *const process,
+                              char *const buffer, unsigned size,
+                              int timeout_ms, unsigned *const out_bytes_read) {
+#if defined(_WIN32)
+  const int status =
+      subprocess_read_status_windows(process->stdout_fd, timeout_ms,
+                                     process->no_wait);
 
-  if (out_process->stdin_file) {
-    fclose(out_process->stdin_file);
-    out_process->stdin_file = SUBPROCESS_NULL;
-  }
+  *out_bytes_read = 0;
 
-  if (out_process->stdout_file) {
-    fclose(out_process->stdout_file);
-    if (out_process->stderr_file &&
-        (out_process->stdout_file != out_process->stderr_file)) {
-      fclose(out_process->stderr_file);
-    }
-    out_process->stdout_file = SUBPROCESS_NULL;
-    out_process->stderr_file = SUBPROCESS_NULL;
+  if (subprocess_read_data != status) {
+    return status;
   }
 
-  subprocess_close_handle(&rd);
-  subprocess_close_handle(&wr);
-  subprocess_close_handle(&startInfo.hStdInput);
+  *out_bytes_read = subprocess_read_stdout(process, buffer, size);
+  return *out_bytes_read ? subprocess_read_data : subprocess_read_eof;
+#else
+  return subprocess_read_fd_ex(process->stdout_fd, subprocess_stream_stdout,
+                               buffer, size, timeout_ms, out_bytes_read);
+#endif
+}
 
-  if (startInfo.hStdOutput == startInfo.hStdError) {
-    subprocess_close_handle(&startInfo.hStdOutput);
-    startInfo.hStdError = SUBPROCESS_NULL;
-  } else {
-    subprocess_close_handle(&startInfo.hStdOutput);
-    subprocess_close_handle(&startInfo.hStdError);
-  }
+int subprocess_read_stderr_ex(struct subprocess_s *const process,
+                              char *const buffer, unsigned size,
+                              int timeout_ms, unsigned *const out_bytes_read) {
+#if defined(_WIN32)
+  const int status =
+      subprocess_read_status_windows(process->stderr_fd, timeout_ms,
+                                     process->no_wait);
 
-  subprocess_close_handle(&out_process->hEventOutput);
-  subprocess_close_handle(&out_process->hEventError);
-  subprocess_close_handle(&processInfo.hThread);
-  subprocess_close_handle(&processInfo.hProcess);
+  *out_bytes_read = 0;
 
-  SetLastError(last_error);
+  if (subprocess_read_data != status) {
+    return status;
+  }
 
-  return result;
-#else
-  int stdinfd[2] = {-1, -1};
-  int stdoutfd[2] = {-1, -1};
-  int stderrfd[2] = {-1, -1};
-  int fd, fd_flags;
-  int async_no_wait;
-  int result = subprocess_error_unknown;
-  int saved_errno = 0;
-  pid_t child = 0;
-  extern char **environ;
-  char *const empty_environment[1] = {SUBPROCESS_NULL};
-  char *const *used_environment;
-#if SUBPROCESS_SPAWN_VIA_FORK
-  /* Pipe used to relay the child's exec() errno back to the parent. */
-  int exec_errfd[2] = {-1, -1};
+  *out_bytes_read = subprocess_read_stderr(process, buffer, size);
+  return *out_bytes_read ? subprocess_read_data : subprocess_read_eof;
 #else
-  int actions_created = 0;
-  int posix_error;
-  posix_spawn_file_actions_t actions;
+  return subprocess_read_fd_ex(process->stderr_fd, subprocess_stream_stderr,
+                               buffer, size, timeout_ms, out_bytes_read);
 #endif
+}
 
-  async_no_wait = subprocess_option_enable_async_no_wait ==
-                  (options & subprocess_option_enable_async_no_wait);
+int subprocess_wait_ready(struct subprocess_s *const process,
+                          int timeout_ms) {
+#if defined(_WIN32)
+  (void)process;
+  (void)timeout_ms;
+  return subprocess_read_error;
+#else
+  const char ready[] = "READY=1";
+  const int length = SUBPROCESS_CAST(int, sizeof(ready) - 1);
+  const unsigned long start = subprocess_monotonic_ms();
+  char buffer[256];
+  unsigned bytes_read;
+  unsigned index;
+  int matched;
+  int status;
 
-  if (async_no_wait && (subprocess_option_enable_async !=
-                        (options & subprocess_option_enable_async))) {
-    errno = EINVAL;
-    return subprocess_error_invalid_options;
+  if (process->ready) {
+    return subprocess_read_data;
   }
 
-  if (subprocess_option_inherit_environment ==
-      (options & subprocess_option_inherit_environment)) {
-    if (SUBPROCESS_NULL != environment) {
-      errno = EINVAL;
-      return subprocess_error_invalid_environment;
+  for (;;) {
+    status = subprocess_read_fd_ex(
+        process->notify_fd, 0, buffer, sizeof(buffer),
+        subprocess_remaining_ms(timeout_ms, start), &bytes_read);
+
+    /* A child may end on READY=1 without a newline. */
+    if ((subprocess_read_eof == status) &&
+        (length == process->notify_matched)) {
+      break;
     }
-  }
 
-  memset(out_process, 0, sizeof(*out_process));
+    if (subprocess_read_data != status) {
+      return status;
+    }
 
-  if (0 != subprocess_pipe_cloexec(stdinfd)) {
-    saved_errno = errno;
-    result = subprocess_error_pipe;
-    goto cleanup;
-  }
+    /* Look for a READY=1 line among whatever else the child sent, carrying
+       the match for an unfinished line over to the next read. */
+    for (index = 0; index < bytes_read; index++) {
+      matched = process->notify_matched;
 
-  if (0 != subprocess_pipe_cloexec(stdoutfd)) {
-    saved_errno = errno;
-    result = subprocess_error_pipe;
-    goto cleanup;
-  }
+      if ('\n' == buffer[index]) {
+        if (length == matched) {
+          break;
+        }
 
-  if (subprocess_option_combined_stdout_stderr !=
-      (options & subprocess_option_combined_stdout_stderr)) {
-    if (0 != subprocess_pipe_cloexec(stderrfd)) {
-      saved_errno = errno;
-      result = subprocess_error_pipe;
-      goto cleanup;
+        process->notify_matched = 0;
+      } else if ((0 <= matched) && (matched < length) &&
+                 (ready[matched] == buffer[index])) {
+        process->notify_matched = matched + 1;
+      } else {
+        process->notify_matched = -1;
+      }
+    }
+
+    if (index < bytes_read) {
+      break;
     }
   }
 
-  if (environment) {
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcast-qual"
-#pragma clang diagnostic ignored "-Wold-style-cast"
-#endif
-    used_environment = SUBPROCESS_CONST_CAST(char *const *, environment);
-#ifdef __clang__
-#pragma clang diagnostic pop
+  close(process->notify_fd);
+  process->notify_fd = -1;
+  process->ready = 1;
+  return subprocess_read_data;
 #endif
-  } else if (subprocess_option_inherit_environment ==
-             (options & subprocess_option_inherit_environment)) {
-    used_environment = environ;
-  } else {
-    used_environment = empty_environment;
-  }
+}
 
-#if SUBPROCESS_SPAWN_VIA_FORK
-  /* fork()+exec() instead of posix_spawn, so the child can chdir() first.
-     exec_errfd[1] is close-on-exec: a successful exec closes it and the parent
-     reads EOF; a failed exec writes errno through it before _exit. */
-  if (0 != pipe(exec_errfd)) {
-    saved_errno = errno;
-    result = subprocess_error_pipe;
-    goto cleanup;
+int subprocess_notify_ready(void) {
+#if defined(_WIN32)
+  return 0;
+#else
+  const char *const variable = getenv("SUBPROCESS_NOTIFY_FD");
+  const char message[] = "READY=1\n";
+  char *end;
+  long fd;
+  ssize_t written;
+
+  if (SUBPROCESS_NULL == variable) {
+    return 0;
   }
 
-  if (-1 == fcntl(exec_errfd[1], F_SETFD, FD_CLOEXEC)) {
-    saved_errno = errno;
-    result = subprocess_error_spawn;
-    goto cleanup;
+  fd = strtol(variable, &end, 10);
+  if ((variable == end) || ('\0' != *end) || (fd <= STDERR_FILENO) ||
+      (fd != SUBPROCESS_CAST(long, SUBPROCESS_CAST(int, fd)))) {
+    errno = EBADF;
+    return subprocess_error_invalid_environment;
   }
 
-  child = fork();
+  do {
+    written = write(SUBPROCESS_CAST(int, fd), message, sizeof(message) - 1);
+  } while ((-1 == written) && (EINTR == errno));
 
-  if (child < 0) {
-    saved_errno = errno;
-    result = subprocess_error_spawn;
-    goto cleanup;
+  if (-1 == written) {
+    return subprocess_error_from_errno(errno);
   }
 
-  if (0 == child) {
-    /* Child. Everything below must stay async-signal-safe: after fork() in a
-       threaded process only such functions may be called before exec. */
-    int child_errno;
+  close(SUBPROCESS_CAST(int, fd));
+  return 0;
+#endif
+}
 
-    close(exec_errfd[0]);
+/* Round a size up to the alignment of a chunk header, every member of which is
+   no bigger than an unsigned long. */
+static size_t subprocess_chunk_align(size_t size) {
+  const size_t align = sizeof(unsigned long);
 
-    if ((-1 == dup2(stdinfd[0], STDIN_FILENO)) ||
-        (-1 == dup2(stdoutfd[1], STDOUT_FILENO))) {
-      goto child_failed;
-    }
+  return (size + align - 1) & ~(align - 1);
+}
 
-    if (subprocess_option_combined_stdout_stderr ==
-        (options & subprocess_option_combined_stdout_stderr)) {
-      if (-1 == dup2(STDOUT_FILENO, STDERR_FILENO)) {
-        goto child_failed;
-      }
-    } else {
-      if (-1 == dup2(stderrfd[1], STDERR_FILENO)) {
-        goto child_failed;
-      }
-    }
+void subprocess_capture_init(struct subprocess_capture_s *const capture,
+                             void *const buffer, size_t capacity) {
+  const size_t address = SUBPROCESS_PTR_CAST(size_t, buffer);
+  size_t skip = subprocess_chunk_align(address) - address;
 
-    /* The originals are only closed once they have been duplicated, so that a
-       pipe end that already sits on 0, 1 or 2 is not closed out from under us. */
-    if (stdinfd[0] > STDERR_FILENO) {
-      close(stdinfd[0]);
-    }
-    if (stdinfd[1] > STDERR_FILENO) {
-      close(stdinfd[1]);
-    }
-    if (stdoutfd[0] > STDERR_FILENO) {
-      close(stdoutfd[0]);
+  if (skip > capacity) {
+    skip = capacity;
+  }
+
+  capture->buffer = SUBPROCESS_CAST(char *, buffer) + skip;
+  capture->capacity = capacity - skip;
+  capture->size = 0;
+  capture->count = 0;
+  capture->sequence = 0;
+  capture->ended = 0;
+}
+
+int subprocess_capture(struct subprocess_s *const process,
+                       struct subprocess_capture_s *const capture) {
+#if defined(_WIN32)
+  (void)process;
+  (void)capture;
+  return subprocess_error_not_supported;
+#else
+  const size_t header = sizeof(struct subprocess_chunk_s);
+  struct subprocess_chunk_s *chunk;
+  struct pollfd fds[2];
+  unsigned streams[2];
+  struct timespec now;
+  ssize_t bytes_read;
+  nfds_t count;
+  nfds_t index;
+  int ready;
+
+  for (;;) {
+    count = 0;
+
+    if ((-1 != process->stdout_fd) &&
+        !(capture->ended & subprocess_stream_stdout)) {
+      fds[count].fd = process->stdout_fd;
+      streams[count++] = subprocess_stream_stdout;
     }
-    if (stdoutfd[1] > STDERR_FILENO) {
-      close(stdoutfd[1]);
+
+    if ((-1 != process->stderr_fd) &&
+        (process->stderr_fd != process->stdout_fd) &&
+        !(capture->ended & subprocess_stream_stderr)) {
+      fds[count].fd = process->stderr_fd;
+      streams[count++] = subprocess_stream_stderr;
     }
-    if (stderrfd[0] > STDERR_FILENO) {
-      close(stderrfd[0]);
+
+    if (0 == count) {
+      return 0;
     }
-    if (stderrfd[1] > STDERR_FILENO) {
-      close(stderrfd[1]);
+
+    for (index = 0; index < count; index++) {
+      fds[index].events = POLLIN;
+      fds[index].revents = 0;
     }
 
-    if (process_cwd && (0 != chdir(process_cwd))) {
-      goto child_failed;
+    do {
+      ready = poll(fds, count, -1);
+    } while ((-1 == ready) && (EINTR == errno));
+
+    if (-1 == ready) {
+      return subprocess_error_from_errno(errno);
     }
 
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcast-qual"
-#pragma clang diagnostic ignored "-Wold-style-cast"
-#endif
-    if (subprocess_option_search_user_path ==
-        (options & subprocess_option_search_user_path)) {
-      execvpe(commandLine[0],
-              SUBPROCESS_CONST_CAST(char *const *, commandLine),
-              SUBPROCESS_CONST_CAST(char *const *, used_environment));
-    } else {
-      execve(commandLine[0],
-             SUBPROCESS_CONST_CAST(char *const *, commandLine),
-             SUBPROCESS_CONST_CAST(char *const *, used_environment));
+    /* One timestamp per wakeup: the kernel says nothing about the order of
+       writes to two pipes that both became readable before we woke. */
+    if (0 != clock_gettime(CLOCK_MONOTONIC, &now)) {
+      return subprocess_error_from_errno(errno);
     }
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
 
-  child_failed:
-    child_errno = errno;
-    /* Nothing useful can be done if this write fails; the parent then sees EOF
-       and reports success, exactly as posix_spawn would without exec reporting. */
-    (void)!write(exec_errfd[1], &child_errno, sizeof(child_errno));
-    /* 127 is what POSIX requires posix_spawn's child to exit with when exec
-       fails, so both implementations look the same to a caller. */
-    _exit(127);
-  }
+    for (index = 0; index < count; index++) {
+      if (0 == fds[index].revents) {
+        continue;
+      }
 
-  /* Parent. */
-  close(exec_errfd[1]);
-  exec_errfd[1] = -1;
+      if (capture->capacity < capture->size + header + 1) {
+        return 1;
+      }
 
-  {
-    int child_errno = 0;
-    ssize_t bytes_read;
+      chunk = SUBPROCESS_PTR_CAST(
+          struct subprocess_chunk_s *,
+          SUBPROCESS_PTR_CAST(void *, capture->buffer + capture->size));
 
-    do {
-      bytes_read = read(exec_errfd[0], &child_errno, sizeof(child_errno));
-    } while ((-1 == bytes_read) && (EINTR == errno));
+      do {
+        bytes_read = read(fds[index].fd, chunk + 1,
+                          capture->capacity - capture->size - header);
+      } while ((-1 == bytes_read) && (EINTR == errno));
 
-    close(exec_errfd[0]);
-    exec_errfd[0] = -1;
+#if SUBPROCESS_HAVE_METRICS
+      subprocess_metrics_read(SUBPROCESS_CAST(int, streams[index]), bytes_read);
+#endif
+
+      if (-1 == bytes_read) {
+        /* A subprocess_option_enable_async_no_wait pipe can wake us with
+           nothing to read. */
+        if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+          continue;
+        }
 
-    if (bytes_read == (ssize_t)sizeof(child_errno)) {
-      /* exec failed in the child. Reap it and surface the reason. */
-      while ((-1 == waitpid(child, SUBPROCESS_NULL, 0)) && (EINTR == errno)) {
+        return subprocess_error_from_errno(errno);
       }
-      child = 0;
-      saved_errno = child_errno;
-      result = subprocess_error_from_errno(child_errno);
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
+
+      if (0 == bytes_read) {
+        capture->ended |= streams[index];
+        continue;
       }
-      goto cleanup;
+
+      chunk->seconds = SUBPROCESS_CAST(unsigned long, now.tv_sec);
+      chunk->nanoseconds = SUBPROCESS_CAST(unsigned long, now.tv_nsec);
+      chunk->sequence = capture->sequence++;
+      chunk->stream = streams[index];
+      chunk->size = SUBPROCESS_CAST(unsigned, bytes_read);
+
+      capture->size += subprocess_chunk_align(
+          header + SUBPROCESS_CAST(size_t, bytes_read));
+      if (capture->size > capture->capacity) {
+        capture->size = capture->capacity;
+      }
+      capture->count++;
     }
   }
-#else
-  posix_error = posix_spawn_file_actions_init(&actions);
-  if (0 != posix_error) {
-    saved_errno = posix_error;
-    result = subprocess_error_from_errno(posix_error);
-    if (subprocess_error_unknown == result) {
-      result = subprocess_error_spawn;
-    }
-    goto cleanup;
+#endif
+}
+
+const struct subprocess_chunk_s *
+subprocess_capture_next(const struct subprocess_capture_s *const capture,
+                        const struct subprocess_chunk_s *const chunk) {
+  size_t offset = 0;
+
+  if (chunk) {
+    offset = SUBPROCESS_CAST(
+        size_t, SUBPROCESS_PTR_CAST(const char *, chunk) - capture->buffer);
+    offset += subprocess_chunk_align(sizeof(*chunk) + chunk->size);
   }
-  actions_created = 1;
 
-  // Set working directory
-  if (process_cwd) {
-#if SUBPROCESS_ADDCHDIR_IS_POSIX
-    posix_error = posix_spawn_file_actions_addchdir(&actions, process_cwd);
-#elif !SUBPROCESS_HAVE_CWD
-    posix_error = ENOSYS;
-#else
-#if defined(__APPLE__) && defined(__clang__)
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-#endif
-    posix_error = posix_spawn_file_actions_addchdir_np(&actions, process_cwd);
-#if defined(__APPLE__) && defined(__clang__)
-#pragma clang diagnostic pop
+  if (offset >= capture->size) {
+    return SUBPROCESS_NULL;
+  }
+
+  return SUBPROCESS_PTR_CAST(
+      const struct subprocess_chunk_s *,
+      SUBPROCESS_PTR_CAST(const void *, capture->buffer + offset));
+}
+
+int subprocess_watch_init(struct subprocess_watch_s *const watch,
+                          const struct subprocess_watch_rule_s *const rules,
+                          unsigned rule_count,
+                          void (*callback)(void *user_data, unsigned rule,
+                                           int stream),
+                          void *const user_data) {
+  const unsigned none = ~0u;
+  const unsigned char *pattern;
+  unsigned byte_classes[256];
+  unsigned *failures;
+  unsigned *queue;
+  unsigned state_count = 1;
+  unsigned head = 0;
+  unsigned tail = 0;
+  unsigned first_count = 0;
+  unsigned class_count = 0;
+  unsigned state;
+  unsigned next;
+  unsigned index;
+  unsigned rule;
+  size_t total = 1;
+  size_t length;
+
+  memset(watch, 0, sizeof(*watch));
+  watch->first_byte = -1;
+
+  if ((SUBPROCESS_NULL == rules) || (0 == rule_count)) {
+#if !defined(_WIN32)
+    errno = EINVAL;
 #endif
+    return subprocess_error_invalid_options;
+  }
+
+  for (index = 0; index < 256; index++) {
+    byte_classes[index] = none;
+  }
+
+  for (rule = 0; rule < rule_count; rule++) {
+    length = rules[rule].pattern ? strlen(rules[rule].pattern) : 0;
+    total += length;
+
+    if ((0 == length) || (0 == rules[rule].streams) || (total > 0x100000)) {
+#if !defined(_WIN32)
+      errno = EINVAL;
 #endif
-    if (0 != posix_error) {
-      saved_errno = posix_error;
-      result = subprocess_error_from_errno(posix_error);
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
+      return subprocess_error_invalid_options;
+    }
+
+    pattern = SUBPROCESS_PTR_CAST(const unsigned char *, rules[rule].pattern);
+    for (index = 0; index < length; index++) {
+      if (none == byte_classes[pattern[index]]) {
+        byte_classes[pattern[index]] = class_count++;
       }
-      goto cleanup;
     }
-  }
 
-  // Close the stdin write end
-  posix_error = posix_spawn_file_actions_addclose(&actions, stdinfd[1]);
-  if (0 != posix_error) {
-    saved_errno = posix_error;
-    result = subprocess_error_from_errno(posix_error);
-    if (subprocess_error_unknown == result) {
-      result = subprocess_error_spawn;
+    if (0 == watch->starts[pattern[0]]) {
+      watch->starts[pattern[0]] = 1;
+      watch->first_byte = pattern[0];
+      first_count++;
     }
-    goto cleanup;
   }
 
-  // Map the read end to stdin
-  posix_error =
-      posix_spawn_file_actions_adddup2(&actions, stdinfd[0], STDIN_FILENO);
-  if (0 != posix_error) {
-    saved_errno = posix_error;
-    result = subprocess_error_from_errno(posix_error);
-    if (subprocess_error_unknown == result) {
-      result = subprocess_error_spawn;
-    }
-    goto cleanup;
+  if (1 != first_count) {
+    watch->first_byte = -1;
   }
 
-  // Close the stdout read end
-  posix_error = posix_spawn_file_actions_addclose(&actions, stdoutfd[0]);
-  if (0 != posix_error) {
-    saved_errno = posix_error;
-    result = subprocess_error_from_errno(posix_error);
-    if (subprocess_error_unknown == result) {
-      result = subprocess_error_spawn;
-    }
-    goto cleanup;
+  /* Bytes that appear in no pattern share class 0, and the rest get one each,
+     which keeps the table small for the usual handful of patterns. When all
+     256 appear there are no others, and the classes start at 0. */
+  next = (class_count < 256) ? 1 : 0;
+  class_count += next;
+
+  for (index = 0; index < 256; index++) {
+    watch->classes[index] = SUBPROCESS_CAST(
+        unsigned char,
+        (none == byte_classes[index]) ? 0 : byte_classes[index] + next);
   }
 
-  // Map the write end to stdout
-  posix_error =
-      posix_spawn_file_actions_adddup2(&actions, stdoutfd[1], STDOUT_FILENO);
-  if (0 != posix_error) {
-    saved_errno = posix_error;
-    result = subprocess_error_from_errno(posix_error);
-    if (subprocess_error_unknown == result) {
-      result = subprocess_error_spawn;
-    }
-    goto cleanup;
+  watch->transitions = SUBPROCESS_PTR_CAST(
+      unsigned *, malloc(sizeof(unsigned) * (total * (class_count + 4) +
+                                             rule_count)));
+  if (SUBPROCESS_NULL == watch->transitions) {
+#if !defined(_WIN32)
+    errno = ENOMEM;
+#endif
+    return subprocess_error_no_memory;
   }
 
-  if (subprocess_option_combined_stdout_stderr ==
-      (options & subprocess_option_combined_stdout_stderr)) {
-    posix_error = posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
-                                                   STDERR_FILENO);
-    if (0 != posix_error) {
-      saved_errno = posix_error;
-      result = subprocess_error_from_errno(posix_error);
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
+  watch->outputs = watch->transitions + total * class_count;
+  watch->output_links = watch->outputs + total;
+  failures = watch->output_links + total;
+  queue = failures + total;
+  watch->next_rules = queue + total;
+  watch->class_count = class_count;
+  watch->rules = rules;
+  watch->rule_count = rule_count;
+  watch->callback = callback;
+  watch->user_data = user_data;
+
+  for (index = 0; index < total * class_count; index++) {
+    watch->transitions[index] = none;
+  }
+
+  for (index = 0; index < total; index++) {
+    watch->outputs[index] = none;
+    watch->output_links[index] = 0;
+  }
+
+  /* The trie, with the rules that end at each node chained in order. */
+  for (rule = 0; rule < rule_count; rule++) {
+    pattern = SUBPROCESS_PTR_CAST(const unsigned char *, rules[rule].pattern);
+    state = 0;
+
+    for (; 0 != *pattern; pattern++) {
+      next = watch->transitions[state * class_count + watch->classes[*pattern]];
+      if (none == next) {
+        next = state_count++;
+        watch->transitions[state * class_count + watch->classes[*pattern]] =
+            next;
       }
-      goto cleanup;
+      state = next;
     }
-  } else {
-    // Close the stderr read end
-    posix_error = posix_spawn_file_actions_addclose(&actions, stderrfd[0]);
-    if (0 != posix_error) {
-      saved_errno = posix_error;
-      result = subprocess_error_from_errno(posix_error);
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
+
+    watch->next_rules[rule] = none;
+    if (none == watch->outputs[state]) {
+      watch->outputs[state] = rule;
+    } else {
+      for (index = watch->outputs[state]; none != watch->next_rules[index];
+           index = watch->next_rules[index]) {
       }
-      goto cleanup;
+      watch->next_rules[index] = rule;
     }
-    // Map the write end to stdout
-    posix_error = posix_spawn_file_actions_adddup2(&actions, stderrfd[1],
-                                                   STDERR_FILENO);
-    if (0 != posix_error) {
-      saved_errno = posix_error;
-      result = subprocess_error_from_errno(posix_error);
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
-      }
-      goto cleanup;
+  }
+
+  /* Aho-Corasick: fill in the missing transitions breadth first from each
+     state's longest proper suffix that is also a prefix, whose row is already
+     complete, so the automaton never has to backtrack. */
+  for (index = 0; index < class_count; index++) {
+    next = watch->transitions[index];
+    if (none == next) {
+      watch->transitions[index] = 0;
+    } else {
+      failures[next] = 0;
+      queue[tail++] = next;
     }
   }
 
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wcast-qual"
-#pragma clang diagnostic ignored "-Wold-style-cast"
-#endif
-  if (subprocess_option_search_user_path ==
-      (options & subprocess_option_search_user_path)) {
-    posix_error = posix_spawnp(&child, commandLine[0], &actions,
-                               SUBPROCESS_NULL,
-                               SUBPROCESS_CONST_CAST(char *const *, commandLine),
-                               used_environment);
-    if (0 != posix_error) {
-      saved_errno = posix_error;
-      result = subprocess_error_from_errno(posix_error);
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
+  while (head < tail) {
+    state = queue[head++];
+
+    for (index = 0; index < class_count; index++) {
+      const unsigned fallback =
+          watch->transitions[failures[state] * class_count + index];
+
+      next = watch->transitions[state * class_count + index];
+      if (none == next) {
+        watch->transitions[state * class_count + index] = fallback;
+        continue;
       }
-      goto cleanup;
+
+      failures[next] = fallback;
+      watch->output_links[next] = (none != watch->outputs[fallback])
+                                      ? fallback
+                                      : watch->output_links[fallback];
+      queue[tail++] = next;
     }
-  } else {
-#if !SUBPROCESS_SPAWN_REPORTS_EXEC_ERRORS
-    /* posix_spawn cannot tell us the exec failed, so check up front */
-    if (0 != access(commandLine[0], X_OK)) {
-      saved_errno = errno;
-      result = subprocess_error_from_errno(saved_errno);
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
+  }
+
+  return 0;
+}
+
+unsigned subprocess_watch_feed(struct subprocess_watch_s *const watch,
+                               struct subprocess_s *const process, int stream,
+                               const char *const data, size_t size) {
+  const unsigned none = ~0u;
+  const unsigned char *cursor =
+      SUBPROCESS_PTR_CAST(const unsigned char *, data);
+  const unsigned char *const end = cursor + size;
+  const unsigned *const transitions = watch->transitions;
+  const unsigned class_count = watch->class_count;
+  unsigned matches = 0;
+  unsigned state;
+  unsigned match;
+  unsigned rule;
+
+  if ((subprocess_stream_stdout != stream) &&
+      (subprocess_stream_stderr != stream)) {
+    return 0;
+  }
+
+  state = watch->states[stream - 1];
+
+  while (cursor < end) {
+    /* Nothing is under way at the start state, so skip to the next byte that
+       can begin a pattern. */
+    if (0 == state) {
+      if (-1 != watch->first_byte) {
+        cursor = SUBPROCESS_PTR_CAST(
+            const unsigned char *,
+            memchr(cursor, watch->first_byte,
+                   SUBPROCESS_CAST(size_t, end - cursor)));
+        if (SUBPROCESS_NULL == cursor) {
+          break;
+        }
+      } else {
+        while ((cursor < end) && (0 == watch->starts[*cursor])) {
+          cursor++;
+        }
+
+        if (cursor == end) {
+          break;
+        }
       }
-      goto cleanup;
     }
-#endif
-    posix_error = posix_spawn(&child, commandLine[0], &actions,
-                              SUBPROCESS_NULL,
-                              SUBPROCESS_CONST_CAST(char *const *, commandLine),
-                              used_environment);
-    if (0 != posix_error) {
-      saved_errno = posix_error;
-      result = subprocess_error_from_errno(posix_error);
-      if (subprocess_error_unknown == result) {
-        result = subprocess_error_spawn;
+
+    state = transitions[state * class_count + watch->classes[*cursor++]];
+
+    if ((none == watch->outputs[state]) && (0 == watch->output_links[state])) {
+      continue;
+    }
+
+    for (match = (none != watch->outputs[state]) ? state
+                                                 : watch->output_links[state];
+         0 != match; match = watch->output_links[match]) {
+      for (rule = watch->outputs[match]; none != rule;
+           rule = watch->next_rules[rule]) {
+        if (0 == (watch->rules[rule].streams &
+                  SUBPROCESS_CAST(unsigned, stream))) {
+          continue;
+        }
+
+        matches++;
+
+        if ((subprocess_watch_terminate == watch->rules[rule].action) &&
+            process) {
+          subprocess_terminate(process);
+        }
+
+        if (watch->callback) {
+          watch->callback(watch->user_data, rule, stream);
+        }
       }
-      goto cleanup;
     }
   }
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
-#endif /* SUBPROCESS_SPAWN_VIA_FORK */
 
-  // Close the stdin read end
-  close(stdinfd[0]);
-  stdinfd[0] = -1;
-  // Store the stdin write end
-  out_process->stdin_file = fdopen(stdinfd[1], "wb");
-  if (SUBPROCESS_NULL == out_process->stdin_file) {
-    saved_errno = errno;
-    result = subprocess_error_from_errno(saved_errno);
-    goto cleanup;
+  watch->states[stream - 1] = state;
+  return matches;
+}
+
+int subprocess_watch_read(struct subprocess_watch_s *const watch,
+                          struct subprocess_s *const process, int stream,
+                          char *const buffer, unsigned size, int timeout_ms,
+                          unsigned *const out_bytes_read) {
+  const int status =
+      (subprocess_stream_stderr == stream)
+          ? subprocess_read_stderr_ex(process, buffer, size, timeout_ms,
+                                      out_bytes_read)
+          : subprocess_read_stdout_ex(process, buffer, size, timeout_ms,
+                                      out_bytes_read);
+
+  if (subprocess_read_data == status) {
+    (void)subprocess_watch_feed(watch, process, stream, buffer,
+                                *out_bytes_read);
   }
-  stdinfd[1] = -1;
 
-  // Close the stdout write end
-  close(stdoutfd[1]);
-  stdoutfd[1] = -1;
-  // Store the stdout read end
-  out_process->stdout_file = fdopen(stdoutfd[0], "rb");
-  if (SUBPROCESS_NULL == out_process->stdout_file) {
-    saved_errno = errno;
-    result = subprocess_error_from_errno(saved_errno);
-    goto cleanup;
+  return status;
+}
+
+void subprocess_watch_destroy(struct subprocess_watch_s *const watch) {
+  free(watch->transitions);
+  watch->transitions = SUBPROCESS_NULL;
+  watch->outputs = SUBPROCESS_NULL;
+  watch->output_links = SUBPROCESS_NULL;
+  watch->next_rules = SUBPROCESS_NULL;
+}
+
+#if defined(__linux__)
+/* Parse the decimal number at *cursor, skipping blanks before it, and move
+   past it. The result is divided by divisor as it is built, so a byte count
+   becomes KiB without overflowing an unsigned long on the way. */
+static unsigned long subprocess_parse_number(const char **const cursor,
+                                             const char *const end,
+                                             unsigned long divisor) {
+  unsigned long quotient = 0;
+  unsigned long remainder = 0;
+  const char *at = *cursor;
+
+  while ((at < end) && ((' ' == *at) || ('\t' == *at))) {
+    at++;
   }
-  stdoutfd[0] = -1;
 
-  // Set non blocking if we are async and asked not to wait.
-  if (async_no_wait) {
-    fd = fileno(out_process->stdout_file);
-    fd_flags = fcntl(fd, F_GETFL, 0);
-    fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
+  for (; (at < end) && ('0' <= *at) && ('9' >= *at); at++) {
+    remainder = remainder * 10 + SUBPROCESS_CAST(unsigned long, *at - '0');
+    quotient = quotient * 10 + remainder / divisor;
+    remainder %= divisor;
   }
 
-  if (subprocess_option_combined_stdout_stderr ==
-      (options & subprocess_option_combined_stdout_stderr)) {
-    out_process->stderr_file = out_process->stdout_file;
-  } else {
-    // Close the stderr write end
-    close(stderrfd[1]);
-    stderrfd[1] = -1;
-    // Store the stderr read end
-    out_process->stderr_file = fdopen(stderrfd[0], "rb");
-    if (SUBPROCESS_NULL == out_process->stderr_file) {
-      saved_errno = errno;
-      result = subprocess_error_from_errno(saved_errno);
-      goto cleanup;
-    }
-    stderrfd[0] = -1;
+  *cursor = at;
+  return quotient;
+}
 
-    // Set non blocking if we are async and asked not to wait.
-    if (async_no_wait) {
-      fd = fileno(out_process->stderr_file);
-      fd_flags = fcntl(fd, F_GETFL, 0);
-      fcntl(fd, F_SETFL, fd_flags | O_NONBLOCK);
-    }
+/* Read a whole /proc file from its start into buffer, NUL-terminated. */
+static ssize_t subprocess_read_proc(int fd, char *const buffer, size_t size) {
+  ssize_t bytes_read;
+
+  do {
+    bytes_read = pread(fd, buffer, size - 1, 0);
+  } while ((-1 == bytes_read) && (EINTR == errno));
+
+  if (0 == bytes_read) {
+    /* An empty file is what a reaped process leaves behind. */
+    errno = ESRCH;
+    return -1;
   }
 
-  // Store the child's pid
-  out_process->child = child;
-  child = 0;
+  if (0 < bytes_read) {
+    buffer[bytes_read] = '\0';
+  }
 
-  out_process->alive = 1;
-  out_process->no_wait = async_no_wait;
+  return bytes_read;
+}
 
-  result = 0;
+/* Open one of a process's /proc files, so that later samples only read. */
+static int subprocess_open_proc(pid_t child, const char *const name) {
+  char path[64];
 
-cleanup:
-  if ((0 != result) && (0 == saved_errno)) {
-    saved_errno = errno;
+  snprintf(path, sizeof(path), "/proc/%ld/%s", SUBPROCESS_CAST(long, child),
+           name);
+  return open(path, O_RDONLY | O_CLOEXEC);
+}
+#endif
+
+int subprocess_sample(struct subprocess_s *const process,
+                      struct subprocess_stats_s *const out_stats) {
+#if defined(__linux__)
+  const long ticks_per_second = sysconf(_SC_CLK_TCK);
+  const long page_size = sysconf(_SC_PAGESIZE);
+  unsigned long hz;
+  unsigned long ticks;
+  unsigned field;
+  char buffer[1024];
+  const char *cursor;
+  const char *end;
+  ssize_t bytes_read;
+  pid_t child;
+
+  memset(out_stats, 0, sizeof(*out_stats));
+
+  child = SUBPROCESS_ATOMIC_LOAD(&process->child);
+  if (0 == child) {
+    errno = ESRCH;
+    return subprocess_error_from_errno(errno);
   }
 
-  if ((subprocess_error_unknown == result) && (0 != saved_errno)) {
-    result = subprocess_error_from_errno(saved_errno);
+  if ((-1 == process->stat_fd) &&
+      (-1 == (process->stat_fd = subprocess_open_proc(child, "stat")))) {
+    return subprocess_error_from_errno(errno);
   }
 
-#if SUBPROCESS_SPAWN_VIA_FORK
-  if (-1 != exec_errfd[0]) {
-    close(exec_errfd[0]);
-    exec_errfd[0] = -1;
+  bytes_read = subprocess_read_proc(process->stat_fd, buffer, sizeof(buffer));
+  if (-1 == bytes_read) {
+    return subprocess_error_from_errno(errno);
   }
 
-  if (-1 != exec_errfd[1]) {
-    close(exec_errfd[1]);
-    exec_errfd[1] = -1;
+  /* The command name in parentheses may hold anything, spaces and ')'
+     included, so the fields start after the last ')'. It is field 2. */
+  end = buffer + bytes_read;
+  for (cursor = end; (cursor > buffer) && (')' != cursor[-1]); cursor--) {
   }
-#else
-  if (actions_created) {
-    posix_spawn_file_actions_destroy(&actions);
+
+  if (cursor == buffer) {
+    errno = EPROTO;
+    return subprocess_error_from_errno(errno);
   }
-#endif
 
-  if (0 != result) {
-    if (child) {
-      kill(child, 9);
-      waitpid(child, SUBPROCESS_NULL, 0);
-    }
+  hz = (0 < ticks_per_second) ? SUBPROCESS_CAST(unsigned long, ticks_per_second)
+                              : 100;
 
-    if (out_process->stdin_file) {
-      fclose(out_process->stdin_file);
-      out_process->stdin_file = SUBPROCESS_NULL;
+  /* Field 3 is the one-letter state, skipped like any other field. */
+  for (field = 3; (cursor < end) && (field <= 24); field++) {
+    while ((cursor < end) && (' ' == *cursor)) {
+      cursor++;
     }
 
-    if (out_process->stdout_file) {
-      fclose(out_process->stdout_file);
-      if (out_process->stderr_file &&
-          (out_process->stdout_file != out_process->stderr_file)) {
-        fclose(out_process->stderr_file);
+    switch (field) {
+    case 14:
+    case 15:
+      ticks = subprocess_parse_number(&cursor, end, 1);
+      ticks = (ticks / hz) * 1000 + ((ticks % hz) * 1000) / hz;
+      if (14 == field) {
+        out_stats->user_ms = ticks;
+      } else {
+        out_stats->system_ms = ticks;
       }
-      out_process->stdout_file = SUBPROCESS_NULL;
-      out_process->stderr_file = SUBPROCESS_NULL;
+      break;
+    case 20:
+      out_stats->threads =
+          SUBPROCESS_CAST(unsigned, subprocess_parse_number(&cursor, end, 1));
+      break;
+    case 24:
+      out_stats->rss_kb = subprocess_parse_number(&cursor, end, 1) *
+                          SUBPROCESS_CAST(unsigned long, page_size / 1024);
+      break;
+    default:
+      break;
     }
-  }
 
-  if (-1 != stdinfd[0]) {
-    close(stdinfd[0]);
-  }
-  if (-1 != stdinfd[1]) {
-    close(stdinfd[1]);
+    while ((cursor < end) && (' ' != *cursor)) {
+      cursor++;
+    }
   }
-  if (-1 != stdoutfd[0]) {
-    close(stdoutfd[0]);
+
+  /* Without task I/O accounting, or for a child the parent may not trace
+     such as a set-user-id one, the io file cannot be opened or read, and the
+     I/O fields are left at 0. */
+  if (-1 == process->io_fd) {
+    process->io_fd = subprocess_open_proc(child, "io");
   }
-  if (-1 != stdoutfd[1]) {
-    close(stdoutfd[1]);
+
+  bytes_read = (-1 == process->io_fd)
+                   ? -1
+                   : subprocess_read_proc(process->io_fd, buffer,
+                                          sizeof(buffer));
+  if (-1 == bytes_read) {
+    return 0;
   }
-  if (-1 != stderrfd[0]) {
-    close(stderrfd[0]);
+
+  /* One "name: value" line each, in a fixed order that is not relied on. */
+  end = buffer + bytes_read;
+  for (cursor = buffer; cursor < end; cursor++) {
+    unsigned long *value = SUBPROCESS_NULL;
+    const char *const line = cursor;
+
+    while ((cursor < end) && (':' != *cursor)) {
+      cursor++;
+    }
+
+    if ((5 == cursor - line) && (0 == memcmp(line, "rchar", 5))) {
+      value = &out_stats->read_kb;
+    } else if ((5 == cursor - line) && (0 == memcmp(line, "wchar", 5))) {
+      value = &out_stats->write_kb;
+    } else if ((10 == cursor - line) && (0 == memcmp(line, "read_bytes", 10))) {
+      value = &out_stats->storage_read_kb;
+    } else if ((11 == cursor - line) &&
+               (0 == memcmp(line, "write_bytes", 11))) {
+      value = &out_stats->storage_write_kb;
+    }
+
+    if (cursor < end) {
+      cursor++;
+    }
+
+    if (value) {
+      *value = subprocess_parse_number(&cursor, end, 1024);
+    }
+
+    while ((cursor < end) && ('\n' != *cursor)) {
+      cursor++;
+    }
   }
-  if (-1 != stderrfd[1]) {
-    close(stderrfd[1]);
+
+  return 0;
+#else
+  (void)process;
+  memset(out_stats, 0, sizeof(*out_stats));
+#if !defined(_WIN32)
+  errno = ENOSYS;
+#endif
+  return subprocess_error_not_supported;
+#endif
+}
+
+unsigned subprocess_sample_group(struct subprocess_s *const processes,
+                                 unsigned count,
+                                 struct subprocess_stats_s *const out_stats) {
+  unsigned sampled = 0;
+  unsigned index;
+
+  for (index = 0; index < count; index++) {
+    if (0 == subprocess_sample(&processes[index], &out_stats[index])) {
+      sampled++;
+    } else {
+      memset(&out_stats[index], 0, sizeof(out_stats[index]));
+    }
   }
 
-  if ((0 != result) && (0 != saved_errno)) {
-    errno = saved_errno;
+  return sampled;
+}
+
+#if SUBPROCESS_HAVE_METRICS
+/* Text written so far, counting what did not fit so the caller can be told the
+   size needed. */
+struct subprocess_metrics_writer_s {
+  char *buffer;
+  size_t size;
+  size_t length;
+};
+
+static void
+subprocess_metrics_text(struct subprocess_metrics_writer_s *const writer,
+                        const char *text) {
+  for (; '\0' != *text; text++, writer->length++) {
+    if (writer->length < writer->size) {
+      writer->buffer[writer->length] = *text;
+    }
   }
-
-  return result;
-#endif
 }
 
-FILE *subprocess_stdin(const struct subprocess_s *const process) {
-  return process->stdin_file;
+static void
+subprocess_metrics_number(struct subprocess_metrics_writer_s *const writer,
+                          unsigned long value, unsigned min_digits) {
+  char digits[24];
+  unsigned count = sizeof(digits) - 1;
+
+  digits[count] = '\0';
+  do {
+    digits[--count] = SUBPROCESS_CAST(char, '0' + (value % 10ul));
+    value /= 10ul;
+  } while ((0ul != value) || (sizeof(digits) - 1 - count < min_digits));
+
+  subprocess_metrics_text(writer, digits + count);
 }
 
-FILE *subprocess_stdout(const struct subprocess_s *const process) {
-  return process->stdout_file;
+static void
+subprocess_metrics_seconds(struct subprocess_metrics_writer_s *const writer,
+                           unsigned long us) {
+  subprocess_metrics_number(writer, us / 1000000ul, 1);
+  subprocess_metrics_text(writer, ".");
+  subprocess_metrics_number(writer, us % 1000000ul, 6);
 }
 
-FILE *subprocess_stderr(const struct subprocess_s *const process) {
-  if (process->stdout_file != process->stderr_file) {
-    return process->stderr_file;
-  } else {
-    return SUBPROCESS_NULL;
+/* One sample: name, an optional label, and a value. */
+static void
+subprocess_metrics_sample(struct subprocess_metrics_writer_s *const writer,
+                          const char *const name, const char *const label,
+                          const char *const label_value, unsigned long value) {
+  subprocess_metrics_text(writer, name);
+  if (label) {
+    subprocess_metrics_text(writer, "{");
+    subprocess_metrics_text(writer, label);
+    subprocess_metrics_text(writer, "=\"");
+    subprocess_metrics_text(writer, label_value);
+    subprocess_metrics_text(writer, "\"}");
   }
+  subprocess_metrics_text(writer, " ");
+  subprocess_metrics_number(writer, value, 1);
+  subprocess_metrics_text(writer, "\n");
 }
+#endif
 
-int subprocess_join(struct subprocess_s *const process,
-                    int *const out_return_code) {
-#if defined(_WIN32)
-  const unsigned long infinite = 0xFFFFFFFF;
+int subprocess_metrics_write(char *const buffer, size_t size,
+                             size_t *const out_length) {
+#if SUBPROCESS_HAVE_METRICS
+  /* Indexed like subprocess_metrics_s::spawn_failures. */
+  static const char *const errors[10] = {
+      "success", "unknown", "invalid_options", "invalid_environment",
+      "not_found", "permission_denied", "no_memory", "pipe", "spawn",
+      "not_supported"};
+  static const char *const streams[2] = {"stdout", "stderr"};
+  struct subprocess_metrics_s *const metrics = subprocess_metrics();
+  struct subprocess_metrics_writer_s writer;
+  unsigned long cumulative = 0;
+  long live;
+  unsigned index;
+
+  writer.buffer = buffer;
+  writer.size = size;
+  writer.length = 0;
+
+  subprocess_metrics_text(&writer, "# TYPE subprocess_spawns counter\n"
+                                   "# HELP subprocess_spawns Processes "
+                                   "created.\n");
+  subprocess_metrics_sample(&writer, "subprocess_spawns_total", SUBPROCESS_NULL,
+                            SUBPROCESS_NULL,
+                            SUBPROCESS_ATOMIC_LOAD(&metrics->spawns));
+
+  subprocess_metrics_text(&writer,
+                          "# TYPE subprocess_spawn_failures counter\n"
+                          "# HELP subprocess_spawn_failures Processes that "
+                          "could not be created, by subprocess_error_e.\n");
+  for (index = 1; index < 10; index++) {
+    subprocess_metrics_sample(
+        &writer, "subprocess_spawn_failures_total", "error", errors[index],
+        SUBPROCESS_ATOMIC_LOAD(&metrics->spawn_failures[index]));
+  }
 
-  if (process->stdin_file) {
-    fclose(process->stdin_file);
-    process->stdin_file = SUBPROCESS_NULL;
+  /* A join can be counted before the spawn it pairs with is. */
+  live = SUBPROCESS_ATOMIC_LOAD(&metrics->live_children);
+  subprocess_metrics_text(&writer,
+                          "# TYPE subprocess_live_children gauge\n"
+                          "# HELP subprocess_live_children Processes created "
+                          "and not yet reaped.\n");
+  subprocess_metrics_sample(&writer, "subprocess_live_children",
+                            SUBPROCESS_NULL, SUBPROCESS_NULL,
+                            (live < 0) ? 0ul
+                                       : SUBPROCESS_CAST(unsigned long, live));
+
+  subprocess_metrics_text(&writer, "# TYPE subprocess_read_bytes counter\n"
+                                   "# HELP subprocess_read_bytes Bytes read "
+                                   "from processes, by stream.\n");
+  for (index = 0; index < 2; index++) {
+    subprocess_metrics_sample(
+        &writer, "subprocess_read_bytes_total", "stream", streams[index],
+        SUBPROCESS_ATOMIC_LOAD(&metrics->read_bytes[index]));
   }
 
-  if (process->hStdInput) {
-    CloseHandle(process->hStdInput);
-    process->hStdInput = SUBPROCESS_NULL;
+  subprocess_metrics_text(&writer, "# TYPE subprocess_reads counter\n"
+                                   "# HELP subprocess_reads Read calls made on "
+                                   "process output, by stream.\n");
+  for (index = 0; index < 2; index++) {
+    subprocess_metrics_sample(&writer, "subprocess_reads_total", "stream",
+                              streams[index],
+                              SUBPROCESS_ATOMIC_LOAD(&metrics->reads[index]));
   }
 
-  WaitForSingleObject(process->hProcess, infinite);
+  subprocess_metrics_text(&writer,
+                          "# TYPE subprocess_join_seconds histogram\n"
+                          "# HELP subprocess_join_seconds How long "
+                          "subprocess_join took.\n");
+  for (index = 0; index < SUBPROCESS_METRICS_BUCKETS; index++) {
+    cumulative += SUBPROCESS_ATOMIC_LOAD(&metrics->join_buckets[index]);
+    subprocess_metrics_text(&writer, "subprocess_join_seconds_bucket{le=\"");
+    subprocess_metrics_seconds(&writer,
+                               subprocess_metrics_bucket_limit(index));
+    subprocess_metrics_text(&writer, "\"} ");
+    subprocess_metrics_number(&writer, cumulative, 1);
+    subprocess_metrics_text(&writer, "\n");
+  }
 
-  if (out_return_code) {
-    if (!GetExitCodeProcess(
-            process->hProcess,
-            SUBPROCESS_PTR_CAST(unsigned long *, out_return_code))) {
-      return -1;
-    }
+  /* The buckets are what was read, so +Inf and the count agree with them even
+     while joins are being recorded. */
+  subprocess_metrics_sample(&writer, "subprocess_join_seconds_bucket", "le",
+                            "+Inf", cumulative);
+  subprocess_metrics_sample(&writer, "subprocess_join_seconds_count",
+                            SUBPROCESS_NULL, SUBPROCESS_NULL, cumulative);
+  subprocess_metrics_text(&writer, "subprocess_join_seconds_sum ");
+  subprocess_metrics_seconds(&writer,
+                             SUBPROCESS_ATOMIC_LOAD(&metrics->join_sum_us));
+  subprocess_metrics_text(&writer, "\n# EOF\n");
+
+  if (out_length) {
+    *out_length = writer.length;
   }
 
-  process->alive = 0;
+  if (writer.length >= size) {
+    if (0 != size) {
+      buffer[size - 1] = '\0';
+    }
+    return subprocess_error_no_memory;
+  }
 
+  buffer[writer.length] = '\0';
   return 0;
 #else
-  int status;
-
-  if (process->stdin_file) {
-    fclose(process->stdin_file);
-    process->stdin_file = SUBPROCESS_NULL;
+  (void)buffer;
+  (void)size;
+  if (out_length) {
+    *out_length = 0;
   }
+  return subprocess_error_not_supported;
+#endif
+}
 
-  if (process->child) {
-    if (process->child != waitpid(process->child, &status, 0)) {
-      return -1;
-    }
+int subprocess_alive(struct subprocess_s *const process) {
+#if defined(_WIN32)
+  int is_alive = SUBPROCESS_CAST(int, process->alive);
 
-    process->child = 0;
+  if (!is_alive) {
+    return 0;
+  }
 
-    if (WIFEXITED(status)) {
-      process->return_status = WEXITSTATUS(status);
-    } else {
-      process->return_status = EXIT_FAILURE;
-    }
+  {
+    const unsigned long zero = 0x0;
+    const unsigned long wait_object_0 = 0x00000000L;
 
-    process->alive = 0;
+    is_alive = wait_object_0 != WaitForSingleObject(process->hProcess, zero);
   }
 
-  if (out_return_code) {
-    *out_return_code = process->return_status;
+  if (!is_alive) {
+    process->alive = 0;
   }
 
-  return 0;
-#endif
-}
+  return is_alive;
+#else
+  int is_alive;
 
-int subprocess_destroy(struct subprocess_s *const process) {
-  if (process->stdin_file) {
-    fclose(process->stdin_file);
-    process->stdin_file = SUBPROCESS_NULL;
+  if (!SUBPROCESS_ATOMIC_LOAD(&process->alive)) {
+    return 0;
   }
 
-  if (process->stdout_file) {
-    fclose(process->stdout_file);
+#if SUBPROCESS_HAVE_REAPER
+  if (process->reaper) {
+    struct pollfd exited;
+
+    /* The reaper owns waiting for the process, so just ask its pidfd, and
+       collect the process if it has finished. Until whichever thread collects
+       it has recorded its status, it is reported as still alive. */
+    if (!SUBPROCESS_ATOMIC_LOAD(&process->collected)) {
+      exited.fd = process->pidfd;
+      exited.events = POLLIN;
+      exited.revents = 0;
 
-    if (process->stdout_file != process->stderr_file) {
-      fclose(process->stderr_file);
+      if ((1 == poll(&exited, 1, 0)) &&
+          (-1 == subprocess_reaper_poll(process->reaper, 0))) {
+        return -1;
+      }
     }
 
-    process->stdout_file = SUBPROCESS_NULL;
-    process->stderr_file = SUBPROCESS_NULL;
+    is_alive = !SUBPROCESS_ATOMIC_LOAD(&process->collected);
+  } else
+#endif
+  {
+    is_alive = subprocess_reap(process, 0);
   }
 
-#if defined(_WIN32)
-  if (process->hProcess) {
-    CloseHandle(process->hProcess);
-    process->hProcess = SUBPROCESS_NULL;
+  return is_alive;
+#endif
+}
 
-    if (process->hStdInput) {
-      CloseHandle(process->hStdInput);
-    }
+#if defined(__clang__)
+#if __has_warning("-Wunsafe-buffer-usage")
+#pragma clang diagnostic pop
+#endif
+#endif
 
-    if (process->hEventOutput) {
-      CloseHandle(process->hEventOutput);
-    }
+#if defined(__cplusplus)
+} // extern "C"
+#endif
 
-    if (process->hEventError) {
-      CloseHandle(process->hEventError);
-    }
-  }
+#if defined(__cplusplus)
+#if (__cplusplus >= 202002L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 202002L))
+#include <span>
 #endif
 
-  return 0;
-}
+namespace subprocess {
+// Only complete when the condition holds, so that sizeof rejects a false one
+// at compile time; static_assert is not available before C++11.
+template <bool Condition> struct options_check;
+template <> struct options_check<true> {};
 
-int subprocess_terminate(struct subprocess_s *const process) {
+// Rejects, at compile time, option sets that subprocess_create_ex would only
+// reject at run time.
+template <int Options> struct options_valid {
+  enum {
+    known = (0 == (Options & ~(subprocess_option_combined_stdout_stderr |
+                               subprocess_option_inherit_environment |
+                               subprocess_option_enable_async |
+                               subprocess_option_no_window |
+                               subprocess_option_search_user_path |
+                               subprocess_option_enable_async_no_wait |
+                               subprocess_option_new_process_group |
+                               subprocess_option_new_session |
+                               subprocess_option_die_with_parent |
+                               subprocess_option_notify_ready))),
+    async = (0 == (Options & subprocess_option_enable_async_no_wait)) ||
+            (0 != (Options & subprocess_option_enable_async)),
 #if defined(_WIN32)
-  unsigned int killed_process_exit_code;
-  int success_terminate;
-  int windows_call_result;
-
-  killed_process_exit_code = 99;
-  windows_call_result =
-      TerminateProcess(process->hProcess, killed_process_exit_code);
-  success_terminate = (windows_call_result == 0) ? 1 : 0;
-  return success_terminate;
+    platform = (0 == (Options & (subprocess_option_new_session |
+                                 subprocess_option_die_with_parent |
+                                 subprocess_option_notify_ready))),
+#elif !defined(__linux__)
+    platform = (0 == (Options & subprocess_option_die_with_parent)),
 #else
-  int result;
-  result = kill(process->child, 9);
-  return result;
+    platform = 1,
 #endif
+    value = known && async && platform
+  };
+};
+
+/// @brief Create a process with options fixed at compile time.
+/// @tparam Options A bit field of subprocess_option_e's.
+/// @param command_line As for subprocess_create_ex.
+/// @param environment As for subprocess_create_ex.
+/// @param process_cwd As for subprocess_create_ex.
+/// @param attr As for subprocess_create_attr.
+/// @param out_process The newly created process.
+/// @return As for subprocess_create_attr.
+///
+/// Option sets that can never work, such as
+/// subprocess_option_enable_async_no_wait without
+/// subprocess_option_enable_async, or options the platform lacks, fail to
+/// compile. This only validates the options; the process is created by
+/// subprocess_create_attr like any other. An environment together with
+/// subprocess_option_inherit_environment is still rejected at run time.
+template <int Options>
+int spawn(const char *const command_line[], const char *const environment[],
+          const char *const process_cwd,
+          const struct subprocess_attr_s *const attr,
+          struct subprocess_s *const out_process) {
+  (void)sizeof(options_check<(options_valid<Options>::value != 0)>);
+
+  return subprocess_create_attr(command_line, Options, environment,
+                                process_cwd, attr, out_process);
 }
 
-unsigned subprocess_read_stdout(struct subprocess_s *const process,
-                                char *const buffer, unsigned size) {
-#if defined(_WIN32)
-  void *handle;
-  unsigned long bytes_available = 0;
-  unsigned long bytes_read = 0;
-  struct subprocess_overlapped_s overlapped = {0, 0, {{0, 0}}, SUBPROCESS_NULL};
-  overlapped.hEvent = process->hEventOutput;
+/// @brief Create a process with options fixed at compile time, in the
+/// parent's working directory, with the default attributes and either no
+/// environment or, with subprocess_option_inherit_environment, the parent's.
+/// @tparam Options A bit field of subprocess_option_e's.
+/// @param command_line As for subprocess_create.
+/// @param out_process The newly created process.
+/// @return As for subprocess_create.
+template <int Options>
+int spawn(const char *const command_line[],
+          struct subprocess_s *const out_process) {
+  (void)sizeof(options_check<(options_valid<Options>::value != 0)>);
+
+  return subprocess_create_attr(command_line, Options, SUBPROCESS_NULL,
+                                SUBPROCESS_NULL, SUBPROCESS_NULL, out_process);
+}
 
-  handle = SUBPROCESS_PTR_CAST(void *,
-                               _get_osfhandle(_fileno(process->stdout_file)));
+// Owns a subprocess_s, and destroys it when it goes out of scope. Errors are
+// returned as subprocess_error_e values, as from the C functions, and nothing
+// here throws or allocates unless read_all has to grow its buffer.
+class process {
+public:
+  process() : process_(), created_(false) {}
 
-  if (process->no_wait) {
-    if (!PeekNamedPipe(handle, SUBPROCESS_NULL, 0, SUBPROCESS_NULL,
-                       &bytes_available, SUBPROCESS_NULL)) {
-      return 0;
-    }
+  ~process() { (void)destroy(); }
 
-    if (0 == bytes_available) {
-      return 0;
+#if (__cplusplus >= 201103L) || (defined(_MSVC_LANG) && (_MSVC_LANG >= 201103L))
+  process(const process &) = delete;
+  process &operator=(const process &) = delete;
+
+  // The process moves with its pipes; the moved from process is left empty.
+  // A process that has been added to a reaper must not be moved.
+  process(process &&other) noexcept
+      : process_(other.process_), created_(other.created_) {
+    other.created_ = false;
+  }
+
+  process &operator=(process &&other) noexcept {
+    if (this != &other) {
+      (void)destroy();
+      process_ = other.process_;
+      created_ = other.created_;
+      other.created_ = false;
     }
+
+    return *this;
   }
+#endif
 
-  if (!ReadFile(handle, buffer, size, &bytes_read,
-                SUBPROCESS_PTR_CAST(LPOVERLAPPED, &overlapped))) {
-    const unsigned long errorIoPending = 997;
-    unsigned long error = GetLastError();
+  /// @brief Create the process, destroying any this held before.
+  /// @return As for subprocess_create_attr.
+  int create(const char *const command_line[], int options,
+             const char *const environment[] = SUBPROCESS_NULL,
+             const char *const process_cwd = SUBPROCESS_NULL,
+             const struct subprocess_attr_s *const attr = SUBPROCESS_NULL) {
+    int result;
+
+    (void)destroy();
+    result = subprocess_create_attr(command_line, options, environment,
+                                    process_cwd, attr, &process_);
+    created_ = (0 == result);
+    return result;
+  }
 
-    // Means we've got an async read!
-    if (error == errorIoPending) {
-      const uintptr_t statusPending = 0x00000103;
+  /// @brief Create the process with options fixed at compile time, as for
+  /// subprocess::spawn, destroying any this held before.
+  /// @return As for subprocess_create.
+  template <int Options> int spawn(const char *const command_line[]) {
+    int result;
 
-      const int wait = statusPending == overlapped.Internal;
+    (void)destroy();
+    result = subprocess::spawn<Options>(command_line, &process_);
+    created_ = (0 == result);
+    return result;
+  }
 
-      if (!GetOverlappedResult(handle,
-                               SUBPROCESS_PTR_CAST(LPOVERLAPPED, &overlapped),
-                               &bytes_read, wait)) {
-        const unsigned long errorHandleEOF = 38;
-        const unsigned long errorBrokenPipe = 109;
-        const unsigned long errorIoIncomplete = 996;
-        error = GetLastError();
+  /// @brief Whether this holds a process.
+  bool valid() const { return created_; }
 
-        if ((errorHandleEOF != error) && (errorBrokenPipe != error) &&
-            (errorIoIncomplete != error)) {
-          return 0;
-        }
-      }
+  /// @brief The process, for the C functions. Only valid while valid() is.
+  struct subprocess_s *get() { return &process_; }
+  const struct subprocess_s *get() const { return &process_; }
+
+  /// @brief Wait for the process, as for subprocess_join.
+  int join(int *const out_return_code = SUBPROCESS_NULL) {
+    if (!created_) {
+      return subprocess_error_invalid_options;
     }
+
+    return subprocess_join(&process_, out_return_code);
   }
 
-  return SUBPROCESS_CAST(unsigned, bytes_read);
-#else
-  const int fd = fileno(process->stdout_file);
-  const ssize_t bytes_read = read(fd, buffer, size);
+  /// @brief Kill the process, as for subprocess_terminate.
+  int terminate() {
+    if (!created_) {
+      return subprocess_error_invalid_options;
+    }
 
-  if (bytes_read < 0) {
-    return 0;
+    return subprocess_terminate(&process_);
   }
 
-  return SUBPROCESS_CAST(unsigned, bytes_read);
-#endif
-}
+  /// @brief Whether the process is still running, as for subprocess_alive.
+  int alive() { return created_ ? subprocess_alive(&process_) : 0; }
 
-unsigned subprocess_read_stderr(struct subprocess_s *const process,
-                                char *const buffer, unsigned size) {
-#if defined(_WIN32)
-  void *handle;
-  unsigned long bytes_available = 0;
-  unsigned long bytes_read = 0;
-  struct subprocess_overlapped_s overlapped = {0, 0, {{0, 0}}, SUBPROCESS_NULL};
-  overlapped.hEvent = process->hEventError;
+  /// @brief Wait until the process says it is ready, as for
+  /// subprocess_wait_ready.
+  int wait_ready(int timeout_ms) {
+    if (!created_) {
+      return subprocess_error_invalid_options;
+    }
 
-  handle = SUBPROCESS_PTR_CAST(void *,
-                               _get_osfhandle(_fileno(process->stderr_file)));
+    return subprocess_wait_ready(&process_, timeout_ms);
+  }
 
-  if (process->no_wait) {
-    if (!PeekNamedPipe(handle, SUBPROCESS_NULL, 0, SUBPROCESS_NULL,
-                       &bytes_available, SUBPROCESS_NULL)) {
+  /// @brief Destroy the process now rather than on scope exit, as for
+  /// subprocess_destroy. Does nothing if this holds no process.
+  int destroy() {
+    if (!created_) {
       return 0;
     }
 
-    if (0 == bytes_available) {
-      return 0;
-    }
+    created_ = false;
+    return subprocess_destroy(&process_);
   }
 
-  if (!ReadFile(handle, buffer, size, &bytes_read,
-                SUBPROCESS_PTR_CAST(LPOVERLAPPED, &overlapped))) {
-    const unsigned long errorIoPending = 997;
-    unsigned long error = GetLastError();
-
-    // Means we've got an async read!
-    if (error == errorIoPending) {
-      if (!GetOverlappedResult(handle,
-                               SUBPROCESS_PTR_CAST(LPOVERLAPPED, &overlapped),
-                               &bytes_read, 1)) {
-        const unsigned long errorIoIncomplete = 996;
-        const unsigned long errorHandleEOF = 38;
-        error = GetLastError();
-
-        if ((error != errorIoIncomplete) && (error != errorHandleEOF)) {
-          return 0;
-        }
-      }
+  /// @brief Read from one of the process's output streams, as for
+  /// subprocess_read_stdout and subprocess_read_stderr.
+  /// @return The number of bytes read, or 0 at the end of the stream.
+  unsigned read(enum subprocess_stream_e stream, char *const buffer,
+                unsigned size) {
+    if (!created_) {
+      return 0;
     }
-  }
-
-  return SUBPROCESS_CAST(unsigned, bytes_read);
-#else
-  const int fd = fileno(process->stderr_file);
-  const ssize_t bytes_read = read(fd, buffer, size);
 
-  if (bytes_read < 0) {
-    return 0;
+    return (subprocess_stream_stderr == stream)
+               ? subprocess_read_stderr(&process_, buffer, size)
+               : subprocess_read_stdout(&process_, buffer, size);
   }
 
-  return SUBPROCESS_CAST(unsigned, bytes_read);
-#endif
-}
-
-int subprocess_alive(struct subprocess_s *const process) {
-  int is_alive = SUBPROCESS_CAST(int, process->alive);
+  /// @brief Read from one of the process's output streams, waiting at most a
+  /// timeout for data, as for subprocess_read_stdout_ex and
+  /// subprocess_read_stderr_ex.
+  /// @return A subprocess_read_status_e.
+  int read(enum subprocess_stream_e stream, char *const buffer, unsigned size,
+           int timeout_ms, unsigned *const out_bytes_read) {
+    if (!created_) {
+      *out_bytes_read = 0;
+      return subprocess_read_eof;
+    }
 
-  if (!is_alive) {
-    return 0;
+    return (subprocess_stream_stderr == stream)
+               ? subprocess_read_stderr_ex(&process_, buffer, size, timeout_ms,
+                                           out_bytes_read)
+               : subprocess_read_stdout_ex(&process_, buffer, size, timeout_ms,
+                                           out_bytes_read);
   }
-#if defined(_WIN32)
-  {
-    const unsigned long zero = 0x0;
-    const unsigned long wait_object_0 = 0x00000000L;
 
-    is_alive = wait_object_0 != WaitForSingleObject(process->hProcess, zero);
+#if defined(__cpp_lib_span)
+  /// @brief Read from one of the process's output streams into a span.
+  /// @return The number of bytes read, or 0 at the end of the stream.
+  unsigned read(enum subprocess_stream_e stream, std::span<char> buffer) {
+    // Reads are capped well below the largest unsigned, which keeps the
+    // comparison meaningful where size_t is no wider than unsigned.
+    return read(stream, buffer.data(),
+                (buffer.size() > 0x40000000u)
+                    ? 0x40000000u
+                    : static_cast<unsigned>(buffer.size()));
   }
-#else
-  {
-    int status;
-    is_alive = 0 == waitpid(process->child, &status, WNOHANG);
+#endif
 
-    // If the process was successfully waited on we need to cleanup now.
-    if (!is_alive) {
-      if (WIFEXITED(status)) {
-        process->return_status = WEXITSTATUS(status);
-      } else {
-        process->return_status = EXIT_FAILURE;
+  /// @brief Append everything left on one of the process's output streams to
+  /// a buffer.
+  /// @param stream The stream to read.
+  /// @param out A contiguous container of char with size, capacity and
+  /// resize, such as std::vector<char, Allocator> or std::pmr::string.
+  /// @return On success zero is returned, subprocess_error_no_memory if the
+  /// buffer could not grow, or subprocess_error_unknown if a read failed. What
+  /// was read up to then stays in out.
+  ///
+  /// Each read goes into a small buffer on the stack and only the bytes read
+  /// are appended to out. Reserve enough beforehand, or use an allocator over
+  /// memory of your own, and this never allocates. This waits for the end of the stream whichever options the
+  /// process was created with, except on Windows with
+  /// subprocess_option_enable_async_no_wait, where it stops as soon as no more
+  /// data is available.
+  template <class Buffer>
+  int read_all(enum subprocess_stream_e stream, Buffer &out) {
+    char chunk[4096];
+
+    for (;;) {
+      unsigned bytes_read;
+      const int status =
+          read(stream, chunk, sizeof(chunk), -1, &bytes_read);
+
+      if ((0 != bytes_read) && !append(out, chunk, bytes_read)) {
+        return subprocess_error_no_memory;
       }
 
-      // Since we've already successfully waited on the process, we need to wipe
-      // the child now.
-      process->child = 0;
+      if (subprocess_read_error == status) {
+        return subprocess_error_unknown;
+      }
 
-      if (subprocess_join(process, SUBPROCESS_NULL)) {
-        return -1;
+      if (subprocess_read_data != status) {
+        return 0;
       }
     }
   }
-#endif
-
-  if (!is_alive) {
-    process->alive = 0;
-  }
-
-  return is_alive;
-}
 
-#if defined(__clang__)
-#if __has_warning("-Wunsafe-buffer-usage")
-#pragma clang diagnostic pop
+private:
+#if !((__cplusplus >= 201103L) ||                                               \
+      (defined(_MSVC_LANG) && (_MSVC_LANG >= 201103L)))
+  process(const process &);
+  process &operator=(const process &);
 #endif
+
+  // Resizing only by the bytes read means nothing is filled in that the copy
+  // does not overwrite straight after, and the container still grows
+  // geometrically.
+  template <class Buffer>
+  static bool append(Buffer &out, const char *const data, size_t size) {
+    const size_t used = out.size();
+
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+    try {
+      out.resize(used + size);
+    } catch (...) {
+      return false;
+    }
+#else
+    out.resize(used + size);
 #endif
 
-#if defined(__cplusplus)
-} // extern "C"
+    memcpy(&out[used], data, size);
+    return true;
+  }
+
+  struct subprocess_s process_;
+  bool created_;
+};
+} // namespace subprocess
 #endif
 
 #endif /* SHEREDOM_SUBPROCESS_H_INCLUDED */
@@ -0,0 +1,78 @@
+// This is free and unencumbered software released into the public domain.
+//
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+//
+// In jurisdictions that recognize copyright laws, the author or authors
+// of this software dedicate any and all copyright interest in the
+// software to the public domain. We make this dedication for the benefit
+// of the public at large and to the detriment of our heirs and
+// successors. We intend this dedication to be an overt act of
+// relinquishment in perpetuity of all present and future rights to this
+// software under copyright law.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+// For more information, please refer to <http://unlicense.org/>
+
+#include <subprocess.h>
+
+#include <stdlib.h>
+
+// Writes the number of bytes in argv[2] to the channel whose descriptor is in
+// argv[1], byte i being (i * 7) & 0xff, in chunks of varying size. Then it
+// says so on stdout and closes the channel.
+int main(int argc, const char *const argv[]) {
+  struct subprocess_channel_s channel;
+  static unsigned char chunk[3001];
+  unsigned long total;
+  unsigned long sent = 0;
+  unsigned size = 1;
+  unsigned written;
+  unsigned index;
+
+  if (3 != argc) {
+    return 1;
+  }
+
+  if (0 != subprocess_channel_open(&channel, atoi(argv[1]))) {
+    return 2;
+  }
+
+  total = strtoul(argv[2], 0, 10);
+
+  while (sent < total) {
+    if (size > total - sent) {
+      size = (unsigned)(total - sent);
+    }
+
+    for (index = 0; index < size; index++) {
+      chunk[index] = (unsigned char)((sent + index) * 7);
+    }
+
+    for (index = 0; index < size; index += written) {
+      if (subprocess_read_data !=
+          subprocess_channel_write(&channel, chunk + index, size - index, -1,
+                                   &written)) {
+        return 3;
+      }
+    }
+
+    sent += size;
+    size = 1 + (size * 13 + 7) % (unsigned)sizeof(chunk);
+  }
+
+  fputs("done\n", stdout);
+  fflush(stdout);
+
+  subprocess_channel_close(&channel);
+  return subprocess_channel_destroy(&channel);
+}
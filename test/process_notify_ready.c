@@ -0,0 +1,88 @@
+// This is free and unencumbered software released into the public domain.
+//
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+//
+// In jurisdictions that recognize copyright laws, the author or authors
+// of this software dedicate any and all copyright interest in the
+// software to the public domain. We make this dedication for the benefit
+// of the public at large and to the detriment of our heirs and
+// successors. We intend this dedication to be an overt act of
+// relinquishment in perpetuity of all present and future rights to this
+// software under copyright law.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+// For more information, please refer to <http://unlicense.org/>
+
+#include <subprocess.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+// Write part of a notification straight to the descriptor, as a child that
+// does not use subprocess_notify_ready might.
+static int write_notify(const char *const message) {
+#if defined(_WIN32)
+  (void)message;
+  return 0;
+#else
+  const char *const variable = getenv("SUBPROCESS_NOTIFY_FD");
+  const size_t length = strlen(message);
+
+  if ((0 == variable) ||
+      (length != (size_t)write(atoi(variable), message, length))) {
+    return 2;
+  }
+
+  return 0;
+#endif
+}
+
+// With "ready" says it is ready, then waits for its standard input to end.
+// With "late" does the same the other way around. With "split" sends another
+// line and the start of READY=1 first, and the rest once its standard input
+// ends. With anything else exits without saying so.
+int main(int argc, const char *const argv[]) {
+  char buffer[64];
+
+  if ((2 != argc) || ((0 != strcmp(argv[1], "ready")) &&
+                      (0 != strcmp(argv[1], "late")) &&
+                      (0 != strcmp(argv[1], "split")))) {
+    return 1;
+  }
+
+  if ((0 == strcmp(argv[1], "split")) &&
+      (0 != write_notify("STATUS=starting\nREA"))) {
+    return 2;
+  }
+
+  if ((0 == strcmp(argv[1], "ready")) && (0 != subprocess_notify_ready())) {
+    return 2;
+  }
+
+  while (0 < fread(buffer, 1, sizeof(buffer), stdin)) {
+  }
+
+  if ((0 == strcmp(argv[1], "late")) && (0 != subprocess_notify_ready())) {
+    return 2;
+  }
+
+  if ((0 == strcmp(argv[1], "split")) && (0 != write_notify("DY=1\n"))) {
+    return 2;
+  }
+
+  return 0;
+}
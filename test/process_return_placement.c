@@ -0,0 +1,74 @@
+// This is free and unencumbered software released into the public domain.
+//
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+//
+// In jurisdictions that recognize copyright laws, the author or authors
+// of this software dedicate any and all copyright interest in the
+// software to the public domain. We make this dedication for the benefit
+// of the public at large and to the detriment of our heirs and
+// successors. We intend this dedication to be an overt act of
+// relinquishment in perpetuity of all present and future rights to this
+// software under copyright law.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+// For more information, please refer to <http://unlicense.org/>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if !defined(_WIN32)
+#include <string.h>
+#include <sys/resource.h>
+#endif
+
+int main(int argc, char *argv[]) {
+#if defined(_WIN32)
+  (void)argc;
+  (void)argv;
+  return 0;
+#else
+  if (2 != argc) {
+    return 255;
+  }
+
+  if (0 == strcmp(argv[1], "nice")) {
+    return getpriority(PRIO_PROCESS, 0);
+  }
+
+#if defined(__linux__)
+  if (0 == strcmp(argv[1], "cpu_count")) {
+    cpu_set_t cpus;
+
+    if (0 != sched_getaffinity(0, sizeof(cpus), &cpus)) {
+      return 255;
+    }
+
+    return CPU_COUNT(&cpus);
+  }
+
+  if (0 == strcmp(argv[1], "scheduler")) {
+    return sched_getscheduler(0);
+  }
+
+  if (0 == strcmp(argv[1], "io_class")) {
+    /* IOPRIO_WHO_PROCESS; the class sits above a 13 bit level. */
+    const long priority = syscall(SYS_ioprio_get, 1, 0);
+    return (-1 == priority) ? 255 : (int)(priority >> 13);
+  }
+#endif
+
+  return 255;
+#endif
+}
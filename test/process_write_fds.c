@@ -0,0 +1,52 @@
+// This is free and unencumbered software released into the public domain.
+//
+// Anyone is free to copy, modify, publish, use, compile, sell, or
+// distribute this software, either in source code form or as a compiled
+// binary, for any purpose, commercial or non-commercial, and by any
+// means.
+//
+// In jurisdictions that recognize copyright laws, the author or authors
+// of this software dedicate any and all copyright interest in the
+// software to the public domain. We make this dedication for the benefit
+// of the public at large and to the detriment of our heirs and
+// successors. We intend this dedication to be an overt act of
+// relinquishment in perpetuity of all present and future rights to this
+// software under copyright law.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+// EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+// MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+// IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+// OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+// ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+// OTHER DEALINGS IN THE SOFTWARE.
+//
+// For more information, please refer to <http://unlicense.org/>
+
+#if !defined(_WIN32)
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#endif
+
+// Writes each argument to the descriptor it names, so that a test can see
+// which descriptor arrived under which number.
+int main(int argc, const char *const argv[]) {
+#if defined(_WIN32)
+  (void)argc;
+  (void)argv;
+  return 0;
+#else
+  int index;
+
+  for (index = 1; index < argc; index++) {
+    const size_t size = strlen(argv[index]);
+
+    if (size != (size_t)write(atoi(argv[index]), argv[index], size)) {
+      return index;
+    }
+  }
+
+  return 0;
+#endif
+}
@@ -60,6 +60,7 @@ UTEST_C_FUNC __declspec(dllimport) void __stdcall SetLastError(unsigned long);
 #define SUBPROCESS_TEST_EXE_SUFFIX ".exe"
 #else
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -71,6 +72,15 @@ UTEST_C_FUNC __declspec(dllimport) void __stdcall SetLastError(unsigned long);
 
 #include "subprocess.h"
 
+#if defined(__cplusplus)
+#include <string>
+#if defined(__has_include)
+#if __has_include(<memory_resource>) && (__cplusplus >= 201703L)
+#include <memory_resource>
+#endif
+#endif
+#endif
+
 static int subprocess_test_open_resource_count(void) {
 #if defined(_WIN32)
   unsigned long count = 0;
@@ -284,6 +294,46 @@ SUBPROCESS_TEST(create, subprocess_return_stdin_count) {
   ASSERT_EQ(0, subprocess_destroy(&process));
 }
 
+#if !defined(_WIN32)
+SUBPROCESS_TEST(create, subprocess_raw_fds) {
+  const char *const commandLine[] = {"./process_stdin_to_stdout", 0};
+  const char temp[6] = "hello";
+  struct subprocess_s process;
+  char data[6] = {0};
+  unsigned index = 0;
+  unsigned bytes_read;
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_combined_stdout_stderr,
+                                 &process));
+  ASSERT_NE(-1, subprocess_stdin_fd(&process));
+  ASSERT_NE(-1, subprocess_stdout_fd(&process));
+  ASSERT_EQ(-1, subprocess_stderr_fd(&process));
+
+  ASSERT_EQ(5, write(subprocess_stdin_fd(&process), temp, 5));
+
+  // Joining closes stdin, and the echo waits in the pipe until read.
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(-1, subprocess_stdin_fd(&process));
+
+  do {
+    bytes_read = subprocess_read_stdout(&process, data + index, 5 - index);
+    index += bytes_read;
+  } while ((0 != bytes_read) && (index < 5));
+
+  ASSERT_STREQ(temp, data);
+
+  // Nothing asked for a file, so none was ever created.
+  ASSERT_FALSE(process.stdin_file);
+  ASSERT_FALSE(process.stdout_file);
+  ASSERT_FALSE(subprocess_stderr(&process));
+
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+#endif
+
 SUBPROCESS_TEST(create, subprocess_stdout_argc) {
   const char *const commandLine[] = {
       "./process_stdout_argc", "foo", "bar", "baz", "faz", 0};
@@ -505,6 +555,188 @@ SUBPROCESS_TEST(create, subprocess_combined_stdout_stderr) {
   ASSERT_EQ(0, subprocess_destroy(&process));
 }
 
+#if defined(__cplusplus)
+SUBPROCESS_TEST(spawn, subprocess_spawn_combined_stdout_stderr) {
+  const char *const commandLine[] = {"./process_combined_stdout_stderr", 0};
+  struct subprocess_s process;
+  int ret = -1;
+  char temp[25];
+
+  ASSERT_EQ(0, subprocess::spawn<subprocess_option_combined_stdout_stderr>(
+                   commandLine, &process));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+
+  ASSERT_FALSE(subprocess_stderr(&process));
+  ASSERT_TRUE(fgets(temp, 25, subprocess_stdout(&process)));
+  ASSERT_STREQ("Hello,It's me!world!Yay!", temp);
+
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(spawn, subprocess_spawn_environment) {
+  const char *const commandLine[] = {"./process_inherit_environment", 0};
+  const char *const allCommandLine[] = {"./process_inherit_environment",
+                                        "all", 0};
+  const char *const environment[] = {"PROCESS_ENV_TEST=1", 0};
+  struct subprocess_s process;
+  int ret = -1;
+
+  // subprocess_option_enable_async_no_wait without
+  // subprocess_option_enable_async would not compile.
+  ASSERT_EQ(0, subprocess::spawn<subprocess_option_enable_async |
+                                 subprocess_option_enable_async_no_wait>(
+                   commandLine, environment, SUBPROCESS_NULL, SUBPROCESS_NULL,
+                   &process));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(1, ret);
+
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  // Inheriting the environment combines with a working directory, and only
+  // an environment alongside it is refused.
+  ASSERT_EQ(0, subprocess::spawn<subprocess_option_inherit_environment>(
+                   allCommandLine, SUBPROCESS_NULL, ".", SUBPROCESS_NULL,
+                   &process));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(1, ret);
+
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(subprocess_error_invalid_environment,
+            subprocess::spawn<subprocess_option_inherit_environment>(
+                commandLine, environment, SUBPROCESS_NULL, SUBPROCESS_NULL,
+                &process));
+}
+
+SUBPROCESS_TEST(process, subprocess_process_read_all) {
+  const char *const commandLine[] = {"./process_stdout_large", "16384", 0};
+  subprocess::process process;
+  std::string data;
+  int ret = -1;
+  size_t index;
+
+  ASSERT_FALSE(process.valid());
+  ASSERT_EQ(0, process.create(commandLine, 0));
+  ASSERT_TRUE(process.valid());
+
+  ASSERT_EQ(0, process.read_all(subprocess_stream_stdout, data));
+  ASSERT_EQ(212992u, data.size());
+
+  for (index = 0; index < 16384; index++) {
+    ASSERT_EQ(0, data.compare(index * 13, 13, "Hello, world!"));
+  }
+
+  ASSERT_EQ(0, process.join(&ret));
+  ASSERT_EQ(0, ret);
+
+  // The destructor destroys the process when it goes out of scope.
+}
+
+SUBPROCESS_TEST(process, subprocess_process_combined_stdout_stderr) {
+  const char *const commandLine[] = {"./process_combined_stdout_stderr", 0};
+  subprocess::process process;
+  char temp[32];
+  unsigned size = 0;
+  unsigned bytes_read;
+  int ret = -1;
+
+  ASSERT_EQ(0, process.spawn<subprocess_option_combined_stdout_stderr>(
+                   commandLine));
+
+  do {
+    bytes_read = process.read(subprocess_stream_stdout, temp + size,
+                              static_cast<unsigned>(sizeof(temp)) - 1 - size);
+    size += bytes_read;
+  } while (0 != bytes_read);
+
+  temp[size] = '\0';
+  ASSERT_STREQ("Hello,It's me!world!Yay!\n", temp);
+
+  ASSERT_EQ(0, process.join(&ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, process.destroy());
+  ASSERT_FALSE(process.valid());
+  ASSERT_EQ(subprocess_error_invalid_options, process.join(&ret));
+}
+
+#if defined(__cpp_rvalue_references)
+SUBPROCESS_TEST(process, subprocess_process_move) {
+  const char *const commandLine[] = {"./process_return_argc", "foo", 0};
+  subprocess::process process;
+  int ret = -1;
+
+  ASSERT_EQ(0, process.create(commandLine, 0));
+
+  subprocess::process moved(static_cast<subprocess::process &&>(process));
+  ASSERT_FALSE(process.valid());
+  ASSERT_TRUE(moved.valid());
+
+  process = static_cast<subprocess::process &&>(moved);
+  ASSERT_TRUE(process.valid());
+  ASSERT_FALSE(moved.valid());
+
+  ASSERT_EQ(0, process.join(&ret));
+  ASSERT_EQ(2, ret);
+}
+#endif
+
+#if defined(__cpp_lib_span)
+SUBPROCESS_TEST(process, subprocess_process_read_span) {
+  const char *const commandLine[] = {"./process_stdout_large", "1", 0};
+  subprocess::process process;
+  char temp[32] = {0};
+  unsigned size = 0;
+  unsigned bytes_read;
+
+  ASSERT_EQ(0, process.create(commandLine, 0));
+
+  do {
+    bytes_read = process.read(subprocess_stream_stdout,
+                              std::span<char>(temp).subspan(size));
+    size += bytes_read;
+  } while (0 != bytes_read);
+
+  ASSERT_STREQ("Hello, world!", temp);
+  ASSERT_EQ(0, process.join());
+}
+#endif
+
+#if defined(__cpp_lib_memory_resource)
+SUBPROCESS_TEST(process, subprocess_process_read_all_pmr) {
+  const char *const commandLine[] = {"./process_stdout_large", "1024", 0};
+  static char storage[65536];
+  std::pmr::monotonic_buffer_resource resource(
+      storage, sizeof(storage), std::pmr::null_memory_resource());
+  std::pmr::string data(&resource);
+  subprocess::process process;
+
+  ASSERT_EQ(0, process.create(commandLine, 0));
+  ASSERT_EQ(0, process.read_all(subprocess_stream_stdout, data));
+  ASSERT_EQ(13312u, data.size());
+  ASSERT_EQ(0, process.join());
+
+  // Growing past the storage fails instead of throwing, keeping what was read.
+  const char *const largeCommandLine[] = {"./process_stdout_large", "16384",
+                                          0};
+  static char small_storage[16384];
+  std::pmr::monotonic_buffer_resource small(
+      small_storage, sizeof(small_storage), std::pmr::null_memory_resource());
+  std::pmr::string partial(&small);
+
+  ASSERT_EQ(0, process.create(largeCommandLine, 0));
+  ASSERT_EQ(subprocess_error_no_memory,
+            process.read_all(subprocess_stream_stdout, partial));
+  ASSERT_LT(0u, partial.size());
+  ASSERT_EQ(0, process.terminate());
+  ASSERT_EQ(0, process.join());
+}
+#endif
+#endif
+
 SUBPROCESS_TEST(create, subprocess_not_inherit_environment) {
   const char *const commandLine[] = {"./process_inherit_environment", 0};
   struct subprocess_s process;
@@ -783,6 +1015,81 @@ SUBPROCESS_TEST(subprocess, read_stdout_async_small) {
   ASSERT_EQ(ret, 0);
 }
 
+SUBPROCESS_TEST(subprocess, read_stdout_ex) {
+  const char *const commandLine[] = {"./process_stdout_large", "1024", 0};
+  struct subprocess_s process;
+  int ret = -1;
+  static char data[16384 + 1] = {0};
+  unsigned index = 0;
+  unsigned bytes_read = 0;
+  int status;
+
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_enable_async |
+                                     subprocess_option_enable_async_no_wait,
+                                 &process));
+
+  for (;;) {
+    status = subprocess_read_stdout_ex(&process, data + index,
+                                       sizeof(data) - 1 - index, -1,
+                                       &bytes_read);
+
+    if (subprocess_read_data != status) {
+      ASSERT_EQ(0u, bytes_read);
+
+      if (subprocess_read_eof == status) {
+        break;
+      }
+    }
+
+    ASSERT_NE(subprocess_read_error, status);
+    index += bytes_read;
+  }
+
+  ASSERT_EQ(13312u, index);
+
+  for (index = 0; index < 1024; index++) {
+    const char *const helloWorld = "Hello, world!";
+    ASSERT_TRUE(0 == memcmp(data + (index * strlen(helloWorld)), helloWorld,
+                            strlen(helloWorld)));
+  }
+
+  // The end of the stream is sticky.
+  ASSERT_EQ(subprocess_read_eof,
+            subprocess_read_stdout_ex(&process, data, 1, 0, &bytes_read));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+  ASSERT_EQ(ret, 0);
+}
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(subprocess, read_stderr_ex_timeout) {
+  const char *const commandLine[] = {"./process_hung", 0};
+  struct subprocess_s process;
+  char data[16];
+  unsigned bytes_read = 1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine, 0, &process));
+
+  ASSERT_EQ(subprocess_read_again,
+            subprocess_read_stderr_ex(&process, data, sizeof(data), 0,
+                                      &bytes_read));
+  ASSERT_EQ(0u, bytes_read);
+  ASSERT_EQ(subprocess_read_again,
+            subprocess_read_stderr_ex(&process, data, sizeof(data), 20,
+                                      &bytes_read));
+
+  ASSERT_EQ(0, subprocess_terminate(&process));
+  ASSERT_EQ(subprocess_read_eof,
+            subprocess_read_stderr_ex(&process, data, sizeof(data), -1,
+                                      &bytes_read));
+
+  ASSERT_EQ(0, subprocess_join(&process, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+#endif
+
 SUBPROCESS_TEST(subprocess, read_stdout_async) {
   const char *const commandLine[] = {"./process_stdout_large", "16384", 0};
   struct subprocess_s process;
@@ -1303,3 +1610,1777 @@ SUBPROCESS_TEST(create, subprocess_option_no_window) {
   ASSERT_EQ(0, subprocess_destroy(&process));
 }
 
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(create_attr, subprocess_stdin_fd_pipe) {
+  const char *const commandLine[] = {"./process_return_stdin", 0};
+  const char *const data = "abba are great!";
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  int fds[2];
+  int ret = -1;
+
+  ASSERT_EQ(0, pipe(fds));
+  ASSERT_EQ(UTEST_CAST(ssize_t, strlen(data)),
+            write(fds[1], data, strlen(data)));
+  ASSERT_EQ(0, close(fds[1]));
+
+  subprocess_attr_init(&attr);
+  attr.stdin_fd = fds[0];
+
+  ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, close(fds[0]));
+
+  ASSERT_FALSE(subprocess_stdin(&process));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(create_attr, subprocess_stdin_data) {
+  const char *const commandLine[] = {"./process_stdin_to_stdout", 0};
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  char buffer[16];
+  int ret = -1;
+
+  subprocess_attr_init(&attr);
+  attr.stdin_data = "hello";
+  attr.stdin_size = 5;
+  attr.stdin_close = 1;
+
+  ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_FALSE(subprocess_stdin(&process));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_TRUE(SUBPROCESS_NULL !=
+              fgets(buffer, sizeof(buffer), subprocess_stdout(&process)));
+  ASSERT_STREQ("hello", buffer);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  // Without stdin_close the parent can carry on writing after the payload.
+  attr.stdin_close = 0;
+  ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_NE(EOF, fputs(", world", subprocess_stdin(&process)));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_TRUE(SUBPROCESS_NULL !=
+              fgets(buffer, sizeof(buffer), subprocess_stdout(&process)));
+  ASSERT_STREQ("hello, world", buffer);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  attr.stdin_fd = 0;
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                   SUBPROCESS_NULL, &attr, &process));
+}
+
+#if defined(__linux__)
+SUBPROCESS_TEST(create_attr, subprocess_stdin_data_grows_pipe) {
+  const char *const commandLine[] = {"./process_return_stdin_count", 0};
+  static char data[200000];
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  int ret = -1;
+
+  // Bigger than the default pipe, which is grown to fit.
+  memset(data, 'x', sizeof(data));
+  subprocess_attr_init(&attr);
+  attr.stdin_data = data;
+  attr.stdin_size = sizeof(data);
+  attr.stdin_close = 1;
+
+  ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(UTEST_CAST(int, sizeof(data) & 0xff), ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+#endif
+
+SUBPROCESS_TEST(create_attr, subprocess_fds) {
+  const char *commandLine[] = {"./process_write_fds", 0, 0, 0};
+  struct subprocess_fd_s fds[2];
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  char first_argument[16];
+  char second_argument[16];
+  char buffer[16];
+  int first[2];
+  int second[2];
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create_pipe(first));
+  ASSERT_EQ(0, subprocess_create_pipe(second));
+
+  /* Each write end goes to the child under the other's number, so neither can
+     be put in place without replacing the other. */
+  fds[0].parent_fd = first[1];
+  fds[0].child_fd = second[1];
+  fds[1].parent_fd = second[1];
+  fds[1].child_fd = first[1];
+
+  sprintf(first_argument, "%d", first[1]);
+  sprintf(second_argument, "%d", second[1]);
+  commandLine[1] = first_argument;
+  commandLine[2] = second_argument;
+
+  subprocess_attr_init(&attr);
+  attr.fds = fds;
+  attr.fd_count = 2;
+
+  ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, close(first[1]));
+  ASSERT_EQ(0, close(second[1]));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  memset(buffer, 0, sizeof(buffer));
+  ASSERT_LT(0, read(first[0], buffer, sizeof(buffer) - 1));
+  ASSERT_STREQ(second_argument, buffer);
+
+  memset(buffer, 0, sizeof(buffer));
+  ASSERT_LT(0, read(second[0], buffer, sizeof(buffer) - 1));
+  ASSERT_STREQ(first_argument, buffer);
+
+  ASSERT_EQ(0, close(first[0]));
+  ASSERT_EQ(0, close(second[0]));
+}
+
+SUBPROCESS_TEST(create_attr, subprocess_fds_invalid) {
+  const char *const commandLine[] = {"./process_return_zero", 0};
+  struct subprocess_fd_s fds[2];
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+
+  subprocess_attr_init(&attr);
+  attr.fds = fds;
+  attr.fd_count = 1;
+  fds[0].parent_fd = 0;
+  fds[0].child_fd = STDERR_FILENO;
+
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                   SUBPROCESS_NULL, &attr, &process));
+
+  attr.fd_count = 2;
+  fds[0].child_fd = 5;
+  fds[1].parent_fd = 1;
+  fds[1].child_fd = 5;
+
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                   SUBPROCESS_NULL, &attr, &process));
+}
+#endif
+
+SUBPROCESS_TEST(create_attr, subprocess_stdin_memfd_shared) {
+  const char *const commandLine[] = {"./process_return_stdin", 0};
+  const char *const data = "abba are great!";
+  struct subprocess_attr_s attr;
+  struct subprocess_s processes[2];
+  int fd = -1;
+  int ret = -1;
+  int i;
+
+#if SUBPROCESS_HAVE_MEMFD
+  ASSERT_EQ(0, subprocess_create_stdin_memfd(data, strlen(data), &fd));
+
+  subprocess_attr_init(&attr);
+  attr.stdin_fd = fd;
+
+  // Both children read the whole blob, each from its own offset.
+  for (i = 0; i < 2; i++) {
+    ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                        SUBPROCESS_NULL, &attr, &processes[i]));
+  }
+
+  ASSERT_EQ(0, close(fd));
+
+  for (i = 0; i < 2; i++) {
+    ASSERT_EQ(0, subprocess_join(&processes[i], &ret));
+    ASSERT_EQ(0, ret);
+    ASSERT_EQ(0, subprocess_destroy(&processes[i]));
+  }
+#else
+  (void)commandLine;
+  (void)attr;
+  (void)processes;
+  (void)ret;
+  (void)i;
+  ASSERT_EQ(subprocess_error_not_supported,
+            subprocess_create_stdin_memfd(data, strlen(data), &fd));
+  ASSERT_EQ(-1, fd);
+#endif
+}
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(pipeline, subprocess_pipeline_three_stages) {
+  const char *const first[] = {"./process_stdout_large", "16384", 0};
+  const char *const middle[] = {"./process_stdin_to_stdout", 0};
+  const char *const *const commandLines[] = {first, middle, middle};
+  struct subprocess_attr_s attr;
+  struct subprocess_s stages[3];
+  static char data[1048576 + 1] = {0};
+  int returnCodes[3] = {-1, -1, -1};
+  int ret = -1;
+  unsigned index = 0;
+  unsigned bytes_read = 0;
+
+  subprocess_attr_init(&attr);
+  attr.pipe_capacity = 1048576;
+
+  ASSERT_EQ(0, subprocess_create_pipeline(commandLines, 3, 0, SUBPROCESS_NULL,
+                                          SUBPROCESS_NULL, &attr, stages));
+
+  ASSERT_TRUE(subprocess_stdin(&stages[0]));
+  ASSERT_FALSE(subprocess_stdout(&stages[0]));
+  ASSERT_FALSE(subprocess_stdin(&stages[2]));
+  ASSERT_TRUE(subprocess_stdout(&stages[2]));
+  ASSERT_TRUE(subprocess_stderr(&stages[1]));
+
+  do {
+    bytes_read = subprocess_read_stdout(&stages[2], data + index,
+                                        sizeof(data) - 1 - index);
+    index += bytes_read;
+  } while (bytes_read != 0);
+
+  ASSERT_EQ(212992u, index);
+
+  for (index = 0; index < 16384; index++) {
+    const char *const helloWorld = "Hello, world!";
+    ASSERT_TRUE(0 == memcmp(data + (index * strlen(helloWorld)), helloWorld,
+                            strlen(helloWorld)));
+  }
+
+  ASSERT_EQ(0, subprocess_join_pipeline(stages, 3, 0, returnCodes, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, returnCodes[0]);
+  ASSERT_EQ(0, returnCodes[1]);
+  ASSERT_EQ(0, returnCodes[2]);
+
+  for (index = 0; index < 3; index++) {
+    ASSERT_EQ(0, subprocess_destroy(&stages[index]));
+  }
+}
+
+SUBPROCESS_TEST(pipeline, subprocess_pipeline_pipefail) {
+  const char *const first[] = {"./process_return_fortytwo", 0};
+  const char *const last[] = {"./process_return_stdin_count", 0};
+  const char *const *const commandLines[] = {first, last};
+  struct subprocess_s stages[2];
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create_pipeline(commandLines, 2, 0, SUBPROCESS_NULL,
+                                          SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                          stages));
+  ASSERT_EQ(0, subprocess_join_pipeline(stages, 2, 0, SUBPROCESS_NULL, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&stages[0]));
+  ASSERT_EQ(0, subprocess_destroy(&stages[1]));
+
+  ASSERT_EQ(0, subprocess_create_pipeline(commandLines, 2, 0, SUBPROCESS_NULL,
+                                          SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                          stages));
+  ASSERT_EQ(0, subprocess_join_pipeline(stages, 2, 1, SUBPROCESS_NULL, &ret));
+  ASSERT_EQ(42, ret);
+  ASSERT_EQ(0, subprocess_destroy(&stages[0]));
+  ASSERT_EQ(0, subprocess_destroy(&stages[1]));
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(reaper, subprocess_reaper_collects_every_process) {
+  const char *const zero[] = {"./process_return_zero", 0};
+  const char *const fortytwo[] = {"./process_return_fortytwo", 0};
+  const char *const argc[] = {"./process_return_argc", "a", "b", 0};
+  const char *const *const commandLines[] = {zero, fortytwo, argc};
+  const int expected[] = {0, 42, 3};
+  struct subprocess_reaper_slot_s slots[4];
+  struct subprocess_reaper_event_s event;
+  struct subprocess_reaper_s reaper;
+  struct subprocess_s processes[3];
+  int seen[3] = {0, 0, 0};
+  int events = 0;
+  int ret = -1;
+  int i;
+
+  if (subprocess_error_not_supported ==
+      subprocess_reaper_init(&reaper, slots, 4)) {
+    UTEST_SKIP("no pidfd support");
+  }
+
+  for (i = 0; i < 3; i++) {
+    ASSERT_EQ(0, subprocess_create(commandLines[i], 0, &processes[i]));
+    ASSERT_EQ(0, subprocess_reaper_add(&reaper, &processes[i]));
+  }
+
+  while (events < 3) {
+    ASSERT_EQ(1, subprocess_reaper_wait(&reaper, -1));
+
+    while (subprocess_reaper_next(&reaper, &event)) {
+      i = UTEST_CAST(int, event.process - processes);
+      ASSERT_TRUE((0 <= i) && (i < 3));
+      ASSERT_EQ(0, seen[i]);
+      ASSERT_EQ(expected[i], event.return_code);
+      seen[i] = 1;
+      events++;
+    }
+  }
+
+  for (i = 0; i < 3; i++) {
+    ASSERT_EQ(0, subprocess_alive(&processes[i]));
+    ASSERT_EQ(0, subprocess_join(&processes[i], &ret));
+    ASSERT_EQ(expected[i], ret);
+    ASSERT_EQ(0, subprocess_destroy(&processes[i]));
+  }
+
+  ASSERT_EQ(0, subprocess_reaper_wait(&reaper, 0));
+  ASSERT_EQ(0, subprocess_reaper_destroy(&reaper));
+}
+
+SUBPROCESS_TEST(reaper, subprocess_reaper_join) {
+  const char *const commandLine[] = {"./process_return_stdin_count", 0};
+  const char *const other[] = {"./process_return_zero", 0};
+  struct subprocess_reaper_slot_s slots[1];
+  struct subprocess_reaper_event_s event;
+  struct subprocess_reaper_s reaper;
+  struct subprocess_s process;
+  struct subprocess_s full;
+  pid_t child;
+  int ret = -1;
+
+  if (subprocess_error_not_supported ==
+      subprocess_reaper_init(&reaper, slots, 1)) {
+    UTEST_SKIP("no pidfd support");
+  }
+
+  ASSERT_EQ(0, subprocess_create(commandLine, 0, &process));
+  ASSERT_EQ(0, subprocess_reaper_add(&reaper, &process));
+  child = process.child;
+
+  // Only one slot, so a second process cannot be added.
+  ASSERT_EQ(0, subprocess_create(other, 0, &full));
+  ASSERT_EQ(subprocess_error_no_memory, subprocess_reaper_add(&reaper, &full));
+  ASSERT_EQ(0, subprocess_join(&full, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&full));
+
+  ASSERT_NE(0, subprocess_alive(&process));
+  ASSERT_NE(EOF, fputs("abc", subprocess_stdin(&process)));
+
+  // Nothing polls the reaper; joining collects the process itself.
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(3, ret);
+
+  ASSERT_EQ(1, subprocess_reaper_next(&reaper, &event));
+  ASSERT_TRUE(&process == event.process);
+  ASSERT_EQ(child, event.pid);
+  ASSERT_EQ(3, event.return_code);
+  ASSERT_EQ(0, process.child);
+  ASSERT_EQ(0, process.alive);
+  ASSERT_EQ(0, subprocess_reaper_next(&reaper, &event));
+
+  ASSERT_EQ(0, subprocess_destroy(&process));
+  ASSERT_EQ(0, subprocess_reaper_destroy(&reaper));
+}
+#endif
+
+#if !defined(_WIN32)
+static void subprocess_test_spawned(struct subprocess_spawn_s *spawn) {
+  int *const calls = UTEST_PTR_CAST(int *, spawn->user_data);
+
+  // Called before the request is marked done.
+  if (!subprocess_spawn_done(spawn)) {
+    *calls += 1;
+  }
+}
+
+SUBPROCESS_TEST(spawner, subprocess_create_async) {
+  const char *const fortytwo[] = {"./process_return_fortytwo", 0};
+  const char *const missing[] = {"./process_does_not_exist", 0};
+  struct subprocess_spawner_slot_s slots[2];
+  struct subprocess_spawner_s spawner;
+  struct subprocess_spawn_s spawns[3];
+  struct subprocess_s processes[3];
+  unsigned char completed[8];
+  unsigned total = 0;
+  int calls = 0;
+  int ret = -1;
+  int i;
+
+  if (subprocess_error_not_supported ==
+      subprocess_spawner_init(&spawner, slots, 2)) {
+    UTEST_SKIP("no eventfd support");
+  }
+
+  memset(spawns, 0, sizeof(spawns));
+
+  for (i = 0; i < 3; i++) {
+    spawns[i].command_line = (1 == i) ? missing : fortytwo;
+    spawns[i].process = &processes[i];
+    spawns[i].callback = subprocess_test_spawned;
+    spawns[i].user_data = &calls;
+  }
+
+  ASSERT_EQ(0, subprocess_create_async(&spawner, &spawns[0]));
+  ASSERT_EQ(0, subprocess_create_async(&spawner, &spawns[1]));
+  ASSERT_EQ(subprocess_error_no_memory,
+            subprocess_create_async(&spawner, &spawns[2]));
+  ASSERT_FALSE(subprocess_spawn_done(&spawns[0]));
+
+  // Running the spawner on this thread after stopping it carries out what
+  // was queued, then returns.
+  ASSERT_EQ(0, subprocess_spawner_stop(&spawner));
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_create_async(&spawner, &spawns[2]));
+  ASSERT_EQ(0, subprocess_spawner_run(&spawner));
+
+  ASSERT_TRUE(subprocess_spawn_done(&spawns[0]));
+  ASSERT_TRUE(subprocess_spawn_done(&spawns[1]));
+  ASSERT_EQ(2, calls);
+  ASSERT_EQ(0, spawns[0].result);
+  ASSERT_NE(0, spawns[1].result);
+
+  // The descriptor holds a native 64-bit count of the completed requests.
+  ASSERT_EQ(UTEST_CAST(ssize_t, sizeof(completed)),
+            read(subprocess_spawner_done_fd(&spawner), completed,
+                 sizeof(completed)));
+  for (i = 0; i < 8; i++) {
+    total += completed[i];
+  }
+  ASSERT_EQ(2u, total);
+
+  ASSERT_EQ(0, subprocess_join(&processes[0], &ret));
+  ASSERT_EQ(42, ret);
+  ASSERT_EQ(0, subprocess_destroy(&processes[0]));
+  ASSERT_EQ(0, subprocess_spawner_destroy(&spawner));
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(sample, subprocess_sample) {
+  const char *const hung[] = {"./process_hung", 0};
+  const char *const quick[] = {"./process_return_zero", 0};
+  const struct timespec pause = {0, 1000000};
+  struct subprocess_stats_s stats[2];
+  struct subprocess_s processes[2];
+  int tries;
+
+  ASSERT_EQ(0, subprocess_create(hung, 0, &processes[0]));
+
+  if (subprocess_error_not_supported ==
+      subprocess_sample(&processes[0], &stats[0])) {
+    ASSERT_EQ(0, subprocess_terminate(&processes[0]));
+    ASSERT_EQ(0, subprocess_join(&processes[0], SUBPROCESS_NULL));
+    ASSERT_EQ(0, subprocess_destroy(&processes[0]));
+    UTEST_SKIP("no /proc");
+  }
+
+  // The child spins, so its CPU time shows up within a few clock ticks.
+  for (tries = 0; tries < 5000; tries++) {
+    ASSERT_EQ(0, subprocess_sample(&processes[0], &stats[0]));
+    if (0 != stats[0].user_ms + stats[0].system_ms) {
+      break;
+    }
+    nanosleep(&pause, SUBPROCESS_NULL);
+  }
+
+  ASSERT_LT(0ul, stats[0].user_ms + stats[0].system_ms);
+  ASSERT_LT(0ul, stats[0].rss_kb);
+  ASSERT_EQ(1u, stats[0].threads);
+
+  ASSERT_EQ(0, subprocess_create(quick, 0, &processes[1]));
+  ASSERT_EQ(0, subprocess_join(&processes[1], SUBPROCESS_NULL));
+
+  // A reaped process cannot be sampled, and only the other one is.
+  ASSERT_NE(0, subprocess_sample(&processes[1], &stats[1]));
+  ASSERT_EQ(1u, subprocess_sample_group(processes, 2, stats));
+  ASSERT_EQ(1u, stats[0].threads);
+  ASSERT_EQ(0u, stats[1].threads);
+
+  ASSERT_EQ(0, subprocess_terminate(&processes[0]));
+  ASSERT_EQ(0, subprocess_join(&processes[0], SUBPROCESS_NULL));
+  ASSERT_NE(0, subprocess_sample(&processes[0], &stats[0]));
+  ASSERT_EQ(0, subprocess_destroy(&processes[0]));
+  ASSERT_EQ(0, subprocess_destroy(&processes[1]));
+}
+
+SUBPROCESS_TEST(sample, subprocess_sample_io) {
+  const char *const commandLine[] = {"./process_stdin_to_stdout", 0};
+  static char data[16384];
+#if defined(__linux__)
+  struct subprocess_stats_s stats;
+#endif
+  struct subprocess_s process;
+  unsigned received = 0;
+  unsigned bytes_read;
+  char buffer[4096];
+
+  ASSERT_EQ(0, subprocess_create(commandLine, subprocess_option_enable_async,
+                                 &process));
+  ASSERT_EQ(sizeof(data), fwrite(data, 1, sizeof(data),
+                                 subprocess_stdin(&process)));
+  ASSERT_EQ(0, fflush(subprocess_stdin(&process)));
+
+  // Whatever came back was read and written by the child first.
+  while (received < 8192) {
+    ASSERT_EQ(UTEST_CAST(int, subprocess_read_data),
+              subprocess_read_stdout_ex(&process, buffer, sizeof(buffer), -1,
+                                        &bytes_read));
+    received += bytes_read;
+  }
+
+#if defined(__linux__)
+  ASSERT_EQ(0, subprocess_sample(&process, &stats));
+  if (-1 != process.io_fd) {
+    ASSERT_LE(8ul, stats.read_kb);
+    ASSERT_LE(8ul, stats.write_kb);
+    ASSERT_EQ(0, close(process.io_fd));
+  }
+
+  // An io file that cannot be read leaves the I/O fields at 0, and the rest
+  // are still filled in.
+  process.io_fd = open(".", O_RDONLY);
+  ASSERT_NE(-1, process.io_fd);
+  ASSERT_EQ(0, subprocess_sample(&process, &stats));
+  ASSERT_EQ(0ul, stats.read_kb);
+  ASSERT_EQ(0ul, stats.write_kb);
+  ASSERT_LT(0u, stats.threads);
+#endif
+
+  ASSERT_EQ(0, subprocess_join(&process, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(standby, subprocess_standby) {
+  const char *const commandLine[] = {"./process_stdin_to_stdout", 0};
+  const struct timespec pause = {0, 1000000};
+  struct subprocess_standby_slot_s slots[2];
+  struct subprocess_standby_s pool;
+  struct subprocess_s process;
+  char buffer[16];
+  int ret = -1;
+
+  subprocess_standby_init(&pool, commandLine, 0, SUBPROCESS_NULL,
+                          SUBPROCESS_NULL, SUBPROCESS_NULL, slots, 2);
+  ASSERT_EQ(0, subprocess_standby_fill(&pool));
+  ASSERT_TRUE(slots[0].ready);
+  ASSERT_TRUE(slots[1].ready);
+
+  // A standby that dies while idle is passed over.
+  ASSERT_EQ(0, subprocess_terminate(&slots[0].process));
+  while (subprocess_alive(&slots[0].process)) {
+    nanosleep(&pause, SUBPROCESS_NULL);
+  }
+
+  ASSERT_EQ(0, subprocess_standby_acquire(&pool, &process));
+  ASSERT_FALSE(slots[0].ready);
+  ASSERT_FALSE(slots[1].ready);
+
+  ASSERT_NE(EOF, fputs("hello", subprocess_stdin(&process)));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_TRUE(SUBPROCESS_NULL !=
+              fgets(buffer, sizeof(buffer), subprocess_stdout(&process)));
+  ASSERT_STREQ("hello", buffer);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(0, subprocess_standby_fill(&pool));
+  ASSERT_TRUE(slots[0].ready);
+  ASSERT_TRUE(slots[1].ready);
+
+  // Lowering the target stops the standbys above it.
+  pool.target = 1;
+  ASSERT_EQ(0, subprocess_standby_fill(&pool));
+  ASSERT_EQ(1, slots[0].ready + slots[1].ready);
+
+  ASSERT_EQ(0, subprocess_standby_destroy(&pool));
+  ASSERT_FALSE(slots[0].ready || slots[1].ready);
+}
+
+SUBPROCESS_TEST(standby, subprocess_standby_spawner) {
+  const char *const commandLine[] = {"./process_stdin_to_stdout", 0};
+  struct subprocess_spawner_slot_s spawner_slots[2];
+  struct subprocess_standby_slot_s slots[2];
+  struct subprocess_spawner_s spawner;
+  struct subprocess_standby_s pool;
+  struct subprocess_s cold;
+  struct subprocess_s warm;
+
+  if (subprocess_error_not_supported ==
+      subprocess_spawner_init(&spawner, spawner_slots, 2)) {
+    UTEST_SKIP("no eventfd support");
+  }
+
+  subprocess_standby_init(&pool, commandLine, 0, SUBPROCESS_NULL,
+                          SUBPROCESS_NULL, SUBPROCESS_NULL, slots, 2);
+  pool.spawner = &spawner;
+  ASSERT_EQ(0, subprocess_standby_fill(&pool));
+  ASSERT_TRUE(slots[0].starting && slots[1].starting);
+
+  // Nothing has been started yet, so this one is created on the spot.
+  ASSERT_EQ(0, subprocess_standby_acquire(&pool, &cold));
+
+  ASSERT_EQ(0, subprocess_spawner_stop(&spawner));
+  ASSERT_EQ(0, subprocess_spawner_run(&spawner));
+
+  ASSERT_EQ(0, subprocess_standby_acquire(&pool, &warm));
+  ASSERT_EQ(0, subprocess_join(&warm, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&warm));
+  ASSERT_EQ(0, subprocess_join(&cold, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&cold));
+
+  ASSERT_EQ(0, subprocess_standby_destroy(&pool));
+  ASSERT_EQ(0, subprocess_spawner_destroy(&spawner));
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(governor, subprocess_governor_max_live) {
+  const char *const commandLine[] = {"./process_stdin_to_stdout", 0};
+  struct subprocess_governor_s governor;
+  struct subprocess_s first;
+  struct subprocess_s second;
+
+  memset(&governor, 0, sizeof(governor));
+  governor.max_live = 1;
+  ASSERT_EQ(0, subprocess_governor_init(&governor));
+
+  ASSERT_EQ(0, subprocess_governor_create(&governor, commandLine, 0,
+                                          SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                          SUBPROCESS_NULL, &first, -1));
+  ASSERT_EQ(1u, governor.live);
+
+  // The first is still running, so the second is not admitted.
+  ASSERT_EQ(subprocess_error_unknown,
+            subprocess_governor_create(&governor, commandLine, 0,
+                                       SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                       SUBPROCESS_NULL, &second, 10));
+  ASSERT_EQ(ETIMEDOUT, errno);
+
+  ASSERT_EQ(0, subprocess_join(&first, SUBPROCESS_NULL));
+  ASSERT_EQ(0u, governor.live);
+  ASSERT_EQ(0, subprocess_destroy(&first));
+
+  ASSERT_EQ(0, subprocess_governor_create(&governor, commandLine, 0,
+                                          SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                          SUBPROCESS_NULL, &second, 0));
+  ASSERT_EQ(0, subprocess_join(&second, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&second));
+
+  ASSERT_EQ(0, subprocess_governor_destroy(&governor));
+}
+
+SUBPROCESS_TEST(governor, subprocess_governor_rate) {
+  const char *const commandLine[] = {"./process_return_zero", 0};
+  struct subprocess_governor_s governor;
+  struct subprocess_s processes[3];
+  unsigned index;
+
+  memset(&governor, 0, sizeof(governor));
+  governor.rate = 2;
+  governor.burst = 2;
+  ASSERT_EQ(0, subprocess_governor_init(&governor));
+
+  // A burst of two starts straight away, and the next is half a second off.
+  for (index = 0; index < 2; index++) {
+    ASSERT_EQ(0, subprocess_governor_create(&governor, commandLine, 0,
+                                            SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                            SUBPROCESS_NULL, &processes[index],
+                                            0));
+  }
+
+  ASSERT_EQ(subprocess_error_unknown,
+            subprocess_governor_create(&governor, commandLine, 0,
+                                       SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                       SUBPROCESS_NULL, &processes[2], 0));
+  ASSERT_EQ(ETIMEDOUT, errno);
+
+  ASSERT_EQ(0, subprocess_governor_create(&governor, commandLine, 0,
+                                          SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                          SUBPROCESS_NULL, &processes[2], -1));
+
+  for (index = 0; index < 3; index++) {
+    ASSERT_EQ(0, subprocess_join(&processes[index], SUBPROCESS_NULL));
+    ASSERT_EQ(0, subprocess_destroy(&processes[index]));
+  }
+
+  ASSERT_EQ(0u, governor.live);
+  ASSERT_EQ(0, subprocess_governor_destroy(&governor));
+}
+
+SUBPROCESS_TEST(governor, subprocess_governor_pressure) {
+  const char *const commandLine[] = {"./process_return_zero", 0};
+  struct subprocess_governor_s governor;
+  struct subprocess_s process;
+  int ret;
+
+  memset(&governor, 0, sizeof(governor));
+  governor.memory_pressure = 100;
+  governor.cpu_pressure = 100;
+  ret = subprocess_governor_init(&governor);
+  if (subprocess_error_not_supported == ret) {
+    UTEST_SKIP("no pressure information");
+  }
+  ASSERT_EQ(0, ret);
+
+  // Nothing is stalled all of the time, so the process is admitted at once.
+  ASSERT_EQ(0, subprocess_governor_create(&governor, commandLine, 0,
+                                          SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                          SUBPROCESS_NULL, &process, 0));
+  ASSERT_EQ(0, subprocess_join(&process, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(0, subprocess_governor_destroy(&governor));
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(scheduler, subprocess_scheduler_fair) {
+  const char *const commandLine[] = {"./process_return_zero", 0};
+  struct subprocess_scheduler_tenant_s tenants[2];
+  struct subprocess_scheduler_job_s jobs[8];
+  struct subprocess_scheduler_job_s *job;
+  struct subprocess_scheduler_s scheduler;
+  char order[9];
+  unsigned index;
+
+  memset(tenants, 0, sizeof(tenants));
+  tenants[0].weight = 2;
+  tenants[1].weight = 1;
+  subprocess_scheduler_init(&scheduler, tenants, 2, 8);
+
+  // The first tenant queues everything it has before the second gets a look
+  // in, yet the second still gets one start in three.
+  memset(jobs, 0, sizeof(jobs));
+  for (index = 0; index < 8; index++) {
+    jobs[index].command_line = commandLine;
+    jobs[index].tenant = (index < 6) ? 0 : 1;
+    ASSERT_EQ(0, subprocess_scheduler_submit(&scheduler, &jobs[index]));
+  }
+
+  for (index = 0; index < 8; index++) {
+    ASSERT_EQ(0, subprocess_scheduler_start(&scheduler, &job));
+    ASSERT_TRUE(SUBPROCESS_NULL != job);
+    order[index] = (char)('A' + job->tenant);
+  }
+  order[8] = '\0';
+  ASSERT_STREQ("AABAABAA", order);
+
+  ASSERT_EQ(0, subprocess_scheduler_start(&scheduler, &job));
+  ASSERT_TRUE(SUBPROCESS_NULL == job);
+  ASSERT_EQ(6ul, tenants[0].started);
+  ASSERT_EQ(2ul, tenants[1].started);
+  ASSERT_TRUE(tenants[1].wait_max_ms <= tenants[1].wait_total_ms);
+
+  for (index = 0; index < 8; index++) {
+    ASSERT_EQ(0, subprocess_join(&jobs[index].process, SUBPROCESS_NULL));
+    ASSERT_EQ(0, subprocess_destroy(&jobs[index].process));
+    subprocess_scheduler_finish(&scheduler, &jobs[index]);
+  }
+
+  ASSERT_EQ(0u, scheduler.running);
+}
+
+SUBPROCESS_TEST(scheduler, subprocess_scheduler_quota) {
+  const char *const commandLine[] = {"./process_return_zero", 0};
+  struct subprocess_scheduler_tenant_s tenants[2];
+  struct subprocess_scheduler_job_s jobs[3];
+  struct subprocess_scheduler_job_s *job;
+  struct subprocess_scheduler_s scheduler;
+  unsigned index;
+
+  memset(tenants, 0, sizeof(tenants));
+  tenants[0].quota = 1;
+  subprocess_scheduler_init(&scheduler, tenants, 2, 4);
+
+  memset(jobs, 0, sizeof(jobs));
+  for (index = 0; index < 3; index++) {
+    jobs[index].command_line = commandLine;
+  }
+  jobs[1].priority = 5;
+  jobs[2].tenant = 1;
+
+  for (index = 0; index < 3; index++) {
+    ASSERT_EQ(0, subprocess_scheduler_submit(&scheduler, &jobs[index]));
+  }
+
+  jobs[0].tenant = 2;
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_scheduler_submit(&scheduler, &jobs[0]));
+  jobs[0].tenant = 0;
+
+  // The higher priority job goes first, and the first tenant's quota then
+  // leaves its other job waiting behind the second tenant's.
+  ASSERT_EQ(0, subprocess_scheduler_start(&scheduler, &job));
+  ASSERT_TRUE(&jobs[1] == job);
+  ASSERT_EQ(0, subprocess_scheduler_start(&scheduler, &job));
+  ASSERT_TRUE(&jobs[2] == job);
+  ASSERT_EQ(0, subprocess_scheduler_start(&scheduler, &job));
+  ASSERT_TRUE(SUBPROCESS_NULL == job);
+
+  ASSERT_EQ(0, subprocess_join(&jobs[1].process, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&jobs[1].process));
+  subprocess_scheduler_finish(&scheduler, &jobs[1]);
+
+  ASSERT_EQ(0, subprocess_scheduler_start(&scheduler, &job));
+  ASSERT_TRUE(&jobs[0] == job);
+
+  for (index = 0; index < 3; index += 2) {
+    ASSERT_EQ(0, subprocess_join(&jobs[index].process, SUBPROCESS_NULL));
+    ASSERT_EQ(0, subprocess_destroy(&jobs[index].process));
+    subprocess_scheduler_finish(&scheduler, &jobs[index]);
+  }
+
+  ASSERT_EQ(0u, scheduler.running);
+  ASSERT_EQ(0u, tenants[0].queued + tenants[1].queued);
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(jobs, subprocess_run_jobs) {
+  const char *const zero[] = {"./process_return_zero", 0};
+  const char *const fortytwo[] = {"./process_return_fortytwo", 0};
+  const unsigned on_first[] = {0};
+  const unsigned on_second[] = {1};
+  const unsigned on_third[] = {2};
+  const unsigned on_fourth[] = {3};
+  const unsigned on_all[] = {0, 1, 2};
+  const int states[] = {subprocess_job_succeeded, subprocess_job_succeeded,
+                        subprocess_job_failed,    subprocess_job_skipped,
+                        subprocess_job_skipped,   subprocess_job_succeeded};
+  struct subprocess_job_s jobs[6];
+  unsigned path[6];
+  unsigned length = 0;
+  unsigned index;
+  unsigned edge;
+
+  memset(jobs, 0, sizeof(jobs));
+  jobs[0].command_line = zero;
+  jobs[1].command_line = zero;
+  jobs[1].dependencies = on_first;
+  jobs[1].dependency_count = 1;
+  jobs[2].command_line = fortytwo;
+  jobs[2].dependencies = on_first;
+  jobs[2].dependency_count = 1;
+  jobs[3].command_line = zero;
+  jobs[3].dependencies = on_third;
+  jobs[3].dependency_count = 1;
+  jobs[4].command_line = zero;
+  jobs[4].dependencies = on_fourth;
+  jobs[4].dependency_count = 1;
+  jobs[5].command_line = zero;
+  jobs[5].dependencies = on_second;
+  jobs[5].dependency_count = 1;
+  jobs[5].weight = 2;
+
+  ASSERT_EQ(0, subprocess_run_jobs(jobs, 6, 2, 0, SUBPROCESS_NULL,
+                                   SUBPROCESS_NULL, SUBPROCESS_NULL, path,
+                                   &length));
+
+  for (index = 0; index < 6; index++) {
+    ASSERT_EQ(states[index], jobs[index].state);
+
+    for (edge = 0; edge < jobs[index].dependency_count; edge++) {
+      if (subprocess_job_skipped != jobs[index].state) {
+        ASSERT_LE(jobs[jobs[index].dependencies[edge]].end_ms,
+                  jobs[index].start_ms);
+      }
+    }
+  }
+
+  ASSERT_EQ(42, jobs[2].return_code);
+
+  // The critical path is a chain of jobs that ran, starting at the root.
+  ASSERT_LE(2u, length);
+  ASSERT_GE(3u, length);
+  ASSERT_EQ(0u, path[0]);
+
+  for (index = 1; index < length; index++) {
+    ASSERT_NE(subprocess_job_skipped, jobs[path[index]].state);
+    ASSERT_EQ(1u, jobs[path[index]].dependency_count);
+    ASSERT_EQ(path[index - 1], jobs[path[index]].dependencies[0]);
+  }
+
+  // A job cannot weigh more than the capacity.
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_run_jobs(jobs, 6, 1, 0, SUBPROCESS_NULL,
+                                SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                SUBPROCESS_NULL, SUBPROCESS_NULL));
+
+  // Dependencies cannot form a cycle.
+  jobs[0].dependencies = on_all;
+  jobs[0].dependency_count = 3;
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_run_jobs(jobs, 6, 0, 0, SUBPROCESS_NULL,
+                                SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                SUBPROCESS_NULL, SUBPROCESS_NULL));
+
+  // No jobs at all is nothing to do.
+  length = 1;
+  ASSERT_EQ(0, subprocess_run_jobs(jobs, 0, 0, 0, SUBPROCESS_NULL,
+                                   SUBPROCESS_NULL, SUBPROCESS_NULL, path,
+                                   &length));
+  ASSERT_EQ(0u, length);
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(create_attr, subprocess_limits) {
+  const char *const core[] = {"./process_return_rlimit", "core", 0};
+  const char *const nofile[] = {"./process_return_rlimit", "nofile", 0};
+  struct subprocess_limit_s limits[2];
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  int ret = -1;
+
+  limits[0].resource = subprocess_limit_core;
+  limits[0].value = 0;
+  limits[1].resource = subprocess_limit_open_files;
+  limits[1].value = 42;
+
+  subprocess_attr_init(&attr);
+  attr.limits = limits;
+  attr.limit_count = 2;
+
+  ASSERT_EQ(0, subprocess_create_attr(core, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(0, subprocess_create_attr(nofile, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(42, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(create_attr, subprocess_limits_search_user_path) {
+  const char *const commandLine[] = {"process_return_rlimit", "nofile", 0};
+  struct subprocess_limit_s limit;
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+
+  limit.resource = subprocess_limit_open_files;
+  limit.value = 42;
+
+  subprocess_attr_init(&attr);
+  attr.limits = &limit;
+  attr.limit_count = 1;
+
+  // The helpers are not on PATH, so the search fails as posix_spawnp would.
+  ASSERT_EQ(subprocess_error_not_found,
+            subprocess_create_attr(commandLine,
+                                   subprocess_option_search_user_path,
+                                   SUBPROCESS_NULL, SUBPROCESS_NULL, &attr,
+                                   &process));
+
+  limit.resource = 42;
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                   SUBPROCESS_NULL, &attr, &process));
+}
+
+SUBPROCESS_TEST(create_attr, subprocess_limits_crash_without_core) {
+  const char *const commandLine[] = {"./process_fail_divzero", 0};
+  struct subprocess_limit_s limit;
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  int ret = 0;
+
+  limit.resource = subprocess_limit_core;
+  limit.value = 0;
+
+  subprocess_attr_init(&attr);
+  attr.limits = &limit;
+  attr.limit_count = 1;
+
+  ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_NE(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(create_attr, subprocess_nice) {
+  const char *const commandLine[] = {"./process_return_placement", "nice", 0};
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  int ret = -1;
+
+  subprocess_attr_init(&attr);
+  attr.nice = 3;
+
+  ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(getpriority(PRIO_PROCESS, 0) + 3, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+#endif
+
+#if !defined(_WIN32) && SUBPROCESS_HAVE_PLACEMENT
+SUBPROCESS_TEST(create_attr, subprocess_placement) {
+  const char *const cpuCount[] = {"./process_return_placement", "cpu_count",
+                                  0};
+  const char *const scheduler[] = {"./process_return_placement", "scheduler",
+                                   0};
+  const char *const ioClass[] = {"./process_return_placement", "io_class", 0};
+  const unsigned cpus[] = {0};
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  int ret = -1;
+
+  subprocess_attr_init(&attr);
+  attr.cpus = cpus;
+  attr.cpu_count = 1;
+  attr.scheduling = subprocess_scheduling_batch;
+  attr.io_class = subprocess_io_idle;
+
+  ASSERT_EQ(0, subprocess_create_attr(cpuCount, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(1, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(0, subprocess_create_attr(scheduler, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(SCHED_BATCH, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(0, subprocess_create_attr(ioClass, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(3, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  attr.io_class = subprocess_io_best_effort;
+  attr.io_level = 8;
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_create_attr(scheduler, 0, SUBPROCESS_NULL,
+                                   SUBPROCESS_NULL, &attr, &process));
+}
+#endif
+
+SUBPROCESS_TEST(create_attr, subprocess_cpu_pool) {
+  const unsigned cpus[] = {4, 5, 6};
+  struct subprocess_cpu_pool_s pool;
+  struct subprocess_attr_s attr;
+  unsigned index;
+
+  pool.cpus = cpus;
+  pool.count = 3;
+  pool.next = 0;
+
+  subprocess_attr_init(&attr);
+
+  for (index = 0; index < 7; index++) {
+    subprocess_cpu_pool_assign(&pool, &attr);
+    ASSERT_EQ(1u, attr.cpu_count);
+    ASSERT_EQ(cpus[index % 3], *attr.cpus);
+  }
+}
+
+static void subprocess_test_watched(void *user_data, unsigned rule,
+                                    int stream) {
+  unsigned *const counts = UTEST_PTR_CAST(unsigned *, user_data);
+
+  counts[rule * 2 + UTEST_CAST(unsigned, stream) - 1]++;
+}
+
+SUBPROCESS_TEST(watch, subprocess_watch_feed) {
+  struct subprocess_watch_rule_s rules[4];
+  struct subprocess_watch_s watch;
+  const char *const out = "xxFATALyyATAzz listening on";
+  unsigned counts[8];
+  unsigned matches = 0;
+  size_t index;
+
+  rules[0].pattern = "FATAL";
+  rules[0].streams = subprocess_stream_stdout | subprocess_stream_stderr;
+  rules[0].action = subprocess_watch_notify;
+  rules[1].pattern = "ATA";
+  rules[1].streams = subprocess_stream_stdout;
+  rules[1].action = subprocess_watch_notify;
+  rules[2].pattern = "listening on";
+  rules[2].streams = subprocess_stream_stderr;
+  rules[2].action = subprocess_watch_notify;
+  rules[3].pattern = "FATAL";
+  rules[3].streams = subprocess_stream_stderr;
+  rules[3].action = subprocess_watch_notify;
+
+  memset(counts, 0, sizeof(counts));
+  ASSERT_EQ(0, subprocess_watch_init(&watch, rules, 4, subprocess_test_watched,
+                                     counts));
+
+  // One byte at a time, so that every match straddles a boundary.
+  for (index = 0; index < strlen(out); index++) {
+    matches += subprocess_watch_feed(&watch, SUBPROCESS_NULL,
+                                     subprocess_stream_stdout, out + index, 1);
+  }
+
+  ASSERT_EQ(3u, matches);
+  ASSERT_EQ(1u, counts[0]);
+  ASSERT_EQ(2u, counts[2]);
+  ASSERT_EQ(0u, counts[4]);
+
+  // The streams are followed apart, so stdout's half match does not carry.
+  ASSERT_EQ(0u, subprocess_watch_feed(&watch, SUBPROCESS_NULL,
+                                      subprocess_stream_stdout, "FAT", 3));
+  ASSERT_EQ(0u, subprocess_watch_feed(&watch, SUBPROCESS_NULL,
+                                      subprocess_stream_stderr, "AL", 2));
+  ASSERT_EQ(3u, subprocess_watch_feed(&watch, SUBPROCESS_NULL,
+                                      subprocess_stream_stderr,
+                                      "FATAL, listening on", 19));
+  ASSERT_EQ(1u, counts[1]);
+  ASSERT_EQ(0u, counts[3]);
+  ASSERT_EQ(1u, counts[5]);
+  ASSERT_EQ(1u, counts[7]);
+
+  subprocess_watch_destroy(&watch);
+
+  // With a single leading byte the gaps are skipped with memchr.
+  rules[0].pattern = "ab";
+  rules[1].pattern = "abc";
+  memset(counts, 0, sizeof(counts));
+  ASSERT_EQ(0, subprocess_watch_init(&watch, rules, 2, subprocess_test_watched,
+                                     counts));
+  ASSERT_EQ('a', watch.first_byte);
+  ASSERT_EQ(3u, subprocess_watch_feed(&watch, SUBPROCESS_NULL,
+                                      subprocess_stream_stdout, "xxabcxab",
+                                      8));
+  ASSERT_EQ(2u, counts[0]);
+  ASSERT_EQ(1u, counts[2]);
+  subprocess_watch_destroy(&watch);
+
+  rules[0].pattern = "";
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_watch_init(&watch, rules, 1, SUBPROCESS_NULL,
+                                  SUBPROCESS_NULL));
+}
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(watch, subprocess_watch_terminate) {
+  const char *const commandLine[] = {"./process_stdout_poll", "1000", 0};
+  struct subprocess_watch_rule_s rule;
+  struct subprocess_watch_s watch;
+  struct subprocess_s process;
+  unsigned counts[2] = {0, 0};
+  char buffer[512];
+  unsigned bytes_read;
+  int status;
+
+  rule.pattern = "world!Hello";
+  rule.streams = subprocess_stream_stdout;
+  rule.action = subprocess_watch_terminate;
+  ASSERT_EQ(0, subprocess_watch_init(&watch, &rule, 1, subprocess_test_watched,
+                                     counts));
+
+  ASSERT_EQ(0, subprocess_create(commandLine, subprocess_option_enable_async,
+                                 &process));
+
+  /* The child keeps waiting on its standard input, so the output only ends
+     because the match terminated it. */
+  do {
+    status = subprocess_watch_read(&watch, &process, subprocess_stream_stdout,
+                                   buffer, sizeof(buffer), -1, &bytes_read);
+  } while (subprocess_read_data == status);
+
+  ASSERT_EQ(UTEST_CAST(int, subprocess_read_eof), status);
+  ASSERT_LT(0u, counts[0]);
+
+  ASSERT_EQ(0, subprocess_join(&process, SUBPROCESS_NULL));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+  subprocess_watch_destroy(&watch);
+}
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(capture, subprocess_capture) {
+  const char *const commandLine[] = {"./process_combined_stdout_stderr", 0};
+  const struct subprocess_chunk_s *chunk = SUBPROCESS_NULL;
+  struct subprocess_capture_s capture;
+  struct subprocess_s process;
+  unsigned long buffer[64];
+  char out[32] = {0};
+  char err[32] = {0};
+  size_t out_size = 0;
+  size_t err_size = 0;
+  unsigned sequence = 0;
+  unsigned long seconds = 0;
+  unsigned long nanoseconds = 0;
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine, 0, &process));
+
+  // Starting one byte in still leaves every header aligned.
+  subprocess_capture_init(&capture, UTEST_PTR_CAST(char *, buffer) + 1,
+                          sizeof(buffer) - 1);
+  ASSERT_EQ(0, subprocess_capture(&process, &capture));
+  ASSERT_LT(0u, capture.count);
+
+  while (SUBPROCESS_NULL != (chunk = subprocess_capture_next(&capture, chunk))) {
+    const char *const data = UTEST_PTR_CAST(const char *, chunk + 1);
+
+    ASSERT_EQ(sequence++, chunk->sequence);
+
+    ASSERT_TRUE((seconds < chunk->seconds) ||
+                ((seconds == chunk->seconds) &&
+                 (nanoseconds <= chunk->nanoseconds)));
+    seconds = chunk->seconds;
+    nanoseconds = chunk->nanoseconds;
+
+    if (subprocess_stream_stdout == chunk->stream) {
+      memcpy(out + out_size, data, chunk->size);
+      out_size += chunk->size;
+    } else {
+      ASSERT_EQ(UTEST_CAST(unsigned, subprocess_stream_stderr), chunk->stream);
+      memcpy(err + err_size, data, chunk->size);
+      err_size += chunk->size;
+    }
+  }
+
+  ASSERT_EQ(capture.count, sequence);
+  ASSERT_STREQ("Hello,world!", out);
+  ASSERT_STREQ("It's me!Yay!\n", err);
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(capture, subprocess_capture_full) {
+  const char *const commandLine[] = {"./process_stdout_large", "100", 0};
+  struct subprocess_capture_s capture;
+  struct subprocess_s process;
+  unsigned long buffer[16];
+  size_t total = 0;
+  int result;
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine, 0, &process));
+
+  subprocess_capture_init(&capture, buffer, sizeof(buffer));
+
+  // Empty the log whenever it fills, and carry on where it stopped.
+  while (1 == (result = subprocess_capture(&process, &capture))) {
+    ASSERT_LT(0u, capture.count);
+    total += capture.size;
+    capture.size = 0;
+    capture.count = 0;
+  }
+
+  ASSERT_EQ(0, result);
+  ASSERT_LT(UTEST_CAST(size_t, 1300), total + capture.size);
+  ASSERT_LT(1u, capture.sequence);
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(metrics, subprocess_metrics_write) {
+  const char *const commandLine[] = {"./process_stdout_argc", "foo", 0};
+  static char snapshot[16384];
+  struct subprocess_s process;
+  size_t length = 0;
+  char data[32];
+  int ret = -1;
+
+#if SUBPROCESS_HAVE_METRICS
+  const char *sample;
+  unsigned long spawns;
+
+  ASSERT_EQ(0, subprocess_metrics_write(snapshot, sizeof(snapshot), &length));
+  sample = strstr(snapshot, "subprocess_spawns_total ");
+  ASSERT_TRUE(sample);
+  spawns = strtoul(sample + strlen("subprocess_spawns_total "), 0, 10);
+
+  ASSERT_EQ(0, subprocess_create(commandLine, 0, &process));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_LT(0u, subprocess_read_stdout(&process, data, sizeof(data)));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(0, subprocess_metrics_write(snapshot, sizeof(snapshot), &length));
+  ASSERT_EQ(strlen(snapshot), length);
+  sample = strstr(snapshot, "subprocess_spawns_total ");
+  ASSERT_TRUE(sample);
+  ASSERT_LT(spawns, strtoul(sample + strlen("subprocess_spawns_total "), 0, 10));
+  ASSERT_TRUE(strstr(snapshot, "subprocess_join_seconds_bucket{le=\"+Inf\"} "));
+  ASSERT_FALSE(strstr(snapshot, "subprocess_join_seconds_count 0\n"));
+  ASSERT_FALSE(strstr(snapshot, "subprocess_reads_total{stream=\"stdout\"} 0\n"));
+  ASSERT_EQ(0, strcmp(snapshot + length - 6, "# EOF\n"));
+
+  // Too small a buffer says how much is needed.
+  ASSERT_EQ(subprocess_error_no_memory,
+            subprocess_metrics_write(snapshot, 16, &length));
+  ASSERT_LT(UTEST_CAST(size_t, 16), length);
+#else
+  (void)commandLine;
+  (void)process;
+  (void)data;
+  (void)ret;
+  ASSERT_EQ(subprocess_error_not_supported,
+            subprocess_metrics_write(snapshot, sizeof(snapshot), &length));
+#endif
+}
+
+SUBPROCESS_TEST(create_fd, subprocess_create_fd) {
+  const char *const commandLine[] = {"fortytwo", 0};
+  struct subprocess_s process;
+  int fd;
+  int ret = -1;
+  int i;
+
+  fd = open("./process_return_fortytwo", O_RDONLY | O_CLOEXEC);
+  ASSERT_NE(-1, fd);
+
+#if SUBPROCESS_HAVE_EXEC_FD
+  // The same descriptor launches the binary again and again.
+  for (i = 0; i < 2; i++) {
+    ASSERT_EQ(0, subprocess_create_fd(fd, commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                      &process));
+    ASSERT_EQ(0, subprocess_join(&process, &ret));
+    ASSERT_EQ(42, ret);
+    ASSERT_EQ(0, subprocess_destroy(&process));
+  }
+
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_create_fd(-1, commandLine, 0, SUBPROCESS_NULL,
+                                 SUBPROCESS_NULL, SUBPROCESS_NULL, &process));
+#else
+  (void)ret;
+  (void)i;
+  ASSERT_EQ(subprocess_error_not_supported,
+            subprocess_create_fd(fd, commandLine, 0, SUBPROCESS_NULL,
+                                 SUBPROCESS_NULL, SUBPROCESS_NULL, &process));
+#endif
+
+  ASSERT_EQ(0, close(fd));
+}
+
+#if SUBPROCESS_HAVE_EXEC_FD && SUBPROCESS_HAVE_MEMFD
+SUBPROCESS_TEST(create_fd, subprocess_create_fd_script) {
+  const char *const commandLine[] = {"script", 0};
+  const char *const script = "#!/bin/sh\nexit 7\n";
+  struct subprocess_s process;
+  int fd = -1;
+  int ret = -1;
+
+  // The memfd is close-on-exec, which a script's interpreter has to get past.
+  ASSERT_EQ(0, subprocess_create_stdin_memfd(script, strlen(script), &fd));
+  ASSERT_EQ(0, subprocess_create_fd(fd, commandLine, 0, SUBPROCESS_NULL,
+                                    SUBPROCESS_NULL, SUBPROCESS_NULL,
+                                    &process));
+  ASSERT_EQ(0, close(fd));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(7, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+#endif
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(notify, subprocess_wait_ready) {
+  const char *const commandLine[] = {"./process_notify_ready", "ready", 0};
+  struct subprocess_s process;
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_inherit_environment |
+                                     subprocess_option_notify_ready,
+                                 &process));
+
+  /* The child only exits once its standard input ends, so this can only
+     return once it has said it is ready. */
+  ASSERT_EQ(subprocess_read_data, subprocess_wait_ready(&process, -1));
+  ASSERT_NE(0, subprocess_alive(&process));
+  ASSERT_EQ(subprocess_read_data, subprocess_wait_ready(&process, 0));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(notify, subprocess_wait_ready_timeout) {
+  const char *const commandLine[] = {"./process_notify_ready", "late", 0};
+  struct subprocess_s process;
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_notify_ready, &process));
+
+  ASSERT_EQ(subprocess_read_again, subprocess_wait_ready(&process, 10));
+
+  /* The child says it is ready once its standard input is closed, just
+     before it exits, and what it said is still there to be read. */
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(subprocess_read_data, subprocess_wait_ready(&process, -1));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(notify, subprocess_wait_ready_split) {
+  const char *const commandLine[] = {"./process_notify_ready", "split", 0};
+  struct subprocess_s process;
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_notify_ready, &process));
+
+  /* Only "STATUS=starting\nREA" has been sent, which is not yet a READY=1
+     line; the rest follows once standard input is closed. */
+  ASSERT_EQ(subprocess_read_again, subprocess_wait_ready(&process, 10));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(subprocess_read_data, subprocess_wait_ready(&process, -1));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(notify, subprocess_wait_ready_exit) {
+  const char *const commandLine[] = {"./process_notify_ready", "never", 0};
+  const char *const plainCommandLine[] = {"./process_return_zero", 0};
+  struct subprocess_s process;
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_notify_ready, &process));
+  ASSERT_EQ(subprocess_read_eof, subprocess_wait_ready(&process, -1));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(1, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(0, subprocess_create(plainCommandLine, 0, &process));
+  ASSERT_EQ(subprocess_read_error, subprocess_wait_ready(&process, 0));
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+#if defined(__cplusplus)
+SUBPROCESS_TEST(notify, subprocess_spawn_notify_ready) {
+  const char *const commandLine[] = {"./process_notify_ready", "ready", 0};
+  struct subprocess_s raw;
+  subprocess::process process;
+  int ret = -1;
+
+  ASSERT_EQ(subprocess_error_invalid_options, process.wait_ready(0));
+
+  ASSERT_EQ(0, subprocess::spawn<subprocess_option_notify_ready>(commandLine,
+                                                                 &raw));
+  ASSERT_EQ(subprocess_read_data, subprocess_wait_ready(&raw, -1));
+  ASSERT_EQ(0, subprocess_join(&raw, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&raw));
+
+  ASSERT_EQ(0, process.spawn<subprocess_option_notify_ready>(commandLine));
+  ASSERT_EQ(subprocess_read_data, process.wait_ready(-1));
+  ASSERT_EQ(0, process.join(&ret));
+  ASSERT_EQ(0, ret);
+}
+#endif
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(channel, subprocess_channel) {
+  const unsigned long total = 1048576;
+  char fd_argument[16];
+  const char *const commandLine[] = {"./process_channel", fd_argument,
+                                     "1048576", 0};
+  struct subprocess_channel_s channel;
+  struct subprocess_attr_s attr;
+  struct subprocess_s process;
+  static unsigned char data[1000];
+  unsigned long received = 0;
+  unsigned bytes_read;
+  unsigned index;
+  char line[8];
+  int status;
+  int ret = -1;
+
+  if (subprocess_error_not_supported ==
+      subprocess_channel_init(&channel, 4096)) {
+    UTEST_SKIP("no memfd or futex support");
+  }
+
+  sprintf(fd_argument, "%d", subprocess_channel_fd(&channel));
+  subprocess_attr_init(&attr);
+  attr.channel = &channel;
+
+  ASSERT_EQ(0, subprocess_create_attr(commandLine, 0, SUBPROCESS_NULL,
+                                      SUBPROCESS_NULL, &attr, &process));
+
+  // Far more than the channel holds goes through it, with the child waiting
+  // for room and the parent waiting for data in turn.
+  for (;;) {
+    status = subprocess_channel_read(&channel, data, sizeof(data), -1,
+                                     &bytes_read);
+    if (subprocess_read_eof == status) {
+      break;
+    }
+
+    ASSERT_EQ(subprocess_read_data, status);
+    for (index = 0; index < bytes_read; index++) {
+      ASSERT_EQ(UTEST_CAST(unsigned char, (received + index) * 7),
+                data[index]);
+    }
+    received += bytes_read;
+  }
+
+  ASSERT_EQ(total, received);
+
+  // Standard output works alongside the channel.
+  ASSERT_TRUE(line == fgets(line, sizeof(line), subprocess_stdout(&process)));
+  ASSERT_STREQ("done\n", line);
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(0, ret);
+  ASSERT_EQ(0, subprocess_destroy(&process));
+
+  ASSERT_EQ(subprocess_read_eof,
+            subprocess_channel_read(&channel, data, sizeof(data), 0,
+                                    &bytes_read));
+  ASSERT_EQ(0, subprocess_channel_destroy(&channel));
+}
+
+SUBPROCESS_TEST(channel, subprocess_channel_timeout) {
+  struct subprocess_channel_s channel;
+  char data[8] = {0};
+  unsigned bytes;
+
+  if (subprocess_error_not_supported ==
+      subprocess_channel_init(&channel, 8)) {
+    UTEST_SKIP("no memfd or futex support");
+  }
+
+  ASSERT_EQ(subprocess_error_invalid_options,
+            subprocess_channel_init(&channel, 12));
+  ASSERT_EQ(0, subprocess_channel_init(&channel, 8));
+
+  ASSERT_EQ(subprocess_read_again,
+            subprocess_channel_read(&channel, data, sizeof(data), 10, &bytes));
+  ASSERT_EQ(0u, bytes);
+
+  ASSERT_EQ(subprocess_read_data,
+            subprocess_channel_write(&channel, "abcdefghij", 10, 0, &bytes));
+  ASSERT_EQ(8u, bytes);
+  ASSERT_EQ(subprocess_read_again,
+            subprocess_channel_write(&channel, "ij", 2, 10, &bytes));
+
+  ASSERT_EQ(subprocess_read_data,
+            subprocess_channel_read(&channel, data, 3, 0, &bytes));
+  ASSERT_EQ(3u, bytes);
+  ASSERT_EQ(0, memcmp(data, "abc", 3));
+
+  // What was written before the close is still read, wrapping around.
+  ASSERT_EQ(subprocess_read_data,
+            subprocess_channel_write(&channel, "ij", 2, 0, &bytes));
+  subprocess_channel_close(&channel);
+  ASSERT_EQ(subprocess_read_eof,
+            subprocess_channel_write(&channel, "k", 1, 0, &bytes));
+  ASSERT_EQ(subprocess_read_data,
+            subprocess_channel_read(&channel, data, sizeof(data), 0, &bytes));
+  ASSERT_EQ(7u, bytes);
+  ASSERT_EQ(0, memcmp(data, "defghij", 7));
+  ASSERT_EQ(subprocess_read_eof,
+            subprocess_channel_read(&channel, data, sizeof(data), -1, &bytes));
+
+  ASSERT_EQ(0, subprocess_channel_destroy(&channel));
+}
+
+#if SUBPROCESS_HAVE_CHANNEL
+SUBPROCESS_TEST(channel, subprocess_channel_corrupted) {
+  struct subprocess_channel_s channel;
+  struct subprocess_ring_s *ring;
+  char data[8] = {0};
+  unsigned bytes;
+
+  ASSERT_EQ(0, subprocess_channel_init(&channel, 8));
+  ring = (struct subprocess_ring_s *)channel.shared;
+
+  // The other side claiming more data than the ring holds, or a bigger ring,
+  // never leads outside the mapping.
+  ring->capacity = 1u << 20;
+  ring->head = 9;
+  ASSERT_EQ(subprocess_read_error,
+            subprocess_channel_read(&channel, data, sizeof(data), 0, &bytes));
+  ASSERT_EQ(EPROTO, errno);
+  ASSERT_EQ(subprocess_read_error,
+            subprocess_channel_write(&channel, "a", 1, 0, &bytes));
+  ASSERT_EQ(EPROTO, errno);
+
+  ring->head = 8;
+  ASSERT_EQ(subprocess_read_data,
+            subprocess_channel_read(&channel, data, sizeof(data), 0, &bytes));
+  ASSERT_EQ(8u, bytes);
+
+  ASSERT_EQ(0, subprocess_channel_destroy(&channel));
+}
+#endif
+#endif
+
+#if !defined(_WIN32)
+SUBPROCESS_TEST(terminate, subprocess_terminate_ex_process_group) {
+  const char *const commandLine[] = {"./process_spawn_tree", 0};
+  const struct timespec pause = {0, 1000000};
+  struct subprocess_s process;
+  char line[16];
+  int ret = 0;
+
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_new_process_group,
+                                 &process));
+  ASSERT_EQ(process.child, getpgid(process.child));
+
+  ASSERT_TRUE(line == fgets(line, sizeof(line), subprocess_stdout(&process)));
+  ASSERT_STREQ("ready\n", line);
+
+  // Both processes ignore SIGTERM, so only the SIGKILL a grace period later
+  // ends them.
+  ASSERT_EQ(0, subprocess_terminate_ex(&process, 1, 100));
+  ASSERT_EQ(1u, subprocess_terminate_poll(&process, 1));
+
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_NE(0, ret);
+  ASSERT_EQ(0u, subprocess_terminate_poll(&process, 1));
+
+  // The grandchild held the pipe open too; it is gone now as well.
+  ASSERT_TRUE(SUBPROCESS_NULL ==
+              fgets(line, sizeof(line), subprocess_stdout(&process)));
+
+  // Once the whole group has gone its id is forgotten, so that it is never
+  // signalled after the system hands it out again.
+  while (0 == subprocess_terminate(&process)) {
+    nanosleep(&pause, SUBPROCESS_NULL);
+  }
+  ASSERT_EQ(ESRCH, errno);
+  ASSERT_EQ(0, process.process_group);
+  ASSERT_NE(0, subprocess_terminate(&process));
+
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+
+SUBPROCESS_TEST(terminate, subprocess_new_session) {
+  const char *const commandLine[] = {"./process_hung", 0};
+  struct subprocess_s processes[2];
+  int ret = 0;
+
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_new_session |
+                                     subprocess_option_combined_stdout_stderr,
+                                 &processes[0]));
+  ASSERT_EQ(processes[0].child, getsid(processes[0].child));
+
+#if defined(__linux__)
+  ASSERT_EQ(0, subprocess_create(commandLine,
+                                 subprocess_option_die_with_parent,
+                                 &processes[1]));
+#else
+  ASSERT_EQ(0, subprocess_create(commandLine, 0, &processes[1]));
+#endif
+
+  // Neither ignores SIGTERM, so both end without waiting out the grace period.
+  ASSERT_EQ(0, subprocess_terminate_ex(processes, 2, 60000));
+  ASSERT_EQ(0, subprocess_join(&processes[0], &ret));
+  ASSERT_NE(0, ret);
+  ASSERT_EQ(0, subprocess_join(&processes[1], &ret));
+  ASSERT_NE(0, ret);
+
+  ASSERT_EQ(0, subprocess_destroy(&processes[0]));
+  ASSERT_EQ(0, subprocess_destroy(&processes[1]));
+}
+
+struct subprocess_test_join_s {
+  struct subprocess_s *process;
+  int result;
+  int return_code;
+};
+
+static void *subprocess_test_join(void *const argument) {
+  struct subprocess_test_join_s *const join =
+      (struct subprocess_test_join_s *)argument;
+
+  join->result = subprocess_join(join->process, &join->return_code);
+  return SUBPROCESS_NULL;
+}
+
+SUBPROCESS_TEST(alive, subprocess_join_concurrently) {
+  const char *const commandLine[] = {"./process_return_fortytwo", 0};
+  struct subprocess_test_join_s joins[2];
+  struct subprocess_s process;
+  pthread_t thread;
+  int round;
+
+  // Both joins race to close stdin, through its file in every other round,
+  // and only one of them may.
+  for (round = 0; round < 20; round++) {
+    ASSERT_EQ(0, subprocess_create(commandLine, 0, &process));
+    if (0 == round % 2) {
+      ASSERT_TRUE(subprocess_stdin(&process));
+    }
+
+    joins[0].process = &process;
+    joins[0].result = -1;
+    joins[0].return_code = -1;
+    joins[1] = joins[0];
+
+    ASSERT_EQ(0, pthread_create(&thread, SUBPROCESS_NULL,
+                                subprocess_test_join, &joins[1]));
+    subprocess_test_join(&joins[0]);
+    ASSERT_EQ(0, pthread_join(thread, SUBPROCESS_NULL));
+
+    ASSERT_EQ(0, joins[0].result);
+    ASSERT_EQ(0, joins[1].result);
+    ASSERT_EQ(42, joins[0].return_code);
+    ASSERT_EQ(42, joins[1].return_code);
+    ASSERT_EQ(-1, process.stdin_fd);
+    ASSERT_EQ(0, subprocess_destroy(&process));
+  }
+}
+
+SUBPROCESS_TEST(alive, subprocess_alive_leaves_stdin_open) {
+  const char *const commandLine[] = {"./process_return_fortytwo", 0};
+  const struct timespec pause = {0, 1000000};
+  struct subprocess_s process;
+  int ret = -1;
+
+  ASSERT_EQ(0, subprocess_create(commandLine, 0, &process));
+
+  while (subprocess_alive(&process)) {
+    nanosleep(&pause, 0);
+  }
+
+  // Finishing is noticed without closing stdin under a thread writing to it.
+  ASSERT_TRUE(subprocess_stdin(&process));
+  ASSERT_EQ(0, subprocess_alive(&process));
+
+  // Every join sees the status published by whichever call reaped it.
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(42, ret);
+  ret = -1;
+  ASSERT_EQ(0, subprocess_join(&process, &ret));
+  ASSERT_EQ(42, ret);
+
+  // Once reaped there is nothing left to signal.
+  ASSERT_NE(0, subprocess_terminate(&process));
+  ASSERT_EQ(ESRCH, errno);
+
+  ASSERT_EQ(0, subprocess_destroy(&process));
+}
+#endif